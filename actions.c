@@ -43,7 +43,7 @@ void kill_user(const char *source, const char *user, const char *reason)
 
 void bad_password(User *u)
 {
-    time_t now = time(NULL);
+    time_t now = cur_time;
 
     if (!BadPassLimit)
 	return;
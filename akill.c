@@ -26,6 +26,16 @@ static int32 nakill = 0;
 static int32 akill_size = 0;
 static struct akill *akills = NULL;
 
+/* Earliest expiry time in the list (or earlier), so expire_akills() can
+ * skip the list until something is due.  0 means nothing expires. */
+static time_t akill_next_expire = 0;
+
+/* Take note of a new AKILL expiry time. */
+#define schedule_akill_expire(t) do {				\
+    if ((t) && (!akill_next_expire || (t) < akill_next_expire))	\
+	akill_next_expire = (t);				\
+} while (0)
+
 /*************************************************************************/
 /****************************** Statistics *******************************/
 /*************************************************************************/
@@ -170,6 +180,9 @@ void load_akill(void)
     } /* switch (version) */
 
     close_db(f);
+
+    for (i = 0; i < nakill; i++)
+	schedule_akill_expire(akills[i].expires);
 }
 
 #undef SAFE
@@ -180,10 +193,10 @@ void load_akill(void)
     if ((x) < 0) {							\
 	restore_db(f);							\
 	log_perror("Error de escritura en %s", AutokillDBName);		\
-	if (time(NULL) - lastwarn > WarningTimeout) {			\
+	if (cur_time - lastwarn > WarningTimeout) {			\
 	    canalopers(NULL, "Error de escritura en %s: %s", AutokillDBName,	\
 			strerror(errno));				\
-	    lastwarn = time(NULL);					\
+	    lastwarn = cur_time;					\
 	}								\
 	return;								\
     }									\
@@ -227,7 +240,7 @@ int check_akill(const char *nick, const char *username, const char *host)
     strlower(strscpy(buf+i, host, sizeof(buf)-i));
     for (i = 0; i < nakill; i++) {
 	if (match_wild_nocase(akills[i].mask, buf)) {
-            time_t now = time(NULL);
+            time_t now = cur_time;
 	    /* Don't use kill_user(); that's for people who have already
 	     * signed on.  This is called before the User structure is
 	     * created.
@@ -250,7 +263,7 @@ int check_akill(const char *nick, const char *username, const char *host)
 		    "GLINE * +%s@%s %ld :%s",
 		    username2, host2,
 		    akills[i].expires && akills[i].expires>now
-				? akills[i].expires-time(NULL)
+				? akills[i].expires-cur_time
 				: 999999999, akills[i].reason);
 	    free(username2);
 	    return 1;
@@ -263,14 +276,19 @@ int check_akill(const char *nick, const char *username, const char *host)
 
 /* Delete any expired autokills. */
 
-void expire_akills(void)
+int expire_akills(void)
 {
     int i;
-    time_t now = time(NULL);
+    time_t now = cur_time;
 
+    if (!akill_next_expire || akill_next_expire > now)
+	return 0;
+    akill_next_expire = 0;
     for (i = 0; i < nakill; i++) {
-	if (akills[i].expires == 0 || akills[i].expires > now)
+	if (akills[i].expires == 0 || akills[i].expires > now) {
+	    schedule_akill_expire(akills[i].expires);
 	    continue;
+	}
 	canalopers(s_OperServ, "GLINE en %s ha expirado", akills[i].mask);
         send_cmd(NULL, "GLINE * -%s", akills[i].mask);
 	free(akills[i].mask);
@@ -280,6 +298,7 @@ void expire_akills(void)
 	    memmove(akills+i, akills+i+1, sizeof(*akills) * (nakill-i));
 	i--;
     }
+    return 0;
 }
 
 /*************************************************************************/
@@ -309,8 +328,9 @@ void add_akill(const char *mask, const char *reason, const char *who,
     }
     akills[nakill].mask = sstrdup(mask);
     akills[nakill].reason = sstrdup(reason);
-    akills[nakill].time = time(NULL);
+    akills[nakill].time = cur_time;
     akills[nakill].expires = expiry;
+    schedule_akill_expire(expiry);
     strscpy(akills[nakill].who, who, NICKMAX);
 /*
     if (expiry) {
@@ -362,7 +382,7 @@ static int del_akill(const char *mask)
 void do_akill(User *u)
 {
     char *cmd, *mask, *reason, *expiry, *s;
-    time_t expires = time(NULL);
+    time_t expires = cur_time;
     int i;
 
     cmd = strtok(NULL, " ");
@@ -370,7 +390,7 @@ void do_akill(User *u)
 	cmd = "";
 
     if (stricmp(cmd, "ADD") == 0) {
-        time_t t = time(NULL);
+        time_t t = cur_time;
         
 	if (nakill >= 32767) {
 	    notice_lang(s_OperServ, u, OPER_TOO_MANY_AKILLS);
@@ -415,7 +435,7 @@ void do_akill(User *u)
             
             strlower(mask);	
 	    add_akill(mask, reason, u->nick, expires);
-            send_cmd(NULL, "GLINE * +%s %lu :%s", mask, expires-time(NULL), reason);	    
+            send_cmd(NULL, "GLINE * +%s %lu :%s", mask, expires-cur_time, reason);	    
 	    notice_lang(s_OperServ, u, OPER_AKILL_ADDED, mask);
 
             if (expires == 0)
@@ -475,7 +495,7 @@ void do_akill(User *u)
                       (expires == -1 || akills[i].expires == expires))) {
 		char timebuf[32], expirebuf[256];
 		struct tm tm;
-		time_t t = time(NULL);
+		time_t t = cur_time;
 
 		tm = *localtime(akills[i].time ? &akills[i].time : &t);
 		strftime_lang(timebuf, sizeof(timebuf),
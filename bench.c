@@ -0,0 +1,458 @@
+/* Synthetic benchmarks.  Running the binary as "bench" starts Services the
+ * way "replay" does (databases loaded read-only, output going to a sink)
+ * and then times one test against the real code, with made-up data fed in
+ * through process() like lines from a server.
+ *
+ * Services is copyright (c) 1996-1999 Andrew Church.
+ *     E-mail: <achurch@dragonfire.net>
+ * Services is copyright (c) 1999-2000 Andrew Kempe.
+ *     E-mail: <theshadow@shadowfire.org>
+ * This program is free but copyrighted software; see the file COPYING for
+ * details.
+ */
+
+#include "services.h"
+#include "latency.h"
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/* Options common to all tests; 0 means the test's own default. */
+static int bench_count = 0;	/* -n: users, nicks... depending on the test */
+static int bench_rounds = 0;	/* -rounds: how many times to time it */
+
+/*************************************************************************/
+
+/* Hand a line to process() as if the server had sent it. */
+
+static void feed(const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(inbuf, sizeof(inbuf), fmt, args);
+    va_end(args);
+    process();
+}
+
+
+static double ms_since(lat_t start)
+{
+    return (lat_now() - start) / 1e6;
+}
+
+
+static void report_rss(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    printf("Peak RSS: %ld kB\n", (long)ru.ru_maxrss);
+}
+
+/*************************************************************************/
+/******************************** Tests *********************************/
+/*************************************************************************/
+
+/* Netsplit: a hub and a leaf behind it with the same number of users, each
+ * on three channels shared between both sides, then time the leaf's SQUIT.
+ * The leaf comes back with all its users before every round. */
+
+static int bench_split(void)
+{
+    int n = bench_count ? bench_count : 30000;
+    int rounds = bench_rounds ? bench_rounds : 5;
+    int nchans = n/30 + 1, i, j, r;
+    double ms, total = 0, best = 0;
+    lat_t start;
+
+    start = lat_now();
+    feed("SERVER bench.hub 1 %ld %ld P10 AA]]] 0 :Benchmark hub",
+		(long)cur_time, (long)cur_time);
+    for (i = 0; i < n; i++) {
+	feed(":bench.hub NICK h%d 1 %ld hub 10.%d.%d.%d bench.hub :Hub user",
+		i, (long)cur_time, i>>16 & 255, i>>8 & 255, i & 255);
+	for (j = 0; j < 3; j++)
+	    feed(":h%d JOIN #split%d", i, (i*7 + j*131) % nchans);
+    }
+    printf("Hub burst of %d users in %.0f ms\n", n, ms_since(start));
+
+    for (r = 0; r < rounds; r++) {
+	feed(":bench.hub SERVER bench.leaf 2 %ld %ld P10 AB]]] 0 :Benchmark leaf",
+		(long)cur_time, (long)cur_time);
+	for (i = 0; i < n; i++) {
+	    feed(":bench.leaf NICK l%d 1 %ld leaf 11.%d.%d.%d bench.leaf"
+		" :Leaf user", i, (long)cur_time, i>>16 & 255, i>>8 & 255,
+		i & 255);
+	    for (j = 0; j < 3; j++)
+		feed(":l%d JOIN #split%d", i, (i*11 + j*97) % nchans);
+	}
+	start = lat_now();
+	feed(":bench.hub SQUIT bench.leaf %ld :Benchmark split",
+		(long)cur_time);
+	ms = ms_since(start);
+	printf("Round %d: split of %d users in %.2f ms (%d users left)\n",
+		r+1, n, ms, usercnt);
+	total += ms;
+	if (!r || ms < best)
+	    best = ms;
+    }
+    printf("Average %.2f ms, best %.2f ms\n", total / rounds, best);
+    return 0;
+}
+
+/*************************************************************************/
+
+/* Nick database load: time load_ns_dbase() on a nick.db of -n nicks
+ * (2000000).  The file is made by a child process the first time, so that
+ * none of the memory used to build it counts here, and kept in the data
+ * directory as bench-nick-<n>.db (with its memo texts in bench-memo-<n>.db)
+ * for later runs; delete it to start again. */
+
+static int bench_nickdb(void)
+{
+    static char nickdb[64], memodb[64];
+    int n = bench_count ? bench_count : 2000000;
+    long nrec, memuse, dummy;
+    struct rusage ru;
+    lat_t start;
+    pid_t pid;
+    int status;
+
+    snprintf(nickdb, sizeof(nickdb), "bench-nick-%d.db", n);
+    snprintf(memodb, sizeof(memodb), "bench-memo-%d.db", n);
+    NickDBName = nickdb;
+    MemoDBName = memodb;
+
+    if (access(nickdb, R_OK) < 0) {
+	/* init() ignores SIGCHLD, which would leave nothing to wait for */
+	signal(SIGCHLD, SIG_DFL);
+	start = lat_now();
+	pid = fork();
+	if (pid < 0) {
+	    perror("fork");
+	    return 1;
+	} else if (pid == 0) {
+	    bench_make_nicks(n);
+	    save_ns_dbase();
+	    _exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)
+				|| WEXITSTATUS(status) != 0) {
+	    fprintf(stderr, "Making %s failed\n", nickdb);
+	    return 1;
+	}
+	printf("Made %s in %.0f ms\n", nickdb, ms_since(start));
+    }
+
+    getrusage(RUSAGE_SELF, &ru);
+    printf("Peak RSS before loading: %ld kB\n", (long)ru.ru_maxrss);
+    start = lat_now();
+    load_ns_dbase();
+    printf("Loaded %s in %.0f ms\n", nickdb, ms_since(start));
+    get_nickserv_stats(&nrec, &memuse, &dummy, &dummy, &dummy, &dummy,
+			&dummy, &dummy);
+    printf("%ld nicks, %ld kB of nick data\n", nrec, memuse / 1024);
+    return 0;
+}
+
+/*************************************************************************/
+
+/* Cloaks: connect -n users (100000), a quarter of them from dial-up host
+ * names and the rest from numeric addresses, and time that (each user's
+ * cloak is made as they connect).  Then time -rounds (10) passes over all
+ * of them computing the cloak afresh with make_virtualhost_r(), and as
+ * many fetching the one kept on the User with user_virtualhost(); the
+ * first pass also checks that the two agree. */
+
+static int bench_cloak(void)
+{
+    int n = bench_count ? bench_count : 100000;
+    int rounds = bench_rounds ? bench_rounds : 10;
+    int i, r, bad = 0;
+    long calls;
+    char buf[BUFSIZE], vhost[VIRTUALHOSTMAX];
+    const char *s;
+    double ms;
+    lat_t start;
+    User *u;
+
+    feed("SERVER bench.hub 1 %ld %ld P10 AA]]] 0 :Benchmark hub",
+		(long)cur_time, (long)cur_time);
+    start = lat_now();
+    for (i = 0; i < n; i++) {
+	if (i%4 == 0)
+	    snprintf(buf, sizeof(buf), "host%d.dialup%d.example.net", i, i%97);
+	else
+	    snprintf(buf, sizeof(buf), "%d.%d.%d.%d", 10 + i%200,
+			i>>16 & 255, i>>8 & 255, i & 255);
+	feed(":bench.hub NICK u%d 1 %ld user %s bench.hub :Bench user",
+		i, (long)cur_time, buf);
+    }
+    printf("%d connects in %.0f ms\n", n, ms_since(start));
+
+    calls = 0;
+    start = lat_now();
+    for (r = 0; r < rounds; r++) {
+	for (u = firstuser(); u; u = nextuser(), calls++) {
+	    if (!make_virtualhost_r(u->host, vhost))
+		strscpy(vhost, u->host, sizeof(vhost));
+	    if (!r && strcmp(vhost, user_virtualhost(u, buf)) != 0)
+		bad++;
+	}
+    }
+    ms = ms_since(start);
+    printf("%ld cloaks computed in %.0f ms: %.0f cloaks/s\n", calls, ms,
+		ms > 0 ? calls / ms * 1000 : 0.0);
+
+    calls = 0;
+    start = lat_now();
+    for (r = 0; r < rounds; r++) {
+	for (u = firstuser(); u; u = nextuser(), calls++) {
+	    s = user_virtualhost(u, buf);
+	    if (!*s)
+		bad++;
+	}
+    }
+    ms = ms_since(start);
+    printf("%ld cached cloaks fetched in %.0f ms: %.0f lookups/s\n", calls,
+		ms, ms > 0 ? calls / ms * 1000 : 0.0);
+
+    if (bad) {
+	printf("%d users' cached cloaks do not match their hosts!\n", bad);
+	return 1;
+    }
+    return 0;
+}
+
+/*************************************************************************/
+
+#ifdef CYBER
+
+/* Ilines: make -n ilines (100000), four in ten for single addresses, half
+ * for networks from /16 to /30 and the rest for host names, all inside
+ * 10.0.0.0-41.255.255.255 so that plenty of networks nest.  They are added
+ * last to first, so that keeping ilinelists[] sorted costs nothing and the
+ * time is that of the indexes (loading iline.db doesn't sort either).  Then
+ * time
+ * -rounds (10) passes of find_iline_host() over a set of hosts, most of
+ * them inside some iline, and delete the ilines again, half and then the
+ * rest.  After each step the radix tree is checked (check_ilinetrie())
+ * and the answers for the first BENCH_CHECK hosts are compared with a
+ * search through every iline. */
+
+#define BENCH_HOSTS	65536
+#define BENCH_CHECK	500
+
+static uint32 bench_seed = 1;
+
+static uint32 bench_rand(void)
+{
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 17;
+    bench_seed ^= bench_seed << 5;
+    return bench_seed;
+}
+
+static int compare_hosts_desc(const void *a, const void *b)
+{
+    return stricmp((const char *)b, (const char *)a);
+}
+
+static void bench_ip(char *buf, int size, uint32 ip)
+{
+    snprintf(buf, size, "%u.%u.%u.%u", ip>>24, ip>>16 & 255, ip>>8 & 255,
+		ip & 255);
+}
+
+/* Return the number of hosts whose iline isn't the one the slow search
+ * finds, after checking the tree. */
+
+static int check_ilines(const char *what, char (*hosts)[32])
+{
+    int i, bad = 0;
+
+    if (check_ilinetrie() < 0) {
+	printf("Iline tree is broken after %s!\n", what);
+	return 1;
+    }
+    for (i = 0; i < BENCH_CHECK; i++) {
+	if (find_iline_host(hosts[i]) != find_iline_host_slow(hosts[i]))
+	    bad++;
+    }
+    if (bad)
+	printf("%d of %d hosts get the wrong iline after %s!\n", bad,
+		BENCH_CHECK, what);
+    return bad;
+}
+
+static int bench_ilines(void)
+{
+    int n = bench_count ? bench_count : 100000;
+    int rounds = bench_rounds ? bench_rounds : 10;
+    int i, r, bits, made = 0, found = 0, bad = 0;
+    char (*names)[32], (*hosts)[32];
+    IlineInfo **ilines, *il;
+    uint32 ip, net;
+    double ms;
+    lat_t start;
+
+    ilines = scalloc(sizeof(*ilines), n);
+    names = smalloc(sizeof(*names) * n);
+    hosts = smalloc(sizeof(*hosts) * BENCH_HOSTS);
+
+    for (i = 0; i < n; i++) {
+	ip = (10 << 24) + bench_rand() % (32 << 24);
+	switch (i % 10) {
+	  case 0: case 1: case 2: case 3:
+	    bench_ip(names[i], sizeof(names[i]), ip);
+	    break;
+	  case 9:
+	    snprintf(names[i], sizeof(names[i]), "cyber%d.example.net", i);
+	    break;
+	  default:
+	    bits = 16 + bench_rand() % 15;
+	    bench_ip(names[i], sizeof(names[i]),
+			ip & ~(uint32)0 << (32-bits));
+	    snprintf(names[i] + strlen(names[i]),
+			sizeof(names[i]) - strlen(names[i]), "/%d", bits);
+	    break;
+	}
+    }
+    qsort(names, n, sizeof(*names), compare_hosts_desc);
+
+    start = lat_now();
+    for (i = 0; i < n; i++) {
+	if ((ilines[i] = bench_add_iline(names[i], 1 + i%50)) != NULL)
+	    made++;
+    }
+    ms = ms_since(start);
+    free(names);
+    printf("%d ilines (%d duplicates skipped) made in %.0f ms\n", made,
+		n - made, ms);
+
+    /* Three hosts in four are in or near an iline: the iline's own host if
+     * it's an address or a name, or an address inside its network. */
+    for (i = 0; i < BENCH_HOSTS; i++) {
+	il = ilines[bench_rand() % n];
+	if (!il || i%4 == 3) {
+	    bench_ip(hosts[i], sizeof(hosts[i]),
+			(10 << 24) + bench_rand() % (32 << 24));
+	} else if (parse_cidr(il->host, &net, &bits) && bits < 32) {
+	    bench_ip(hosts[i], sizeof(hosts[i]),
+			net | (bench_rand() & ~(~(uint32)0 << (32-bits))));
+	} else {
+	    strscpy(hosts[i], il->host, sizeof(hosts[i]));
+	}
+    }
+    bad += check_ilines("adding", hosts);
+
+    start = lat_now();
+    for (r = 0; r < rounds; r++) {
+	for (i = 0; i < BENCH_HOSTS; i++) {
+	    if (find_iline_host(hosts[i]))
+		found++;
+	}
+    }
+    ms = ms_since(start);
+    printf("%d lookups (%d found) in %.0f ms: %.0f lookups/s\n",
+		rounds * BENCH_HOSTS, found, ms,
+		ms > 0 ? rounds * BENCH_HOSTS / ms * 1000 : 0.0);
+
+    /* Every other iline, then the rest, so that nodes get pruned both
+     * while their neighbours are still there and once they're all gone. */
+    start = lat_now();
+    for (i = 0; i < n; i += 2) {
+	if (ilines[i])
+	    bench_del_iline(ilines[i]);
+    }
+    ms = ms_since(start);
+    bad += check_ilines("deleting half", hosts);
+    start = lat_now();
+    for (i = 1; i < n; i += 2) {
+	if (ilines[i])
+	    bench_del_iline(ilines[i]);
+    }
+    ms += ms_since(start);
+    printf("%d ilines deleted in %.0f ms\n", made, ms);
+    bad += check_ilines("deleting all", hosts);
+
+    free(hosts);
+    free(ilines);
+    return bad ? 1 : 0;
+}
+
+#endif /* CYBER */
+
+/*************************************************************************/
+
+static struct {
+    const char *name;
+    int (*func)(void);
+    int nodb;			/* Start without loading the databases */
+    const char *desc;
+} tests[] = {
+    { "split",  bench_split,  0,
+		"SQUIT of a leaf with -n users (30000), each on 3 channels" },
+    { "nickdb", bench_nickdb, 1,
+		"loading a nick.db of -n nicks (2000000), made the first time" },
+    { "cloak",  bench_cloak,  0,
+		"Terra cloaks of -n users (100000), -rounds (10) times over" },
+#ifdef CYBER
+    { "ilines", bench_ilines, 0,
+		"iline lookups among -n ilines (100000), checked as they change" },
+#endif
+    { NULL }
+};
+
+
+/* Entry point when run as "bench".  The test name comes first; -n and
+ * -rounds are ours, and anything else is passed on to init() as usual. */
+
+int do_bench(int ac, char **av)
+{
+    int i, j, t = -1;
+
+    if (ac >= 2) {
+	for (t = 0; tests[t].name; t++) {
+	    if (strcmp(av[1], tests[t].name) == 0)
+		break;
+	}
+	if (!tests[t].name)
+	    t = -1;
+    }
+    if (t < 0) {
+	fprintf(stderr, "\
+\n\
+Usage: bench test [-n count] [-rounds n] [services options]\n\
+\n\
+Starts Services with its databases loaded read-only and output going to\n\
+/dev/null, then times one of these tests (defaults in parentheses):\n\
+\n");
+	for (t = 0; tests[t].name; t++)
+	    fprintf(stderr, "   %-8s %s\n", tests[t].name, tests[t].desc);
+	fprintf(stderr, "\n");
+	return 1;
+    }
+    for (i = 2, j = 1; i < ac; i++) {
+	if (strcmp(av[i], "-n") == 0 && i+1 < ac)
+	    bench_count = atoi(av[++i]);
+	else if (strcmp(av[i], "-rounds") == 0 && i+1 < ac)
+	    bench_rounds = atoi(av[++i]);
+	else
+	    av[j++] = av[i];
+    }
+    ac = j;
+    av[ac] = NULL;
+
+    readonly = 1;
+    skeleton = tests[t].nodb;
+    replay_sink = "/dev/null";
+    if ((i = init(ac, av)) != 0)
+	return i;
+    i = tests[t].func();
+    report_rss();
+    disconn(servsock);
+    return i;
+}
+
+/*************************************************************************/
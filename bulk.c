@@ -0,0 +1,230 @@
+/* Bulk operations: clearing every op, voice, ban or user from a channel,
+ * or killing every user on a host.  The targets are copied when the
+ * operation starts, then handled BULK_STEP at a time, the rest going to a
+ * background job so a large channel or host can't hold up the main loop.
+ * Channel modes are stacked BULK_MAXMODES to a line.
+ *
+ * Services is copyright (c) 1996-1999 Andrew Church.
+ *     E-mail: <achurch@dragonfire.net>
+ * Services is copyright (c) 1999-2000 Andrew Kempe.
+ *     E-mail: <theshadow@shadowfire.org>
+ * This program is free but copyrighted software; see the file COPYING for
+ * details.
+ */
+
+#include "services.h"
+#include "pseudo.h"
+
+/* Longest parameter list we put in one MODE line; leaves room within the
+ * 510 characters allowed for the prefix, channel name and modes. */
+#define BULK_LINELEN	400
+
+struct bulkentry_ {
+    char what;			/* 'o', 'v', 'b' (-o/-v/-b), 'k' (KICK) or
+				 * 'K' (KILL) */
+    char *name;			/* Nick or ban mask */
+};
+
+/*************************************************************************/
+
+BulkOp *bulk_new(const char *service, User *u, const char *target)
+{
+    BulkOp *op = scalloc(sizeof(BulkOp), 1);
+
+    op->service = op->sender = service;
+    strscpy(op->who, u->nick, NICKMAX);
+    op->target = sstrdup(target);
+    op->done_msg = -1;
+    return op;
+}
+
+/*************************************************************************/
+
+/* Record a target, or if the list hasn't been allocated yet, just count it
+ * and the space its name needs. */
+
+static void add_target(BulkOp *op, char what, const char *name,
+		       char **pool, long *size)
+{
+    if (op->list) {
+	op->list[op->count].what = what;
+	op->list[op->count].name = *pool;
+	strcpy(*pool, name);
+	*pool += strlen(name)+1;
+    } else {
+	*size += strlen(name)+1;
+    }
+    op->count++;
+}
+
+static void add_targets(BulkOp *op, int what, Channel *c, FloodHost *fh,
+			char **pool, long *size)
+{
+    int spare = what & BULK_SPARE_OPERS;
+    struct c_userlist *cu;
+    User *u;
+    int i;
+
+    if (c && (what & BULK_DEOP)) {
+	for (cu = c->chanops; cu; cu = cu->next) {
+	    if (!spare || !is_services_oper(cu->user))
+		add_target(op, 'o', cu->user->nick, pool, size);
+	}
+    }
+    if (c && (what & BULK_DEVOICE)) {
+	for (cu = c->voices; cu; cu = cu->next)
+	    add_target(op, 'v', cu->user->nick, pool, size);
+    }
+    if (c && (what & BULK_UNBAN)) {
+	for (i = 0; i < c->bancount; i++)
+	    add_target(op, 'b', c->bans[i], pool, size);
+    }
+    if (c && (what & BULK_KICK)) {
+	for (cu = c->users; cu; cu = cu->next) {
+	    if (!spare || !is_services_oper(cu->user))
+		add_target(op, 'k', cu->user->nick, pool, size);
+	}
+    }
+    if (fh && (what & BULK_KILL)) {
+	for (u = fh->users; u; u = u->hnext)
+	    add_target(op, 'K', u->nick, pool, size);
+    }
+}
+
+/*************************************************************************/
+
+/* Send one MODE line for the run of targets with the same mode starting at
+ * op->pos (stopping before `end'), and update our channel data to match.
+ * Users who have left the channel since we started are skipped. */
+
+static void send_modes(BulkOp *op, int end)
+{
+    char what = op->list[op->pos].what;
+    char modes[BULK_MAXMODES+2], params[BULK_LINELEN+NICKMAX+2];
+    char *av[BULK_MAXMODES+2];
+    char *name;
+    int n = 0, len = 0, chan_ok = (findchan(op->target) != NULL);
+    User *u;
+
+    while (op->pos < end && n < BULK_MAXMODES
+				&& op->list[op->pos].what == what) {
+	name = op->list[op->pos].name;
+	if (n && len + strlen(name) >= BULK_LINELEN)
+	    break;
+	op->pos++;
+	if (!chan_ok || (what != 'b' && (!(u = finduser(name))
+					|| !is_on_chan(u, op->target))))
+	    continue;
+	modes[++n] = what;
+	av[n+1] = name;
+	if (len)
+	    params[len++] = ' ';
+	strcpy(params+len, name);
+	len += strlen(name);
+    }
+    if (!n)
+	return;
+    modes[0] = '-';
+    modes[n+1] = 0;
+    send_cmd(op->sender, "MODE %s %s %s", op->target, modes, params);
+    av[0] = op->target;
+    av[1] = modes;
+    do_cmode(op->sender, n+2, av);
+    op->done += n;
+}
+
+/*************************************************************************/
+
+/* Handle up to BULK_STEP more targets.  Returns nonzero if there are any
+ * left, else finishes the operation and frees it. */
+
+static int bulk_run(BulkOp *op)
+{
+    int end = op->pos + BULK_STEP;
+    const char *reason = op->reason ? op->reason : "";
+    char buf[BUFSIZE];
+    char *av[3];
+    BulkEntry *e;
+    User *u;
+
+    if (end > op->count)
+	end = op->count;
+    while (op->pos < end) {
+	e = &op->list[op->pos];
+	if (e->what != 'k' && e->what != 'K') {
+	    send_modes(op, end);
+	    continue;
+	}
+	op->pos++;
+	if (!(u = finduser(e->name)))
+	    continue;
+	if (e->what == 'k' && is_on_chan(u, op->target)) {
+	    send_cmd(op->sender, "KICK %s %s :%s", op->target, e->name, reason);
+	    av[0] = op->target;
+	    av[1] = e->name;
+	    av[2] = (char *)reason;
+	    do_kick(op->sender, 3, av);
+	    op->done++;
+	} else if (e->what == 'K' && stricmp(u->host, op->target) == 0) {
+	    op->done++;
+	    snprintf(buf, sizeof(buf), "%s [%d]", reason, op->done);
+	    kill_user(NULL, e->name, buf);
+	}
+    }
+
+    if (op->pos < op->count) {
+	if (cur_time - op->last_report >= BULK_REPORT
+				&& (u = finduser(op->who)) != NULL) {
+	    notice_lang(op->service, u, BULK_IN_PROGRESS, op->target,
+			op->pos, op->count);
+	    op->last_report = cur_time;
+	}
+	return 1;
+    }
+
+    if (op->finish)
+	op->finish(op);
+    if (op->done_msg >= 0 && (u = finduser(op->who)) != NULL)
+	notice_lang(op->service, u, op->done_msg, op->target);
+    free(op->list);
+    free(op->target);
+    free(op->reason);
+    free(op);
+    return 0;
+}
+
+static int bulk_job(Job *j)
+{
+    return bulk_run(j->data);
+}
+
+/*************************************************************************/
+
+void bulk_start(BulkOp *op, int what)
+{
+    Channel *c = NULL;
+    FloodHost *fh = NULL;
+    char *host, *pool;
+    long size = 0;
+
+    if (what & BULK_KILL) {
+	host = sintern_nocase(op->target);
+	fh = find_floodhost(host);
+	sunintern(host);
+    } else {
+	c = findchan(op->target);
+    }
+
+    add_targets(op, what, c, fh, NULL, &size);
+    if (op->count) {
+	op->list = smalloc(op->count * sizeof(BulkEntry) + size);
+	pool = (char *)(op->list + op->count);
+	op->count = 0;
+	add_targets(op, what, c, fh, &pool, NULL);
+    }
+
+    if (bulk_run(op))
+	add_job(bulk_job, op);
+}
+
+/*************************************************************************/
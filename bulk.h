@@ -0,0 +1,71 @@
+/* Bulk channel/host operation include stuff.
+ *
+ * Services is copyright (c) 1996-1999 Andrew Church.
+ *     E-mail: <achurch@dragonfire.net>
+ * Services is copyright (c) 1999-2000 Andrew Kempe.
+ *     E-mail: <theshadow@shadowfire.org>
+ * This program is free but copyrighted software; see the file COPYING for
+ * details.
+ */
+
+#ifndef BULK_H
+#define BULK_H
+
+#include <time.h>
+
+
+/* Maximum number of targets handled per trip through the main loop; the
+ * rest are left for a background job. */
+#define BULK_STEP	100
+
+/* Maximum number of modes stacked in one MODE line (ircu's MAXMODEPARAMS). */
+#define BULK_MAXMODES	6
+
+/* Seconds between progress notices to whoever started the operation. */
+#define BULK_REPORT	10
+
+/* Things an operation can do.  They are done in this order. */
+#define BULK_DEOP	0x0001	/* -o every chanop */
+#define BULK_DEVOICE	0x0002	/* -v every voiced user */
+#define BULK_UNBAN	0x0004	/* -b every ban */
+#define BULK_KICK	0x0008	/* Kick every user */
+#define BULK_KILL	0x0010	/* Kill every user on a host */
+
+#define BULK_SPARE_OPERS 0x0100	/* Leave Services opers alone (-o, KICK) */
+
+typedef struct bulkentry_ BulkEntry;
+
+typedef struct bulkop_ BulkOp;
+struct bulkop_ {
+    const char *service;	/* Pseudo-client sending the notices */
+    const char *sender;		/* Source of the MODEs/KICKs (default
+				 * `service') */
+    char who[NICKMAX];		/* Who asked for it */
+    char *target;		/* Channel name, or host for BULK_KILL */
+    char *reason;		/* KICK/KILL reason (a KILL gets " [n]" added) */
+    int done_msg;		/* Notice (taking `target') to send at the
+				 * end, or -1 for none */
+    void (*finish)(BulkOp *op);	/* Called at the end, or NULL */
+    void *data;			/* For `finish' */
+
+    /* The rest is filled in by bulk_start(). */
+    BulkEntry *list;		/* Targets, as they were when we started */
+    int count, pos;		/* Number of targets, next one to handle */
+    int done;			/* Number of MODEs/KICKs/KILLs actually sent */
+    time_t last_report;
+};
+
+
+/* Create a bulk operation on the given channel (or host) for the given
+ * user; the caller may then change any of the fields above before passing
+ * it to bulk_start(). */
+extern BulkOp *bulk_new(const char *service, User *u, const char *target);
+
+/* Take a snapshot of everything `what' (BULK_* flags) applies to, handle
+ * the first BULK_STEP targets and leave the rest to a background job.
+ * For BULK_KILL, `target' must be a host interned with sintern_nocase().
+ * The operation is freed when it finishes. */
+extern void bulk_start(BulkOp *op, int what);
+
+
+#endif	/* BULK_H */
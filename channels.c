@@ -10,8 +10,43 @@
 
 #include "services.h"
 
-#define HASH(chan)	((chan)[1] ? ((chan)[1]&31)<<5 | ((chan)[2]&31) : 0)
-static Channel *chanlist[1024];
+/* Igual que la de usuarios, la tabla de canales crece al doble cuando hay
+ * mas canales que entradas. */
+#define CHANHASH_MIN	1024
+#define HASH(chan)	(hash_nocase(chan) & (chanhash_size-1))
+static Channel **chanlist;
+static int chanhash_size;
+
+static long ban_memuse(Channel *c);
+
+/*************************************************************************/
+
+/* Rehash all channels into a table of the given size. */
+
+static void resize_chanhash(int newsize)
+{
+    Channel **newlist, *c, *next, **list;
+    int i;
+
+    log_debug(LOG_USERS, 1, "debug: Redimensionando tabla de canales de %d a %d",
+		chanhash_size, newsize);
+    newlist = scalloc(sizeof(Channel *), newsize);
+    for (i = 0; i < chanhash_size; i++) {
+	for (c = chanlist[i]; c; c = next) {
+	    next = c->next;
+	    list = &newlist[hash_nocase(c->name) & (newsize-1)];
+	    c->prev = NULL;
+	    c->next = *list;
+	    if (*list)
+		(*list)->prev = c;
+	    *list = c;
+	}
+    }
+    if (chanlist)
+	free(chanlist);
+    chanlist = newlist;
+    chanhash_size = newsize;
+}
 
 /*************************************************************************/
 
@@ -24,7 +59,7 @@ void get_channel_stats(long *nrec, long *memuse)
     struct c_userlist *cu;
     int i, j;
 
-    for (i = 0; i < 1024; i++) {
+    for (i = 0; i < chanhash_size; i++) {
 	for (chan = chanlist[i]; chan; chan = chan->next) {
 	    count++;
 	    mem += sizeof(*chan);
@@ -37,6 +72,7 @@ void get_channel_stats(long *nrec, long *memuse)
 		if (chan->bans[j])
 		    mem += strlen(chan->bans[j])+1;
 	    }
+	    mem += ban_memuse(chan);
 	    for (cu = chan->users; cu; cu = cu->next)
 		mem += sizeof(*cu);
 	    for (cu = chan->chanops; cu; cu = cu->next)
@@ -45,12 +81,36 @@ void get_channel_stats(long *nrec, long *memuse)
 		mem += sizeof(*cu);
 	}
     }
+    mem += sizeof(Channel *) * chanhash_size;
     *nrec = count;
     *memuse = mem;
 }
 
 /*************************************************************************/
 
+/* Return the size of the channel hash table, the number of channels in it
+ * and a histogram of chain lengths, as get_user_hash_stats() does.
+ */
+
+void get_channel_hash_stats(int *size, int *count, int *hist, int histlen)
+{
+    int i, len;
+    Channel *c;
+
+    memset(hist, 0, sizeof(int) * histlen);
+    *count = 0;
+    for (i = 0; i < chanhash_size; i++) {
+	len = 0;
+	for (c = chanlist[i]; c; c = c->next)
+	    len++;
+	*count += len;
+	hist[len < histlen ? len : histlen-1]++;
+    }
+    *size = chanhash_size;
+}
+
+/*************************************************************************/
+
 #ifdef DEBUG_COMMANDS
 
 /* Send the current list of channels to the named user. */
@@ -142,16 +202,16 @@ Channel *findchan(const char *chan)
 {
     Channel *c;
 
-    if (debug >= 3)
-	log("debug: findchan(%p)", chan);
+    log_debug(LOG_USERS, 3, "debug: findchan(%p)", chan);
+    if (!chanlist)
+	return NULL;
     c = chanlist[HASH(chan)];
     while (c) {
 	if (stricmp(c->name, chan) == 0)
 	    return c;
 	c = c->next;
     }
-    if (debug >= 3)
-	log("debug: findchan(%s) -> %p", chan, c);
+    log_debug(LOG_USERS, 3, "debug: findchan(%s) -> %p", chan, c);
     return NULL;
 }
 
@@ -167,10 +227,9 @@ static int next_index;
 Channel *firstchan(void)
 {
     next_index = 0;
-    while (next_index < 1024 && current == NULL)
+    while (next_index < chanhash_size && current == NULL)
 	current = chanlist[next_index++];
-    if (debug >= 3)
-	log("debug: firstchan() returning %s",
+    log_debug(LOG_USERS, 3, "debug: firstchan() returning %s",
 			current ? current->name : "NULL (end of list)");
     return current;
 }
@@ -179,16 +238,268 @@ Channel *nextchan(void)
 {
     if (current)
 	current = current->next;
-    if (!current && next_index < 1024) {
-	while (next_index < 1024 && current == NULL)
+    if (!current && next_index < chanhash_size) {
+	while (next_index < chanhash_size && current == NULL)
 	    current = chanlist[next_index++];
     }
-    if (debug >= 3)
-	log("debug: nextchan() returning %s",
+    log_debug(LOG_USERS, 3, "debug: nextchan() returning %s",
 			current ? current->name : "NULL (end of list)");
     return current;
 }
 
+/*************************************************************************/
+
+/* Indice de los bans de un canal.  c->bans sigue teniendo las mascaras, en
+ * cualquier orden (al quitar una, la ultima pasa a su sitio).  Por cada
+ * una, el indice guarda:
+ *   - su entrada en una tabla por mascara exacta, para los +b/-b;
+ *   - la mascara ya partida en nick, user y host (en minusculas, como en
+ *     match_usermask()), en un grupo por sufijo de host: la parte literal
+ *     desde el primer punto tras el ultimo comodin, asi que "*!*@*.foo.es"
+ *     va al grupo "foo.es" y "*!*@pc1.foo.es" al "pc1.foo.es".  Un host
+ *     solo puede coincidir con los bans de los grupos de sus sufijos, o con
+ *     los que no tienen sufijo ("*!*@1.2.3.*"), que van en lista aparte.
+ * Las tablas crecen al doble cuando hay mas bans que entradas. */
+
+#define BANHASH_MIN	16
+
+typedef struct chanban_ ChanBan;
+struct chanban_ {
+    ChanBan *next;		/* Tabla exacta */
+    ChanBan *gnext, **gprev;	/* Grupo de sufijo (gprev NULL si en ninguno) */
+    char *mask;			/* La de c->bans[pos] */
+    int pos;
+    char *nick, *user, *host;	/* Dentro de buf; nick NULL si no hay */
+    char *key;			/* Sufijo del grupo, NULL si no hay */
+    char buf[1];
+};
+
+struct banindex_ {
+    int size;
+    ChanBan **exact;
+    ChanBan **groups;
+    ChanBan *nogroup;
+};
+
+static void group_ban(BanIndex *bi, ChanBan *b)
+{
+    ChanBan **list;
+
+    if (b->key)
+	list = &bi->groups[hash_nocase(b->key) & (bi->size-1)];
+    else
+	list = &bi->nogroup;
+    b->gnext = *list;
+    if (*list)
+	(*list)->gprev = &b->gnext;
+    b->gprev = list;
+    *list = b;
+}
+
+static void resize_banindex(BanIndex *bi, int newsize)
+{
+    ChanBan **exact = bi->exact, *b, *next;
+    int i, oldsize = bi->size;
+
+    bi->size = newsize;
+    bi->exact = scalloc(sizeof(ChanBan *), newsize);
+    free(bi->groups);
+    bi->groups = scalloc(sizeof(ChanBan *), newsize);
+    for (i = 0; i < oldsize; i++) {
+	for (b = exact[i]; b; b = next) {
+	    next = b->next;
+	    b->next = bi->exact[hash_nocase(b->mask) & (newsize-1)];
+	    bi->exact[hash_nocase(b->mask) & (newsize-1)] = b;
+	    if (b->key)
+		group_ban(bi, b);
+	}
+    }
+    free(exact);
+}
+
+static ChanBan *find_ban(BanIndex *bi, const char *mask)
+{
+    ChanBan *b;
+
+    for (b = bi->exact[hash_nocase(mask) & (bi->size-1)]; b; b = b->next) {
+	if (strcmp(b->mask, mask) == 0)
+	    return b;
+    }
+    return NULL;
+}
+
+/* Add a ban to a channel, unless it's already there. */
+
+static void add_ban(Channel *c, const char *mask)
+{
+    BanIndex *bi = c->banindex;
+    ChanBan *b, **list;
+    char *s;
+
+    if (!bi) {
+	bi = c->banindex = scalloc(sizeof(BanIndex), 1);
+	bi->size = BANHASH_MIN;
+	bi->exact = scalloc(sizeof(ChanBan *), bi->size);
+	bi->groups = scalloc(sizeof(ChanBan *), bi->size);
+    } else if (find_ban(bi, mask)) {
+	return;
+    }
+    if (c->bancount >= bi->size)
+	resize_banindex(bi, bi->size*2);
+    if (c->bancount >= c->bansize) {
+	c->bansize = c->bansize ? c->bansize*2 : 8;
+	c->bans = srealloc(c->bans, sizeof(char *) * c->bansize);
+    }
+
+    b = scalloc(sizeof(ChanBan) + strlen(mask), 1);
+    b->mask = c->bans[c->bancount] = sstrdup(mask);
+    b->pos = c->bancount++;
+    list = &bi->exact[hash_nocase(mask) & (bi->size-1)];
+    b->next = *list;
+    *list = b;
+
+    strcpy(b->buf, mask);
+    if (strchr(b->buf, '!')) {
+	b->nick = strlower(strtok(b->buf, "!"));
+	b->user = strtok(NULL, "@");
+    } else {
+	b->user = strtok(b->buf, "@");
+    }
+    b->host = strtok(NULL, "");
+    if (!b->user || !b->host)
+	return;		/* No coincide con nadie, no va en ningun grupo */
+    strlower(b->host);
+    s = b->host + strcspn(b->host, "*?");
+    if (!*s) {
+	b->key = b->host;
+    } else {
+	char *t;
+	while ((t = strpbrk(s+1, "*?")) != NULL)
+	    s = t;
+	if ((s = strchr(s, '.')) != NULL && s[1])
+	    b->key = s+1;
+    }
+    group_ban(bi, b);
+}
+
+/* Remove a ban from a channel, if it's there. */
+
+static void del_ban(Channel *c, const char *mask)
+{
+    BanIndex *bi = c->banindex;
+    ChanBan *b, **prev;
+
+    if (!bi)
+	return;
+    prev = &bi->exact[hash_nocase(mask) & (bi->size-1)];
+    while ((b = *prev) != NULL && strcmp(b->mask, mask) != 0)
+	prev = &b->next;
+    if (!b)
+	return;
+    *prev = b->next;
+    if (b->gprev) {
+	*b->gprev = b->gnext;
+	if (b->gnext)
+	    b->gnext->gprev = b->gprev;
+    }
+    if (b->pos < --c->bancount) {
+	c->bans[b->pos] = c->bans[c->bancount];
+	find_ban(bi, c->bans[b->pos])->pos = b->pos;
+    }
+    free(b->mask);
+    free(b);
+}
+
+static void free_bans(Channel *c)
+{
+    BanIndex *bi = c->banindex;
+    ChanBan *b, *next;
+    int i;
+
+    if (bi) {
+	for (i = 0; i < bi->size; i++) {
+	    for (b = bi->exact[i]; b; b = next) {
+		next = b->next;
+		free(b->mask);
+		free(b);
+	    }
+	}
+	free(bi->exact);
+	free(bi->groups);
+	free(bi);
+    }
+    if (c->bansize)
+	free(c->bans);
+}
+
+static int ban_matches(ChanBan *b, const char *nick, const char *user,
+		       const char *host)
+{
+    return (!b->nick || match_wild(b->nick, nick)) &&
+	   match_wild(b->user, user) &&
+	   match_wild(b->host, host);
+}
+
+/* Return the number of bans on a channel which match the user (as
+ * match_usermask() would), and store copies of them in a malloc()'d array
+ * in *ret; the copies and the array should be free()'d when done with.
+ * The copies stay valid when the bans are removed, so they can be passed
+ * straight to do_cmode().  If `virtual' is set, the user's virtual host
+ * (see user_virtualhost()) is checked instead of the real one. */
+
+int match_bans(Channel *c, User *u, int virtual, char ***ret)
+{
+    BanIndex *bi = c->banindex;
+    char buf[NICKMAX+16], nick[NICKMAX], *host, *s;
+    ChanBan *b;
+    int count = 0, size = 0;
+
+    *ret = NULL;
+    if (!bi || !c->bancount)
+	return 0;
+    strscpy(nick, u->nick, sizeof(nick));
+    strlower(nick);
+    host = strlower(sstrdup(virtual ? user_virtualhost(u, buf) : u->host));
+
+#define ADD_MATCH(b) do {					\
+	if (ban_matches((b), nick, u->username, host)) {	\
+	    if (count >= size) {				\
+		size = size ? size*2 : 8;			\
+		*ret = srealloc(*ret, sizeof(char *) * size);	\
+	    }							\
+	    (*ret)[count++] = sstrdup((b)->mask);		\
+	}							\
+    } while (0)
+
+    for (b = bi->nogroup; b; b = b->gnext)
+	ADD_MATCH(b);
+    for (s = host; s; s = strchr(s, '.') ? strchr(s, '.')+1 : NULL) {
+	for (b = bi->groups[hash_nocase(s) & (bi->size-1)]; b; b = b->gnext) {
+	    if (strcmp(b->key, s) == 0)
+		ADD_MATCH(b);
+	}
+    }
+
+#undef ADD_MATCH
+
+    free(host);
+    return count;
+}
+
+/* Devuelve la memoria usada por el indice de bans de un canal. */
+
+static long ban_memuse(Channel *c)
+{
+    long mem = 0;
+    int i;
+
+    if (c->banindex)
+	mem += sizeof(BanIndex) + sizeof(ChanBan *) * 2 * c->banindex->size;
+    for (i = 0; i < c->bancount; i++)
+	mem += sizeof(ChanBan) + strlen(c->bans[i]);
+    return mem;
+}
+
 /*************************************************************************/
 /*************************************************************************/
 
@@ -204,17 +515,20 @@ void chan_adduser(User *user, const char *chan)
     struct c_userlist *u;
 
     if (newchan) {
-	if (debug)
-	    log("debug: Creando canal %s", chan);
+	log_debug(LOG_USERS, 1, "debug: Creando canal %s", chan);
 	/* Allocate pre-cleared memory */
 	c = scalloc(sizeof(Channel), 1);
 	strscpy(c->name, chan, sizeof(c->name));
+	if (!chanlist)
+	    resize_chanhash(CHANHASH_MIN);
+	else if (chancnt >= chanhash_size)
+	    resize_chanhash(chanhash_size * 2);
 	list = &chanlist[HASH(c->name)];
 	c->next = *list;
 	if (*list)
 	    (*list)->prev = c;
 	*list = c;
-	c->creation_time = time(NULL);
+	c->creation_time = cur_time;
 	/* Store ChannelInfo pointer in channel record */
 	c->ci = cs_findchan(chan);
 	if (c->ci) {
@@ -232,7 +546,7 @@ void chan_adduser(User *user, const char *chan)
         chancnt++;
         if (chancnt > maxchancnt) {
             maxchancnt = chancnt;
-            maxchantime = time(NULL);
+            maxchantime = cur_time;
             if (LogMaxChans)
                 log("Channel: New maximum Chan count: %d", maxchancnt);
         }                                                	
@@ -266,13 +580,45 @@ void chan_adduser(User *user, const char *chan)
 }
 
 
+/*************************************************************************/
+
+/* Remove and free a Channel structure once its last user has left. */
+
+static void delete_channel(Channel *c)
+{
+    log_debug(LOG_USERS, 1, "debug: Borrando canal %s", c->name);
+    /* Contador Canales */
+    chancnt--;
+    if (c->ci)
+	c->ci->c = NULL;
+    if (c->topic)
+	free(c->topic);
+    if (c->key)
+	free(c->key);
+    free_bans(c);
+    if (c->chanops || c->voices)
+	log("channel: Memory leak freeing %s: %s%s%s %s non-NULL!",
+		c->name,
+		c->chanops ? "c->chanops" : "",
+		c->chanops && c->voices ? " and " : "",
+		c->voices ? "c->voices" : "",
+		c->chanops && c->voices ? "are" : "is");
+    if (c->next)
+	c->next->prev = c->prev;
+    if (c->prev)
+	c->prev->next = c->next;
+    else
+	chanlist[HASH(c->name)] = c->next;
+    free(c);
+}
+
+/*************************************************************************/
+
 void chan_deluser(User *user, Channel *c)
 {
     struct c_userlist *u;
-    int i;
 
-    if (debug >= 2)
-        log("channel: chan_deluser() called...");
+    log_debug(LOG_USERS, 2, "channel: chan_deluser() called...");
 
     for (u = c->users; u && u->user != user; u = u->next)
 	;
@@ -307,42 +653,51 @@ void chan_deluser(User *user, Channel *c)
 	    c->voices = u->next;
 	free(u);
     }
-    if (!c->users) {
-	if (debug)
-	    log("debug: Borrando canal %s", c->name);
-        /* Contador Canales */
-        chancnt--;	    
-	if (c->ci)
-	    c->ci->c = NULL;
-	if (c->topic)
-	    free(c->topic);
-	if (c->key)
-	    free(c->key);
-	for (i = 0; i < c->bancount; ++i) {
-	    if (c->bans[i])
-		free(c->bans[i]);
-	    else
-		log("channel: BUG freeing %s: bans[%d] is NULL!", c->name, i);
-	}
-	if (c->bansize)
-	    free(c->bans);
-	if (c->chanops || c->voices)
-	    log("channel: Memory leak freeing %s: %s%s%s %s non-NULL!",
-			c->name,
-			c->chanops ? "c->chanops" : "",
-			c->chanops && c->voices ? " and " : "",
-			c->voices ? "c->voices" : "",
-			c->chanops && c->voices ? "are" : "is");
-	if (c->next)
-	    c->next->prev = c->prev;
-	if (c->prev)
-	    c->prev->next = c->next;
+    if (!c->users)
+	delete_channel(c);
+}
+
+/*************************************************************************/
+
+/* Quita de una lista de un canal todos los usuarios del servidor dado. */
+
+static void purge_server_list(struct c_userlist **list, Server *server)
+{
+    struct c_userlist *u, *next;
+
+    for (u = *list; u; u = next) {
+	next = u->next;
+	if (u->user->server != server)
+	    continue;
+	if (u->next)
+	    u->next->prev = u->prev;
+	if (u->prev)
+	    u->prev->next = u->next;
 	else
-	    chanlist[HASH(c->name)] = c->next;
-	free(c);
+	    *list = u->next;
+	free(u);
     }
 }
 
+/* Remove all users on the given server from a channel in one pass over
+ * its member lists, instead of one chan_deluser() per user.  Used when a
+ * server splits; the caller frees the users' own u_chanlist entries and
+ * must not touch the channel again, as it may have been freed here.
+ */
+
+void chan_delusers_server(Channel *c, Server *server)
+{
+    log_debug(LOG_USERS, 2, "channel: chan_delusers_server(%s, %s) called...",
+		c->name, server->name);
+
+    c->squit = NULL;
+    purge_server_list(&c->users, server);
+    purge_server_list(&c->chanops, server);
+    purge_server_list(&c->voices, server);
+    if (!c->users)
+	delete_channel(c);
+}
+
 /*************************************************************************/
 
 /* Handle a channel MODE command. */
@@ -365,9 +720,9 @@ void do_cmode(const char *source, int ac, char **av)
 
     /* This shouldn't trigger on +o, etc. */
     if (strchr(source, '.') && !modestr[strcspn(modestr, "bov")]) {
-	if (time(NULL) != chan->server_modetime) {
+	if (cur_time != chan->server_modetime) {
 	    chan->server_modecount = 0;
-	    chan->server_modetime = time(NULL);
+	    chan->server_modetime = cur_time;
 	}
 	chan->server_modecount++;
     }
@@ -476,29 +831,13 @@ void do_cmode(const char *source, int ac, char **av)
 		break;
 	    }
 	    if (add) {
-		if (chan->bancount >= chan->bansize) {
-		    chan->bansize += 8;
-		    chan->bans = srealloc(chan->bans,
-					sizeof(char *) * chan->bansize);
-		}
-		chan->bans[chan->bancount++] = sstrdup(*av++);
+		add_ban(chan, *av++);
 	    } else {
 	    
 	    /* Aqui el futuro soporte de SET NOUNBAN
 	     * para evitar unbans de cyber
 	     */
-		char **s = chan->bans;
-		int i = 0;
-		while (i < chan->bancount && strcmp(*s, *av) != 0) {
-		    i++;
-		    s++;
-		}
-		if (i < chan->bancount) {
-		    chan->bancount--;
-		    if (i < chan->bancount)
-			memmove(s, s+1, sizeof(char *) * (chan->bancount-i));
-		}
-		av++;
+		del_ban(chan, *av++);
 	    }
 	    break;
 
@@ -521,8 +860,7 @@ void do_cmode(const char *source, int ac, char **av)
 							chan->name, nick);
 		    break;
 		}
-		if (debug)
-		    log("debug: Setting +o on %s for %s", chan->name, nick);
+		log_debug(LOG_USERS, 1, "debug: Setting +o on %s for %s", chan->name, nick);
 		if (!check_valid_op(user, chan->name, !!strchr(source, '.')))
 		    break;
 		u = smalloc(sizeof(*u));
@@ -544,8 +882,7 @@ void do_cmode(const char *source, int ac, char **av)
                                                chan->name, nick);
                     break;
                 }
-                if (debug)
-                    log("debug: Setting -o on %s for %s", chan->name, nick);
+                log_debug(LOG_USERS, 1, "debug: Setting -o on %s for %s", chan->name, nick);
                                                                                                                                                                                     
               /* Leave Ops */		    
                 if (check_leaveops(user, chan->name, source))
@@ -580,8 +917,7 @@ void do_cmode(const char *source, int ac, char **av)
 							chan->name, nick);
 		    break;
 		}
-		if (debug)
-		    log("debug: Setting +v on %s for %s", chan->name, nick);
+		log_debug(LOG_USERS, 1, "debug: Setting +v on %s for %s", chan->name, nick);
                 if (!check_valid_voice(user, chan->name, !!strchr(source, '.')))
                     break;                                    
 		u = smalloc(sizeof(*u));
@@ -603,8 +939,7 @@ void do_cmode(const char *source, int ac, char **av)
                                                            chan->name, nick);
                     break;
                 }                                                                                                            
-                if (debug)
-                    log("debug: Setting -v on %s for %s", chan->name, nick);
+                log_debug(LOG_USERS, 1, "debug: Setting -v on %s for %s", chan->name, nick);
                                     
               /* Leave Voices */
                 if (check_leavevoices(user, chan->name, source))
@@ -643,7 +978,7 @@ void do_topic(const char *source, int ac, char **av)
     if (check_topiclock(av[0]))
 	return;
     strscpy(c->topic_setter, source, sizeof(c->topic_setter));
-    c->topic_time = time(NULL);
+    c->topic_time = cur_time;
     if (c->topic) {
 	free(c->topic);
 	c->topic = NULL;
@@ -16,6 +16,27 @@
 /*************************************************************************/
 
 static ChannelInfo *chanlists[256];
+static ExpireHeap cs_expire;		/* Channels ordered by expiry check */
+static SearchIndex cs_search;		/* Trigrams of LIST lines */
+
+/* Estado de un LIST en curso; igual que en NickServ, se procesa por pasos
+ * de SEARCH_STEP canales. */
+typedef struct chanlist_ ChanList;
+struct chanlist_ {
+    ChanList *next, *prev;
+    Job *job;			/* NULL si aun no se ha pasado a segundo plano */
+    User *who;			/* Quien ha pedido el LIST */
+    char *pattern;
+    int is_servoper;		/* Se comprueba de nuevo en cada paso */
+    int16 matchflags;
+    int shown;
+    int prefixlen;		/* Prefijo literal del patron, 0 si no hay */
+    int bucket;			/* Postings de cs_search, -1 si no se usan */
+    int pos;			/* Siguiente posicion en los postings */
+    int i;			/* chanlists[] que se esta recorriendo */
+    ChannelInfo *ci;		/* Siguiente canal a mirar en chanlists[i] */
+};
+static ChanList *chanlist_jobs;
 
 static int def_levels[][2] = {
     { CA_AUTOOP,           300 },
@@ -69,13 +90,40 @@ static int levelinfo_maxwidth = 0;
 
 /*************************************************************************/
 
+/* Indice del access list de un canal: los niveles por NickInfo principal
+ * (getlink() de cada entrada), en una tabla de direccionamiento abierto.
+ * Si varias entradas van al mismo nick principal, vale la primera, como
+ * cuando se recorria la lista.  Se rehace la primera vez que hace falta
+ * despues de cambiar la lista (access_changed()) o algun enlace de nicks
+ * (link_generation). */
+
+typedef struct {
+    NickInfo *ni;
+    int16 level;
+} AccessSlot;
+
+struct accessindex_ {
+    uint32 generation;		/* link_generation al crearlo */
+    int size;			/* Potencia de 2, al menos el doble de entradas */
+    AccessSlot *slots;
+};
+
+#define ACCESS_HASH(ni,size) \
+	((uint32)(((unsigned long)(ni) >> 4) * 0x9E3779B1UL) & ((size)-1))
+
+/*************************************************************************/
+
 static void alpha_insert_chan(ChannelInfo *ci);
 static ChannelInfo *makechan(const char *chan);
 static int delchan(ChannelInfo *ci);
+static void schedule_chan_expire(ChannelInfo *ci);
+static void index_chan(ChannelInfo *ci);
+static void chanlist_forget(ChannelInfo *ci);
 static void reset_levels(ChannelInfo *ci);
 static int is_founder(User *user, ChannelInfo *ci);
 static int is_identified(User *user, ChannelInfo *ci);
 static int get_access(User *user, ChannelInfo *ci);
+static void access_changed(ChannelInfo *ci);
 
 static void do_help(User *u);
 static void do_credits(User *u);
@@ -391,6 +439,9 @@ void get_chanserv_stats(long *nrec, long *memuse, long *nforbid,
 		mem += strlen(ci->email)+1;
             caccess += ci->accesscount;
 	    mem += ci->accesscount * sizeof(ChanAccess);
+	    if (ci->accindex)
+		mem += sizeof(AccessIndex)
+		     + sizeof(AccessSlot) * ci->accindex->size;
             cakick += ci->akickcount;
 	    mem += ci->akickcount * sizeof(AutoKick);
 	    for (j = 0; j < ci->akickcount; j++) {
@@ -436,6 +487,23 @@ void get_chanserv_stats(long *nrec, long *memuse, long *nforbid,
     *nmemosnr = cmemosnr;
 }
 
+/*************************************************************************/
+
+/* ns_foreach_memo() for channel memos. */
+
+void cs_foreach_memo(void (*fn)(Memo *m))
+{
+    ChannelInfo *ci;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+	for (ci = chanlists[i]; ci; ci = ci->next) {
+	    for (j = 0; j < ci->memos.memocount; j++)
+		fn(&ci->memos.memos[j]);
+	}
+    }
+}
+
 /*************************************************************************/
 /*************************************************************************/
 
@@ -748,6 +816,7 @@ void load_cs_dbase(void)
     dbFILE *f;
     int ver, i, j, c;
     ChannelInfo *ci, **last, *prev;
+    uint32 memogen = 0;
     int failed = 0;
 
     if (!(f = open_db(s_ChanServ, ChanDBName, "r", CHAN_VERSION)))
@@ -755,12 +824,17 @@ void load_cs_dbase(void)
 
     switch (ver = get_file_version(f)) {
 
+      case 10:
       case 9:
       case 8:
       case 7:
       case 6:
       case 5:
 
+	/* Memo texts are in the memo store as of version 10 */
+	if (ver >= 10)
+	    SAFE(read_int32(&memogen, f));
+
 	for (i = 0; i < 256 && !failed; i++) {
 	    int16 tmp16;
 	    int32 tmp32;
@@ -777,6 +851,9 @@ void load_cs_dbase(void)
 		last = &ci->next;
 		ci->prev = prev;
 		prev = ci;
+		ci->expire_pos = 0;
+		ci->search_id = 0;
+		ci->accindex = NULL;
 		SAFE(read_buffer(ci->name, f));
 		SAFE(read_string(&s, f));
 		if (s)
@@ -935,7 +1012,15 @@ void load_cs_dbase(void)
 			SAFE(read_int32(&tmp32, f));
 			memos->time = tmp32;
 			SAFE(read_buffer(memos->sender, f));
-			SAFE(read_string(&memos->text, f));
+			if (ver >= 10) {
+			    SAFE(read_int32(&memos->textpos, f));
+			    SAFE(read_int16(&memos->textlen, f));
+			    memo_store_loaded(memos, memogen, MEMO_STORE_CHANS);
+			} else {
+			    SAFE(read_string(&s, f));
+			    memo_store_add(memos, s ? s : "");
+			    free(s);
+			}
 		    }
 		}
 
@@ -950,6 +1035,7 @@ void load_cs_dbase(void)
 	    } /* while (getc_db(f) != 0) */
 
 	    *last = NULL;
+	    release_db_pages(f);
 
 	} /* for (i) */
 
@@ -985,6 +1071,8 @@ void load_cs_dbase(void)
 */		
 		
 	    }
+	    schedule_chan_expire(ci);
+	    index_chan(ci);
 	}
     }
 
@@ -998,10 +1086,10 @@ void load_cs_dbase(void)
     if ((x) < 0) {						\
 	restore_db(f);						\
 	log_perror("Write error on %s", ChanDBName);		\
-	if (time(NULL) - lastwarn > WarningTimeout) {		\
+	if (cur_time - lastwarn > WarningTimeout) {		\
 	    canalopers(NULL, "Error de escritura en %s: %s", ChanDBName,	\
 			strerror(errno));			\
-	    lastwarn = time(NULL);				\
+	    lastwarn = cur_time;				\
 	}							\
 	return;							\
     }								\
@@ -1013,10 +1101,13 @@ void save_cs_dbase(void)
     int i, j;
     ChannelInfo *ci;
     Memo *memos;
+    uint32 memogen;
     static time_t lastwarn = 0;
 
+    memogen = sync_memo_store();
     if (!(f = open_db(s_ChanServ, ChanDBName, "w", CHAN_VERSION)))
 	return;
+    SAFE(write_int32(memogen, f));
 
     for (i = 0; i < 256; i++) {
 	int16 tmp16;
@@ -1091,7 +1182,8 @@ void save_cs_dbase(void)
 		SAFE(write_int16(memos->flags, f));
 		SAFE(write_int32(memos->time, f));
 		SAFE(write_buffer(memos->sender, f));
-		SAFE(write_string(memos->text, f));
+		SAFE(write_int32(memo_store_pos(memos), f));
+		SAFE(write_int16(memos->textlen, f));
 	    }
 
 	    SAFE(write_string(ci->entry_message, f));
@@ -1103,7 +1195,10 @@ void save_cs_dbase(void)
 
     } /* for (i) */
 
-    close_db(f);
+    /* Igual que en save_ns_dbase(): si el chan.db nuevo no ha quedado en
+     * su sitio, el viejo aun apunta a la generacion vieja del almacen */
+    if (close_db(f) == 0)
+	memo_store_saved(MEMO_STORE_CHANS);
 }
 
 #undef SAFE
@@ -1136,9 +1231,9 @@ void check_modes(const char *chan)
 	return;
     }
 
-    if (c->chanserv_modetime != time(NULL)) {
+    if (c->chanserv_modetime != cur_time) {
 	c->chanserv_modecount = 0;
-	c->chanserv_modetime = time(NULL);
+	c->chanserv_modetime = cur_time;
     }
     c->chanserv_modecount++;
 
@@ -1321,7 +1416,7 @@ int check_valid_op(User *user, const char *chan, int serverop)
         return 0;
     }
 
-    if (serverop && time(NULL)-start_time >= CSRestrictDelay
+    if (serverop && cur_time-start_time >= CSRestrictDelay
 				&& !check_access(user, ci, CA_AUTOOP)) {
 /* Genera mucho trafico */
 //	notice_lang(s_ChanServ, user, CHAN_IS_REGISTERED, s_ChanServ);
@@ -1368,7 +1463,7 @@ int check_valid_voice(User *user, const char *chan, int serverop)
         return 0;
     }    
    
-    if (serverop && time(NULL)-start_time >= CSRestrictDelay
+    if (serverop && cur_time-start_time >= CSRestrictDelay
                && !check_access(user, ci, CA_AUTOVOICE)) {
        /* Genera mucho trafico */
 //      notice_lang(s_ChanServ, user, CHAN_IS_REGISTERED, s_ChanServ);
@@ -1408,7 +1503,7 @@ int check_should_op(User *user, const char *chan)
 
     if (check_access(user, ci, CA_AUTOOP)) {
 	send_cmd(s_ChanServ, "MODE %s +o %s", chan, user->nick);
-	ci->last_used = time(NULL);
+	ci->last_used = cur_time;
 	return 1;
     }
     
@@ -1574,7 +1669,7 @@ int check_kick(User *user, const char *chan)
 	}
     }
 
-    if (time(NULL)-start_time >= CSRestrictDelay
+    if (cur_time-start_time >= CSRestrictDelay
 				&& check_access(user, ci, CA_NOJOIN)) {
 	mask = create_mask(user);
 	reason = getstring(user->ni, CHAN_NOT_ALLOWED_TO_JOIN);
@@ -1598,7 +1693,7 @@ kick:
     strcpy(av[0], chan);
     av[1] = sstrdup("+b");
     av[2] = mask;
-    send_cmd(s_ChanServ, "MODE %s +b %s  %lu", chan, av[2], time(NULL));
+    send_cmd(s_ChanServ, "MODE %s +b %s  %lu", chan, av[2], cur_time);
     do_cmode(s_ChanServ, 3, av);
     free(av[0]);
     free(av[1]);
@@ -1703,50 +1798,93 @@ int check_topiclock(const char *chan)
 
 /*************************************************************************/
 
-/* Remove all channels which have expired. */
+/* Remove all channels which have expired.  As with expire_nicks(), only
+ * channels whose check is due are looked at, at most EXPIRE_BATCH per
+ * call.  Returns nonzero if there are still due channels left.
+ */
 
-void expire_chans()
+int expire_chans()
 {
-    ChannelInfo *ci, *next;
+    ChannelInfo *ci;
     Channel *c;
-    int i;
-    time_t now = time(NULL);
+    int n = 0;
+    time_t now = cur_time;
 
     if (!CSExpire || opt_noexpire)
-	return;
+	return 0;
 
-    for (i = 0; i < 256; i++) {
-	for (ci = chanlists[i]; ci; ci = next) {
-	    next = ci->next;
+    while (n++ < EXPIRE_BATCH && (ci = expire_next(&cs_expire, now))) {
 /* Expiraciones de suspends */	    
-            if (ci->flags & NS_SUSPENDED)
-                if (ci->time_expiresuspend != 0 && ci->time_expiresuspend <= now) {
-                    if (NSExpire && NSSuspendGrace &&
-                           (now - ci->last_used >= CSExpire - CSSuspendGrace))
-                        ci->last_used = now - CSExpire + CSSuspendGrace;
-                    log("Expiring channel-suspend for %s", ci->name);
-                    canalopers(s_ChanServ, "Expirando suspension del canal %s", ci->name);
-                    free(ci->suspendby);
-                    free(ci->suspendreason);
-                    ci->time_suspend = 0;
-                    ci->time_expiresuspend = 0;
-                    ci->flags &= ~NS_SUSPENDED;
-                }                       
+	if (ci->flags & CI_SUSPENDED)
+	    if (ci->time_expiresuspend != 0 && ci->time_expiresuspend <= now) {
+		if (CSExpire && CSSuspendGrace &&
+		       (now - ci->last_used >= CSExpire - CSSuspendGrace))
+		    ci->last_used = now - CSExpire + CSSuspendGrace;
+		log("Expiring channel-suspend for %s", ci->name);
+		canalopers(s_ChanServ, "Expirando suspension del canal %s", ci->name);
+		free(ci->suspendby);
+		free(ci->suspendreason);
+		ci->time_suspend = 0;
+		ci->time_expiresuspend = 0;
+		ci->flags &= ~CI_SUSPENDED;
+	    }                       
 /* Expiraciones de canales */                       
-	    if (now - ci->last_used >= CSExpire	    
-			&& !(ci->flags & (CI_VERBOTEN | CI_NO_EXPIRE | CI_SUSPENDED))) {
-		log("Expiring channel %s", ci->name);
-		canalopers(s_ChanServ, "Expirando canal %s", ci->name);
-		if ((c = findchan(ci->name))) {
-		    c->mode &= ~CMODE_r;
-		    send_cmd(s_ChanServ, "MODE %s -r", ci->name);
-		}
-                if (CSInChannel)
-                    send_cmd(s_ChanServ, "PART %s", ci->name);
-		delchan(ci);
-	    }	    
-	}
+	if (now - ci->last_used >= CSExpire	    
+		    && !(ci->flags & (CI_VERBOTEN | CI_NO_EXPIRE | CI_SUSPENDED))) {
+	    log("Expiring channel %s", ci->name);
+	    canalopers(s_ChanServ, "Expirando canal %s", ci->name);
+	    if ((c = findchan(ci->name))) {
+		c->mode &= ~CMODE_r;
+		send_cmd(s_ChanServ, "MODE %s -r", ci->name);
+	    }
+	    if (CSInChannel)
+		send_cmd(s_ChanServ, "PART %s", ci->name);
+	    delchan(ci);
+	    continue;
+	}	    
+	schedule_chan_expire(ci);
     }
+    return expire_due(&cs_expire, now);
+}
+
+/*************************************************************************/
+
+/* Put a channel in the expiry heap at the time it next needs checking;
+ * see schedule_nick_expire() in nickserv.c. */
+
+static void schedule_chan_expire(ChannelInfo *ci)
+{
+    time_t when;
+
+    if ((ci->flags & CI_SUSPENDED) && ci->time_expiresuspend)
+	when = ci->time_expiresuspend;
+    else if (ci->flags & (CI_VERBOTEN | CI_NO_EXPIRE | CI_SUSPENDED))
+	when = cur_time + CSExpire;
+    else
+	when = ci->last_used + CSExpire;
+    expire_add(&cs_expire, ci, &ci->expire_pos, when);
+}
+
+/*************************************************************************/
+
+/* Build the line LIST matches its pattern against. */
+
+static void chan_list_text(ChannelInfo *ci, char *buf, int size)
+{
+    snprintf(buf, size, "%-20s  %s %s", ci->name,
+			ci->flags & CI_OFICIAL_CHAN ? "[Oficial]" : "",
+			ci->desc ? ci->desc : "");
+}
+
+/* (Re)index a channel for LIST; call whenever its description or
+ * CI_OFICIAL_CHAN changes. */
+
+static void index_chan(ChannelInfo *ci)
+{
+    char buf[BUFSIZE];
+
+    chan_list_text(ci, buf, sizeof(buf));
+    search_add(&cs_search, ci, &ci->search_id, buf);
 }
 
 /*************************************************************************/
@@ -1803,6 +1941,7 @@ void cs_remove_nick(const NickInfo *ni)
 		if (ca->in_use && ca->ni == ni) {
 		    ca->in_use = 0;
 		    ca->ni = NULL;
+		    access_changed(ci);
 		}
 	    }
 	    for (akick = ci->akick, j = ci->akickcount; j > 0; akick++, j--) {
@@ -2031,9 +2170,11 @@ static ChannelInfo *makechan(const char *chan)
 
     ci = scalloc(sizeof(ChannelInfo), 1);
     strscpy(ci->name, chan, CHANMAX);
-    ci->time_registered = time(NULL);
+    ci->time_registered = cur_time;
     reset_levels(ci);
     alpha_insert_chan(ci);
+    index_chan(ci);
+    expire_add(&cs_expire, ci, &ci->expire_pos, cur_time);
     return ci;
 }
 
@@ -2047,6 +2188,10 @@ static int delchan(ChannelInfo *ci)
     int i;
     NickInfo *ni = ci->founder;
 
+    expire_del(&cs_expire, &ci->expire_pos);
+    search_del(&cs_search, &ci->search_id);
+    chanlist_forget(ci);
+
     if (ci->c)
 	ci->c->ci = NULL;
     if (ci->next)
@@ -2071,6 +2216,7 @@ static int delchan(ChannelInfo *ci)
         free (ci->forbidreason);	
     if (ci->access)
 	free(ci->access);
+    access_changed(ci);
     for (i = 0; i < ci->akickcount; i++) {
 	if (!ci->akick[i].is_nick && ci->akick[i].u.mask)
 	    free(ci->akick[i].u.mask);
@@ -2082,10 +2228,8 @@ static int delchan(ChannelInfo *ci)
     if (ci->levels)
 	free(ci->levels);
     if (ci->memos.memos) {
-	for (i = 0; i < ci->memos.memocount; i++) {
-	    if (ci->memos.memos[i].text)
-		free(ci->memos.memos[i].text);
-	}
+	for (i = 0; i < ci->memos.memocount; i++)
+	    memo_free_text(&ci->memos.memos[i]);
 	free(ci->memos.memos);
     }
     free(ci);
@@ -2145,6 +2289,48 @@ static int is_identified(User *user, ChannelInfo *ci)
 
 /*************************************************************************/
 
+/* Throw away a channel's access index after its access list changes. */
+
+static void access_changed(ChannelInfo *ci)
+{
+    if (ci->accindex) {
+	free(ci->accindex->slots);
+	free(ci->accindex);
+	ci->accindex = NULL;
+    }
+}
+
+static AccessIndex *access_index(ChannelInfo *ci)
+{
+    AccessIndex *ai = ci->accindex;
+    ChanAccess *access;
+    NickInfo *ni;
+    int i, h;
+
+    if (ai && ai->generation == link_generation)
+	return ai;
+    access_changed(ci);
+    ai = ci->accindex = smalloc(sizeof(AccessIndex));
+    ai->generation = link_generation;
+    ai->size = 8;
+    while (ai->size < ci->accesscount*2)
+	ai->size *= 2;
+    ai->slots = scalloc(sizeof(AccessSlot), ai->size);
+    for (access = ci->access, i = 0; i < ci->accesscount; access++, i++) {
+	if (!access->in_use)
+	    continue;
+	ni = getlink(access->ni);
+	h = ACCESS_HASH(ni, ai->size);
+	while (ai->slots[h].ni && ai->slots[h].ni != ni)
+	    h = (h+1) & (ai->size-1);
+	if (!ai->slots[h].ni) {
+	    ai->slots[h].ni = ni;
+	    ai->slots[h].level = access->level;
+	}
+    }
+    return ai;
+}
+
 /* Return the access level the given user has on the channel.  If the
  * channel doesn't exist, the user isn't on the access list, or the channel
  * is CS_SECURE and the user hasn't IDENTIFY'd with NickServ, return 0. */
@@ -2152,8 +2338,8 @@ static int is_identified(User *user, ChannelInfo *ci)
 static int get_access(User *user, ChannelInfo *ci)
 {
     NickInfo *ni = user->ni;
-    ChanAccess *access;
-    int i;
+    AccessIndex *ai;
+    int h;
 
     if (!ci || !ni)
 	return 0;
@@ -2162,9 +2348,11 @@ static int get_access(User *user, ChannelInfo *ci)
     if (nick_identified(user)
 	|| (nick_recognized(user) && !(ci->flags & CI_SECURE))
     ) {
-	for (access = ci->access, i = 0; i < ci->accesscount; access++, i++) {
-	    if (access->in_use && getlink(access->ni) == ni)
-		return access->level;
+	ai = access_index(ci);
+	for (h = ACCESS_HASH(ni, ai->size); ai->slots[h].ni;
+						h = (h+1) & (ai->size-1)) {
+	    if (ai->slots[h].ni == ni)
+		return ai->slots[h].level;
 	}
     }
     return 0;
@@ -2312,6 +2500,7 @@ static void do_register(User *u)
 	strscpy(ci->founderpass, pass, PASSMAX);
 #endif
 	ci->desc = sstrdup(desc);
+	index_chan(ci);
 	if (c->topic) {
 	    ci->last_topic = sstrdup(c->topic);
 	    strscpy(ci->last_topic_setter, c->topic_setter, NICKMAX);
@@ -2685,6 +2874,7 @@ static void do_set_desc(User *u, ChannelInfo *ci, char *param)
     if (ci->desc)
 	free(ci->desc);
     ci->desc = sstrdup(param);
+    index_chan(ci);
     notice_lang(s_ChanServ, u, CHAN_DESC_CHANGED, ci->name, param);
 }
 
@@ -2755,7 +2945,7 @@ static void do_set_topic(User *u, ChannelInfo *ci, char *param)
 	free(c->topic);
 	c->topic_time--;	/* to get around TS8 */
     } else
-	c->topic_time = time(NULL);
+	c->topic_time = cur_time;
     if (*param)
 	c->topic = sstrdup(param);
     else
@@ -3156,9 +3346,11 @@ static void do_set_oficial(User *u, ChannelInfo *ci, char *param)
     }
     if (stricmp(param, "ON") == 0) {
         ci->flags |= CI_OFICIAL_CHAN;
+        index_chan(ci);
         notice_lang(s_ChanServ, u, CHAN_SET_OFICIAL_ON, ci->name);
     } else if (stricmp(param, "OFF") == 0) {
         ci->flags &= ~CI_OFICIAL_CHAN;
+        index_chan(ci);
         notice_lang(s_ChanServ, u, CHAN_SET_OFICIAL_OFF, ci->name);
    } else {
       syntax_error(s_ChanServ, u, "SET OFICIAL", CHAN_SET_OFICIAL_SYNTAX);
@@ -3178,6 +3370,7 @@ static void do_set_noexpire(User *u, ChannelInfo *ci, char *param)
 	notice_lang(s_ChanServ, u, CHAN_SET_NOEXPIRE_ON, ci->name);
     } else if (stricmp(param, "OFF") == 0) {
 	ci->flags &= ~CI_NO_EXPIRE;
+	schedule_chan_expire(ci);
 	notice_lang(s_ChanServ, u, CHAN_SET_NOEXPIRE_OFF, ci->name);
     } else {
 	syntax_error(s_ChanServ, u, "SET NOEXPIRE", CHAN_SET_NOEXPIRE_SYNTAX);
@@ -3212,7 +3405,10 @@ static int access_del_callback(User *u, int num, va_list args)
     if (num < 1 || num > ci->accesscount)
 	return 0;
     *last = num;
-    return access_del(u, &ci->access[num-1], perm, uacc);
+    if (!access_del(u, &ci->access[num-1], perm, uacc))
+	return 0;
+    access_changed(ci);
+    return 1;
 }
 #endif
 
@@ -3327,6 +3523,7 @@ static void do_access(User *u)
 		    return;
 		}
 		access->level = level;
+		access_changed(ci);
 		notice_lang(s_ChanServ, u, CHAN_ACCESS_LEVEL_CHANGED,
 			access->ni->nick, chan, level);
                 if (ci->flags & CI_OPNOTICE) {
@@ -3358,6 +3555,7 @@ static void do_access(User *u)
 	access->ni = ni;
 	access->in_use = 1;
 	access->level = level;
+	access_changed(ci);
 	notice_lang(s_ChanServ, u, CHAN_ACCESS_ADDED,
 		access->ni->nick, chan, level);
         if (ci->flags & CI_OPNOTICE) {
@@ -3433,6 +3631,7 @@ static void do_access(User *u)
                                           
 		access->ni = NULL;
 		access->in_use = 0;
+		access_changed(ci);
 	    }
 //	}
 
@@ -3636,7 +3835,7 @@ static void do_akick(User *u)
 	else
 	    akick->reason = NULL;
 	strscpy(akick->who, u->nick, NICKMAX);    
-        akick->time = time(NULL);
+        akick->time = cur_time;
 /* Kick */
         if (u2) {
         /* Solo kickea si esta en el canal y no es un oper */
@@ -3911,7 +4110,7 @@ static void do_info(User *u)
             notice_lang(s_ChanServ, u, CHAN_INFO_SUSPENDED_REASON,  ci->suspendreason);
             if (is_services_oper(u)) {
                 char timebuf[32], expirebuf[256];
-                time_t now = time(NULL);                                   
+                time_t now = cur_time;                                   
                 tm = localtime(&ci->time_suspend);
                 strftime_lang(timebuf, sizeof(timebuf), u, STRFTIME_DATE_TIME_FORMAT, tm);
                 if (ci->time_expiresuspend == 0) {
@@ -4107,6 +4306,157 @@ static void do_info(User *u)
 
 /*************************************************************************/
 
+/* Mira si un canal entra en el LIST y, si es asi, lo manda.  Devuelve 1 si
+ * se ha mostrado. */
+
+static int chanlist_match(User *u, ChanList *cl, ChannelInfo *ci)
+{
+    char buf[BUFSIZE];
+    char noexpire_char = ' ';
+
+    if (!cl->is_servoper && ((ci->flags & CI_PRIVATE)
+				    || (ci->flags & CI_VERBOTEN)))
+	return 0;
+    if ((cl->matchflags != 0) && !(ci->flags & cl->matchflags))
+	return 0;
+    chan_list_text(ci, buf, sizeof(buf));
+    if (stricmp(cl->pattern, ci->name) != 0 &&
+				!match_wild_nocase(cl->pattern, buf))
+	return 0;
+
+    if (cl->is_servoper && (ci->flags & CI_NO_EXPIRE))
+	noexpire_char = '!';
+    /* This can only be true for SADMINS - normal users
+     * Will never get this far with a VERBOTEN channel.
+     * -TheShadow */
+    if (ci->flags & CI_VERBOTEN) {
+	snprintf(buf, sizeof(buf), "%-20s [Prohibido]",
+			ci->name);
+    }
+    if (ci->flags & CI_SUSPENDED) {
+	snprintf(buf, sizeof(buf), "%-20s [Suspendido]",
+			ci->name);
+    }
+    privmsg(s_ChanServ, u->nick, "  %c%s", noexpire_char, buf);
+    cl->shown++;
+    return 1;
+}
+
+/*************************************************************************/
+
+/* Libera un LIST terminado o cancelado. */
+
+static void chanlist_free(ChanList *cl)
+{
+    if (cl->next)
+	cl->next->prev = cl->prev;
+    if (cl->prev)
+	cl->prev->next = cl->next;
+    else
+	chanlist_jobs = cl->next;
+    if (cl->bucket >= 0)
+	search_release(&cs_search);
+    free(cl->pattern);
+    free(cl);
+}
+
+/*************************************************************************/
+
+/* Avanza un LIST hasta SEARCH_STEP canales; ver nicklist_run() en
+ * nickserv.c.  Aqui el indice cubre la linea entera (nombre, [Oficial] y
+ * descripcion), asi que sirve para cualquier patron con tres caracteres
+ * literales seguidos.
+ */
+
+static int chanlist_run(ChanList *cl)
+{
+    User *u = cl->who;
+    ChannelInfo *ci;
+    int n, done = 0;
+
+    /* Si ha dejado de ser oper no ve el resto de la lista de oper */
+    if (cl->is_servoper && !is_services_oper(u)) {
+	chanlist_free(cl);
+	return 0;
+    }
+    for (n = 0; n < SEARCH_STEP && cl->shown < CSListMax; n++) {
+	if (cl->bucket >= 0) {
+	    Postings *p = &cs_search.post[cl->bucket];
+	    if (cl->pos >= p->count) {
+		done = 1;
+		break;
+	    }
+	    if (!(ci = search_get(&cs_search, p->ids[cl->pos++])))
+		continue;
+	} else {
+	    while (!cl->ci && !cl->prefixlen && ++cl->i < 256)
+		cl->ci = chanlists[cl->i];
+	    if (!(ci = cl->ci)) {
+		done = 1;
+		break;
+	    }
+	    cl->ci = ci->next;
+	    if (cl->prefixlen) {
+		int cmp = strnicmp(ci->name, cl->pattern, cl->prefixlen);
+		if (cmp < 0)
+		    continue;
+		if (cmp > 0) {
+		    done = 1;
+		    break;
+		}
+	    }
+	}
+	chanlist_match(u, cl, ci);
+    }
+    if (!done && cl->shown < CSListMax)
+	return 1;
+    notice_lang(s_ChanServ, u, CHAN_LIST_END, cl->shown);
+    chanlist_free(cl);
+    return 0;
+}
+
+static int chanlist_job(Job *j)
+{
+    return chanlist_run(j->data);
+}
+
+/*************************************************************************/
+
+/* Un canal va a desaparecer; que ningun LIST en curso se quede apuntando
+ * a el. */
+
+static void chanlist_forget(ChannelInfo *ci)
+{
+    ChanList *cl;
+
+    for (cl = chanlist_jobs; cl; cl = cl->next) {
+	if (cl->ci == ci)
+	    cl->ci = ci->next;
+    }
+}
+
+/*************************************************************************/
+
+/* Cancela el LIST en curso de un usuario, si tiene alguno.  Se llama
+ * tambien cuando el usuario sale o cambia de nick, para que el resto de la
+ * lista no le llegue a otro que coja ese nick. */
+
+void cancel_chan_list(User *u)
+{
+    ChanList *cl;
+
+    for (cl = chanlist_jobs; cl; cl = cl->next) {
+	if (cl->who == u) {
+	    if (cl->job)
+		del_job(cl->job);
+	    chanlist_free(cl);
+	    return;
+	}
+    }
+}
+
+/*************************************************************************/
+
 /* SADMINS can search for channels based on their CI_VERBOTEN and CI_NO_EXPIRE
  * status. This works in the same way as NickServ's LIST command.
  * Syntax for sadmins: LIST pattern [FORBIDDEN] [NOEXPIRE]
@@ -4118,9 +4468,8 @@ static void do_list(User *u)
 {
     char *pattern = strtok(NULL, " ");
     char *keyword;
+    ChanList *cl;
     ChannelInfo *ci;
-    int nchans, i;
-    char buf[BUFSIZE];
     int is_servoper = is_services_oper(u);
     int16 matchflags = 0; /* CI_ flags a chan must match one of the qualify */
 
@@ -4132,59 +4481,61 @@ static void do_list(User *u)
     if (!pattern) {
 	syntax_error(s_ChanServ, u, "LIST",
 	        is_servoper ? NICK_LIST_SERVADMIN_SYNTAX : CHAN_LIST_SYNTAX);
+	return;
+    }
+
+    while (is_servoper && (keyword = strtok(NULL, " ")))  {
+	if (stricmp(keyword, "FORBID") == 0)
+	    matchflags |= CI_VERBOTEN;
+	if (stricmp(keyword, "NOEXPIRE") == 0)
+	    matchflags |= CI_NO_EXPIRE;
+	if (stricmp(keyword, "SUSPEND") == 0)
+	    matchflags |= CI_SUSPENDED;
+	if (stricmp(keyword, "OFICIAL") == 0)
+	    matchflags |= CI_OFICIAL_CHAN;
+    }
+
+    /* Un LIST nuevo cancela el anterior del mismo usuario */
+    cancel_chan_list(u);
+
+    cl = scalloc(sizeof(ChanList), 1);
+    cl->who = u;
+    cl->pattern = sstrdup(pattern);
+    cl->is_servoper = is_servoper;
+    cl->matchflags = matchflags;
+    cl->bucket = -1;
+    cl->prefixlen = strcspn(pattern, "*?");
+    cl->next = chanlist_jobs;
+    if (chanlist_jobs)
+	chanlist_jobs->prev = cl;
+    chanlist_jobs = cl;
+
+    notice_lang(s_ChanServ, u, CHAN_LIST_HEADER, pattern);
+
+    /* Los canales van por el segundo caracter en chanlists[], asi que el
+     * prefijo solo sirve si tiene al menos dos */
+    if (!pattern[cl->prefixlen]) {
+	/* Sin comodines solo puede coincidir el canal con ese nombre: la
+	 * linea entera lleva ademas la descripcion */
+	if ((ci = cs_findchan(pattern)))
+	    chanlist_match(u, cl, ci);
+	notice_lang(s_ChanServ, u, CHAN_LIST_END, cl->shown);
+	chanlist_free(cl);
+	return;
+    } else if (cl->prefixlen >= 2) {
+	cl->i = tolower(pattern[1]);
+	cl->ci = chanlists[cl->i];
+    } else if ((cl->bucket = search_bucket(&cs_search, pattern,
+						strlen(pattern))) >= 0) {
+	search_hold(&cs_search);
     } else {
-	nchans = 0;
-	
-	while (is_servoper && (keyword = strtok(NULL, " ")))  {
-	    if (stricmp(keyword, "FORBID") == 0)
-	        matchflags |= CI_VERBOTEN;
-	    if (stricmp(keyword, "NOEXPIRE") == 0)
-	        matchflags |= CI_NO_EXPIRE;
-            if (stricmp(keyword, "SUSPEND") == 0)
-                matchflags |= CI_SUSPENDED;
-            if (stricmp(keyword, "OFICIAL") == 0)
-                matchflags |= CI_OFICIAL_CHAN;    
-	}
-	            
-	notice_lang(s_ChanServ, u, CHAN_LIST_HEADER, pattern);
-	for (i = 0; i < 256; i++) {
-	    for (ci = chanlists[i]; ci; ci = ci->next) {
-		if (!is_servoper && ((ci->flags & CI_PRIVATE)
-		                               || (ci->flags & CI_VERBOTEN)))
-		    continue;
-		if ((matchflags != 0) && !(ci->flags & matchflags))
-		    continue;    
-		snprintf(buf, sizeof(buf), "%-20s  %s %s", ci->name,
-                              ci->flags & CI_OFICIAL_CHAN ? "[Oficial]" : "",
-                              ci->desc ? ci->desc : "");
-		if (stricmp(pattern, ci->name) == 0 ||
-					match_wild_nocase(pattern, buf)) {
-		    if (++nchans <= CSListMax) {
-			char noexpire_char = ' ';
-			if (is_servoper && (ci->flags & CI_NO_EXPIRE))
-			    noexpire_char = '!';
-			/* This can only be true for SADMINS - normal users
-			 * Will never get this far with a VERBOTEN channel.
-			 * -TheShadow */
-			if (ci->flags & CI_VERBOTEN) {
-			    snprintf(buf, sizeof(buf), "%-20s [Prohibido]",
-			                ci->name);
-			}                 
-                                                                    			
-                        if (ci->flags & CI_SUSPENDED) {
-                            snprintf(buf, sizeof(buf), "%-20s [Suspendido]",
-                                        ci->name);
-                        }			
-			privmsg(s_ChanServ, u->nick, "  %c%s",
-						noexpire_char, buf);
-		    }
-		}
-	    }
-	}
-	notice_lang(s_ChanServ, u, CHAN_LIST_END,
-			nchans>CSListMax ? CSListMax : nchans, nchans);
+	cl->prefixlen = 0;
+	cl->i = 0;
+	cl->ci = chanlists[0];
     }
 
+    if (chanlist_run(cl))
+	cl->job = add_job(chanlist_job, cl);
 }
 
 /*************************************************************************/
@@ -4544,42 +4895,27 @@ static void do_unban(User *u)
     } else if (!c->bancount) {
         notice_lang(s_ChanServ, u, CHAN_UNBAN_NOT_FOUND, chan);
     } else {
-	/* Save original ban info */
-	int desban = 0;
-	int count = c->bancount;
-	char **bans = smalloc(sizeof(char *) * count);
-	memcpy(bans, c->bans, sizeof(char *) * count);
+	/* Copies of the matching bans, since removing them frees them */
+	char **bans;
+	int count = match_bans(c, u, 0, &bans);
 
+#ifdef PROV
+	    /* Desbanea la ip virtual */
+	if (!count)
+	    count = match_bans(c, u, 1, &bans);
+#endif
 	av[0] = chan;
 	av[1] = sstrdup("-b");
 	for (i = 0; i < count; i++) {
-	    if (match_usermask(bans[i], u)) {
-		send_cmd(s_ChanServ, "MODE %s -b %s",
-			chan, bans[i]);
-		av[2] = sstrdup(bans[i]);
-		do_cmode(s_ChanServ, 3, av);
-		free(av[2]);
-		desban = 1;
-	    }
-	}  
-#ifdef PROV
-	    /* Desbanea la ip virtual */
-        if (!desban) 
-        for (i = 0; i < count; i++) {
-            if (match_virtualmask(bans[i], u)) {           
-                send_cmd(s_ChanServ, "MODE %s -b %s",
-                        chan, bans[i]);
-                av[2] = sstrdup(bans[i]);
-                do_cmode(s_ChanServ, 3, av);
-                free(av[2]);
-                desban = 1;
-            }         	    
+	    send_cmd(s_ChanServ, "MODE %s -b %s", chan, bans[i]);
+	    av[2] = bans[i];
+	    do_cmode(s_ChanServ, 3, av);
+	    free(bans[i]);
 	}
-#endif	
-	
 	free(av[1]);
-	free(bans);
-        if (desban)
+	if (bans)
+	    free(bans);
+        if (count)
             notice_lang(s_ChanServ, u, CHAN_UNBANNED, chan);
         else
             notice_lang(s_ChanServ, u, CHAN_UNBAN_FAILED, chan);
@@ -4623,6 +4959,7 @@ static void do_clear(User *u)
     char *what = strtok(NULL, " ");
     Channel *c;
     ChannelInfo *ci;
+    BulkOp *op;
 
     if (!what) {
 	syntax_error(s_ChanServ, u, "CLEAR", CHAN_CLEAR_SYNTAX);
@@ -4637,35 +4974,13 @@ static void do_clear(User *u)
     } else if (!u || (!check_access(u, ci, CA_CLEAR) && !is_services_oper(u))) {
 	notice_lang(s_ChanServ, u, PERMISSION_DENIED);
     } else if (stricmp(what, "bans") == 0) {
-
-	char *av[3];
-	int i;
-        int count = c->bancount;
-        char **bans = NULL;
-
-        if (!count) {
+        if (!c->bancount) {
             notice_lang(s_ChanServ, u, CHAN_UNBAN_NOT_FOUND, chan);
             return;
         }
-
-	/* Save original info */
-        bans = smalloc(sizeof(char *) * count);
-	for (i = 0; i < count; i++)
-	    bans[i] = sstrdup(c->bans[i]);
-
-	for (i = 0; i < count; i++) {
-	    av[0] = sstrdup(chan);
-	    av[1] = sstrdup("-b");
-	    av[2] = bans[i];
-	    send_cmd(s_ChanServ, "MODE %s %s :%s",
-			av[0], av[1], av[2]);
-	    do_cmode(s_ChanServ, 3, av);
-	    free(av[2]);
-	    free(av[1]);
-	    free(av[0]);
-	}
-	notice_lang(s_ChanServ, u, CHAN_CLEARED_BANS, chan);
-	free(bans);
+	op = bulk_new(s_ChanServ, u, chan);
+	op->done_msg = CHAN_CLEARED_BANS;
+	bulk_start(op, BULK_UNBAN);
     } else if (stricmp(what, "modes") == 0) {
 	char *av[3];
 
@@ -4686,62 +5001,24 @@ static void do_clear(User *u)
 	check_modes(chan);
 	notice_lang(s_ChanServ, u, CHAN_CLEARED_MODES, chan);
     } else if (stricmp(what, "ops") == 0) {
-	char *av[3];
-	struct c_userlist *cu, *next;
-
-	for (cu = c->chanops; cu; cu = next) {
-	    next = cu->next;
-	    av[0] = sstrdup(chan);
-	    av[1] = sstrdup("-o");
-	    av[2] = sstrdup(cu->user->nick);
-	    send_cmd(s_ChanServ, "MODE %s %s :%s",
-			av[0], av[1], av[2]);
-	    do_cmode(s_ChanServ, 3, av);
-	    free(av[2]);
-	    free(av[1]);
-	    free(av[0]);
-	}
-	notice_lang(s_ChanServ, u, CHAN_CLEARED_OPS, chan);
+	op = bulk_new(s_ChanServ, u, chan);
+	op->done_msg = CHAN_CLEARED_OPS;
+	bulk_start(op, BULK_DEOP);
     } else if (stricmp(what, "voices") == 0) {
-	char *av[3];
-	struct c_userlist *cu, *next;
- 
-	for (cu = c->voices; cu; cu = next) {
-	    next = cu->next;
-	    av[0] = sstrdup(chan);
-	    av[1] = sstrdup("-v");
-	    av[2] = sstrdup(cu->user->nick);
-	    send_cmd(s_ChanServ, "MODE %s %s :%s",
-			av[0], av[1], av[2]);
-	    do_cmode(s_ChanServ, 3, av);
-	    free(av[2]);
-	    free(av[1]);
-	    free(av[0]);
-	}
-	notice_lang(s_ChanServ, u, CHAN_CLEARED_VOICES, chan);
+	op = bulk_new(s_ChanServ, u, chan);
+	op->done_msg = CHAN_CLEARED_VOICES;
+	bulk_start(op, BULK_DEVOICE);
     } else if (stricmp(what, "users") == 0) {
-	char *av[3];
-	struct c_userlist *cu, *next;
 	char buf[256];
 
 	snprintf(buf, sizeof(buf), "12CLEAR USERS por %s", u->nick);
-
-	for (cu = c->users; cu; cu = next) {
-	    next = cu->next;
-	    av[0] = sstrdup(chan);
-	    av[1] = sstrdup(cu->user->nick);
-	    av[2] = sstrdup(buf);
-	    send_cmd(s_ChanServ, "KICK %s %s :%s",
-			av[0], av[1], av[2]);
-	    do_kick(s_ChanServ, 3, av);
-	    free(av[2]);
-	    free(av[1]);
-	    free(av[0]);
-	}
-	notice_lang(s_ChanServ, u, CHAN_CLEARED_USERS, chan);
 	if (get_access(u, ci) < CA_CLEAR)
 	    canaladmins(s_ChanServ, "%s hace un CLEAR USERS en %s como OPER",
 	                        u->nick, ci->name);
+	op = bulk_new(s_ChanServ, u, chan);
+	op->reason = sstrdup(buf);
+	op->done_msg = CHAN_CLEARED_USERS;
+	bulk_start(op, BULK_KICK);
     } else if (stricmp(what, "topic") == 0) {
         send_cmd(s_ChanServ, "TOPIC %s :%s", ci->name, ci->last_topic ? ci->last_topic : "");
         notice_lang(s_ChanServ, u, CHAN_CLEARED_TOPIC, chan);        
@@ -4828,19 +5105,20 @@ static void do_suspend(User *u)
                 notice_lang(s_ChanServ, u, BAD_EXPIRY_TIME);
                 return;
             } else if (expires > 0) {
-                expires += time(NULL);
+                expires += cur_time;
             }
         } else {        
-            expires = time(NULL) + CSSuspendExpire;
+            expires = cur_time + CSSuspendExpire;
         }
 
         log("%s: %s!%s@%s SUSPENDi el canal %s, Motivo: %s",
                    s_ChanServ, u->nick, u->username, u->host, chan, reason);
         ci->suspendby = sstrdup(u->nick);
         ci->suspendreason = sstrdup(reason);
-        ci->time_suspend = time(NULL);
+        ci->time_suspend = cur_time;
         ci->time_expiresuspend = expires;
         ci->flags |= CI_SUSPENDED;
+        schedule_chan_expire(ci);
         
         notice_lang(s_ChanServ, u, CHAN_SUSPEND_SUCCEEDED, chan);
         canalopers(s_ChanServ, "%s ha SUSPENDido el canal %s, motivo %s",
@@ -4891,6 +5169,7 @@ static void do_unsuspend(User *u)
         ci->time_suspend = 0;
         ci->time_expiresuspend = 0;
         ci->flags &= ~CI_SUSPENDED;                            
+        schedule_chan_expire(ci);
         
         notice_lang(s_ChanServ, u, CHAN_UNSUSPEND_SUCCEEDED, chan);
         canalopers(s_ChanServ, "%s ha reactivado el canal %s", u->nick, chan);
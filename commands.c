@@ -11,6 +11,7 @@
 #include "services.h"
 #include "commands.h"
 #include "language.h"
+#include "latency.h"
 
 /*************************************************************************/
 
@@ -39,9 +40,11 @@ void run_cmd(const char *service, User *u, Command *list, const char *cmd)
 {
     Command *c = lookup_cmd(list, cmd);
     if (c && c->routine) {
-	if ((c->has_priv == NULL) || c->has_priv(u))
+	if ((c->has_priv == NULL) || c->has_priv(u)) {
+	    lat_t start = lat_now();
 	    c->routine(u);
-	else
+	    lat_record(&c->latency, service, c->name, lat_now() - start);
+	} else
 	    notice_lang(service, u, ACCESS_DENIED);
     } else {
     	notice_lang(service, u, UNKNOWN_COMMAND_HELP, cmd, service);
@@ -30,6 +30,7 @@ typedef struct {
     const char *help_param2;
     const char *help_param3;
     const char *help_param4;
+    struct latstat_ *latency;	/* Timing statistics; see latency.h */
 } Command;
 
 /*************************************************************************/
@@ -54,6 +54,7 @@ char *ChanDBName;
 char *OperDBName;
 char *AutokillDBName;
 char *NewsDBName;
+char *MemoDBName;
 char *IlineDBName;
 
 char *SendMailPatch;
@@ -71,6 +72,10 @@ int   ReadTimeout;
 int   WarningTimeout;
 int   TimeoutCheck;
 int   SettimeTimeout;
+int   FloodUserCount;
+int   FloodUserPeriod;
+int   FloodHostCount;
+int   FloodHostPeriod;
 
 int   NSNicksMail;
 static int NSDefNone;
@@ -211,6 +216,10 @@ Directive directives[] = {
     { "DevNullName",      { { PARAM_STRING, 0, &s_DevNull },
                             { PARAM_STRING, 0, &desc_DevNull } } },
     { "ExpireTimeout",    { { PARAM_TIME, 0, &ExpireTimeout } } },
+    { "FloodHost",        { { PARAM_POSINT, 0, &FloodHostCount },
+                            { PARAM_TIME, 0, &FloodHostPeriod } } },
+    { "FloodUser",        { { PARAM_POSINT, 0, &FloodUserCount },
+                            { PARAM_TIME, 0, &FloodUserPeriod } } },
     { "GlobalName",       { { PARAM_STRING, 0, &s_GlobalNoticer },
                             { PARAM_STRING, 0, &desc_GlobalNoticer } } },
     { "HelpDir",          { { PARAM_STRING, 0, &HelpDir } } },
@@ -237,6 +246,7 @@ Directive directives[] = {
     { "MSIgnoreMax",      { { PARAM_POSINT, 0, &MSIgnoreMax } } },
     { "MSNotifyAll",      { { PARAM_SET, 0, &MSNotifyAll } } },
     { "MSSendDelay",      { { PARAM_TIME, 0, &MSSendDelay } } },
+    { "MemoServDB",       { { PARAM_STRING, 0, &MemoDBName } } },
     { "NewsDB",           { { PARAM_STRING, 0, &NewsDBName } } },
     { "NickservDB",       { { PARAM_STRING, 0, &NickDBName } } },
     { "NickServName",     { { PARAM_STRING, 0, &s_NickServ },
@@ -616,6 +626,11 @@ int read_config()
 	NSDefMemoReceive = 1;
     }
 
+    /* Memo texts used to live in nick.db and chan.db, so older
+     * configuration files won't have this */
+    if (!MemoDBName)
+	MemoDBName = "memo.db";
+
     return retval;
 }
 
@@ -29,6 +29,10 @@
 /* Name of log file (in Services directory) */
 #define LOG_FILENAME	"services.log"
 
+/* Name of the file OperServ STATS LATENCY DUMP writes command latency
+ * histograms to (in Services directory) */
+#define LATENCY_FILENAME	"latency.log"
+
 /* Maximum amount of data from/to the network to buffer (bytes). */
 #define NET_BUFSIZE	65536*64   /* 4 MB para Terra - zoltan */
 
@@ -16,16 +16,51 @@
 
 #ifdef CYBER
 
-#define HASH(host)      (((host)[0]&31)<<5 | ((host)[1]&31))
+/* Clones por host.  La tabla crece con el numero de hosts: con las dos
+ * primeras letras como hash, las ips caian todas en un centenar de listas
+ * y cada conexion las recorria. */
 
-static Clones *cloneslist[1024];
+#define HASH(host)      (hash_nocase(host) & (cloneshash_size-1))
+
+static Clones **cloneslist;
+static int cloneshash_size;
 static int32 nclones = 0;
 
 static IlineInfo *ilinelists[256];
+static ExpireHeap iline_expire;         /* Ilines por fecha de expiracion */
+
+/* Indices de ilines.  ilinelists[] sigue siendo la lista ordenada que se
+ * usa para listar y grabar; ademas cada iline esta en una tabla hash por
+ * host y otra por host2 (sin distinguir mayusculas), y las que son una red
+ * (ip/bits) en un arbol radix binario con los prefijos comprimidos, de
+ * forma que buscar la iline de un host al conectar no depende del numero
+ * de ilines. */
+
+#define ILHASH(s)	(hash_nocase(s) & (ilinehash_size-1))
+
+static IlineInfo **ilinehash;           /* Por host, enlazadas por hnext */
+static IlineInfo **ilinehash2;          /* Por host2, enlazadas por h2next */
+static int ilinehash_size, ilinehash_count;
+
+typedef struct ilinenode_ IlineNode;
+struct ilinenode_ {
+    IlineNode *child[2];        /* Segun el bit que sigue al prefijo */
+    uint32 net;                 /* Red, con los bits de host a cero */
+    int bits;                   /* Longitud del prefijo */
+    IlineInfo *ilines;          /* Ilines de esta red, enlazadas por tnext
+                                 * (NULL si el nodo solo separa ramas) */
+};
+static IlineNode *ilinetrie;
+static int32 nilinenodes;
+
+#define NETMASK(bits)	((bits) ? ~(uint32)0 << (32-(bits)) : 0)
+#define NETBIT(ip,n)	((ip) >> (31-(n)) & 1)
 
 static void alpha_insert_iline(IlineInfo *il);
 static void change_host_iline(IlineInfo *il, const char *host);
-static IlineInfo *find_iline_host2(const char *host);
+static IlineInfo *find_iline_exact(const char *host);
+static void index_iline(IlineInfo *il);
+static void unindex_iline(IlineInfo *il);
 static IlineInfo *makeiline(const char *host);
 static int deliline(IlineInfo *il);
 
@@ -142,17 +177,11 @@ void listilines(int count_only, const char *host)
 
 void get_clones_stats(long *nrec, long *memuse)
 {
-    Clones *clones;
     long mem;
-    int i;
-            
+
+    /* Los hosts son compartidos, ver get_intern_stats() */
     mem = sizeof(Clones) * nclones;
-    for (i = 0; i < 1024; i++) {
-        for (clones = cloneslist[i]; clones; clones = clones->next) {
-            mem += strlen(clones->host)+1;
-        }
-    }    
-    
+    mem += cloneshash_size * sizeof(Clones *);
     *nrec = nclones;
     *memuse = mem;
 }
@@ -196,6 +225,8 @@ void get_iline_stats(long *nrec, long *memuse, long *nsuspend,
                 mem += strlen(il->operwho)+1;
         }
     }
+    mem += ilinehash_size * 2 * sizeof(IlineInfo *);
+    mem += nilinenodes * sizeof(IlineNode);
     *nrec = count;
     *memuse = mem;
     *nsuspend = csuspend;
@@ -211,21 +242,41 @@ void get_iline_stats(long *nrec, long *memuse, long *nsuspend,
 Clones *findclones(const char *host)
 {
     Clones *clones;
-    int i;
         
-    if (!host)
+    if (!host || !cloneshash_size)
         return NULL;
 
-    for (i = 0; i < 1024; i++) {
-        for (clones = cloneslist[i]; clones; clones = clones->next) {
-            if (stricmp(host, clones->host) == 0) {
-                return clones;
-            }
-        }
-    }        
+    /* HASH() no distingue mayusculas, basta con mirar una lista */
+    for (clones = cloneslist[HASH(host)]; clones; clones = clones->next) {
+        if (host == clones->host || stricmp(host, clones->host) == 0)
+            return clones;
+    }
     return NULL;
 }
 
+/* Duplica el tamao de la tabla de clones. */
+
+static void grow_cloneslist(void)
+{
+    Clones **old = cloneslist, *clones, *next, **list;
+    int oldsize = cloneshash_size, i;
+
+    cloneshash_size = oldsize ? oldsize*2 : 1024;
+    cloneslist = scalloc(cloneshash_size, sizeof(*cloneslist));
+    for (i = 0; i < oldsize; i++) {
+        for (clones = old[i]; clones; clones = next) {
+            next = clones->next;
+            list = &cloneslist[HASH(clones->host)];
+            clones->prev = NULL;
+            clones->next = *list;
+            if (*list)
+                (*list)->prev = clones;
+            *list = clones;
+        }
+    }
+    free(old);
+}
+
 /*************************************************************************/
 
 int add_clones(const char *nick, const char *host)
@@ -261,12 +312,12 @@ int add_clones(const char *nick, const char *host)
             /* Tiene Iline y miramos si hay record */
                 if (clones->numeroclones >= iline->record_clones) {
                     iline->record_clones = clones->numeroclones;
-                    iline->time_record = time(NULL);
+                    iline->time_record = cur_time;
                 }   
                 /* Pone el Vhost al usuario */
                 if (iline->vhost)
                     send_cmd(ServerName, "SVSVHOST %s :%s", nick, iline->vhost);
-//            }    
+                return 1;
             } else {
 /* MIGRACION */
 /* Si Tiene 3 o 4 o 5 clones MOSTRAR MENSAJE DE AVISO */
@@ -282,9 +333,11 @@ int add_clones(const char *nick, const char *host)
             }
         }
     }
+    if (nclones >= cloneshash_size)
+        grow_cloneslist();
     nclones++;
     clones = scalloc(sizeof(Clones), 1);
-    clones->host = sstrdup(host);
+    clones->host = sintern_nocase(host);
     list = &cloneslist[HASH(clones->host)];
     clones->next = *list;
     if (*list)
@@ -328,7 +381,7 @@ void del_clones(const char *host)
     if (debug >= 2)
         log("debug: del_clones(): free session structure");
                               
-    free(clones->host);
+    sunintern(clones->host);
     free(clones);
         
     nclones--;
@@ -421,6 +474,7 @@ void load_cyber_dbase(void)
                 last = &il->next;
                 il->prev = prev;
                 prev = il;
+                il->expire_pos = 0;
                 
                 SAFE(read_string(&il->host, f));
                 SAFE(read_string(&il->host2, f));                            
@@ -446,6 +500,10 @@ void load_cyber_dbase(void)
                 SAFE(read_int32(&tmp32, f));
                 il->time_record = tmp32;                                                                                               
                 SAFE(read_int16(&il->estado, f));
+                if (il->time_expiracion)
+                    expire_add(&iline_expire, il, &il->expire_pos,
+                               il->time_expiracion);
+                index_iline(il);
             }  /* while (getc_db(f) != 0) */
             *last = NULL;
                         
@@ -466,10 +524,10 @@ void load_cyber_dbase(void)
     if ((x) < 0) {                                              \
         restore_db(f);                                          \
         log_perror("Write error on %s", IlineDBName);            \
-        if (time(NULL) - lastwarn > WarningTimeout) {           \
+        if (cur_time - lastwarn > WarningTimeout) {           \
             canalopers(NULL, "Write error on %s: %s", IlineDBName,  \
                         strerror(errno));                       \
-            lastwarn = time(NULL);                              \
+            lastwarn = cur_time;                              \
         }                                                       \
         return;                                                 \
     }                                                           \
@@ -523,24 +581,23 @@ void save_cyber_dbase(void)
 
 /*************************************************************************/
 
-void expire_ilines(void)
-{
+/* Borra las ilines caducadas.  Solo se miran las que estan en el heap de
+ * expiracion (las que tienen fecha), y como mucho EXPIRE_BATCH por
+ * llamada.  Devuelve distinto de cero si quedan pendientes.
+ */
 
-    int i;
-    IlineInfo *il = NULL, *next;
-    time_t now = time(NULL);
+int expire_ilines(void)
+{
+    IlineInfo *il;
+    int n = 0;
+    time_t now = cur_time;
     
-    for (i = 0; i < 256; i++) {
-        for (il = ilinelists[i]; il; il = next) {
-            next = il->next;
-            if (now >= il->time_expiracion) {
-                log("Expirando iline %s [%s]", il->host, il->comentario);
-                canalopers(s_CyberServ, "Expirando iline %s [%s]", il->host, il->comentario);
-                deliline(il);
-            }
-        }
+    while (n++ < EXPIRE_BATCH && (il = expire_next(&iline_expire, now))) {
+        log("Expirando iline %s [%s]", il->host, il->comentario);
+        canalopers(s_CyberServ, "Expirando iline %s [%s]", il->host, il->comentario);
+        deliline(il);
     }    
-
+    return expire_due(&iline_expire, now);
 }
 
 /*************************************************************************/
@@ -574,41 +631,336 @@ void cyber_remove_nick(const NickInfo *ni)
 
 /*************************************************************************/
 
-/* Return the ChannelInfo structure for the given channel, or NULL if the
- * channel isn't registered. */
- 
+/* Duplica el tamao de las tablas hash. */
+
+static void grow_ilinehash(void)
+{
+    IlineInfo **old = ilinehash, **old2 = ilinehash2, *il, *next;
+    int oldsize = ilinehash_size, i;
+
+    ilinehash_size = oldsize ? oldsize*2 : 1024;
+    ilinehash = scalloc(ilinehash_size, sizeof(*ilinehash));
+    ilinehash2 = scalloc(ilinehash_size, sizeof(*ilinehash2));
+    for (i = 0; i < oldsize; i++) {
+        for (il = old[i]; il; il = next) {
+            next = il->hnext;
+            il->hnext = ilinehash[ILHASH(il->host)];
+            ilinehash[ILHASH(il->host)] = il;
+        }
+        for (il = old2[i]; il; il = next) {
+            next = il->h2next;
+            il->h2next = ilinehash2[ILHASH(il->host2)];
+            ilinehash2[ILHASH(il->host2)] = il;
+        }
+    }
+    free(old);
+    free(old2);
+}
+
+/*************************************************************************/
+
+/* Si el host de la iline es una red ip/bits, guarda la red y devuelve 1. */
+
+static int iline_net(const char *host, uint32 *net, int *bits)
+{
+    return strchr(host, '/') && parse_cidr(host, net, bits);
+}
+
+/* Devuelve el nodo del arbol para la red net/bits, creandolo si hace
+ * falta. */
+
+static IlineNode *get_ilinenode(uint32 net, int bits)
+{
+    IlineNode **np = &ilinetrie, *n, *split;
+    int common;
+
+    while ((n = *np) != NULL) {
+        for (common = 0; common < bits && common < n->bits
+                         && !NETBIT(net ^ n->net, common); common++)
+            ;
+        if (common == n->bits) {
+            if (n->bits == bits)
+                return n;
+            np = &n->child[NETBIT(net, n->bits)];
+            continue;
+        }
+        /* La red del nodo no contiene la nuestra: se mete un nodo nuevo
+         * donde se separan, que es la nuestra si contiene a la del nodo. */
+        split = scalloc(sizeof(IlineNode), 1);
+        split->net = net & NETMASK(common);
+        split->bits = common;
+        split->child[NETBIT(n->net, common)] = n;
+        *np = split;
+        nilinenodes++;
+        if (common == bits)
+            return split;
+        np = &split->child[NETBIT(net, common)];
+        break;
+    }
+    n = scalloc(sizeof(IlineNode), 1);
+    n->net = net;
+    n->bits = bits;
+    *np = n;
+    nilinenodes++;
+    return n;
+}
+
+/* Quita el nodo si no tiene ilines y le sobra al arbol (menos de dos
+ * hijos). */
+
+static void prune_ilinenode(IlineNode **np)
+{
+    IlineNode *n = *np;
+
+    if (n->ilines || (n->child[0] && n->child[1]))
+        return;
+    *np = n->child[0] ? n->child[0] : n->child[1];
+    free(n);
+    nilinenodes--;
+}
+
+static void del_ilinenode(uint32 net, int bits, IlineInfo *il)
+{
+    IlineNode **np = &ilinetrie, **parent = NULL, *n;
+    IlineInfo **prev;
+
+    while ((n = *np) != NULL && n->bits < bits
+                             && !((net ^ n->net) & NETMASK(n->bits))) {
+        parent = np;
+        np = &n->child[NETBIT(net, n->bits)];
+    }
+    if (!n || n->bits != bits || n->net != net)
+        return;
+    for (prev = &n->ilines; *prev && *prev != il; prev = &(*prev)->tnext)
+        ;
+    if (*prev)
+        *prev = il->tnext;
+    prune_ilinenode(np);
+    if (parent)
+        prune_ilinenode(parent);
+}
+
+/*************************************************************************/
+
+/* Mete la iline en los indices, o la saca.  Hay que sacarla antes de
+ * cambiarle host o host2 y volverla a meter despues. */
+
+static void index_iline(IlineInfo *il)
+{
+    IlineNode *n;
+    uint32 net;
+    int bits;
+
+    if (ilinehash_count >= ilinehash_size)
+        grow_ilinehash();
+    ilinehash_count++;
+    il->hnext = ilinehash[ILHASH(il->host)];
+    ilinehash[ILHASH(il->host)] = il;
+    if (il->host2) {
+        il->h2next = ilinehash2[ILHASH(il->host2)];
+        ilinehash2[ILHASH(il->host2)] = il;
+    }
+    if (iline_net(il->host, &net, &bits)) {
+        n = get_ilinenode(net, bits);
+        il->tnext = n->ilines;
+        n->ilines = il;
+    }
+}
+
+static void unindex_iline(IlineInfo *il)
+{
+    IlineInfo **prev;
+    uint32 net;
+    int bits;
+
+    for (prev = &ilinehash[ILHASH(il->host)]; *prev != il;
+                                              prev = &(*prev)->hnext)
+        ;
+    *prev = il->hnext;
+    if (il->host2) {
+        for (prev = &ilinehash2[ILHASH(il->host2)]; *prev != il;
+                                                    prev = &(*prev)->h2next)
+            ;
+        *prev = il->h2next;
+    }
+    ilinehash_count--;
+    if (iline_net(il->host, &net, &bits))
+        del_ilinenode(net, bits, il);
+}
+
+/*************************************************************************/
+
+/* Pasa un host dado en ILINE/SET a la forma en que se guarda: las redes
+ * como a.b.c.d/bits con los bits de host a cero (y /32 como ip sola).
+ * Devuelve NULL si tiene / pero no es una red valida de /8 o menos. */
+
+static const char *canon_iline_host(const char *host, char *buf, int size)
+{
+    uint32 net;
+    int bits;
+
+    if (!strchr(host, '/'))
+        return host;
+    if (!parse_cidr(host, &net, &bits) || bits < 8)
+        return NULL;
+    snprintf(buf, size, "%u.%u.%u.%u", net>>24, net>>16 & 255,
+             net>>8 & 255, net & 255);
+    if (bits < 32)
+        snprintf(buf+strlen(buf), size-strlen(buf), "/%d", bits);
+    return buf;
+}
+
+/*************************************************************************/
+
+/* Busca la iline que es exactamente de ese host (o host2). */
+
+static IlineInfo *find_iline_exact(const char *host)
+{
+    IlineInfo *il;
+
+    if (!ilinehash_size)
+        return NULL;
+    for (il = ilinehash[ILHASH(host)]; il; il = il->hnext) {
+        if (stricmp(il->host, host) == 0)
+            return il;
+    }
+    for (il = ilinehash2[ILHASH(host)]; il; il = il->h2next) {
+        if (stricmp(il->host2, host) == 0)
+            return il;
+    }
+    return NULL;
+}
+
+/* Busca la iline que se aplica a un host: la suya propia si la tiene, y
+ * si no y es una ip, la de la red mas concreta que la contenga. */
+
 IlineInfo *find_iline_host(const char *host)
 {
- 
-     IlineInfo *il;
-//     int i;
-    
-     for (il = ilinelists[tolower(*host)]; il; il = il->next) {
-//     for (i = 0; i < 256; i++) {
-//         for (il = ilinelists[i]; il; il = il->next) {
-              
-         if (stricmp(il->host, host) == 0)
-             return il;
-     }     
-//     }          
-//     return NULL;
-      return find_iline_host2(host); 
+    IlineInfo *il, *best = NULL;
+    IlineNode *n;
+    uint32 ip;
+    int bits;
+
+    if ((il = find_iline_exact(host)) != NULL)
+        return il;
+    if (!ilinetrie || !parse_cidr(host, &ip, &bits) || bits != 32)
+        return NULL;
+    for (n = ilinetrie; n && !((ip ^ n->net) & NETMASK(n->bits));
+                        n = n->bits < 32 ? n->child[NETBIT(ip, n->bits)] : NULL) {
+        if (n->ilines)
+            best = n->ilines;
+    }
+    return best;
 }
 
-IlineInfo *find_iline_host2(const char *host)
+/*************************************************************************/
+
+/* Para el benchmark de ilines (bench.c): crear y borrar ilines sin pasar
+ * por CyberServ, buscar la iline de un host mirandolas todas una por una
+ * (lo que tiene que devolver find_iline_host()), y comprobar que el arbol
+ * esta bien formado. */
+
+IlineInfo *bench_add_iline(const char *host, int limite)
 {
+    IlineInfo *il;
 
-     IlineInfo *il;
-     int i;
+    if (find_iline_exact(host))
+        return NULL;
+    il = makeiline(host);
+    il->limite = limite;
+    return il;
+}
 
-     for (i = 0; i < 256; i++) {
-         for (il = ilinelists[i]; il; il = il->next) {
+void bench_del_iline(IlineInfo *il)
+{
+    deliline(il);
+}
+
+IlineInfo *find_iline_host_slow(const char *host)
+{
+    IlineInfo *il, *best = NULL;
+    uint32 ip, net;
+    int i, bits, ipbits, bestbits = -1;
 
-             if (il->host2 && (stricmp(il->host, host) == 0))
+    for (i = 0; i < 256; i++) {
+        for (il = ilinelists[i]; il; il = il->next) {
+            if (stricmp(il->host, host) == 0)
                 return il;
-         }
-     }
-     return NULL;
+        }
+    }
+    for (i = 0; i < 256; i++) {
+        for (il = ilinelists[i]; il; il = il->next) {
+            if (il->host2 && stricmp(il->host2, host) == 0)
+                return il;
+        }
+    }
+    if (!parse_cidr(host, &ip, &ipbits) || ipbits != 32)
+        return NULL;
+    for (i = 0; i < 256; i++) {
+        for (il = ilinelists[i]; il; il = il->next) {
+            if (iline_net(il->host, &net, &bits) && bits > bestbits
+                                && !((ip ^ net) & NETMASK(bits))) {
+                best = il;
+                bestbits = bits;
+            }
+        }
+    }
+    return best;
+}
+
+/* Devuelve el numero de nodos que cuelgan de `n' (incluido), y suma a
+ * *nilines las ilines que tienen, o -1 si alguno esta mal: bits de host
+ * puestos, fuera de la red de su padre o en el lado que no es, ilines de
+ * otra red, o sin ilines y con menos de dos hijos (tendria que haberse
+ * podado). */
+
+static int32 check_ilinenode(const IlineNode *n, const IlineNode *parent,
+                             int side, int32 *nilines)
+{
+    const IlineInfo *il;
+    uint32 net;
+    int32 a, b;
+    int bits;
+
+    if (!n)
+        return 0;
+    if (n->net & ~NETMASK(n->bits))
+        return -1;
+    if (parent && (n->bits <= parent->bits
+                   || ((n->net ^ parent->net) & NETMASK(parent->bits))
+                   || NETBIT(n->net, parent->bits) != side))
+        return -1;
+    if (!n->ilines && !(n->child[0] && n->child[1]))
+        return -1;
+    for (il = n->ilines; il; il = il->tnext, (*nilines)++) {
+        if (!iline_net(il->host, &net, &bits) || net != n->net
+                                              || bits != n->bits)
+            return -1;
+    }
+    if ((a = check_ilinenode(n->child[0], n, 0, nilines)) < 0
+            || (b = check_ilinenode(n->child[1], n, 1, nilines)) < 0)
+        return -1;
+    return 1 + a + b;
+}
+
+/* Devuelve 0 si el arbol esta bien y tiene todas las ilines que son una
+ * red, -1 si no. */
+
+int check_ilinetrie(void)
+{
+    IlineInfo *il;
+    uint32 net;
+    int32 nodes, nilines = 0, nnets = 0;
+    int i, bits;
+
+    nodes = check_ilinenode(ilinetrie, NULL, 0, &nilines);
+    for (i = 0; i < 256; i++) {
+        for (il = ilinelists[i]; il; il = il->next) {
+            if (iline_net(il->host, &net, &bits))
+                nnets++;
+        }
+    }
+    return nodes == nilinenodes && nilines == nnets ? 0 : -1;
 }
 
 
@@ -718,6 +1070,7 @@ static IlineInfo *makeiline(const char *host)
     il = scalloc(sizeof(IlineInfo), 1);
     il->host = sstrdup(host);
     alpha_insert_iline(il);
+    index_iline(il);
     return il;
 }
                                         
@@ -725,6 +1078,8 @@ static IlineInfo *makeiline(const char *host)
 
 static int deliline(IlineInfo *il)
 {
+    expire_del(&iline_expire, &il->expire_pos);
+    unindex_iline(il);
 
     if (il->next)
         il->next->prev = il->prev;
@@ -737,8 +1092,6 @@ static int deliline(IlineInfo *il)
         free(il->host);
     if (il->host2)
         free(il->host2);                   
-    if (il->host)
-        free(il->host);        
     if (il->nombreadmin)
         free(il->nombreadmin);        
     if (il->dniadmin)
@@ -793,7 +1146,10 @@ static void change_host_iline(IlineInfo *il, const char *host)
         ilinelists[tolower(*il->host)] = il->next;
     if (il->next)
         il->next->prev = il->prev;
-    strcpy(il->host, host);
+    unindex_iline(il);
+    free(il->host);
+    il->host = sstrdup(host);
+    index_iline(il);
     list = &ilinelists[tolower(*il->host)];
     il->next = *list;
     il->prev = NULL;
@@ -859,7 +1215,7 @@ static void do_actualiza(User *u)
         notice_lang(s_CyberServ, u, CYBER_NO_ADMIN_CYBER);
     } else if (!(iline->estado & IL_IPNOFIJA)) {
         notice_lang(s_CyberServ, u, CYBER_ACTUALIZA_IPFIJA, iline->host);
-    } else if (find_iline_host(u->host)) {
+    } else if (find_iline_exact(u->host)) {
         notice_lang(s_CyberServ, u, CYBER_ACTUALIZA_HOST, u->host);
     } else { 
  privmsg(s_CyberServ, u->nick, "COMANDO DESACTIVADO TEMPORALMENTE");
@@ -914,7 +1270,7 @@ static void do_info(User *u)
                 notice_lang(s_CyberServ, u, CYBER_INFO_VHOST, il->vhost);
             if (is_servadmin) {    
                 char timebuf[32], expirebuf[256];
-                time_t now = time(NULL);
+                time_t now = cur_time;
                 tm = localtime(&il->time_concesion);
                 strftime_lang(timebuf, sizeof(timebuf), u, STRFTIME_DATE_TIME_FORMAT, tm);
                 if (il->time_expiracion == 0) {
@@ -1091,26 +1447,21 @@ static void do_cyberunban(User *u)
        return;
    } else {
             
-       int count = c->bancount;
-       int desban = 0;
-       char **bans = smalloc(sizeof(char *) * count);
-       memcpy(bans, c->bans, sizeof(char *) * count);
-                                            
-   
+       char **bans;
+       int count = match_bans(c, u, 0, &bans);
+
        av[0] = chan;
        av[1] = sstrdup("-b");
        for (i = 0; i < count; i++) {
-           if (match_usermask(bans[i], u)) {
-               send_cmd(s_CyberServ, "MODE %s -b %s", chan, bans[i]);
-               av[2] = sstrdup(bans[i]);
-               do_cmode(s_CyberServ, 3, av);
-               free(av[2]);
-               desban = 1;
-           }
+           send_cmd(s_CyberServ, "MODE %s -b %s", chan, bans[i]);
+           av[2] = bans[i];
+           do_cmode(s_CyberServ, 3, av);
+           free(bans[i]);
        }
        free(av[1]);
-       free(bans);
-       if (desban)
+       if (bans)
+           free(bans);
+       if (count)
            notice_lang(s_CyberServ, u, CYBER_UNBAN_SUCCEEDED, chan);
        else
            notice_lang(s_CyberServ, u, CYBER_UNBAN_FAILED, chan);       
@@ -1165,6 +1516,26 @@ static void do_verify(User *u)
 
 /*************************************************************************/
 
+/* Para CLONES NET: a quien se le manda la lista, y cuantos van. */
+typedef struct {
+    User *u;
+    int shown;
+} ClonesNet;
+
+/* Maximo de redes que lista CLONES TOP. */
+#define CLONES_TOP_MAX	50
+
+static void clones_net_user(User *u2, void *arg)
+{
+    ClonesNet *cn = arg;
+
+    if (++cn->shown <= CyberListMax)
+        notice_lang(s_CyberServ, cn->u, CYBER_CLONES_NET_FORMAT,
+                        u2->nick, u2->username, u2->host);
+    else
+        cn->shown = CyberListMax;
+}
+
 static void do_clones(User *u)
 {
 
@@ -1195,7 +1566,7 @@ static void do_clones(User *u)
         } else {
             notice_lang(s_CyberServ, u, CYBER_CLONES_LIST_HEADER, mincount);
             notice_lang(s_CyberServ, u, CYBER_CLONES_LIST_COLHEAD);
-            for (i = 0; i < 1024; i++) {
+            for (i = 0; i < cloneshash_size; i++) {
                 for (clones = cloneslist[i]; clones; clones=clones->next) {
                     if (clones->numeroclones >= mincount)
                         notice_lang(s_CyberServ, u, CYBER_CLONES_LIST_FORMAT,
@@ -1220,6 +1591,51 @@ static void do_clones(User *u)
                                    iline ? iline->limite : LimiteClones);
          }
       }
+
+    } else if (stricmp(cmd, "NET") == 0) {
+        uint32 net;
+        int bits, count;
+        ClonesNet cn;
+
+        if (!param || !parse_cidr(param, &net, &bits) || bits < 8) {
+            syntax_error(s_CyberServ, u, "CLONES", CYBER_CLONES_NET_SYNTAX);
+        } else {
+            cn.u = u;
+            cn.shown = 0;
+            notice_lang(s_CyberServ, u, CYBER_CLONES_NET_HEADER, param);
+            count = foreach_net_user(net, bits, clones_net_user, &cn);
+            notice_lang(s_CyberServ, u, CYBER_CLONES_NET_END,
+                                        count, cn.shown);
+        }
+
+    } else if (stricmp(cmd, "TOP") == 0) {
+        char *s = strtok(NULL, " ");
+        IpNet *top[CLONES_TOP_MAX];
+        char buf[32];
+        int bits = param ? atoi(param) : 24;
+        int max = s ? atoi(s) : 10;
+
+        if (bits != 16 && bits != 24) {
+            syntax_error(s_CyberServ, u, "CLONES", CYBER_CLONES_TOP_SYNTAX);
+            return;
+        }
+        if (max < 1 || max > CLONES_TOP_MAX)
+            max = CLONES_TOP_MAX;
+        max = top_ipnets(bits, top, max);
+        notice_lang(s_CyberServ, u, CYBER_CLONES_TOP_HEADER, bits);
+        notice_lang(s_CyberServ, u, CYBER_CLONES_TOP_COLHEAD);
+        for (i = 0; i < max; i++) {
+            snprintf(buf, sizeof(buf), "%u.%u.%u.%u/%d",
+                        (unsigned)(top[i]->net >> 24),
+                        (unsigned)(top[i]->net >> 16) & 255,
+                        (unsigned)(top[i]->net >> 8) & 255,
+                        (unsigned)top[i]->net & 255, bits);
+            notice_lang(s_CyberServ, u, CYBER_CLONES_LIST_FORMAT,
+                                        top[i]->nusers, buf);
+        }
+
+    } else {
+        syntax_error(s_CyberServ, u, "CLONES", CYBER_CLONES_SYNTAX);
    }
 }                                           
                      
@@ -1293,7 +1709,9 @@ static void do_iline(User *u)
 {
 
     char *comando = strtok(NULL, " ");
-    char *host, *admin, *expiracion, *motivo, *limite;
+    char *admin, *expiracion, *motivo, *limite;
+    const char *host;
+    char buf[32];
     int limit, expires;
     
     IlineInfo *il;
@@ -1320,8 +1738,12 @@ static void do_iline(User *u)
              notice_lang(s_CyberServ, u, CYBER_ILINE_INVALID_HOSTMASK);
              return;
         }
+        if (!(host = canon_iline_host(host, buf, sizeof(buf)))) {
+             notice_lang(s_CyberServ, u, CYBER_ILINE_INVALID_NET);
+             return;
+        }
        
-        if (find_iline_host(host)) {
+        if (find_iline_exact(host)) {
             notice_lang(s_CyberServ, u, CYBER_ILINE_ALREADY_PRESENT, host);      
             return;
         }
@@ -1373,7 +1795,7 @@ static void do_iline(User *u)
             notice_lang(s_CyberServ, u, BAD_EXPIRY_TIME);
             return;
         } else if (expires > 0) {
-            expires += time(NULL);
+            expires += cur_time;
         }
         
         motivo = strtok(NULL, "");
@@ -1389,10 +1811,12 @@ static void do_iline(User *u)
             il->comentario = sstrdup(motivo);          
             strscpy(il->operwho, u->nick, NICKMAX);                        
             il->limite = limit;              
-            il->time_concesion = time(NULL);
+            il->time_concesion = cur_time;
             il->time_expiracion = expires;
+            if (expires)
+                expire_add(&iline_expire, il, &il->expire_pos, expires);
             il->record_clones = 0;
-            il->time_record = time(NULL);          
+            il->time_record = cur_time;          
             log("%s: %s!%s@%s Aade iline %s limite %d", s_CyberServ, u->nick,
                        u->username, u->host, host, limit);
             canalopers(s_CyberServ, "%s aade iline %s limite %d", u->nick, host, limit);
@@ -1414,7 +1838,9 @@ static void do_iline(User *u)
             return;
         }
 
-        if (!(il = find_iline_host(host))) {
+        if (!(host = canon_iline_host(host, buf, sizeof(buf)))) {
+            notice_lang(s_CyberServ, u, CYBER_ILINE_INVALID_NET);
+        } else if (!(il = find_iline_exact(host))) {
             notice_lang(s_CyberServ, u, CYBER_ILINE_NOT_FOUND, host);
 
         } else {     
@@ -1456,7 +1882,7 @@ static void do_set_cyber(User *u)
     
     if (!param && (!cmd || (stricmp(cmd, "HOST2") != 0))) {
         syntax_error(s_CyberServ, u, "SET", CYBER_SET_SYNTAX);
-    } else if (!(il = find_iline_host(host))) {
+    } else if (!(il = find_iline_exact(host))) {
         notice_lang(s_CyberServ, u, CYBER_ILINE_NOT_CONCEDED, host);
     } else if (stricmp(cmd, "HOST") == 0) {
         do_set_host(u, il, param);
@@ -1497,13 +1923,11 @@ static void do_set_host(User *u, IlineInfo *il, char *param)
  privmsg(s_CyberServ, u->nick, "COMANDO DESACTIVADO TEMPORALMENTE");
  return;
     
-    if (find_iline_host(param)) {
+    if (find_iline_exact(param)) {
         notice_lang(s_CyberServ, u, CYBER_ACTUALIZA_HOST, param);
     } else {
-        if (il->host)
-            free(il->host);
-        change_host_iline(il, param);
         notice_lang(s_CyberServ, u, CYBER_SET_HOST_CHANGED, antiguo, param);
+        change_host_iline(il, param);
     }                
 }
 
@@ -1512,6 +1936,7 @@ static void do_set_host(User *u, IlineInfo *il, char *param)
 static void do_set_host2(User *u, IlineInfo *il, char *param)
 {
     
+    unindex_iline(il);
     if (il->host2) 
         free(il->host2);
 
@@ -1523,6 +1948,7 @@ static void do_set_host2(User *u, IlineInfo *il, char *param)
         notice_lang(s_CyberServ, u, CYBER_SET_HOST2_UNSET, il->host);
                     
     }                                            
+    index_iline(il);
 }
 
 /*************************************************************************/
@@ -1676,16 +2102,20 @@ static void do_set_expire(User *u, IlineInfo *il, char *param)
 
     int expires;
     char timebuf[256];
-    time_t now = time(NULL);
+    time_t now = cur_time;
 
     expires = param ? dotime(param) : ExpIlineDefault;
     if (expires < 0) {
         notice_lang(s_CyberServ, u, BAD_EXPIRY_TIME);
         return;
     } else if (expires > 0) {
-        expires += time(NULL);
+        expires += cur_time;
     }
     il->time_expiracion = expires;
+    if (expires)
+        expire_add(&iline_expire, il, &il->expire_pos, expires);
+    else
+        expire_del(&iline_expire, &il->expire_pos);
 
     expires_in_lang(timebuf, sizeof(timebuf), u,
                          il->time_expiracion - now + 59);
@@ -1710,7 +2140,7 @@ static void do_suspend(User *u)
     if (readonly)
         notice_lang(s_CyberServ, u, READ_ONLY_MODE);
 
-    if (!(il = find_iline_host(host))) {
+    if (!(il = find_iline_exact(host))) {
         notice_lang(s_CyberServ, u, CYBER_ILINE_NOT_FOUND, host);
     } else if (il->estado & IL_SUSPENDED) {
         notice_lang(s_CyberServ, u, CYBER_SUSPEND_SUSPENDED, il->host);
@@ -1742,7 +2172,7 @@ static void do_unsuspend(User *u)
     if (readonly)
         notice_lang(s_ChanServ, u, READ_ONLY_MODE);
 
-    if (!(il = find_iline_host(host))) {
+    if (!(il = find_iline_exact(host))) {
         notice_lang(s_CyberServ, u, CYBER_ILINE_NOT_FOUND, host);
     } else if (!(il->estado & IL_SUSPENDED)) {
         notice_lang(s_CyberServ, u, CYBER_UNSUSPEND_NOT_SUSPEND, il->host);
@@ -1760,14 +2190,36 @@ static void do_unsuspend(User *u)
 
 /***********************************************************************/
 
+/* Cuando KILLCLONES ha killeado a todos los del host, avisar a los opers.
+ * El GLINE se puso al empezar. */
+
+static void killclones_done(BulkOp *op)
+{
+    char *clonemask, *akillmask;
+
+    clonemask = smalloc(strlen(op->target) + 5);
+    sprintf(clonemask, "*!*@%s", op->target);
+
+    akillmask = smalloc(strlen(op->target) + 3);
+    sprintf(akillmask, "*@%s", op->target);
+    strlower(akillmask);
+
+    canalopers(s_OperServ, "%s ha usado KILLCLONES para %s killear "
+              "%d clones. Un GLINE temporal ha sido aadido "
+              "para %s.", op->who, clonemask, op->done, akillmask);
+    log("%s: KILLCLONES: %d clone(s) matching %s killed.",
+                           s_OperServ, op->done, clonemask);
+
+    free(akillmask);
+    free(clonemask);
+}
+
 static void do_killclones(User *u)
 {
     char *clonenick = strtok(NULL, " ");
-    int count=0;
-    User *cloneuser, *user, *tempuser;
-    char *clonemask, *akillmask;
-    char killreason[NICKMAX+32];
-    char akillreason[] = "GLine temporal de KILLCLONES de Cyber.";
+    User *cloneuser;
+    char *akillmask;
+    BulkOp *op;
 
     if (!clonenick) {
         notice_lang(s_CyberServ, u, OPER_KILLCLONES_SYNTAX);
@@ -1776,37 +2228,18 @@ static void do_killclones(User *u)
         notice_lang(s_CyberServ, u, OPER_KILLCLONES_UNKNOWN_NICK, clonenick);
                         
     } else {
-        clonemask = smalloc(strlen(cloneuser->host) + 5);
-        sprintf(clonemask, "*!*@%s", cloneuser->host);
-                    
+        op = bulk_new(s_CyberServ, u, cloneuser->host);
+        op->reason = sstrdup("Kill de clones");
+        op->finish = killclones_done;
+        /* El GLINE va antes de los kills, para que no puedan volver con
+         * otro nick mientras se les va killeando. */
         akillmask = smalloc(strlen(cloneuser->host) + 3);
-        sprintf(akillmask, "*@%s", strlower(cloneuser->host));
-
-        user = firstuser();
-        while (user) {
-            if (match_usermask(clonemask, user) != 0) {
-                tempuser = nextuser();
-                count++;
-                snprintf(killreason, sizeof(killreason),
-                                          "Kill de clones [%d]", count);
-                kill_user(NULL, user->nick, killreason);
-                user = tempuser;
-            } else {
-                user = nextuser();
-            }
-        }
-
-        add_akill(akillmask, akillreason, u->nick,
-                        time(NULL) + KillClonesAkillExpire);
-                                
-        canalopers(s_OperServ, "%s ha usado KILLCLONES para %s killear "
-                  "%d clones. Un GLINE temporal ha sido aadido "
-                  "para %s.", u->nick, clonemask, count, akillmask);
-        log("%s: KILLCLONES: %d clone(s) matching %s killed.",
-                               s_OperServ, count, clonemask);
-                                
+        sprintf(akillmask, "*@%s", cloneuser->host);
+        strlower(akillmask);
+        add_akill(akillmask, "GLine temporal de KILLCLONES de Cyber.",
+                  u->nick, cur_time + KillClonesAkillExpire);
         free(akillmask);
-        free(clonemask);
+        bulk_start(op, BULK_KILL);
     }
 }
 
@@ -11,6 +11,11 @@
 #include "services.h"
 #include "datafiles.h"
 #include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#if HAVE_PTHREAD
+# include <pthread.h>
+#endif
 
 /*************************************************************************/
 /*************************************************************************/
@@ -22,20 +27,18 @@
 
 int get_file_version(dbFILE *f)
 {
-    FILE *fp = f->fp;
-    int version = fgetc(fp)<<24 | fgetc(fp)<<16 | fgetc(fp)<<8 | fgetc(fp);
-    if (ferror(fp)) {
-#ifndef NOT_MAIN
-	log_perror("Error reading version number on %s", f->filename);
-#endif
-	return 0;
-    } else if (feof(fp)) {
+    int version;
+
+    if (f->end - f->pos < 4) {
 #ifndef NOT_MAIN
 	log("Error reading version number on %s: End of file detected",
 		f->filename);
 #endif
 	return 0;
-    } else if (version < 1) {
+    }
+    version = f->pos[0]<<24 | f->pos[1]<<16 | f->pos[2]<<8 | f->pos[3];
+    f->pos += 4;
+    if (version < 1) {
 #ifndef NOT_MAIN
 	log("Invalid version number (%d) on %s", version, f->filename);
 #endif
@@ -52,13 +55,7 @@ int get_file_version(dbFILE *f)
 
 int write_file_version(dbFILE *f, uint32 version)
 {
-    FILE *fp = f->fp;
-    if (
-	fputc(version>>24 & 0xFF, fp) < 0 ||
-	fputc(version>>16 & 0xFF, fp) < 0 ||
-	fputc(version>> 8 & 0xFF, fp) < 0 ||
-	fputc(version     & 0xFF, fp) < 0
-    ) {
+    if (write_int32(version, f) < 0) {
 #ifndef NOT_MAIN
 	log_perror("Error writing version number on %s", f->filename);
 #endif
@@ -70,10 +67,228 @@ int write_file_version(dbFILE *f, uint32 version)
 /*************************************************************************/
 /*************************************************************************/
 
-static dbFILE *open_db_read(const char *service, const char *filename)
+/* CRC32C (Castagnoli) of a block, for the checksums in the file trailer.
+ * Eight bytes are folded in per step ("slicing by 8"): table[k][b] is the
+ * CRC of byte b followed by k zero bytes, so the eight lookups of a step
+ * are independent of each other. */
+
+static uint32 crc32c(const unsigned char *buf, size_t len)
+{
+    static uint32 table[8][256];
+    static int table_ready = 0;
+    uint32 crc = 0xFFFFFFFF, hi;
+
+    if (!table_ready) {
+	uint32 i, j, c;
+	for (i = 0; i < 256; i++) {
+	    c = i;
+	    for (j = 0; j < 8; j++)
+		c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+	    table[0][i] = c;
+	}
+	for (i = 0; i < 256; i++) {
+	    c = table[0][i];
+	    for (j = 1; j < 8; j++) {
+		c = table[0][c & 0xFF] ^ (c >> 8);
+		table[j][i] = c;
+	    }
+	}
+	table_ready = 1;
+    }
+    for (; len >= 8; buf += 8, len -= 8) {
+	crc ^= buf[0] | buf[1]<<8 | buf[2]<<16 | (uint32)buf[3]<<24;
+	hi = buf[4] | buf[5]<<8 | buf[6]<<16 | (uint32)buf[7]<<24;
+	crc = table[7][crc & 0xFF] ^ table[6][crc>>8 & 0xFF]
+	    ^ table[5][crc>>16 & 0xFF] ^ table[4][crc>>24]
+	    ^ table[3][hi & 0xFF] ^ table[2][hi>>8 & 0xFF]
+	    ^ table[1][hi>>16 & 0xFF] ^ table[0][hi>>24];
+    }
+    while (len--)
+	crc = table[0][(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFF;
+}
+
+static uint32 get_int32(const unsigned char *p)
+{
+    return (uint32)p[0]<<24 | p[1]<<16 | p[2]<<8 | p[3];
+}
+
+static void put_int32(unsigned char *p, uint32 val)
+{
+    p[0] = val>>24 & 0xFF;
+    p[1] = val>>16 & 0xFF;
+    p[2] = val>> 8 & 0xFF;
+    p[3] = val     & 0xFF;
+}
+
+/*************************************************************************/
+
+/* Run func(arg, part) for every part from 0 to nparts-1, spread over one
+ * thread per CPU (up to DB_MAX_THREADS) when we have threads and more than
+ * one CPU, and return once all of them are done.  The calling thread takes
+ * parts too.  func runs outside the main thread, so it must keep to its
+ * own part: no log(), no shared lists or tables. */
+
+typedef struct {
+    void (*func)(void *arg, int part);
+    void *arg;
+    int nparts;
+    volatile int next;
+} ParallelRun;
+
+static void *parallel_worker(void *arg)
+{
+    ParallelRun *pr = arg;
+    int part;
+
+    while ((part = __sync_fetch_and_add(&pr->next, 1)) < pr->nparts)
+	pr->func(pr->arg, part);
+    return NULL;
+}
+
+void db_parallel(int nparts, void (*func)(void *arg, int part), void *arg)
+{
+    ParallelRun pr;
+#if HAVE_PTHREAD
+    pthread_t threads[DB_MAX_THREADS];
+    int nthreads = 0, ncpu, i;
+    sigset_t all, old;
+#endif
+
+    pr.func = func;
+    pr.arg = arg;
+    pr.nparts = nparts;
+    pr.next = 0;
+#if HAVE_PTHREAD
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu > DB_MAX_THREADS)
+	ncpu = DB_MAX_THREADS;
+    if (ncpu > nparts)
+	ncpu = nparts;
+    if (ncpu > 1) {
+	/* As for the log writer, signals stay with the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (i = 1; i < ncpu; i++) {
+	    if (pthread_create(&threads[nthreads], NULL,
+				parallel_worker, &pr) == 0)
+		nthreads++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+#endif
+    parallel_worker(&pr);
+#if HAVE_PTHREAD
+    for (i = 0; i < nthreads; i++)
+	pthread_join(threads[i], NULL);
+#endif
+}
+
+/*************************************************************************/
+
+/* Blocks are checked DB_CHECK_BLOCKS at a time, in parallel; each part
+ * notes the first bad block it finds. */
+
+#define DB_CHECK_BLOCKS	16
+
+typedef struct {
+    const unsigned char *data, *crcs;
+    size_t datalen;
+    uint32 blocksize, nblocks;
+    uint32 *firstbad;		/* Per part; nblocks if none */
+} BlockCheck;
+
+static void check_block_range(void *arg, int part)
+{
+    BlockCheck *bc = arg;
+    uint32 i = (uint32)part * DB_CHECK_BLOCKS;
+    uint32 last = i + DB_CHECK_BLOCKS;
+
+    if (last > bc->nblocks)
+	last = bc->nblocks;
+    bc->firstbad[part] = bc->nblocks;
+    for (; i < last; i++) {
+	size_t start = (size_t)i * bc->blocksize;
+	size_t len = bc->datalen-start < bc->blocksize
+			? bc->datalen-start : bc->blocksize;
+	if (crc32c(bc->data+start, len) != get_int32(bc->crcs+i*4)) {
+	    bc->firstbad[part] = i;
+	    return;
+	}
+    }
+}
+
+/* Check the block checksums in a file's trailer, if it has one, and set
+ * the end of the readable data accordingly: just before the trailer if
+ * everything is fine, or at the start of the first damaged block, so that
+ * nothing past the damage gets loaded.  Files from before checksums were
+ * added have no trailer and are read as they are.
+ */
+
+static void check_db_blocks(dbFILE *f)
+{
+    const unsigned char *t;
+    uint32 blocksize, nblocks, i;
+    size_t datalen;
+    BlockCheck bc;
+    int nparts, part;
+
+    f->end = f->data + f->datalen;
+    if (f->datalen < DB_TRAILER_LEN
+		|| memcmp(f->end-4, DB_TRAILER_MAGIC, 4) != 0)
+	return;
+    t = f->end - DB_TRAILER_LEN;
+    blocksize = get_int32(t);
+    nblocks = get_int32(t+4);
+    datalen = (size_t)get_int32(t+8) << 16 << 16 | get_int32(t+12);
+    if (!blocksize || datalen > f->datalen
+		|| nblocks != (datalen + blocksize-1) / blocksize
+		|| datalen + (size_t)nblocks*4 + DB_TRAILER_LEN != f->datalen) {
+#ifndef NOT_MAIN
+	log("%s: checksum trailer is damaged; reading without checking",
+		f->filename);
+#endif
+	return;
+    }
+    bc.data = f->data;
+    bc.crcs = f->data + datalen;
+    bc.datalen = datalen;
+    bc.blocksize = blocksize;
+    bc.nblocks = nblocks;
+    nparts = (nblocks + DB_CHECK_BLOCKS-1) / DB_CHECK_BLOCKS;
+    bc.firstbad = smalloc(sizeof(uint32) * (nparts ? nparts : 1));
+    crc32c(f->data, 0);		/* Fill in the table before the threads */
+    db_parallel(nparts, check_block_range, &bc);
+    i = nblocks;
+    for (part = 0; part < nparts && i == nblocks; part++)
+	i = bc.firstbad[part];
+    free(bc.firstbad);
+    if (i < nblocks) {
+	size_t start = (size_t)i * blocksize;
+	size_t len = datalen-start < blocksize ? datalen-start : blocksize;
+#ifndef NOT_MAIN
+	log("%s: block %u (bytes %lu-%lu) fails its checksum; "
+	    "bytes %lu-%lu cannot be used", f->filename, i,
+	    (unsigned long)start, (unsigned long)(start+len-1),
+	    (unsigned long)start, (unsigned long)(datalen-1));
+#endif
+	f->end = f->data + start;
+	f->damaged = 1;
+	return;
+    }
+    f->end = f->data + datalen;
+}
+
+/*************************************************************************/
+
+/* Files are read in one go: mmap()ed if possible, or else read into a
+ * buffer, and the read routines below just decode from memory. */
+
+static dbFILE *map_db(const char *service, const char *filename)
 {
     dbFILE *f;
-    FILE *fp;
+    struct stat st;
+    int fd;
 
 //    f = malloc(sizeof(*f));
     f = scalloc(sizeof(*f), 1);    
@@ -85,82 +300,136 @@ static dbFILE *open_db_read(const char *service, const char *filename)
     }
     strscpy(f->filename, filename, sizeof(f->filename));
     f->mode = 'r';
-    fp = fopen(f->filename, "rb");
-    if (!fp) {
+    fd = open(f->filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
 	int errno_save = errno;
 #ifndef NOT_MAIN
 	if (errno != ENOENT)
 	    log_perror("Can't read %s database %s", service, f->filename);
 #endif
+	if (fd >= 0)
+	    close(fd);
 	free(f);
 	errno = errno_save;
 	return NULL;
     }
-    f->fp = fp;
-    f->backupfp = NULL;
+    f->datalen = st.st_size;
+    if (f->datalen > 0) {
+	f->data = mmap(NULL, f->datalen, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (f->data != MAP_FAILED) {
+	    f->mapped = 1;
+#ifdef MADV_SEQUENTIAL
+	    madvise(f->data, f->datalen, MADV_SEQUENTIAL);
+#endif
+	} else {
+	    size_t got = 0;
+	    int i = 0;
+	    f->data = smalloc(f->datalen);
+	    while (got < f->datalen
+		   && ((i = read(fd, f->data+got, f->datalen-got)) > 0
+		       || (i < 0 && errno == EINTR))) {
+		if (i > 0)
+		    got += i;
+	    }
+	    if (i < 0) {
+		int errno_save = errno;
+#ifndef NOT_MAIN
+		log_perror("Can't read %s database %s", service, f->filename);
+#endif
+		close(fd);
+		free(f->data);
+		free(f);
+		errno = errno_save;
+		return NULL;
+	    }
+	    f->datalen = got;
+	}
+    }
+    close(fd);
+    f->pos = f->data;
+    check_db_blocks(f);
+    return f;
+}
+
+static void free_db(dbFILE *f);
+
+/* Open a database for reading.  If it is damaged, the copy it replaced is
+ * used instead, as long as that one is intact; otherwise the damaged file
+ * is returned cut short at the first bad block, and the load routines will
+ * refuse it unless -forceload was given. */
+
+static dbFILE *open_db_read(const char *service, const char *filename)
+{
+    char namebuf[PATH_MAX];
+    dbFILE *f, *bf;
+
+    if (!(f = map_db(service, filename)) || !f->damaged)
+	return f;
+    snprintf(namebuf, sizeof(namebuf), "%s%s", filename, DB_BACKUP_SUFFIX);
+    bf = map_db(service, namebuf);
+    if (bf && !bf->damaged) {
+#ifndef NOT_MAIN
+	log("%s is damaged; loading the previous copy %s instead (changes "
+	    "since it was saved are lost)", f->filename, bf->filename);
+#endif
+	free_db(f);
+	return bf;
+    }
+    if (bf)
+	free_db(bf);
+#ifndef NOT_MAIN
+    log("%s is damaged and has no usable %s copy; -forceload starts with "
+	"whatever can be read from its first %lu bytes", f->filename,
+	DB_BACKUP_SUFFIX, (unsigned long)(f->end - f->data));
+#endif
     return f;
 }
 
+/* Release the contents of a file opened for reading. */
+
+static void free_db_data(dbFILE *f)
+{
+    if (!f->data)
+	return;
+    if (f->mapped)
+	munmap(f->data, f->datalen);
+    else
+	free(f->data);
+    f->data = f->pos = f->end = NULL;
+}
+
 /*************************************************************************/
 
+/* The new contents go to a temporary file next to the database; the
+ * database itself is only replaced (by rename()) in close_db(), so a
+ * failed or interrupted save leaves the old copy in place. */
+
 static dbFILE *open_db_write(const char *service, const char *filename, uint32 version)
 {
     dbFILE *f;
-    int fd;
 
-//    f = malloc(sizeof(*f));
     f = scalloc(sizeof(*f), 1);
-    if (!f) {
-#ifndef NOT_MAIN
-	log_perror("Can't read %s database %s", service, filename);
-#endif
-	return NULL;
-    }
     strscpy(f->filename, filename, sizeof(f->filename));
     filename = f->filename;
     f->mode = 'w';
+    f->fd = -1;
 
-    *f->backupname = 0;
-    snprintf(f->backupname, sizeof(f->backupname), "%s.save", filename);
-    if (!*f->backupname || strcmp(f->backupname, filename) == 0) {
-	int errno_save = errno;
+    *f->tempname = 0;
+    snprintf(f->tempname, sizeof(f->tempname), "%s.new", filename);
+    if (!*f->tempname || strcmp(f->tempname, filename) == 0) {
 #ifndef NOT_MAIN
 	log("Opening %s database %s for write: Filename too long",
 		service, filename);
 #endif
 	free(f);
-	errno = errno_save;
+	errno = ENAMETOOLONG;
 	return NULL;
     }
-    unlink(f->backupname);
-    f->backupfp = fopen(filename, "rb");
-    if (rename(filename, f->backupname) < 0 && errno != ENOENT) {
-	int errno_save = errno;
-#ifndef NOT_MAIN
-	static int walloped = 0;
-	if (!walloped) {
-	    walloped++;
-	    wallops(NULL, "Can't back up %s database %s", service, filename);
-	}
-	errno = errno_save;
-	log_perror("Can't back up %s database %s", service, filename);
-	if (!NoBackupOkay) {
-#endif
-	    if (f->backupfp)
-		fclose(f->backupfp);
-	    free(f);
-	    errno = errno_save;
-	    return NULL;
-#ifndef NOT_MAIN
-	}
-#endif
-	*f->backupname = 0;
-    }
-    unlink(filename);
+    unlink(f->tempname);
     /* Use open() to avoid people sneaking a new file in under us */
-    fd = open(filename, O_WRONLY | O_CREAT | O_EXCL, 0666);
-    f->fp = fdopen(fd, "wb");	/* will fail and return NULL if fd < 0 */
-    if (!f->fp || !write_file_version(f, version)) {
+    f->fd = open(f->tempname, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    f->wbuf = smalloc(DB_BLOCKSIZE);
+    if (f->fd < 0 || !write_file_version(f, version)) {
 	int errno_save = errno;
 #ifndef NOT_MAIN
 	static int walloped = 0;
@@ -171,16 +440,7 @@ static dbFILE *open_db_write(const char *service, const char *filename, uint32 v
 	errno = errno_save;
 	log_perror("Can't write to %s database %s", service, filename);
 #endif
-	if (f->fp) {
-	    fclose(f->fp);
-	    unlink(filename);
-	}
-	if (*f->backupname && rename(f->backupname, filename) < 0)
-#ifndef NOT_MAIN
-	    log_perror("Cannot restore backup copy of %s", filename);
-#else
-	    ;
-#endif
+	restore_db(f);
 	errno = errno_save;
 	return NULL;
     }
@@ -191,11 +451,8 @@ static dbFILE *open_db_write(const char *service, const char *filename, uint32 v
 
 /* Open a database file for reading (*mode == 'r') or writing (*mode == 'w').
  * Return the stream pointer, or NULL on error.  When opening for write, it
- * is an error for rename() to return an error (when backing up the original
- * file) other than ENOENT, if NO_BACKUP_OKAY is not defined; it is an error
- * if the version number cannot be written to the file; and it is a fatal
- * error if opening the file for write fails and the backup was successfully
- * made but cannot be restored.
+ * is an error if the temporary file cannot be created or the version
+ * number cannot be written to it.
  */
 
 dbFILE *open_db(const char *service, const char *filename, const char *mode, uint32 version)
@@ -212,71 +469,179 @@ dbFILE *open_db(const char *service, const char *filename, const char *mode, uin
 
 /*************************************************************************/
 
+/* Write out the block being filled (which must not be empty unless it is
+ * the only one) and record its checksum.  Returns 0 on success, -1 on
+ * error.
+ */
+
+int flush_db_block(dbFILE *f)
+{
+    unsigned char *ptr = f->wbuf;
+    int left = f->wlen, i;
+
+    if (f->ncrcs >= f->crcsize) {
+	f->crcsize = f->crcsize ? f->crcsize*2 : 64;
+	f->crcs = srealloc(f->crcs, sizeof(uint32) * f->crcsize);
+    }
+    f->crcs[f->ncrcs++] = crc32c(f->wbuf, f->wlen);
+    while (left > 0) {
+	i = write(f->fd, ptr, left);
+	if (i < 0 && errno == EINTR)
+	    continue;
+	if (i <= 0)
+	    return -1;
+	ptr += i;
+	left -= i;
+    }
+    f->wlen = 0;
+    return 0;
+}
+
+/*************************************************************************/
+
+/* Finish writing a file: write the last block and the checksum trailer,
+ * and make sure it has all reached the disk.  Returns 0 on success, -1 on
+ * error.
+ */
+
+static int finish_db_write(dbFILE *f)
+{
+    unsigned char *trailer, *t;
+    size_t datalen;
+    int len, i, ok = 0;
+
+    if (f->fd < 0)
+	return -1;
+    datalen = (size_t)f->ncrcs * DB_BLOCKSIZE + f->wlen;
+    if (f->wlen > 0 && flush_db_block(f) < 0)
+	return -1;
+    len = f->ncrcs*4 + DB_TRAILER_LEN;
+    trailer = smalloc(len);
+    for (i = 0; i < f->ncrcs; i++)
+	put_int32(trailer+i*4, f->crcs[i]);
+    t = trailer + f->ncrcs*4;
+    put_int32(t, DB_BLOCKSIZE);
+    put_int32(t+4, f->ncrcs);
+    put_int32(t+8, (uint32)(datalen >> 16 >> 16));
+    put_int32(t+12, (uint32)datalen);
+    memcpy(t+16, DB_TRAILER_MAGIC, 4);
+    t = trailer;
+    while (len > 0) {
+	i = write(f->fd, t, len);
+	if (i < 0 && errno == EINTR)
+	    continue;
+	if (i <= 0)
+	    break;
+	t += i;
+	len -= i;
+    }
+    if (len == 0 && fsync(f->fd) == 0)
+	ok = 1;
+    free(trailer);
+    return ok ? 0 : -1;
+}
+
+/*************************************************************************/
+
+/* Release everything a dbFILE holds, closing (but not removing) any file
+ * it has open. */
+
+static void free_db(dbFILE *f)
+{
+    if (f->fd >= 0 && f->mode == 'w')
+	close(f->fd);
+    free_db_data(f);
+    if (f->wbuf)
+	free(f->wbuf);
+    if (f->crcs)
+	free(f->crcs);
+    free(f);
+}
+
+/*************************************************************************/
+
 /* Restore the database file to its condition before open_db().  This is
- * identical to close_db() for files open for reading; however, for files
- * open for writing, we first attempt to restore any backup file before
- * closing files.
+ * identical to close_db() for files open for reading; for files open for
+ * writing, the new copy is thrown away and the database left as it was.
  */
 
 void restore_db(dbFILE *f)
 {
     int errno_save = errno;
 
+    if (f->mode == 'w' && *f->tempname)
+	unlink(f->tempname);
+    free_db(f);
+    errno = errno_save;
+}
+
+/*************************************************************************/
+
+/* Keep the current copy of a database as <name>DB_BACKUP_SUFFIX before it
+ * is replaced.  Returns 0 if the copy was made (or there was nothing to
+ * keep) or NoBackupOkay is set, -1 otherwise. */
+
+static int backup_db(dbFILE *f)
+{
+    char namebuf[PATH_MAX];
+
+    snprintf(namebuf, sizeof(namebuf), "%s%s", f->filename, DB_BACKUP_SUFFIX);
+    unlink(namebuf);
+    if (link(f->filename, namebuf) == 0 || errno == ENOENT)
+	return 0;
+#ifndef NOT_MAIN
+    log_perror("Can't back up %s", f->filename);
+    if (NoBackupOkay)
+	return 0;
+#endif
+    return -1;
+}
+
+/* Close a database file.  If the file was opened for write, finish it off
+ * and move it into place over the old copy, which is kept as a backup.
+ * Returns -1 if the new copy could not be written or the old one could not
+ * be backed up (the old one is then left in place), 0 otherwise.
+ */
+
+int close_db(dbFILE *f)
+{
+    int retval = 0;
+
     if (f->mode == 'w') {
-	int ok = 0;	/* Did we manage to restore the old file? */
-	errno = errno_save = 0;
-	if (*f->backupname && strcmp(f->backupname, f->filename) != 0) {
-	    if (rename(f->backupname, f->filename) == 0)
-		ok = 1;
-	}
-	if (!ok && f->backupfp) {
-	    char buf[1024];
-	    int i;
-	    ok = 1;
-	    if (fseek(f->fp, 0, SEEK_SET) < 0)
-		ok = 0;
-	    while (ok && (i = fread(buf, 1, sizeof(buf), f->backupfp)) > 0) {
-		if (fwrite(buf, 1, i, f->fp) != i)
-		    ok = 0;
-	    }
-	    if (ok) {
-		fflush(f->fp);
-		ftruncate(fileno(f->fp), ftell(f->fp));
-	    }
-	}
+	if (finish_db_write(f) < 0 || close(f->fd) < 0
+			|| (f->fd = -1, backup_db(f) < 0)
+			|| rename(f->tempname, f->filename) < 0) {
+	    int errno_save = errno;
 #ifndef NOT_MAIN
-	if (!ok && errno > 0)
-	    log_perror("Unable to restore backup of %s", f->filename);
+	    log_perror("Can't write %s; keeping the old copy", f->filename);
 #endif
-	errno_save = errno;
-	if (f->backupfp)
-	    fclose(f->backupfp);
-	if (*f->backupname)
-	    unlink(f->backupname);
+	    unlink(f->tempname);
+	    errno = errno_save;
+	    retval = -1;
+	}
+	f->fd = -1;
     }
-    fclose(f->fp);
-    if (!errno_save)
-	errno_save = errno;
-    free(f);
-    errno = errno_save;
+    free_db(f);
+    return retval;
 }
 
 /*************************************************************************/
 
-/* Close a database file.  If the file was opened for write, remove the
- * backup we (may have) created earlier.
+/* Tell the kernel we'll be reading the given database file soon, so it can
+ * start reading it in while we're busy with other things.  Errors (such
+ * as the file not existing) are ignored; open_db() will report them.
  */
 
-void close_db(dbFILE *f)
+void prefetch_db(const char *filename)
 {
-    if (f->mode == 'w' && *f->backupname
-			&& strcmp(f->backupname, f->filename) != 0) {
-	if (f->backupfp)
-	    fclose(f->backupfp);
-	unlink(f->backupname);
-    }
-    fclose(f->fp);
-    free(f);
+#ifdef POSIX_FADV_WILLNEED
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0)
+	return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+#endif
 }
 
 /*************************************************************************/
@@ -295,21 +660,78 @@ void close_db(dbFILE *f)
  */
 
 
-int read_int16(uint16 *ret, dbFILE *f)
+size_t read_db(dbFILE *f, void *buf, size_t len)
 {
-    int c1, c2;
+    if (len > f->end - f->pos)
+	len = f->end - f->pos;
+    memcpy(buf, f->pos, len);
+    f->pos += len;
+    return len;
+}
+
+
+size_t write_db(dbFILE *f, const void *buf, size_t len)
+{
+    const unsigned char *ptr = buf;
+    size_t done = 0, n;
+
+    while (done < len) {
+	if (f->wlen >= DB_BLOCKSIZE && flush_db_block(f) < 0)
+	    break;
+	n = DB_BLOCKSIZE - f->wlen;
+	if (n > len-done)
+	    n = len-done;
+	memcpy(f->wbuf + f->wlen, ptr+done, n);
+	f->wlen += n;
+	done += n;
+    }
+    return done;
+}
+
+
+/* Return a pointer to the next `len' bytes of a file being read, and skip
+ * past them; NULL if the file doesn't have that many bytes left.  The
+ * memory stays valid until the file is closed. */
+
+const unsigned char *read_db_span(dbFILE *f, size_t len)
+{
+    const unsigned char *ptr = f->pos;
+
+    if (len > f->end - f->pos)
+	return NULL;
+    f->pos += len;
+    return ptr;
+}
 
-    c1 = fgetc(f->fp);
-    c2 = fgetc(f->fp);
-    if (c1 == EOF || c2 == EOF)
+
+/* Give back the pages of a mapped file that have been touched so far, so
+ * that a big database isn't held in memory twice (mapped, and decoded)
+ * while it loads.  Nothing read from the file becomes invalid: a page that
+ * is needed again is just read back in from the page cache.  Loaders call
+ * this after each hash bucket; it does nothing for files read into a
+ * buffer. */
+
+void release_db_pages(dbFILE *f)
+{
+#ifdef MADV_DONTNEED
+    if (f->mapped && f->data)
+	madvise(f->data, f->datalen, MADV_DONTNEED);
+#endif
+}
+
+
+int read_int16(uint16 *ret, dbFILE *f)
+{
+    if (f->end - f->pos < 2)
 	return -1;
-    *ret = c1<<8 | c2;
+    *ret = f->pos[0]<<8 | f->pos[1];
+    f->pos += 2;
     return 0;
 }
 
 int write_int16(uint16 val, dbFILE *f)
 {
-    if (fputc((val>>8) & 0xFF, f->fp) == EOF || fputc(val & 0xFF, f->fp) == EOF)
+    if (putc_db((val>>8) & 0xFF, f) == EOF || putc_db(val & 0xFF, f) == EOF)
 	return -1;
     return 0;
 }
@@ -317,27 +739,22 @@ int write_int16(uint16 val, dbFILE *f)
 
 int read_int32(uint32 *ret, dbFILE *f)
 {
-    int c1, c2, c3, c4;
-
-    c1 = fgetc(f->fp);
-    c2 = fgetc(f->fp);
-    c3 = fgetc(f->fp);
-    c4 = fgetc(f->fp);
-    if (c1 == EOF || c2 == EOF || c3 == EOF || c4 == EOF)
+    if (f->end - f->pos < 4)
 	return -1;
-    *ret = c1<<24 | c2<<16 | c3<<8 | c4;
+    *ret = (uint32)f->pos[0]<<24 | f->pos[1]<<16 | f->pos[2]<<8 | f->pos[3];
+    f->pos += 4;
     return 0;
 }
 
 int write_int32(uint32 val, dbFILE *f)
 {
-    if (fputc((val>>24) & 0xFF, f->fp) == EOF)
+    if (putc_db((val>>24) & 0xFF, f) == EOF)
 	return -1;
-    if (fputc((val>>16) & 0xFF, f->fp) == EOF)
+    if (putc_db((val>>16) & 0xFF, f) == EOF)
 	return -1;
-    if (fputc((val>> 8) & 0xFF, f->fp) == EOF)
+    if (putc_db((val>> 8) & 0xFF, f) == EOF)
 	return -1;
-    if (fputc((val    ) & 0xFF, f->fp) == EOF)
+    if (putc_db((val    ) & 0xFF, f) == EOF)
 	return -1;
     return 0;
 }
@@ -345,18 +762,15 @@ int write_int32(uint32 val, dbFILE *f)
 
 int read_ptr(void **ret, dbFILE *f)
 {
-    int c;
-
-    c = fgetc(f->fp);
-    if (c == EOF)
+    if (f->pos >= f->end)
 	return -1;
-    *ret = (c ? (void *)1 : (void *)0);
+    *ret = (*f->pos++ ? (void *)1 : (void *)0);
     return 0;
 }
 
 int write_ptr(const void *ptr, dbFILE *f)
 {
-    if (fputc(ptr ? 1 : 0, f->fp) == EOF)
+    if (putc_db(ptr ? 1 : 0, f) == EOF)
 	return -1;
     return 0;
 }
@@ -373,12 +787,14 @@ int read_string(char **ret, dbFILE *f)
 	*ret = NULL;
 	return 0;
     }
-//    s = smalloc(len);
-    s = scalloc(len, 1);
-    if (len != fread(s, 1, len, f->fp)) {
-	free(s);
+    if (f->end - f->pos < len)
 	return -1;
-    }
+    /* Strings are always written with their trailing null, but don't
+     * trust the file on that */
+    s = smalloc(len);
+    memcpy(s, f->pos, len-1);
+    s[len-1] = 0;
+    f->pos += len;
     *ret = s;
     return 0;
 }
@@ -394,9 +810,9 @@ int write_string(const char *s, dbFILE *f)
 	len = 65534;
     if (write_int16((uint16)(len+1), f) < 0)
 	return -1;
-    if (len > 0 && fwrite(s, 1, len, f->fp) != len)
+    if (len > 0 && write_db(f, s, len) != len)
 	return -1;
-    if (fputc(0, f->fp) == EOF)
+    if (putc_db(0, f) == EOF)
 	return -1;
     return 0;
 }
@@ -13,14 +13,46 @@
 
 /*************************************************************************/
 
+/* Files being written are collected in blocks of DB_BLOCKSIZE bytes, each
+ * of which gets a CRC32C checksum; the checksums go in a trailer at the end
+ * of the file (after everything the load routines read, so older versions
+ * of Services just ignore it):
+ *	checksums (4 bytes each), block size (4), number of blocks (4),
+ *	length of data covered (8), DB_TRAILER_MAGIC (4)
+ * All numbers are big-endian, like the rest of the file.  The file is
+ * written under a temporary name and renamed over the real one only once
+ * it is complete and has been fsync()ed; the copy it replaces is kept
+ * (hard-linked) as DB_BACKUP_SUFFIX, and loaded instead if the new one
+ * turns out to be damaged.
+ */
+#define DB_BLOCKSIZE		65536
+#define DB_TRAILER_MAGIC	"DBCK"
+#define DB_TRAILER_LEN		20	/* Not counting the checksums */
+#define DB_BACKUP_SUFFIX	".save"
+
+/* Most threads db_parallel() will use, whatever the number of CPUs. */
+#define DB_MAX_THREADS		8
+
 typedef struct dbFILE_ dbFILE;
 struct dbFILE_ {
     int mode;			/* 'r' for reading, 'w' for writing */
-    FILE *fp;			/* The normal file descriptor */
-    FILE *backupfp;		/* Open file pointer to a backup copy of
-				 *    the database file (if non-NULL) */
     char filename[PATH_MAX];	/* Name of the database file */
-    char backupname[PATH_MAX];	/* Name of the backup file */
+
+    /* Reading: */
+    unsigned char *data;	/* Contents of the file */
+    unsigned char *pos, *end;	/* Read pointer and end of the contents */
+    size_t datalen;		/* Length of the file */
+    int mapped;			/* Nonzero if `data' is mmap()ed, zero if
+				 *    it was read into an allocated buffer */
+    int damaged;		/* Nonzero if a block failed its checksum */
+
+    /* Writing: */
+    int fd;			/* The temporary file being written */
+    char tempname[PATH_MAX];	/* Its name */
+    unsigned char *wbuf;	/* Block being filled */
+    int wlen;			/* Bytes used in wbuf */
+    uint32 *crcs;		/* Checksums of the blocks written so far */
+    int ncrcs, crcsize;
 };
 
 /*************************************************************************/
@@ -32,10 +64,17 @@ E int get_file_version(dbFILE *f);
 E int write_file_version(dbFILE *f, uint32 version);
 E dbFILE *open_db(const char *service, const char *filename, const char *mode, uint32 version);
 E void restore_db(dbFILE *f);	/* Restore to state before open_db() */
-E void close_db(dbFILE *f);
-#define read_db(f,buf,len)	(fread((buf),1,(len),(f)->fp))
-#define write_db(f,buf,len)	(fwrite((buf),1,(len),(f)->fp))
-#define getc_db(f)		(fgetc((f)->fp))
+E int close_db(dbFILE *f);
+E void prefetch_db(const char *filename);
+E void db_parallel(int nparts, void (*func)(void *arg, int part), void *arg);
+E size_t read_db(dbFILE *f, void *buf, size_t len);
+E const unsigned char *read_db_span(dbFILE *f, size_t len);
+E void release_db_pages(dbFILE *f);
+E size_t write_db(dbFILE *f, const void *buf, size_t len);
+E int flush_db_block(dbFILE *f);
+#define getc_db(f)		((f)->pos < (f)->end ? *(f)->pos++ : EOF)
+#define putc_db(c,f)		(((f)->wlen < DB_BLOCKSIZE || flush_db_block(f) == 0) \
+				 ? ((f)->wbuf[(f)->wlen++] = (c)) : EOF)
 
 E int read_int16(uint16 *ret, dbFILE *f);
 E int write_int16(uint16 val, dbFILE *f);
@@ -46,8 +85,12 @@ E int write_ptr(const void *ptr, dbFILE *f);
 E int read_string(char **ret, dbFILE *f);
 E int write_string(const char *s, dbFILE *f);
 
-#define read_int8(ret,f)	((*(ret)=fgetc((f)->fp))==EOF ? -1 : 0)
-#define write_int8(val,f)	(fputc((val),(f)->fp)==EOF ? -1 : 0)
+/* Decode big-endian numbers from memory returned by read_db_span(). */
+#define DB_INT16(p)	((uint16)((p)[0]<<8 | (p)[1]))
+#define DB_INT32(p)	((uint32)(p)[0]<<24 | (p)[1]<<16 | (p)[2]<<8 | (p)[3])
+
+#define read_int8(ret,f)	((*(ret)=getc_db(f))==EOF ? -1 : 0)
+#define write_int8(val,f)	(putc_db((val)&0xFF,(f))==EOF ? -1 : 0)
 #define read_buffer(buf,f)	(read_db((f),(buf),sizeof(buf)) == sizeof(buf))
 #define write_buffer(buf,f)	(write_db((f),(buf),sizeof(buf)) == sizeof(buf))
 #define read_buflen(buf,len,f)	(read_db((f),(buf),(len)) == (len))
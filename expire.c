@@ -0,0 +1,107 @@
+/* Time-ordered expiry index: a binary min-heap keyed on the time each
+ * record has to be looked at again, so the expire routines only touch
+ * records which are actually due.
+ *
+ * Services is copyright (c) 1996-1999 Andrew Church.
+ *     E-mail: <achurch@dragonfire.net>
+ * Services is copyright (c) 1999-2000 Andrew Kempe.
+ *     E-mail: <theshadow@shadowfire.org>
+ * This program is free but copyrighted software; see the file COPYING for
+ * details.
+ */
+
+#include "services.h"
+#include "expire.h"
+
+/*************************************************************************/
+
+/* Store an entry at the given (0-based) index and update its record. */
+
+static void set_entry(ExpireHeap *h, int i, ExpireEntry *e)
+{
+    h->heap[i] = *e;
+    *e->pos = i+1;
+}
+
+/* Move the entry at index i up or down until the heap is ordered again. */
+
+static void sift(ExpireHeap *h, int i)
+{
+    ExpireEntry e = h->heap[i];
+    int child;
+
+    while (i > 0 && h->heap[(i-1)/2].when > e.when) {
+	set_entry(h, i, &h->heap[(i-1)/2]);
+	i = (i-1)/2;
+    }
+    while ((child = 2*i+1) < h->count) {
+	if (child+1 < h->count && h->heap[child+1].when < h->heap[child].when)
+	    child++;
+	if (h->heap[child].when >= e.when)
+	    break;
+	set_entry(h, i, &h->heap[child]);
+	i = child;
+    }
+    set_entry(h, i, &e);
+}
+
+/*************************************************************************/
+
+void expire_add(ExpireHeap *h, void *data, int *pos, time_t when)
+{
+    int i;
+
+    if (*pos) {
+	i = *pos - 1;
+	h->heap[i].when = when;
+	sift(h, i);
+	return;
+    }
+    if (h->count >= h->size) {
+	h->size = h->size ? h->size*2 : 1024;
+	h->heap = srealloc(h->heap, sizeof(ExpireEntry) * h->size);
+    }
+    i = h->count++;
+    h->heap[i].when = when;
+    h->heap[i].data = data;
+    h->heap[i].pos = pos;
+    sift(h, i);
+}
+
+/*************************************************************************/
+
+void expire_del(ExpireHeap *h, int *pos)
+{
+    int i;
+
+    if (!*pos)
+	return;
+    i = *pos - 1;
+    *pos = 0;
+    if (i != --h->count) {
+	h->heap[i] = h->heap[h->count];
+	sift(h, i);
+    }
+}
+
+/*************************************************************************/
+
+void *expire_next(ExpireHeap *h, time_t now)
+{
+    void *data;
+
+    if (!expire_due(h, now))
+	return NULL;
+    data = h->heap[0].data;
+    expire_del(h, h->heap[0].pos);
+    return data;
+}
+
+/*************************************************************************/
+
+int expire_due(ExpireHeap *h, time_t now)
+{
+    return h->count > 0 && h->heap[0].when <= now;
+}
+
+/*************************************************************************/
@@ -0,0 +1,52 @@
+/* Time-ordered expiry index include stuff.
+ *
+ * Services is copyright (c) 1996-1999 Andrew Church.
+ *     E-mail: <achurch@dragonfire.net>
+ * Services is copyright (c) 1999-2000 Andrew Kempe.
+ *     E-mail: <theshadow@shadowfire.org>
+ * This program is free but copyrighted software; see the file COPYING for
+ * details.
+ */
+
+#ifndef EXPIRE_H
+#define EXPIRE_H
+
+#include <time.h>
+
+
+/* Maximum number of due records each expire routine handles per call; the
+ * rest are left for the next trip through the main loop. */
+#define EXPIRE_BATCH	50
+
+/* A min-heap of records ordered by the time they next have to be checked.
+ * Each record keeps its own position in the heap (1-based; 0 means it is
+ * not in the heap) so it can be removed or rescheduled in O(log n).
+ */
+typedef struct {
+    time_t when;		/* When to look at the record again */
+    void *data;			/* The record (NickInfo, ChannelInfo...) */
+    int *pos;			/* Record's field holding its heap position */
+} ExpireEntry;
+
+typedef struct expireheap_ ExpireHeap;
+struct expireheap_ {
+    ExpireEntry *heap;
+    int count, size;
+};
+
+
+/* Add a record to the heap to be checked at `when', or move it there if
+ * it is already in the heap. */
+extern void expire_add(ExpireHeap *h, void *data, int *pos, time_t when);
+
+/* Remove a record from the heap (if it's there). */
+extern void expire_del(ExpireHeap *h, int *pos);
+
+/* Remove and return the earliest record if it is due at `now', else NULL. */
+extern void *expire_next(ExpireHeap *h, time_t now);
+
+/* Return whether any record in the heap is due at `now'. */
+extern int expire_due(ExpireHeap *h, time_t now);
+
+
+#endif	/* EXPIRE_H */
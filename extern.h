@@ -28,11 +28,16 @@ E int num_akills(void);
 E void load_akill(void);
 E void save_akill(void);
 E int check_akill(const char *nick, const char *username, const char *host);
-E void expire_akills(void);
+E int expire_akills(void);
 E void do_akill(User *u);
 E void add_akill(const char *mask, const char *reason, const char *who,
 			const time_t expiry);
 
+/**** bench.c ****/
+
+E int do_bench(int ac, char **av);
+
+
 /**** channels.c ****/
 
 #ifdef DEBUG_COMMANDS
@@ -41,12 +46,15 @@ E void send_channel_users(User *user);
 #endif
 
 E void get_channel_stats(long *nrec, long *memuse);
+E void get_channel_hash_stats(int *size, int *count, int *hist, int histlen);
 E Channel *findchan(const char *chan);
 E Channel *firstchan(void);
 E Channel *nextchan(void);
 
 E void chan_adduser(User *user, const char *chan);
 E void chan_deluser(User *user, Channel *c);
+E void chan_delusers_server(Channel *c, Server *server);
+E int match_bans(Channel *c, User *u, int virtual, char ***ret);
 
 E void do_cmode(const char *source, int ac, char **av);
 E void do_topic(const char *source, int ac, char **av);
@@ -63,6 +71,8 @@ E void cs_init(void);
 E void chanserv(const char *source, char *buf);
 E void load_cs_dbase(void);
 E void save_cs_dbase(void);
+E void cs_foreach_memo(void (*fn)(Memo *m));
+E void cancel_chan_list(User *u);
 E void check_modes(const char *chan);
 E int check_valid_op(User *user, const char *chan, int newchan);
 E int check_valid_voice(User *user, const char *chan, int newchan);
@@ -74,7 +84,7 @@ E int check_kick(User *user, const char *chan);
 E void record_topic(const char *chan);
 E void restore_topic(const char *chan);
 E int check_topiclock(const char *chan);
-E void expire_chans(void);
+E int expire_chans(void);
 E void cs_remove_nick(const NickInfo *ni);
 
 E ChannelInfo *cs_findchan(const char *chan);
@@ -152,6 +162,7 @@ E char *ChanDBName;
 E char *OperDBName;
 E char *AutokillDBName;
 E char *NewsDBName;
+E char *MemoDBName;
 E char *IlineDBName;
 
 E char *SendMailPatch;
@@ -169,6 +180,10 @@ E int   ReadTimeout;
 E int   WarningTimeout;
 E int   TimeoutCheck;
 E int   SettimeTimeout;
+E int   FloodUserCount;
+E int   FloodUserPeriod;
+E int   FloodHostCount;
+E int   FloodHostPeriod;
 
 E int   NSNicksMail;
 E int   NSForceNickChange; 
@@ -254,13 +269,17 @@ E void cyber_init(void);
 E void cyberserv(const char *source, char *buf);
 E void load_cyber_dbase(void);
 E void save_cyber_dbase(void);
-E void expire_ilines(void);
+E int expire_ilines(void);
 
 E int add_clones(const char *nick, const char *host);
 E void del_clones(const char *host);
 E Clones *findclones(const char *host);
 
 E IlineInfo *find_iline_host(const char *host);
+E IlineInfo *bench_add_iline(const char *host, int limite);
+E void bench_del_iline(IlineInfo *il);
+E IlineInfo *find_iline_host_slow(const char *host);
+E int check_ilinetrie(void);
 E IlineInfo *find_iline_admin(const char *nick);
 E int is_cyber_admin(User *u);
 E int nick_is_cyber_admin(NickInfo *ni);
@@ -304,14 +323,21 @@ E void do_listilines(int ac, char **av);
 
 /**** log.c ****/
 
+E int log_levels[LOG_NSUBSYS];
 E int open_log(void);
 E void close_log(void);
+E void start_log_writer(void);
 E void log(const char *fmt, ...)		FORMAT(printf,1,2);
+E void log_debug(int sub, int level, const char *fmt, ...)
+						FORMAT(printf,3,4);
 E void log_perror(const char *fmt, ...)		FORMAT(printf,1,2);
 E void fatal(const char *fmt, ...)		FORMAT(printf,1,2);
 E void fatal_perror(const char *fmt, ...)	FORMAT(printf,1,2);
 
 E void rotate_log(User *u);
+E int set_log_level(const char *name, int level);
+E void get_log_stats(long *nlines, long *ndropped, long dropped[LOG_NSUBSYS]);
+E const char *log_subsys_name(int sub);
 
 
 /**** main.c ****/
@@ -331,6 +357,8 @@ E int   skeleton;
 E int   nofork;
 E int   forceload;
 E int   opt_noexpire;
+E char *capture_filename;
+E char *replay_sink;
 
 E int   quitting;
 E int   delayed_quit;
@@ -340,6 +368,10 @@ E int   servsock;
 E int   save_data;
 E int   got_alarm;
 E time_t start_time;
+E time_t cur_time;
+
+E void update_time(void);
+E void set_virtual_time(time_t t);
 
 
 /**** memory.c ****/
@@ -348,6 +380,10 @@ E void *smalloc(long size);
 E void *scalloc(long elsize, long els);
 E void *srealloc(void *oldptr, long newsize);
 E char *sstrdup(const char *s);
+E char *sintern(const char *s);
+E char *sintern_nocase(const char *s);
+E void sunintern(char *s);
+E void get_intern_stats(long *nstrings, long *nrefs, long *memuse, long *saved);
 
 
 /**** memoserv.c ****/
@@ -358,6 +394,14 @@ E void load_old_ms_dbase(void);
 E void check_memos(User *u);
 E void check_all_cs_memos(User *u);
 E void check_cs_memos(User *u, ChannelInfo *ci);
+E void memo_store_add(Memo *m, const char *text);
+E const char *memo_text(Memo *m);
+E void memo_free_text(Memo *m);
+E void memo_store_loaded(Memo *m, uint32 gen, int which);
+E uint32 memo_store_pos(Memo *m);
+E uint32 sync_memo_store(void);
+E void memo_store_saved(int which);
+E void compact_memo_store(void);
 
 /**** misc.c ****/
 
@@ -368,6 +412,7 @@ E char *strlower(char *s);
 E char *strLower(char *s);
 E char *strnrepl(char *s, int32 size, const char *old, const char *new);
 E int strCasecmp(const char *a, const char *b);
+E uint32 hash_nocase(const char *s);
 E int NTL_tolower_tab[];
 E int NTL_toupper_tab[];
 E char *strToken(char **save, char *str, char *fs);
@@ -396,21 +441,29 @@ E void do_opernews(User *u);
 
 /**** nickserv.c ****/
 
+E uint32 link_generation;
 E void listnicks(int count_only, const char *nick);
+E int listnicks_columns(int count_only);
+E int load_ns_nick(const char *nick);
 E void get_nickserv_stats(long *nrec, long *memuse, long *nforbid, long *nsuspend, long *naccess, long *nignore, long *nmemos, long *nmemosnr);
 
 E void ns_init(void);
 E void nickserv(const char *source, char *buf);
 E void load_ns_dbase(void);
 E void save_ns_dbase(void);
+E void bench_make_nicks(int count);
+E void ns_foreach_memo(void (*fn)(Memo *m));
 E int validate_user(User *u);
 E void cancel_user(User *u);
+E void update_last_seen(User *u);
+E void cancel_nick_list(User *u);
 E int nick_identified(User *u);
 E int nick_recognized(User *u);
-E void expire_nicks(void);
+E int expire_nicks(void);
 
 E NickInfo *findnick(const char *nick);
 E NickInfo *getlink(NickInfo *ni);
+E void set_last_usermask(NickInfo *ni, User *u);
 
 
 /**** operserv.c ****/
@@ -434,10 +487,17 @@ E void check_clones(User *user);
 /**** process.c ****/
 
 E int allow_ignore;
-E IgnoreData *ignore[];
 
-E void add_ignore(const char *nick, time_t delta);
-E IgnoreData *get_ignore(const char *nick);
+E FloodHost *find_floodhost(const char *host);
+E void get_floodhost(User *u);
+E void put_floodhost(User *u);
+E int parse_cidr(const char *s, uint32 *net, int *bits);
+E int foreach_net_user(uint32 net, int bits,
+		       void (*fn)(User *u, void *arg), void *arg);
+E int top_ipnets(int bits, IpNet **top, int max);
+E int flood_check(const char *nick);
+E void flood_penalty(User *u, int secs);
+E void get_flood_stats(long *nhosts, long *nuser, long *nhost);
 
 E int split_buf(char *buf, char ***argv, int colon_special);
 E void process(void);
@@ -469,6 +529,10 @@ E void get_server_stats(long *nrec, long *memuse);
 E void do_server(const char *source, int ac, char **av);
 E void do_squit(const char *source, int ac, char **av);
 E Server *find_servername(const char *servername);
+E Server *find_servernumeric(const char *numeric);
+E User *find_usernumeric(const char *numeric);
+E void add_usernumeric(User *user, const char *numeric);
+E void del_usernumeric(User *user);
 E Server *add_server(const char *servername);
 E void del_server(Server *server);
 E void recursive_squit(Server *parent, const char *reason);
@@ -476,6 +540,14 @@ E void del_users_server(Server *server);
 E void do_servers(User *u);
 
 
+/**** replay.c ****/
+
+E int open_capture(const char *filename);
+E void close_capture(void);
+E void capture_line(const char *line);
+E int do_replay(int ac, char **av);
+
+
 /**** sockutil.c ****/
 
 E int32 total_read, total_written;
@@ -485,9 +557,11 @@ E int32 write_buffer_len(void);
 E int sgetc(int s);
 E char *sgets(char *buf, int len, int s);
 E char *sgets2(char *buf, int len, int s);
+E int sready(int s);
 E int sread(int s, char *buf, int len);
 E int sputs(char *str, int s);
 E int sockprintf(int s, char *fmt,...);
+E void sflush(int s);
 E int conn(const char *host, int port, const char *lhost, int lport);
 E void disconn(int s);
 
@@ -497,15 +571,15 @@ E char convert2y[];
 E unsigned int base64toint(const char *s);
 E const char *inttobase64(char *buf, unsigned int v, unsigned int count);
 E void cifrado_tea(unsigned int v[], unsigned int k[], unsigned int x[]);
+E int make_virtualhost_r(const char *host, char *buf);
 E const char *make_virtualhost(const char *host);
+E const char *user_virtualhost(User *user, char *buf);
 E const char *make_special_admin_host(const char *nick);
 E const char *make_special_oper_host(const char *nick);
 E const char *make_special_ircop_host(const char *nick);
 
 /**** users.c ****/
 
-E User *userlist[1024];
-
 E int usercnt, chancnt, opcnt, maxusercnt, maxchancnt, servercnt;
 E time_t maxusertime;
 E time_t maxchantime;
@@ -516,6 +590,7 @@ E void send_user_info(User *user);
 #endif
 
 E void get_user_stats(long *nusers, long *memuse);
+E void get_user_hash_stats(int *size, int *count, int *hist, int histlen);
 E User *finduser(const char *nick);
 E User *firstuser(void);
 E User *nextuser(void);
@@ -537,7 +612,6 @@ E int is_chanop(const char *nick, Channel *c);
 E int is_voiced(const char *nick, Channel *c);
 
 E int match_usermask(const char *mask, User *user);
-E int match_virtualmask(const char *mask, User *user);
 E int match_cybermask(const char *mask, User *user);
 E void split_usermask(const char *mask, char **nick, char **user, char **host);
 E char *create_mask(User *u);
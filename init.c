@@ -9,6 +9,8 @@
  */
 
 #include "services.h"
+#include "datafiles.h"
+#include <fcntl.h>
 
 /*************************************************************************/
 
@@ -18,7 +20,7 @@
 
 # define NICK(nick,name) \
     do { \
-	send_cmd(ServerName, "NICK %s 1 %ld %s %s %s :%s", (nick), time(NULL),\
+	send_cmd(ServerName, "NICK %s 1 %ld %s %s %s :%s", (nick), cur_time,\
 		ServiceUser, ServiceHost, ServerName, (name)); \
     } while (0)
 
@@ -230,6 +232,12 @@ static int parse_options(int ac, char **av)
 		    return -1;
 		}
 		log_filename = av[i];
+	    } else if (strcmp(s, "capture") == 0) {
+		if (++i >= ac) {
+		    fprintf(stderr, "-capture requires a parameter\n");
+		    return -1;
+		}
+		capture_filename = av[i];
 	    } else if (strcmp(s, "update") == 0) {
 		if (++i >= ac) {
 		    fprintf(stderr, "-update requires a parameter\n");
@@ -319,6 +327,9 @@ int init(int ac, char **av)
     extern void sighandler(int signum);
 
 
+    /* Nothing has read the clock yet. */
+    update_time();
+
     /* Set file creation mask and group ID. */
 #if defined(DEFUMASK) && HAVE_UMASK
     umask(DEFUMASK);
@@ -353,8 +364,8 @@ int init(int ac, char **av)
     /* Parse all remaining command-line options. */
     parse_options(ac, av);
 
-    /* Detach ourselves if requested. */
-    if (!nofork) {
+    /* Detach ourselves if requested (never when replaying a capture). */
+    if (!nofork && !replay_sink) {
 	if ((i = fork()) < 0) {
 	    perror("fork()");
 	    return -1;
@@ -372,8 +383,18 @@ int init(int ac, char **av)
 	}
     }
 
-    /* Write our PID to the PID file. */
-    write_pidfile();
+    /* Write our PID to the PID file (unless we're only replaying a
+     * capture, alongside the real thing). */
+    if (!replay_sink)
+	write_pidfile();
+
+    /* From here on the log file is written by its own thread. */
+    start_log_writer();
+
+    /* Record what the server sends us, if asked to. */
+    if (capture_filename && !replay_sink
+			&& open_capture(capture_filename) < 0)
+	log_perror("Can't open capture file %s", capture_filename);
 
     /* Announce ourselves to the logfile. */
     if (debug || readonly || skeleton) {
@@ -385,7 +406,7 @@ int init(int ac, char **av)
 	log("Services %s (compiled for %s) starting up",
 		version_number, version_protocol);
     }
-    start_time = time(NULL);
+    start_time = cur_time;
 
     /* If in read-only mode, close the logfile again. */
     if (readonly)
@@ -433,7 +454,19 @@ int init(int ac, char **av)
     cyber_init();
 #endif
 
-    /* Load up databases */
+    /* Load up databases.  Ask the kernel to start reading all of them now,
+     * so the later files are (mostly) in memory by the time we get to
+     * them. */
+    if (!skeleton) {
+	prefetch_db(NickDBName);
+	prefetch_db(ChanDBName);
+    }
+    prefetch_db(OperDBName);
+    prefetch_db(AutokillDBName);
+    prefetch_db(NewsDBName);
+#ifdef CYBER
+    prefetch_db(IlineDBName);
+#endif
     if (!skeleton) {
 	load_ns_dbase();
 	if (debug)
@@ -458,14 +491,22 @@ int init(int ac, char **av)
 #endif        
     log("Databases loaded");
 
-    /* Connect to the remote server */
-    servsock = conn(RemoteServer, RemotePort, LocalHost, LocalPort);
-    if (servsock < 0)
-	fatal_perror("Can't connect to server");
+    /* Connect to the remote server, or open the sink for a replay. */
+    if (replay_sink) {
+	servsock = open(replay_sink, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (servsock < 0)
+	    fatal_perror("Can't open %s", replay_sink);
+	*inbuf = 0;
+    } else {
+	servsock = conn(RemoteServer, RemotePort, LocalHost, LocalPort);
+	if (servsock < 0)
+	    fatal_perror("Can't connect to server");
+    }
     send_cmd(NULL, "PASS :%s", RemotePassword);
     send_cmd(NULL, "SERVER %s 1 %lu %lu P09 :%s",
 		ServerName, start_time, start_time, ServerDesc);
-    sgets2(inbuf, sizeof(inbuf), servsock);
+    if (!replay_sink)
+	sgets2(inbuf, sizeof(inbuf), servsock);
     if (strnicmp(inbuf, "ERROR", 5) == 0) {
 	/* Close server socket first to stop wallops, since the other
 	 * server doesn't want to listen to us anyway */
@@ -483,7 +524,7 @@ int init(int ac, char **av)
     /* Bring in our pseudo-clients */
     introduce_user(NULL);
     /* Sincroniza la red al tiempo real */
-    send_cmd(ServerName, "SETTIME :%lu", time(NULL));
+    send_cmd(ServerName, "SETTIME :%lu", cur_time);
     
     /* Manda global */
 #ifdef PROVISIONAL
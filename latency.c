@@ -0,0 +1,202 @@
+/* Latency statistics: how long each server message and each service
+ * command takes to handle, kept as counters plus a histogram per message
+ * or command.
+ *
+ * Services is copyright (c) 1996-1999 Andrew Church.
+ *     E-mail: <achurch@dragonfire.net>
+ * Services is copyright (c) 1999-2000 Andrew Kempe.
+ *     E-mail: <theshadow@shadowfire.org>
+ * This program is free but copyrighted software; see the file COPYING for
+ * details.
+ */
+
+#include "services.h"
+#include "latency.h"
+
+static LatStat *latlist;
+static long latcount;
+
+/*************************************************************************/
+
+lat_t lat_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (lat_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#elif HAVE_GETTIMEOFDAY
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (lat_t)tv.tv_sec * 1000000000 + (lat_t)tv.tv_usec * 1000;
+#else
+    return (lat_t)time(NULL) * 1000000000;
+#endif
+}
+
+/*************************************************************************/
+
+/* Return the histogram bucket for a time, and the lowest time which goes
+ * into a bucket. */
+
+static int bucket(lat_t ns)
+{
+    int e;
+
+    if (ns < LAT_SUB)
+	return (int)ns;
+    if (ns >> LAT_MAXBITS)
+	return LAT_NBUCKETS-1;
+    for (e = LAT_SUBBITS; ns >> (e+1); e++)
+	;
+    return (e-LAT_SUBBITS+1)*LAT_SUB
+		+ (int)((ns >> (e-LAT_SUBBITS)) & (LAT_SUB-1));
+}
+
+static lat_t bucket_low(int i)
+{
+    int e;
+
+    if (i < LAT_SUB)
+	return i;
+    e = i/LAT_SUB + LAT_SUBBITS-1;
+    return (lat_t)(LAT_SUB + i%LAT_SUB) << (e-LAT_SUBBITS);
+}
+
+/*************************************************************************/
+
+void lat_record(LatStat **lsp, const char *service, const char *name,
+		lat_t ns)
+{
+    LatStat *ls = *lsp;
+
+    if (!ls) {
+	ls = scalloc(sizeof(*ls), 1);
+	ls->service = sstrdup(service);
+	ls->name = name;
+	ls->next = latlist;
+	latlist = ls;
+	latcount++;
+	*lsp = ls;
+    }
+    ls->count++;
+    ls->total += ns;
+    if (ns > ls->max)
+	ls->max = ns;
+    ls->hist[bucket(ns)]++;
+}
+
+/*************************************************************************/
+
+lat_t lat_percentile(const LatStat *ls, int permille)
+{
+    uint32 want, seen = 0;
+    lat_t high;
+    int i;
+
+    if (!ls->count)
+	return 0;
+    want = (uint32)(((lat_t)ls->count * permille + 999) / 1000);
+    if (want < 1)
+	want = 1;
+    for (i = 0; i < LAT_NBUCKETS-1; i++) {
+	seen += ls->hist[i];
+	if (seen >= want) {
+	    high = bucket_low(i+1) - 1;
+	    return high < ls->max ? high : ls->max;
+	}
+    }
+    return ls->max;
+}
+
+/*************************************************************************/
+
+char *lat_format(char *buf, int size, lat_t ns)
+{
+    if (ns < 1000)
+	snprintf(buf, size, "%dns", (int)ns);
+    else if (ns < 1000000)
+	snprintf(buf, size, "%d.%dus", (int)(ns/1000), (int)(ns/100%10));
+    else if (ns < 1000000000)
+	snprintf(buf, size, "%d.%dms", (int)(ns/1000000),
+		(int)(ns/100000%10));
+    else
+	snprintf(buf, size, "%d.%02ds", (int)(ns/1000000000),
+		(int)(ns/10000000%100));
+    return buf;
+}
+
+/*************************************************************************/
+
+LatStat *lat_list(void)
+{
+    return latlist;
+}
+
+
+void get_latency_stats(long *nrec, long *memuse)
+{
+    LatStat *ls;
+    long mem = 0;
+
+    for (ls = latlist; ls; ls = ls->next)
+	mem += sizeof(*ls) + strlen(ls->service)+1;
+    *nrec = latcount;
+    *memuse = mem;
+}
+
+
+void lat_reset(void)
+{
+    LatStat *ls;
+
+    for (ls = latlist; ls; ls = ls->next) {
+	ls->count = 0;
+	ls->total = ls->max = 0;
+	memset(ls->hist, 0, sizeof(ls->hist));
+    }
+}
+
+/*************************************************************************/
+
+/* The dump has one line per message or command:
+ *	service name count total max p50 p90 p99 p99.9
+ * followed by one indented "low count" line per non-empty bucket, where
+ * `low' is the smallest time (in ns) counted in that bucket. */
+
+int lat_dump(const char *filename)
+{
+    FILE *f;
+    LatStat *ls;
+    time_t t = time(NULL);
+    int i, errno_save;
+
+    if (!(f = fopen(filename, "w")))
+	return -1;
+    fprintf(f, "# Services latency dump, %s", ctime(&t));
+    fprintf(f, "# service name count total_ns max_ns p50 p90 p99 p99.9\n");
+    for (ls = latlist; ls; ls = ls->next) {
+	if (!ls->count)
+	    continue;
+	fprintf(f, "%s %s %lu %llu %llu %llu %llu %llu %llu\n",
+		ls->service, ls->name, (unsigned long)ls->count,
+		ls->total, ls->max,
+		lat_percentile(ls, 500), lat_percentile(ls, 900),
+		lat_percentile(ls, 990), lat_percentile(ls, 999));
+	for (i = 0; i < LAT_NBUCKETS; i++) {
+	    if (ls->hist[i])
+		fprintf(f, "\t%llu %lu\n", bucket_low(i),
+			(unsigned long)ls->hist[i]);
+	}
+    }
+    if (fclose(f) == EOF) {
+	errno_save = errno;
+	log_perror("Error writing %s", filename);
+	errno = errno_save;
+	return -1;
+    }
+    return 0;
+}
+
+/*************************************************************************/
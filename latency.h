@@ -0,0 +1,70 @@
+/* Latency statistics include stuff.
+ *
+ * Services is copyright (c) 1996-1999 Andrew Church.
+ *     E-mail: <achurch@dragonfire.net>
+ * Services is copyright (c) 1999-2000 Andrew Kempe.
+ *     E-mail: <theshadow@shadowfire.org>
+ * This program is free but copyrighted software; see the file COPYING for
+ * details.
+ */
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+
+/* Times are measured in nanoseconds on the monotonic clock. */
+typedef unsigned long long lat_t;
+
+/* Histogram layout, as in HdrHistogram: values below LAT_SUB get a bucket
+ * each, and every power of two above that is split into LAT_SUB buckets,
+ * so a value is known to within 1/LAT_SUB (about 6%) of itself.  Anything
+ * of 2^LAT_MAXBITS ns (about 18 minutes) or more goes in the last bucket. */
+#define LAT_SUBBITS	4
+#define LAT_SUB		(1<<LAT_SUBBITS)
+#define LAT_MAXBITS	40
+#define LAT_NBUCKETS	((LAT_MAXBITS-LAT_SUBBITS+1) * LAT_SUB)
+
+/* Statistics for one server message or service command.  They are created
+ * the first time the message or command is timed, and hang off both the
+ * Message or Command entry and a global list. */
+typedef struct latstat_ LatStat;
+struct latstat_ {
+    LatStat *next;
+    char *service;		/* "server" for server messages */
+    const char *name;
+    uint32 count;		/* Calls timed */
+    lat_t total, max;
+    uint32 hist[LAT_NBUCKETS];
+};
+
+
+/* Return the current monotonic time in nanoseconds. */
+extern lat_t lat_now(void);
+
+/* Add a call taking `ns' nanoseconds to the statistics in *lsp, creating
+ * them (under the given service and name) if *lsp is NULL. */
+extern void lat_record(LatStat **lsp, const char *service, const char *name,
+			lat_t ns);
+
+/* Return the time below which the given fraction (in thousandths) of the
+ * calls fell. */
+extern lat_t lat_percentile(const LatStat *ls, int permille);
+
+/* Format a time with a suitable unit ("850ns", "12.3us", "1.05s"...). */
+extern char *lat_format(char *buf, int size, lat_t ns);
+
+/* Return the list of all statistics, most recently created first. */
+extern LatStat *lat_list(void);
+
+/* Return the number of statistics and their memory use. */
+extern void get_latency_stats(long *nrec, long *memuse);
+
+/* Clear all counts and histograms. */
+extern void lat_reset(void);
+
+/* Write all statistics, with their full histograms, to the given file.
+ * Return 0 on success, -1 (with errno set) on error. */
+extern int lat_dump(const char *filename);
+
+
+#endif	/* LATENCY_H */
@@ -74,14 +74,20 @@ are given, detailed information about those nicks is displayed.\n\
     }
     if (!read_config())
 	exit(1);
-    load_ns_dbase();
-    
     lang_init();
-    
+
+    /* With a columnar nick.db (version 11 and up), only read what we need */
     if (ac > 1) {
+	for (i = 1; i < ac; i++) {
+	    if (!load_ns_nick(av[i]))
+		break;
+	}
+	if (i < ac)
+	    load_ns_dbase();
 	for (i = 1; i < ac; i++)
 	    listnicks(0, av[i]);
-    } else {
+    } else if (!listnicks_columns(count)) {
+	load_ns_dbase();
 	listnicks(count, NULL);
     }
     exit(0);
@@ -0,0 +1,967 @@
+/* Load generator: a fake ircu hub for Services to connect to.  Once
+ * Services has linked, it bursts a synthetic network (servers, users and
+ * channel memberships), registers a share of the nicks and channels (or
+ * identifies them, with a database seeded by an earlier run), then floods
+ * NickServ IDENTIFY and ChanServ OP commands at a fixed rate and measures
+ * how long the replies take.
+ *
+ * This is a standalone program; it doesn't link with the rest of Services.
+ * Build it with "make loadgen", point RemoteServer in services.conf at it,
+ * start it and then start Services.
+ *
+ * Services is copyright (c) 1996-1999 Andrew Church.
+ *     E-mail: <achurch@dragonfire.net>
+ * Services is copyright (c) 1999-2000 Andrew Kempe.
+ *     E-mail: <theshadow@shadowfire.org>
+ * This program is free but copyrighted software; see the file COPYING for
+ * details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/*************************************************************************/
+
+/* Settings (see usage()). */
+
+static int port = 4400;
+static int nservers = 10;
+static int nusers = 10000;
+static int nchans = 2000;
+static int chans_per_user = 3;
+static double zipf_s = 1.0;
+static int identify_rate = 100;
+static int op_rate = 100;
+static int duration = 30;
+static char *hubname = "hub.load.test";
+static char *nickserv = "NickServ";
+static char *chanserv = "ChanServ";
+static char *password = "loadtest";
+static int reg_nicks = 50;
+static int reg_chans = 50;
+static int access_per_chan = 10;
+static char *rootnick = NULL;
+static int setup = 0;
+
+/* What to do with the nicks and channels before flooding (-setup). */
+#define SETUP_REGISTER	0
+#define SETUP_IDENTIFY	1
+#define SETUP_NONE	2
+
+static const char *setup_names[] = { "register", "identify", "none" };
+
+/* Replies slower than this count as lost. */
+#define REPLY_TIMEOUT	10.0
+
+/*************************************************************************/
+
+/* Users.  `sent' is when the command we are waiting on a reply for was
+ * sent (0 if none), and `cmd' which command it was. */
+
+typedef struct {
+    char nick[16];
+    int server;
+    int chan;			/* A channel the user is on */
+    int shared;			/* On a host shared by many users */
+    int reg;			/* Nick registered during setup */
+    int access;			/* On the access list of `chan' */
+    int dead;			/* Killed or renamed by Services */
+    double sent;
+    int cmd;
+} LoadUser;
+
+#define CMD_IDENTIFY	0
+#define CMD_OP		1
+#define NCMDS		2
+
+static const char *cmd_names[NCMDS] = { "IDENTIFY", "OP" };
+
+static LoadUser *users;
+static int *nickhash;		/* Open addressing, user index + 1 */
+static int nickhash_size;
+
+/* Channels: in use (somebody joined it), registered during setup, and
+ * how many access list entries setup gave them. */
+static char *chan_used, *chan_reg;
+static int *chan_access;
+static int nregnicks, nregchans, naccess;
+
+/* Users each command is sent from: for IDENTIFY, those with a registered
+ * nick; for OP, those on a registered channel.  If setup registered
+ * nothing, anybody (on a channel, for OP). */
+static int *pool[NCMDS], npool[NCMDS];
+
+/* The PONG which ends the current wait in run(). */
+static const char *pong_wanted;
+
+/* Latency histograms, in microseconds: 16 buckets per power of two. */
+#define HIST_SUB	16
+#define HIST_SIZE	(32*HIST_SUB)
+
+typedef struct {
+    long sent, replied, lost;
+    double total, max;
+    long hist[HIST_SIZE];
+} CmdStats;
+
+static CmdStats stats[NCMDS];
+
+static int sock = -1;
+static char *outbuf;
+static long outlen, outsize, outpos;
+static long lines_sent;
+
+/*************************************************************************/
+/*************************************************************************/
+
+static double now(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+#endif
+}
+
+static void *xmalloc(long size)
+{
+    void *p = calloc(1, size);
+
+    if (!p) {
+	fprintf(stderr, "loadgen: out of memory\n");
+	exit(1);
+    }
+    return p;
+}
+
+/*************************************************************************/
+
+/* Queue a line to send to Services. */
+
+static void sendline(const char *fmt, ...)
+{
+    va_list args;
+    int len;
+
+    if (outsize - outlen < 1024) {
+	if (outpos > 0) {
+	    memmove(outbuf, outbuf+outpos, outlen-outpos);
+	    outlen -= outpos;
+	    outpos = 0;
+	}
+	if (outsize - outlen < 1024) {
+	    outsize = outsize ? outsize*2 : 1<<20;
+	    outbuf = realloc(outbuf, outsize);
+	    if (!outbuf) {
+		fprintf(stderr, "loadgen: out of memory\n");
+		exit(1);
+	    }
+	}
+    }
+    va_start(args, fmt);
+    len = vsnprintf(outbuf+outlen, 1022, fmt, args);
+    va_end(args);
+    if (len > 1021)
+	len = 1021;
+    outlen += len;
+    outbuf[outlen++] = '\r';
+    outbuf[outlen++] = '\n';
+    lines_sent++;
+}
+
+/* Write as much queued output as the socket will take. */
+
+static void flush_output(void)
+{
+    long n;
+
+    while (outpos < outlen) {
+	n = write(sock, outbuf+outpos, outlen-outpos);
+	if (n <= 0) {
+	    if (n < 0 && errno != EAGAIN && errno != EINTR) {
+		perror("loadgen: write");
+		exit(1);
+	    }
+	    return;
+	}
+	outpos += n;
+    }
+    outpos = outlen = 0;
+}
+
+/*************************************************************************/
+
+/* Random numbers: uniform in [0,n), and Zipf-distributed ranks in [0,n)
+ * from a precomputed cumulative table. */
+
+static int rnd(int n)
+{
+    return (int)(random() % n);
+}
+
+typedef struct {
+    double *cdf;
+    int n;
+} Zipf;
+
+static void zipf_init(Zipf *z, int n, double s)
+{
+    double sum = 0;
+    int i;
+
+    z->n = n;
+    z->cdf = xmalloc(sizeof(double) * n);
+    for (i = 0; i < n; i++)
+	z->cdf[i] = (sum += 1.0 / pow(i+1, s));
+    for (i = 0; i < n; i++)
+	z->cdf[i] /= sum;
+}
+
+static int zipf(Zipf *z)
+{
+    double r = (double)random() / RAND_MAX;
+    int lo = 0, hi = z->n - 1, mid;
+
+    while (lo < hi) {
+	mid = (lo+hi) / 2;
+	if (z->cdf[mid] < r)
+	    lo = mid+1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+/*************************************************************************/
+
+/* Nick lookup for replies. */
+
+static unsigned int nick_hashval(const char *s)
+{
+    unsigned int h = 0;
+
+    while (*s)
+	h = h*31 + (unsigned char)tolower(*s++);
+    return h;
+}
+
+static void nick_add(int i)
+{
+    unsigned int h = nick_hashval(users[i].nick) & (nickhash_size-1);
+
+    while (nickhash[h])
+	h = (h+1) & (nickhash_size-1);
+    nickhash[h] = i+1;
+}
+
+static int nick_find(const char *nick)
+{
+    unsigned int h = nick_hashval(nick) & (nickhash_size-1);
+
+    while (nickhash[h]) {
+	if (strcasecmp(users[nickhash[h]-1].nick, nick) == 0)
+	    return nickhash[h]-1;
+	h = (h+1) & (nickhash_size-1);
+    }
+    return -1;
+}
+
+/*************************************************************************/
+
+/* Make up a nick, username, host and real name which look like those on a
+ * real network: nicks built from syllables with the odd number or
+ * underscore, mostly dynamic ISP hosts, some bare IPs, and a few hosts
+ * shared by many users (cybercafes, proxies). */
+
+static const char *syllables[] = {
+    "ma", "ri", "to", "lu", "na", "pe", "dro", "ka", "sa", "la", "ne",
+    "jo", "se", "an", "ge", "li", "ta", "mo", "ra", "vi", "da", "ni",
+    "chi", "co", "bo", "fer", "gui", "cris", "xa", "zu",
+};
+#define NSYLL	(sizeof(syllables) / sizeof(*syllables))
+
+static void make_nick(char *buf, int size, int i)
+{
+    int n = 2 + rnd(3), len = 0;
+
+    while (n-- > 0 && len < size-8)
+	len += snprintf(buf+len, size-len, "%s", syllables[rnd(NSYLL)]);
+    buf[0] = toupper(buf[0]);
+    switch (rnd(4)) {
+      case 0:
+	/* Plain, if it's not taken */
+	if (nick_find(buf) < 0)
+	    return;
+	/* fall through */
+      case 1:
+	snprintf(buf+len, size-len, "%d", i % 10000);
+	break;
+      case 2:
+	snprintf(buf+len, size-len, "_%d", i % 1000);
+	break;
+      default:
+	snprintf(buf+len, size-len, "%c%d", 'a' + i%26, i / 26 % 1000);
+	break;
+    }
+    if (nick_find(buf) >= 0)
+	snprintf(buf, size, "Usr%d", i);
+}
+
+static int make_host(char *buf, int size, Zipf *shared)
+{
+    int r = rnd(100);
+
+    if (r < 10) {
+	snprintf(buf, size, "proxy%d.cyber.example.net", zipf(shared));
+	return 1;
+    } else if (r < 30)
+	snprintf(buf, size, "%d.%d.%d.%d", 80 + rnd(140), rnd(256),
+		rnd(256), 1 + rnd(254));
+    else
+	snprintf(buf, size, "%d.red-%d-%d-%d.dynamicip.example.%s",
+		1 + rnd(254), 80 + rnd(140), rnd(256), rnd(256),
+		rnd(3) ? "es" : "com");
+    return 0;
+}
+
+/*************************************************************************/
+
+/* Base64 numerics, as ircu writes them. */
+
+static const char b64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789[]";
+
+static char *server_name(char *buf, int size, int s)
+{
+    snprintf(buf, size, "s%d.load.test", s);
+    return buf;
+}
+
+/*************************************************************************/
+
+/* Send the network burst. */
+
+static void send_burst(void)
+{
+    Zipf zservers, zchans, zshared;
+    char sname[64], ident[16], host[64];
+    time_t t = time(NULL);
+    int i, j, n;
+
+    zipf_init(&zservers, nservers, zipf_s);
+    zipf_init(&zchans, nchans, zipf_s);
+    zipf_init(&zshared, nusers/200 + 1, zipf_s);
+
+    for (i = 0; i < nservers; i++) {
+	sendline(":%s SERVER %s 2 %ld %ld P10 %c%c]]] 0 :Load test server %d",
+		hubname, server_name(sname, sizeof(sname), i),
+		(long)t, (long)t, b64[(i+1)/64], b64[(i+1)%64], i);
+    }
+
+    for (i = 0; i < nusers; i++) {
+	LoadUser *u = &users[i];
+	make_nick(u->nick, sizeof(u->nick), i);
+	nick_add(i);
+	u->server = zipf(&zservers);
+	for (j = 0, n = 3 + rnd(6); j < n; j++)
+	    ident[j] = 'a' + rnd(26);
+	ident[j] = 0;
+	u->shared = make_host(host, sizeof(host), &zshared);
+	sendline(":%s NICK %s 1 %ld %s %s %s :Load user %d",
+		server_name(sname, sizeof(sname), u->server), u->nick,
+		(long)t, ident, host, sname, i);
+    }
+
+    /* Channel memberships: how many channels each user is on is spread
+     * around the average, and which channels follows the power law. */
+    for (i = 0; i < nusers; i++) {
+	n = chans_per_user > 0 ? rnd(2*chans_per_user) + 1 : 0;
+	users[i].chan = -1;
+	for (j = 0; j < n; j++) {
+	    int c = zipf(&zchans);
+	    if (users[i].chan < 0)
+		users[i].chan = c;
+	    chan_used[c] = 1;
+	    sendline(":%s JOIN #load%d", users[i].nick, c);
+	}
+    }
+
+    /* Services answers this once it has got through everything above. */
+    sendline("PING :burstend");
+}
+
+/*************************************************************************/
+
+/* Register the nicks and channels the flood will use, so that IDENTIFY
+ * checks a real password and OP goes through the channel's access list.
+ * Which ones is fixed by the options alone, so a later run with the same
+ * options and -setup identify finds them in the saved databases.  Users
+ * on shared hosts are left out, since the per-host flood limit would drop
+ * their commands.  Registering channels takes the Services root (-root),
+ * who founds them all and puts up to -access members of each on its
+ * access list. */
+
+static void send_setup(void)
+{
+    const char *cmd = setup == SETUP_REGISTER ? "REGISTER" : "IDENTIFY";
+    char sname[64];
+    int i, c;
+
+    if (setup == SETUP_NONE) {
+	sendline("PING :setupend");
+	return;
+    }
+    for (i = 0; i < nusers; i++) {
+	users[i].reg = (i % 100 < reg_nicks && !users[i].shared);
+	nregnicks += users[i].reg;
+    }
+    for (c = 0; c < nchans; c++) {
+	chan_reg[c] = (c % 100 < reg_chans && chan_used[c]
+			&& (rootnick || setup == SETUP_IDENTIFY));
+	nregchans += chan_reg[c];
+    }
+    for (i = 0; i < nusers; i++) {
+	LoadUser *u = &users[i];
+	if (u->reg && u->chan >= 0 && chan_reg[u->chan]
+			&& chan_access[u->chan] < access_per_chan) {
+	    u->access = 1;
+	    chan_access[u->chan]++;
+	    naccess++;
+	}
+    }
+    for (i = 0; i < nusers; i++) {
+	if (users[i].reg)
+	    sendline(":%s PRIVMSG %s :%s %s", users[i].nick, nickserv, cmd,
+			password);
+    }
+    if (rootnick) {
+	sendline(":%s NICK %s 1 %ld root load.test %s :Load test root",
+		server_name(sname, sizeof(sname), 0), rootnick,
+		(long)time(NULL), sname);
+	sendline(":%s MODE %s :+o", rootnick, rootnick);
+	sendline(":%s PRIVMSG %s :%s %s", rootnick, nickserv, cmd, password);
+    }
+    if (setup == SETUP_REGISTER && rootnick) {
+	for (c = 0; c < nchans; c++) {
+	    if (!chan_reg[c])
+		continue;
+	    sendline(":%s JOIN #load%d", rootnick, c);
+	    sendline(":%s MODE #load%d +o %s", hubname, c, rootnick);
+	    sendline(":%s PRIVMSG %s :REGISTER #load%d %s Load test channel",
+			rootnick, chanserv, c, password);
+	}
+	for (i = 0; i < nusers; i++) {
+	    if (users[i].access)
+		sendline(":%s PRIVMSG %s :ACCESS #load%d ADD %s 300", rootnick,
+			chanserv, users[i].chan, users[i].nick);
+	}
+    }
+    sendline("PING :setupend");
+}
+
+/* Work out which users each command is sent from. */
+
+static void make_pools(void)
+{
+    int cmd, i, ok;
+
+    for (cmd = 0; cmd < NCMDS; cmd++) {
+	pool[cmd] = xmalloc(sizeof(int) * nusers);
+	for (i = 0; i < nusers; i++) {
+	    LoadUser *u = &users[i];
+	    if (cmd == CMD_IDENTIFY)
+		ok = !nregnicks || u->reg;
+	    else
+		ok = u->chan >= 0 && (!nregchans || (u->reg && chan_reg[u->chan]));
+	    if (ok)
+		pool[cmd][npool[cmd]++] = i;
+	}
+    }
+}
+
+/*************************************************************************/
+
+/* Send a command from a random user who isn't waiting for a reply. */
+
+static void send_command(int cmd, double t)
+{
+    LoadUser *u;
+    int tries;
+
+    if (!npool[cmd])
+	return;
+    for (tries = 0; tries < 10; tries++) {
+	u = &users[pool[cmd][rnd(npool[cmd])]];
+	if (u->sent && t - u->sent >= REPLY_TIMEOUT) {
+	    stats[u->cmd].lost++;
+	    u->sent = 0;
+	}
+	if (!u->dead && !u->sent)
+	    break;
+    }
+    if (tries == 10)
+	return;
+    if (cmd == CMD_IDENTIFY)
+	sendline(":%s PRIVMSG %s :IDENTIFY %s", u->nick, nickserv, password);
+    else
+	sendline(":%s PRIVMSG %s :OP #load%d %s", u->nick, chanserv, u->chan,
+		u->nick);
+    u->sent = t;
+    u->cmd = cmd;
+    stats[cmd].sent++;
+}
+
+static void record_reply(LoadUser *u, double t)
+{
+    CmdStats *cs = &stats[u->cmd];
+    double us = (t - u->sent) * 1e6;
+    unsigned long v = us > 0 ? (unsigned long)us : 0;
+    int e, b;
+
+    cs->replied++;
+    cs->total += us;
+    if (us > cs->max)
+	cs->max = us;
+    if (v < HIST_SUB) {
+	b = v;
+    } else {
+	for (e = 4; v >> (e+1); e++)
+	    ;
+	b = (e-3)*HIST_SUB + (int)((v >> (e-4)) & (HIST_SUB-1));
+	if (b >= HIST_SIZE)
+	    b = HIST_SIZE-1;
+    }
+    cs->hist[b]++;
+    u->sent = 0;
+}
+
+/* Return the given percentile (in thousandths) in microseconds. */
+
+static double percentile(CmdStats *cs, int permille)
+{
+    long want = (cs->replied * permille + 999) / 1000, seen = 0;
+    int i, e;
+
+    for (i = 0; i < HIST_SIZE; i++) {
+	seen += cs->hist[i];
+	if (seen >= want && seen > 0) {
+	    if (i+1 < HIST_SUB)
+		return i;
+	    /* Upper bound of the bucket */
+	    e = (i+1)/HIST_SUB + 3;
+	    return (double)((HIST_SUB + (i+1)%HIST_SUB) << (e-4)) - 1;
+	}
+    }
+    return cs->max;
+}
+
+/*************************************************************************/
+
+/* Handle a line from Services.  Return 1 if it was the PONG run() is
+ * waiting for.  A successful OP is answered only with the channel MODE. */
+
+static int handle_line(char *line, double t)
+{
+    char *source = NULL, *cmd, *target, *s;
+    int i;
+
+    if (*line == ':') {
+	source = line+1;
+	if (!(s = strchr(line, ' ')))
+	    return 0;
+	*s++ = 0;
+	line = s;
+    }
+    cmd = line;
+    if ((s = strchr(line, ' ')))
+	*s++ = 0;
+    else
+	s = line + strlen(line);
+
+    if (strcmp(cmd, "PING") == 0) {
+	sendline(":%s PONG %s %s", hubname, hubname, *s == ':' ? s+1 : s);
+    } else if (strcmp(cmd, "PONG") == 0) {
+	return pong_wanted && strstr(s, pong_wanted) != NULL;
+    } else if (strcmp(cmd, "NOTICE") == 0 || strcmp(cmd, "PRIVMSG") == 0) {
+	target = s;
+	if ((s = strchr(target, ' ')))
+	    *s = 0;
+	if (!source || (strcasecmp(source, nickserv) != 0
+				&& strcasecmp(source, chanserv) != 0))
+	    return 0;
+	if ((i = nick_find(target)) >= 0 && users[i].sent)
+	    record_reply(&users[i], t);
+    } else if (strcmp(cmd, "MODE") == 0) {
+	/* "#channel +o nick": the nick is the last word */
+	if (!source || strcasecmp(source, chanserv) != 0)
+	    return 0;
+	if ((target = strrchr(s, ' ')) != NULL
+			&& (i = nick_find(target+1)) >= 0
+			&& users[i].sent && users[i].cmd == CMD_OP)
+	    record_reply(&users[i], t);
+    } else if (strcmp(cmd, "KILL") == 0 || strcmp(cmd, "SVSNICK") == 0) {
+	target = s;
+	if ((s = strchr(target, ' ')))
+	    *s = 0;
+	if ((i = nick_find(target)) >= 0) {
+	    if (users[i].sent)
+		stats[users[i].cmd].lost++;
+	    users[i].dead = 1;
+	    users[i].sent = 0;
+	}
+    }
+    return 0;
+}
+
+/* Read whatever Services has sent and handle each complete line.  Return
+ * 1 if the PONG being waited for was among them. */
+
+static int read_input(double t)
+{
+    static char buf[65536];
+    static int len = 0;
+    char *line, *eol;
+    int n, done = 0, one = 1;
+
+    n = read(sock, buf+len, sizeof(buf)-1-len);
+    if (n == 0) {
+	fprintf(stderr, "loadgen: Services closed the connection\n");
+	return -1;
+    } else if (n < 0) {
+	if (errno == EAGAIN || errno == EINTR)
+	    return 0;
+	perror("loadgen: read");
+	return -1;
+    }
+#ifdef TCP_QUICKACK
+    /* Services' socket uses Nagle, so its second reply in a row waits for
+     * our ACK of the first; don't let delayed ACKs show up as latency.
+     * Linux turns quick ACKs back off by itself, hence every read. */
+    setsockopt(sock, IPPROTO_TCP, TCP_QUICKACK, (void *)&one, sizeof(one));
+#endif
+    len += n;
+    buf[len] = 0;
+    line = buf;
+    while ((eol = strchr(line, '\n'))) {
+	*eol = 0;
+	if (eol > line && eol[-1] == '\r')
+	    eol[-1] = 0;
+	done |= handle_line(line, t);
+	line = eol+1;
+    }
+    len -= line - buf;
+    memmove(buf, line, len);
+    if (len == sizeof(buf)-1)
+	len = 0;	/* Line too long, drop it */
+    return done;
+}
+
+/*************************************************************************/
+
+/* Run the select loop until `until' (if not 0) or until the PONG in
+ * pong_wanted arrives.  Commands are sent at the configured rates while
+ * flooding. */
+
+static int run(double until, int flooding)
+{
+    fd_set rfds, wfds;
+    struct timeval tv;
+    double t, last = now(), owed[NCMDS] = { 0, 0 };
+    int rates[NCMDS], i, r;
+
+    rates[CMD_IDENTIFY] = identify_rate;
+    rates[CMD_OP] = op_rate;
+    for (;;) {
+	t = now();
+	if (until && t >= until)
+	    return 0;
+	if (flooding) {
+	    for (i = 0; i < NCMDS; i++) {
+		owed[i] += rates[i] * (t - last);
+		while (owed[i] >= 1) {
+		    send_command(i, t);
+		    owed[i]--;
+		}
+	    }
+	    last = t;
+	}
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+	FD_SET(sock, &rfds);
+	if (outpos < outlen)
+	    FD_SET(sock, &wfds);
+	tv.tv_sec = 0;
+	tv.tv_usec = 10000;
+	if (select(sock+1, &rfds, &wfds, NULL, &tv) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    perror("loadgen: select");
+	    return -1;
+	}
+	if (FD_ISSET(sock, &wfds))
+	    flush_output();
+	if (FD_ISSET(sock, &rfds)) {
+	    r = read_input(now());
+	    if (r < 0)
+		return -1;
+	    if (r && !until)
+		return 0;
+	}
+    }
+}
+
+/*************************************************************************/
+
+static void usage(void)
+{
+    fprintf(stderr, "\
+\n\
+Usage: loadgen [options]\n\
+   -port n        port to listen on (default %d)\n\
+   -hub name      our server name (default %s)\n\
+   -servers n     number of servers behind us (default %d)\n\
+   -users n       number of users in the burst (default %d)\n\
+   -chans n       number of channels (default %d)\n\
+   -perchan n     average channels per user (default %d)\n\
+   -zipf s        power law exponent for users per server and per\n\
+                  channel (default %.1f)\n\
+   -identify n    NickServ IDENTIFYs per second (default %d)\n\
+   -op n          ChanServ OPs per second (default %d)\n\
+   -time n        seconds to flood for (default %d)\n\
+   -nickserv nick, -chanserv nick\n\
+                  names of the services (default %s, %s)\n\
+   -pass password password to register and IDENTIFY with (default %s)\n\
+   -setup how     register: REGISTER the nicks and channels below first\n\
+                  identify: they are already in the databases (from an\n\
+                            earlier run with the same options); IDENTIFY\n\
+                  none: flood unregistered nicks and channels\n\
+                  (default %s)\n\
+   -regnicks n    percentage of users with a registered nick (default %d)\n\
+   -regchans n    percentage of channels registered (default %d)\n\
+   -access n      access list entries per registered channel (default %d)\n\
+   -root nick     Services root, who registers the channels; without it\n\
+                  -setup register registers nicks only\n\
+\n\
+Waits for Services to connect, bursts the network, registers nicks and\n\
+channels, waits for Services to catch up, then floods commands and reports\n\
+the reply latency.  IDENTIFYs come from users with a registered nick and\n\
+OPs from registered users on a registered channel (some of them on its\n\
+access list), so they go through the password and access list checks.\n\
+Users on hosts shared by many users are never registered, as the per-host\n\
+flood limit would drop their commands.  Nick registration needs Services\n\
+built without REG_NICK_MAIL, which mails out a random password.\n\
+\n", port, hubname, nservers, nusers, nchans, chans_per_user, zipf_s,
+	identify_rate, op_rate, duration, nickserv, chanserv, password,
+	setup_names[setup], reg_nicks, reg_chans, access_per_chan);
+    exit(1);
+}
+
+static void parse_options(int ac, char **av)
+{
+    int i;
+    char *opt, *val;
+
+    for (i = 1; i < ac; i++) {
+	opt = av[i];
+	if (*opt != '-' || i+1 >= ac)
+	    usage();
+	val = av[++i];
+	if (strcmp(opt, "-port") == 0)
+	    port = atoi(val);
+	else if (strcmp(opt, "-hub") == 0)
+	    hubname = val;
+	else if (strcmp(opt, "-servers") == 0)
+	    nservers = atoi(val);
+	else if (strcmp(opt, "-users") == 0)
+	    nusers = atoi(val);
+	else if (strcmp(opt, "-chans") == 0)
+	    nchans = atoi(val);
+	else if (strcmp(opt, "-perchan") == 0)
+	    chans_per_user = atoi(val);
+	else if (strcmp(opt, "-zipf") == 0)
+	    zipf_s = atof(val);
+	else if (strcmp(opt, "-identify") == 0)
+	    identify_rate = atoi(val);
+	else if (strcmp(opt, "-op") == 0)
+	    op_rate = atoi(val);
+	else if (strcmp(opt, "-time") == 0)
+	    duration = atoi(val);
+	else if (strcmp(opt, "-nickserv") == 0)
+	    nickserv = val;
+	else if (strcmp(opt, "-chanserv") == 0)
+	    chanserv = val;
+	else if (strcmp(opt, "-pass") == 0)
+	    password = val;
+	else if (strcmp(opt, "-regnicks") == 0)
+	    reg_nicks = atoi(val);
+	else if (strcmp(opt, "-regchans") == 0)
+	    reg_chans = atoi(val);
+	else if (strcmp(opt, "-access") == 0)
+	    access_per_chan = atoi(val);
+	else if (strcmp(opt, "-root") == 0)
+	    rootnick = val;
+	else if (strcmp(opt, "-setup") == 0) {
+	    for (setup = 0; setup <= SETUP_NONE; setup++) {
+		if (strcmp(val, setup_names[setup]) == 0)
+		    break;
+	    }
+	    if (setup > SETUP_NONE)
+		usage();
+	} else
+	    usage();
+    }
+    if (nservers < 1 || nservers > 4000 || nusers < 1 || nchans < 1)
+	usage();
+}
+
+/*************************************************************************/
+
+/* Accept a connection from Services and wait for its SERVER line. */
+
+static void wait_for_services(void)
+{
+    struct sockaddr_in sa;
+    char buf[4096], *s;
+    int lsock, len = 0, n, one = 1;
+
+    lsock = socket(AF_INET, SOCK_STREAM, 0);
+    if (lsock < 0) {
+	perror("loadgen: socket");
+	exit(1);
+    }
+    setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, (void *)&one, sizeof(one));
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(lsock, (struct sockaddr *)&sa, sizeof(sa)) < 0
+			|| listen(lsock, 1) < 0) {
+	perror("loadgen: bind");
+	exit(1);
+    }
+    printf("Waiting for Services on port %d...\n", port);
+    fflush(stdout);
+    sock = accept(lsock, NULL, NULL);
+    if (sock < 0) {
+	perror("loadgen: accept");
+	exit(1);
+    }
+    close(lsock);
+
+    for (;;) {
+	n = read(sock, buf+len, sizeof(buf)-1-len);
+	if (n <= 0) {
+	    fprintf(stderr, "loadgen: Services disconnected during handshake\n");
+	    exit(1);
+	}
+	len += n;
+	buf[len] = 0;
+	if ((s = strstr(buf, "SERVER ")) && strchr(s, '\n'))
+	    break;
+	if (len == sizeof(buf)-1)
+	    len = 0;
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    /* Each command should go out as soon as it's sent, or we'd be
+     * measuring Nagle's algorithm. */
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void *)&one, sizeof(one));
+}
+
+/*************************************************************************/
+
+int main(int ac, char **av)
+{
+    double t0, t1, t2, t3;
+    long burst_lines;
+    int i;
+
+    parse_options(ac, av);
+    srandom(1);
+    users = xmalloc(sizeof(LoadUser) * nusers);
+    for (nickhash_size = 1024; nickhash_size < nusers*2; nickhash_size *= 2)
+	;
+    nickhash = xmalloc(sizeof(int) * nickhash_size);
+    chan_used = xmalloc(nchans);
+    chan_reg = xmalloc(nchans);
+    chan_access = xmalloc(sizeof(int) * nchans);
+
+    wait_for_services();
+
+    /* Our own SERVER line, then the burst. */
+    t0 = now();
+    sendline("SERVER %s 1 %ld %ld P10 AA]]] 0 :Load test hub", hubname,
+		(long)time(NULL), (long)time(NULL));
+    send_burst();
+    burst_lines = lines_sent;
+    t1 = now();
+    printf("Burst: %d servers, %d users, %ld lines generated in %.3f s\n",
+		nservers, nusers, burst_lines, t1-t0);
+    fflush(stdout);
+    pong_wanted = "burstend";
+    if (run(0, 0) < 0)
+	return 1;
+    t2 = now();
+    printf("Burst processed in %.3f s (%.0f lines/s)\n", t2-t0,
+		burst_lines / (t2-t0));
+    fflush(stdout);
+
+    send_setup();
+    pong_wanted = "setupend";
+    if (run(0, 0) < 0)
+	return 1;
+    t3 = now();
+    if (setup != SETUP_NONE) {
+	printf("Setup (%s): %d nicks, %d channels, %d access entries"
+		" in %.3f s\n", setup_names[setup], nregnicks, nregchans,
+		naccess, t3-t2);
+    }
+    make_pools();
+
+    printf("Flooding for %d s: %d IDENTIFY/s, %d OP/s\n", duration,
+		identify_rate, op_rate);
+    fflush(stdout);
+    pong_wanted = NULL;
+    if (run(t3 + duration, 1) < 0)
+	return 1;
+    /* Give stragglers a chance to be answered. */
+    run(now() + 2, 0);
+
+    /* Anything still unanswered is lost. */
+    for (i = 0; i < nusers; i++) {
+	if (users[i].sent)
+	    stats[users[i].cmd].lost++;
+    }
+    printf("\n%-9s %8s %8s %6s %10s %10s %10s %10s %10s\n", "Command",
+		"Sent", "Replied", "Lost", "Avg", "P50", "P90", "P99", "Max");
+    for (i = 0; i < NCMDS; i++) {
+	CmdStats *cs = &stats[i];
+	printf("%-9s %8ld %8ld %6ld %8.0fus %8.0fus %8.0fus %8.0fus %8.0fus\n",
+		cmd_names[i], cs->sent, cs->replied, cs->lost,
+		cs->replied ? cs->total / cs->replied : 0.0,
+		percentile(cs, 500), percentile(cs, 900), percentile(cs, 990),
+		cs->max);
+    }
+    return 0;
+}
+
+/*************************************************************************/
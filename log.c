@@ -10,8 +10,207 @@
 
 #include "services.h"
 #include "pseudo.h"
+#include <fcntl.h>
+#include <signal.h>
+#if HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
+static int logfd = -1;
+
+/* Per-subsystem debug levels; -1 means follow the global `debug' level. */
+int log_levels[LOG_NSUBSYS] = { -1, -1, -1, -1 };
+static const char *log_names[LOG_NSUBSYS] = { "general", "in", "out", "users" };
+
+static long lines_logged;		/* Lines written or queued */
+static long lines_dropped[LOG_NSUBSYS];	/* Lines lost because the queue
+					 * was full */
+static long drops_pending;		/* Lost since the last notice */
+
+/* Maximum length of a single log line, including timestamp. */
+#define LOG_LINEMAX	4096
+
+/* Flags for log_line(). */
+#define LOG_SYNC	0x01	/* Bypass the queue (fatal errors) */
+#define LOG_STDERR	0x02	/* Copy to stderr even if we forked */
+
+/* With threads, the main loop never touches the disk: lines are copied
+ * into a ring buffer and a writer thread empties it.  Only the main thread
+ * moves ring_head and only the writer moves ring_tail, so no locks are
+ * needed, just barriers to make sure the data is seen before the index.
+ * If a line doesn't fit we drop it and count it rather than wait; the
+ * count is logged as soon as there is room again. */
+#define LOG_RINGSIZE	(256*1024)	/* Must be a power of 2 */
+#define LOG_IDLE_USEC	20000		/* Writer's nap when there's nothing
+					 * to write */
+
+#if HAVE_PTHREAD
+static char ring[LOG_RINGSIZE];
+static volatile uint32 ring_head, ring_tail;
+static volatile int writer_stop;
+static int writer_running;
+static pthread_t writer;
+#endif
+
+/* Set while log_line() is running; a signal handler logging in the middle
+ * of it writes synchronously instead of touching the queue. */
+static volatile int in_log;
+
+/*************************************************************************/
+
+/* Write a buffer to the log file and, if we didn't fork, to stderr. */
+
+static void write_all(int fd, const char *buf, int len)
+{
+    int n;
+
+    while (len > 0) {
+	n = write(fd, buf, len);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return;
+	}
+	buf += n;
+	len -= n;
+    }
+}
 
-static FILE *logfile;
+static void output(const char *buf, int len, int flags)
+{
+    if (logfd >= 0)
+	write_all(logfd, buf, len);
+    if (nofork || (flags & LOG_STDERR))
+	write_all(2, buf, len);
+}
+
+/*************************************************************************/
+
+#if HAVE_PTHREAD
+
+/* The writer thread: write out whatever is in the ring, then nap. */
+
+static void *log_writer(void *arg)
+{
+    uint32 head, tail, pos, len;
+
+    for (;;) {
+	head = ring_head;
+	tail = ring_tail;
+	__sync_synchronize();
+	if (head == tail) {
+	    if (writer_stop)
+		break;
+	    usleep(LOG_IDLE_USEC);
+	    continue;
+	}
+	pos = tail & (LOG_RINGSIZE-1);
+	len = head - tail;
+	if (pos + len > LOG_RINGSIZE) {
+	    output(ring+pos, LOG_RINGSIZE-pos, 0);
+	    output(ring, len - (LOG_RINGSIZE-pos), 0);
+	} else {
+	    output(ring+pos, len, 0);
+	}
+	__sync_synchronize();
+	ring_tail = head;
+    }
+    return NULL;
+}
+
+
+/* Copy a line into the ring.  Return 0 if there isn't room for it. */
+
+static int ring_put(const char *buf, uint32 len)
+{
+    uint32 head = ring_head, pos;
+
+    if (len > LOG_RINGSIZE - (head - ring_tail))
+	return 0;
+    __sync_synchronize();
+    pos = head & (LOG_RINGSIZE-1);
+    if (pos + len > LOG_RINGSIZE) {
+	memcpy(ring+pos, buf, LOG_RINGSIZE-pos);
+	memcpy(ring, buf + (LOG_RINGSIZE-pos), len - (LOG_RINGSIZE-pos));
+    } else {
+	memcpy(ring+pos, buf, len);
+    }
+    __sync_synchronize();
+    ring_head = head + len;
+    return 1;
+}
+
+
+/* Stop the writer thread once it has written everything queued. */
+
+static void stop_log_writer(void)
+{
+    if (!writer_running)
+	return;
+    writer_stop = 1;
+    pthread_join(writer, NULL);
+    writer_running = 0;
+}
+
+
+/* A forked child (e.g. for sending mail) has no writer thread; it logs
+ * synchronously and must not wait for the thread when it exits. */
+
+static void forget_log_writer(void)
+{
+    writer_running = 0;
+}
+
+#endif	/* HAVE_PTHREAD */
+
+/*************************************************************************/
+
+/* Start the log writer thread, if we have threads; until this is called
+ * (and if it fails) lines are written as they are logged.  Must be called
+ * after forking. */
+
+void start_log_writer(void)
+{
+#if HAVE_PTHREAD
+    static int registered = 0;
+    sigset_t all, old;
+    int err;
+
+    if (writer_running)
+	return;
+    writer_stop = 0;
+    /* Signals must go to the main thread: block them all while creating
+     * the writer, which inherits the mask. */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    err = pthread_create(&writer, NULL, log_writer, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err) {
+	errno = err;
+	log_perror("Unable to start log writer thread, logging synchronously");
+	return;
+    }
+    writer_running = 1;
+    if (!registered) {
+	atexit(stop_log_writer);
+	pthread_atfork(NULL, NULL, forget_log_writer);
+	registered = 1;
+    }
+#endif
+}
+
+
+/* Wait until everything queued has been written. */
+
+static void drain_log(void)
+{
+#if HAVE_PTHREAD
+    if (!writer_running)
+	return;
+    while (ring_tail != ring_head)
+	usleep(1000);
+#endif
+}
 
 /*************************************************************************/
 
@@ -20,26 +219,24 @@ static FILE *logfile;
 
 int open_log(void)
 {
-    if (logfile)
+    if (logfd >= 0)
 	return 0;
-    logfile = fopen(log_filename, "a");
-    if (logfile)
-	setbuf(logfile, NULL);
-    return logfile!=NULL ? 0 : -1;
+    logfd = open(log_filename, O_WRONLY | O_APPEND | O_CREAT, 0666);
+    return logfd >= 0 ? 0 : -1;
 }
 
-/* Close the log file. */
+/* Close the log file, after writing out anything still queued. */
 
 void close_log(void)
 {
-    if (!logfile)
+    if (logfd < 0)
 	return;
-    fclose(logfile);
-    logfile = NULL;
+    drain_log();
+    close(logfd);
+    logfd = -1;
 }
 
 /*************************************************************************/
-
 /* Rename the log file. Errors are wallop'ed if *u is NULL. Returns 1 if the
  * log file is successfully renamed otherwise 0 is returned. newname should 
  * not be user-supplied - rather use the date or something. Pass NULL for *u 
@@ -147,6 +344,96 @@ void rotate_log(User *u)
 
 /*************************************************************************/
 
+/* Put the "[Mon dd hh:mm:ss yyyy] " prefix into buf and return its length.
+ * The date is only reformatted when the second changes; in debug mode the
+ * microseconds are spliced in after the seconds. */
+
+static int timestamp(char *buf, int size)
+{
+    static time_t last = -1;
+    static char pre[32], post[16];
+    time_t t;
+#if HAVE_GETTIMEOFDAY
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    t = tv.tv_sec;
+#else
+    time(&t);
+#endif
+    if (t != last) {
+	struct tm tm = *localtime(&t);
+	strftime(pre, sizeof(pre)-1, "[%b %d %H:%M:%S", &tm);
+	strftime(post, sizeof(post)-1, " %Y] ", &tm);
+	last = t;
+    }
+#if HAVE_GETTIMEOFDAY
+    if (debug)
+	snprintf(buf, size, "%s.%06d%s", pre, (int)tv.tv_usec, post);
+    else
+#endif
+	snprintf(buf, size, "%s%s", pre, post);
+    return strlen(buf);
+}
+
+/*************************************************************************/
+
+/* Format a line and send it on its way: into the queue if the writer
+ * thread is running, straight to the file otherwise. */
+
+static void vlog_line(int sub, int flags, const char *fmt, va_list args)
+{
+    char buf[LOG_LINEMAX];
+    int len;
+
+    if (logfd < 0 && !nofork && !(flags & LOG_STDERR))
+	return;
+    in_log++;
+    len = timestamp(buf, sizeof(buf));
+    vsnprintf(buf+len, sizeof(buf)-len-1, fmt, args);
+    len += strlen(buf+len);
+    buf[len++] = '\n';
+    lines_logged++;
+
+#if HAVE_PTHREAD
+    if (writer_running && in_log == 1 && !(flags & LOG_SYNC)) {
+	if (drops_pending) {
+	    char note[64];
+	    int n = timestamp(note, sizeof(note));
+	    snprintf(note+n, sizeof(note)-n, "log: %ld lines dropped\n",
+			drops_pending);
+	    if (ring_put(note, strlen(note)))
+		drops_pending = 0;
+	}
+	if (!drops_pending && ring_put(buf, len)) {
+	    in_log--;
+	    return;
+	}
+	lines_logged--;
+	lines_dropped[sub]++;
+	drops_pending++;
+	in_log--;
+	return;
+    }
+#endif
+
+    if (flags & LOG_SYNC)
+	drain_log();
+    output(buf, len, flags);
+    in_log--;
+}
+
+static void log_line(int sub, int flags, const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    vlog_line(sub, flags, fmt, args);
+    va_end(args);
+}
+
+/*************************************************************************/
+
 /* Log stuff to the log file with a datestamp.  Note that errno is
  * preserved by this routine and log_perror().
  */
@@ -154,39 +441,29 @@ void rotate_log(User *u)
 void log(const char *fmt, ...)
 {
     va_list args;
-    time_t t;
-    struct tm tm;
-    char buf[256];
     int errno_save = errno;
 
     va_start(args, fmt);
-    time(&t);
-    tm = *localtime(&t);
-#if HAVE_GETTIMEOFDAY
-    if (debug) {
-	char *s;
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	strftime(buf, sizeof(buf)-1, "[%b %d %H:%M:%S", &tm);
-	s = buf + strlen(buf);
-	s += snprintf(s, sizeof(buf)-(s-buf), ".%06d", tv.tv_usec);
-	strftime(s, sizeof(buf)-(s-buf)-1, " %Y] ", &tm);
-    } else {
-#endif
-	strftime(buf, sizeof(buf)-1, "[%b %d %H:%M:%S %Y] ", &tm);
-#if HAVE_GETTIMEOFDAY
-    }
-#endif
-    if (logfile) {
-	fputs(buf, logfile);
-	vfprintf(logfile, fmt, args);
-	fputc('\n', logfile);
-    }
-    if (nofork) {
-	fputs(buf, stderr);
-	vfprintf(stderr, fmt, args);
-	fputc('\n', stderr);
-    }
+    vlog_line(LOG_GENERAL, 0, fmt, args);
+    va_end(args);
+    errno = errno_save;
+}
+
+
+/* Like log(), but only if the debug level of the given subsystem (see
+ * LOG_LEVEL()) is at least `level'.
+ */
+
+void log_debug(int sub, int level, const char *fmt, ...)
+{
+    va_list args;
+    int errno_save = errno;
+
+    if (LOG_LEVEL(sub) < level)
+	return;
+    va_start(args, fmt);
+    vlog_line(sub, 0, fmt, args);
+    va_end(args);
     errno = errno_save;
 }
 
@@ -198,40 +475,52 @@ void log(const char *fmt, ...)
 void log_perror(const char *fmt, ...)
 {
     va_list args;
-    time_t t;
-    struct tm tm;
-    char buf[256];
+    char buf[LOG_LINEMAX];
     int errno_save = errno;
 
     va_start(args, fmt);
-    time(&t);
-    tm = *localtime(&t);
-#if HAVE_GETTIMEOFDAY
-    if (debug) {
-	char *s;
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	strftime(buf, sizeof(buf)-1, "[%b %d %H:%M:%S", &tm);
-	s = buf + strlen(buf);
-	s += snprintf(s, sizeof(buf)-(s-buf), ".%06d", tv.tv_usec);
-	strftime(s, sizeof(buf)-(s-buf)-1, " %Y] ", &tm);
-    } else {
-#endif
-	strftime(buf, sizeof(buf)-1, "[%b %d %H:%M:%S %Y] ", &tm);
-#if HAVE_GETTIMEOFDAY
-    }
-#endif
-    if (logfile) {
-	fputs(buf, logfile);
-	vfprintf(logfile, fmt, args);
-	fprintf(logfile, ": %s\n", strerror(errno_save));
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    log_line(LOG_GENERAL, 0, "%s: %s", buf, strerror(errno_save));
+    errno = errno_save;
+}
+
+/*************************************************************************/
+
+/* Set the debug level of the subsystem with the given name (-1 to follow
+ * the global level).  Return 0 if there is no such subsystem. */
+
+int set_log_level(const char *name, int level)
+{
+    int i;
+
+    for (i = 0; i < LOG_NSUBSYS; i++) {
+	if (stricmp(name, log_names[i]) == 0) {
+	    log_levels[i] = level;
+	    return 1;
+	}
     }
-    if (nofork) {
-	fputs(buf, stderr);
-	vfprintf(stderr, fmt, args);
-	fprintf(stderr, ": %s\n", strerror(errno_save));
+    return 0;
+}
+
+const char *log_subsys_name(int sub)
+{
+    return sub >= 0 && sub < LOG_NSUBSYS ? log_names[sub] : "?";
+}
+
+/* Return the number of lines logged and dropped, in total and (for
+ * dropped lines) per subsystem. */
+
+void get_log_stats(long *nlines, long *ndropped, long dropped[LOG_NSUBSYS])
+{
+    int i;
+
+    *nlines = lines_logged;
+    *ndropped = 0;
+    for (i = 0; i < LOG_NSUBSYS; i++) {
+	dropped[i] = lines_dropped[i];
+	*ndropped += lines_dropped[i];
     }
-    errno = errno_save;
 }
 
 /*************************************************************************/
@@ -243,33 +532,12 @@ void log_perror(const char *fmt, ...)
 void fatal(const char *fmt, ...)
 {
     va_list args;
-    time_t t;
-    struct tm tm;
-    char buf[256], buf2[4096];
+    char buf2[4096];
 
     va_start(args, fmt);
-    time(&t);
-    tm = *localtime(&t);
-#if HAVE_GETTIMEOFDAY
-    if (debug) {
-	char *s;
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	strftime(buf, sizeof(buf)-1, "[%b %d %H:%M:%S", &tm);
-	s = buf + strlen(buf);
-	s += snprintf(s, sizeof(buf)-(s-buf), ".%06d", tv.tv_usec);
-	strftime(s, sizeof(buf)-(s-buf)-1, " %Y] ", &tm);
-    } else {
-#endif
-	strftime(buf, sizeof(buf)-1, "[%b %d %H:%M:%S %Y] ", &tm);
-#if HAVE_GETTIMEOFDAY
-    }
-#endif
     vsnprintf(buf2, sizeof(buf2), fmt, args);
-    if (logfile)
-	fprintf(logfile, "%sFATAL: %s\n", buf, buf2);
-    if (nofork)
-	fprintf(stderr, "%sFATAL: %s\n", buf, buf2);
+    va_end(args);
+    log_line(LOG_GENERAL, LOG_SYNC, "FATAL: %s", buf2);
     if (servsock >= 0)
 	canalopers(NULL, "FATAL ERROR!  %s", buf2);
     exit(1);
@@ -281,37 +549,16 @@ void fatal(const char *fmt, ...)
 void fatal_perror(const char *fmt, ...)
 {
     va_list args;
-    time_t t;
-    struct tm tm;
-    char buf[256], buf2[4096];
+    char buf2[4096];
     int errno_save = errno;
 
     va_start(args, fmt);
-    time(&t);
-    tm = *localtime(&t);
-#if HAVE_GETTIMEOFDAY
-    if (debug) {
-	char *s;
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	strftime(buf, sizeof(buf)-1, "[%b %d %H:%M:%S", &tm);
-	s = buf + strlen(buf);
-	s += snprintf(s, sizeof(buf)-(s-buf), ".%06d", tv.tv_usec);
-	strftime(s, sizeof(buf)-(s-buf)-1, " %Y] ", &tm);
-    } else {
-#endif
-	strftime(buf, sizeof(buf)-1, "[%b %d %H:%M:%S %Y] ", &tm);
-#if HAVE_GETTIMEOFDAY
-    }
-#endif
     vsnprintf(buf2, sizeof(buf2), fmt, args);
-    if (logfile)
-	fprintf(logfile, "%sFATAL: %s: %s\n", buf, buf2, strerror(errno_save));
-    if (stderr)
-	fprintf(stderr, "%sFATAL: %s: %s\n", buf, buf2, strerror(errno_save));
+    va_end(args);
+    log_line(LOG_GENERAL, LOG_SYNC | LOG_STDERR, "FATAL: %s: %s", buf2,
+		strerror(errno_save));
     if (servsock >= 0)
-	canalopers(NULL, "FATAL ERROR!  %s: %s", buf2,
-strerror(errno_save));
+	canalopers(NULL, "FATAL ERROR!  %s: %s", buf2, strerror(errno_save));
     exit(1);
 }
 
@@ -32,6 +32,11 @@ int   skeleton     = 0;			/* -skeleton */
 int   nofork       = 0;			/* -nofork */
 int   forceload    = 0;			/* -forceload */
 int   opt_noexpire = 0;               /* -noexpire */
+char *capture_filename = NULL;		/* -capture filename */
+
+/* Where to send output when replaying a capture (run as "replay") */
+char *replay_sink = NULL;
+
 /* Set to 1 if we are to quit */
 int quitting = 0;
 
@@ -53,6 +58,10 @@ int save_data = 0;
 /* At what time were we started? */
 time_t start_time;
 
+/* What time is it?  Read at the top of each trip through the main loop
+ * and again when a line arrives; use this instead of calling time(). */
+time_t cur_time;
+
 int logtochan = 0;
 
 /******** Local variables! ********/
@@ -66,6 +75,9 @@ static int started = 0;
 /* If we get a signal, use this to jump out of the main loop. */
 static jmp_buf panic_jmp;
 
+/* Nonzero if the clock is being driven by hand (see set_virtual_time()). */
+static int virtual_clock = 0;
+
 /*************************************************************************/
 
 /* If we get a weird signal, come here. */
@@ -105,6 +117,8 @@ void sighandler(int signum)
 	    switch (waiting) {
 		case  -1: snprintf(buf, sizeof(buf), "in timed_update");
 		          break;
+		case -10: snprintf(buf, sizeof(buf), "compacting %s", MemoDBName);
+		          break;
 		case -11: snprintf(buf, sizeof(buf), "saving %s", NickDBName);
 		          break;
 		case -12: snprintf(buf, sizeof(buf), "saving %s", ChanDBName);
@@ -123,6 +137,8 @@ void sighandler(int signum)
 		          break;
 		case -25: snprintf(buf, sizeof(buf), "expiring autokills");
 		          break;
+		case  -5: snprintf(buf, sizeof(buf), "running background jobs");
+		          break;
 		default : snprintf(buf, sizeof(buf), "waiting=%d", waiting);
 	    }
 	    canalopers(NULL, "PANIC! %s (%s)", buf, strsignal(signum));
@@ -152,6 +168,27 @@ void sighandler(int signum)
 
 /*************************************************************************/
 
+/* Bring cur_time up to date, unless the clock is virtual. */
+
+void update_time(void)
+{
+    if (!virtual_clock)
+	cur_time = time(NULL);
+}
+
+
+/* Set the clock to `t' and leave it there until the next call, so that
+ * replayed traffic sees the times it was captured at; 0 goes back to the
+ * system clock. */
+
+void set_virtual_time(time_t t)
+{
+    virtual_clock = (t != 0);
+    cur_time = t ? t : time(NULL);
+}
+
+/*************************************************************************/
+
 /* Main routine.  (What does it look like? :-) ) */
 
 int main(int ac, char **av, char **envp)
@@ -160,8 +197,9 @@ int main(int ac, char **av, char **envp)
     volatile time_t last_expire; /* When did we last expire nicks/channels? */
     volatile time_t last_check;  /* When did we last check timeouts? */
     volatile time_t last_settime; /* When did we last SETTIME */
+    volatile int expire_pending = 0; /* Records left over from last expire */
     int i;
-    char *progname;
+    char *progname, *line;
 
 
     /* Find program name. */
@@ -178,6 +216,10 @@ int main(int ac, char **av, char **envp)
     } else if (strcmp(progname, "listchans") == 0) {
 	do_listchans(ac, av);
 	return 0;
+    } else if (strcmp(progname, "replay") == 0) {
+	return do_replay(ac, av);
+    } else if (strcmp(progname, "bench") == 0) {
+	return do_bench(ac, av);
     }
 
 
@@ -190,10 +232,11 @@ int main(int ac, char **av, char **envp)
     process();
 
     /* Set up timers. */
-    last_update = time(NULL);
-    last_expire = time(NULL);
-    last_check  = time(NULL);
-    last_settime = time(NULL);
+    update_time();
+    last_update = cur_time;
+    last_expire = cur_time;
+    last_check  = cur_time;
+    last_settime = cur_time;
 
     /* The signal handler routine will drop back here with quitting != 0
      * if it gets called. */
@@ -205,30 +248,38 @@ int main(int ac, char **av, char **envp)
     /*** Main loop. ***/
 
     while (!quitting) {
-	time_t t = time(NULL);
+	time_t t;
+
+	update_time();
+	t = cur_time;
 
 	if (debug >= 2)
 	    log("debug: Top of main loop");
-	if (!readonly && (save_data || t-last_expire >= ExpireTimeout)) {
+	/* The expire routines only handle a batch of due records per call;
+	 * if any are left, keep calling them each time through the loop
+	 * until they have caught up. */
+	if (!readonly && (save_data || expire_pending
+				|| t-last_expire >= ExpireTimeout)) {
 	    waiting = -3;
-	    if (debug)
+	    if (debug >= 2 || (debug && !expire_pending))
 		log("debug: Running expire routines");
+	    expire_pending = 0;
 	    if (!skeleton) {
 		waiting = -21;
-		expire_nicks();
+		expire_pending |= expire_nicks();
 		waiting = -22;
-		expire_chans();
+		expire_pending |= expire_chans();
 	    }
 	    waiting = -25;
-	    expire_akills();
+	    expire_pending |= expire_akills();
 #ifdef CYBER
-//	    expire_ilines();
+//	    expire_pending |= expire_ilines();
 #endif
 	    last_expire = t;
 	}
       /* Hace un SETTIME a la red cada x tiempo */
         if (t-last_settime >= SettimeTimeout) {
-            send_cmd(NULL, "SETTIME %lu", time(NULL));
+            send_cmd(NULL, "SETTIME %lu", cur_time);
             send_cmd(ServerName, "WALLOPS :Sincronizacion automatica de la RED...");
             last_settime = t;
         }
@@ -238,6 +289,8 @@ int main(int ac, char **av, char **envp)
 	    if (debug)
 		log("debug: Saving databases");
 	    if (!skeleton) {
+		waiting = -10;
+		compact_memo_store();
 		waiting = -11;
 		save_ns_dbase();
 		waiting = -12;
@@ -267,12 +320,19 @@ int main(int ac, char **av, char **envp)
 	    check_timeouts();
 	    last_check = t;
 	}
+	/* Si quedan trabajos pendientes o registros por expirar no nos
+	 * quedamos esperando al servidor; volvemos a dar otra vuelta si no
+	 * hay nada que leer. */
+	waiting = -5;
+	if ((run_jobs() || expire_pending) && !sready(servsock))
+	    continue;
 	waiting = 1;
-	i = (int)(long)sgets2(inbuf, sizeof(inbuf), servsock);
+	line = sgets2(inbuf, sizeof(inbuf), servsock);
 	waiting = 0;
-	if (i > 0) {
+	if (line && line != (char *)-1) {
+	    update_time();	/* We may have been waiting a while */
 	    process();
-	} else if (i == 0) {
+	} else if (!line) {
 	    int errno_save = errno;
 	    quitmsg = malloc(BUFSIZE);
 	    if (quitmsg) {
@@ -9,6 +9,7 @@
  */
 
 #include "services.h"
+#include <stddef.h>
 
 /*************************************************************************/
 /*************************************************************************/
@@ -74,6 +75,137 @@ char *sstrdup(const char *s)
     return t;
 }
 
+/*************************************************************************/
+
+/* sintern, sintern_nocase, sunintern:
+ *	Shared, reference-counted copies of strings which lots of records
+ *	hold identical copies of (usernames, hostnames, realnames, last seen
+ *	masks).  sintern() returns the shared copy of a string, making one
+ *	if there isn't one yet.  sintern_nocase() is the same, except that
+ *	strings which only differ in case (as strCasecmp() sees it) share a
+ *	copy, spelled the way the first one was.  Two strings interned the
+ *	same way are equal if and only if the pointers are.  Interned
+ *	strings must not be modified, and are released with sunintern()
+ *	rather than free().  Both take and return NULL for NULL.
+ */
+
+typedef struct interned_ Interned;
+struct interned_ {
+    Interned *next;
+    uint32 hash;		/* hash_nocase() of the string */
+    int refs;
+    int nocase;
+    char str[1];		/* Really as long as it needs to be */
+};
+
+#define INTERN_MIN	1024	/* Minimum (and initial) table size */
+#define INTERNED(s)	((Interned *)((s) - offsetof(Interned, str)))
+
+static Interned **interntab;
+static int interntab_size, interntab_count;
+static long intern_refs;	/* Total references */
+static long intern_bytes;	/* Bytes in distinct strings (with nulls) */
+static long intern_refbytes;	/* Bytes the references would take unshared */
+
+static void resize_interntab(int newsize)
+{
+    Interned **newtab = scalloc(sizeof(Interned *), newsize);
+    Interned *in, *next;
+    int i;
+
+    for (i = 0; i < interntab_size; i++) {
+	for (in = interntab[i]; in; in = next) {
+	    next = in->next;
+	    in->next = newtab[in->hash & (newsize-1)];
+	    newtab[in->hash & (newsize-1)] = in;
+	}
+    }
+    free(interntab);
+    interntab = newtab;
+    interntab_size = newsize;
+}
+
+static char *do_intern(const char *s, int nocase)
+{
+    Interned *in;
+    uint32 hash;
+    int len;
+
+    if (!s)
+	return NULL;
+    if (!interntab)
+	resize_interntab(INTERN_MIN);
+    hash = hash_nocase(s);
+    len = strlen(s);
+    for (in = interntab[hash & (interntab_size-1)]; in; in = in->next) {
+	if (in->hash == hash && in->nocase == nocase
+		&& (nocase ? strCasecmp(in->str, s) : strcmp(in->str, s)) == 0)
+	    break;
+    }
+    if (!in) {
+	if (interntab_count >= interntab_size)
+	    resize_interntab(interntab_size*2);
+	in = smalloc(offsetof(Interned, str) + len+1);
+	in->hash = hash;
+	in->refs = 0;
+	in->nocase = nocase;
+	memcpy(in->str, s, len+1);
+	in->next = interntab[hash & (interntab_size-1)];
+	interntab[hash & (interntab_size-1)] = in;
+	interntab_count++;
+	intern_bytes += len+1;
+    }
+    in->refs++;
+    intern_refs++;
+    intern_refbytes += len+1;
+    return in->str;
+}
+
+char *sintern(const char *s)
+{
+    return do_intern(s, 0);
+}
+
+char *sintern_nocase(const char *s)
+{
+    return do_intern(s, 1);
+}
+
+void sunintern(char *s)
+{
+    Interned *in, **prev;
+    int len;
+
+    if (!s)
+	return;
+    in = INTERNED(s);
+    len = strlen(s);
+    intern_refs--;
+    intern_refbytes -= len+1;
+    if (--in->refs > 0)
+	return;
+    for (prev = &interntab[in->hash & (interntab_size-1)]; *prev != in;
+							prev = &(*prev)->next)
+	;
+    *prev = in->next;
+    interntab_count--;
+    intern_bytes -= len+1;
+    free(in);
+}
+
+/* Return statistics on interned strings: the number of distinct strings,
+ * the number of references to them, the memory they use, and how much
+ * more they would use if every reference had its own copy. */
+
+void get_intern_stats(long *nstrings, long *nrefs, long *memuse, long *saved)
+{
+    *nstrings = interntab_count;
+    *nrefs = intern_refs;
+    *memuse = sizeof(Interned *) * interntab_size
+		+ offsetof(Interned, str) * interntab_count + intern_bytes;
+    *saved = intern_refbytes - intern_bytes;
+}
+
 /*************************************************************************/
 /*************************************************************************/
 
@@ -10,6 +10,7 @@
 
 #include "services.h"
 #include "pseudo.h"
+#include <fcntl.h>
 
 /*************************************************************************/
 
@@ -62,6 +63,385 @@ static Command cmds[] = {
 /*************************************************************************/
 /*************************************************************************/
 
+/* The memo store.  Memo texts are kept out of nick.db and chan.db, in a
+ * file of their own (MemoDBName) which texts are only ever appended to;
+ * each Memo just records where its text is, and the text is read in the
+ * first time somebody asks for it.  Deleted texts stay in the file until
+ * there is more dead space than live text, at which point the live texts
+ * are copied to a new file (see compact_memo_store()).
+ *
+ * The file starts with MEMO_STORE_MAGIC and a generation number, which
+ * goes up by one each time the store is compacted.  nick.db and chan.db
+ * record the generation their positions refer to; the previous generation
+ * is kept as MemoDBName.old until both of them have been saved again, so
+ * a database saved before a compaction can still find its texts.
+ */
+
+#define MEMO_STORE_MAGIC	"MTXT"
+#define MEMO_STORE_HEADER	8	/* Magic plus generation */
+#define MEMO_STORE_SLACK	1048576	/* Dead bytes before compacting */
+
+static int store_fd = -1;
+static uint32 store_gen;	/* Generation of the open store */
+static uint32 store_size;	/* Current end of file */
+static uint32 store_live;	/* Bytes (with nulls) used by live memos */
+static int store_dirty;		/* Appended to since the last fsync()? */
+static int store_pending;	/* Databases not saved since compaction */
+
+static int old_fd = -1;		/* Previous generation, if needed */
+static uint32 old_gen;
+
+/*************************************************************************/
+
+/* Open a memo store file and read its generation number.  If `create' is
+ * set, the file is created (as generation 1) if it doesn't exist.
+ * Returns the file descriptor, or -1 on error. */
+
+static int open_store_file(const char *name, int create, uint32 *gen,
+			   uint32 *size)
+{
+    unsigned char buf[MEMO_STORE_HEADER];
+    struct stat st;
+    int fd;
+
+    fd = open(name, create ? O_RDWR | O_CREAT : O_RDONLY, 0666);
+    if (fd < 0)
+	return -1;
+    if (fstat(fd, &st) < 0) {
+	close(fd);
+	return -1;
+    }
+    if (st.st_size == 0 && create) {
+	memcpy(buf, MEMO_STORE_MAGIC, 4);
+	buf[4] = buf[5] = buf[6] = 0;
+	buf[7] = 1;
+	if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+	    close(fd);
+	    return -1;
+	}
+	st.st_size = sizeof(buf);
+    } else if (read(fd, buf, sizeof(buf)) != sizeof(buf)
+		|| memcmp(buf, MEMO_STORE_MAGIC, 4) != 0) {
+	close(fd);
+	errno = EINVAL;
+	return -1;
+    }
+    *gen = DB_INT32(buf+4);
+    *size = st.st_size;
+    return fd;
+}
+
+/* Make sure the memo store is open.  Returns 0 on success, -1 if the store
+ * can't be used (in which case texts are kept in memory). */
+
+static int open_memo_store(void)
+{
+    static int failed = 0;
+
+    if (store_fd >= 0)
+	return 0;
+    if (failed)
+	return -1;
+    store_fd = open_store_file(MemoDBName, 1, &store_gen, &store_size);
+    if (store_fd < 0) {
+	log_perror("Can't open memo store %s", MemoDBName);
+	if (!forceload)
+	    fatal("Can't open memo store %s", MemoDBName);
+	failed = 1;
+	return -1;
+    }
+    return 0;
+}
+
+/*************************************************************************/
+
+/* Length of a text as stored; Memo.textlen is only 16 bits. */
+
+static int text_len(const char *text)
+{
+    size_t len = strlen(text);
+    return len > 65535 ? 65535 : len;
+}
+
+/* Append a text to the store and set the memo's position from it.  Leaves
+ * the memo alone and returns -1 on error. */
+
+static int append_text(Memo *m, const char *text)
+{
+    int len = text_len(text);
+
+    if (open_memo_store() < 0)
+	return -1;
+    /* The null goes in separately, since the text may have been cut */
+    if (pwrite(store_fd, text, len, store_size) != len
+		|| pwrite(store_fd, "", 1, store_size+len) != 1) {
+	log_perror("Write error on %s", MemoDBName);
+	return -1;
+    }
+    m->textpos = store_size;
+    m->textlen = len;
+    store_size += len+1;
+    store_live += len+1;
+    store_dirty = 1;
+    return 0;
+}
+
+/* Give a memo the given text.  If the store can't be written, the text is
+ * kept in memory instead, and written out with the next database save. */
+
+void memo_store_add(Memo *m, const char *text)
+{
+    m->text = NULL;
+    m->textpos = MEMO_NO_TEXT;
+    m->textlen = 0;
+    if (append_text(m, text) < 0)
+	m->text = sstrdup(text);
+}
+
+/* Return a memo's text, reading it in from the store if necessary. */
+
+const char *memo_text(Memo *m)
+{
+    if (m->text)
+	return m->text;
+    if (m->textpos == MEMO_NO_TEXT || open_memo_store() < 0)
+	return "";
+    m->text = smalloc(m->textlen+1);
+    if (pread(store_fd, m->text, m->textlen, m->textpos) != m->textlen) {
+	log_perror("Read error on %s", MemoDBName);
+	free(m->text);
+	m->text = NULL;
+	return "";
+    }
+    m->text[m->textlen] = 0;
+    return m->text;
+}
+
+/* Forget a memo's text (when the memo is deleted). */
+
+void memo_free_text(Memo *m)
+{
+    if (m->text) {
+	free(m->text);
+	m->text = NULL;
+    }
+    if (m->textpos != MEMO_NO_TEXT) {
+	store_live -= m->textlen+1;
+	m->textpos = MEMO_NO_TEXT;
+    }
+}
+
+/*************************************************************************/
+
+/* Check a memo position just loaded from a database which refers to
+ * generation `gen' of the store.  If that isn't the current generation,
+ * copy the text over from the previous one (if it's still there). */
+
+void memo_store_loaded(Memo *m, uint32 gen, int which)
+{
+    static uint32 lost_gen = 0;
+    char *text;
+
+    m->text = NULL;
+    if (m->textpos == MEMO_NO_TEXT || open_memo_store() < 0) {
+	m->textpos = MEMO_NO_TEXT;
+	return;
+    }
+    if (gen == store_gen) {
+	if ((uint32)m->textpos + m->textlen + 1 > store_size) {
+	    log("%s: memo text position %lu out of range in %s",
+			s_MemoServ, (unsigned long)m->textpos, MemoDBName);
+	    m->textpos = MEMO_NO_TEXT;
+	} else {
+	    store_live += m->textlen+1;
+	}
+	return;
+    }
+
+    /* Saved before the last compaction */
+    if (old_fd < 0 && lost_gen != gen) {
+	char namebuf[PATH_MAX+1];
+	uint32 size;
+	snprintf(namebuf, sizeof(namebuf), "%s.old", MemoDBName);
+	old_fd = open_store_file(namebuf, 0, &old_gen, &size);
+    }
+    if (old_fd < 0 || old_gen != gen) {
+	if (lost_gen != gen) {
+	    log("%s: memo store generation %lu not found, memo texts lost",
+			s_MemoServ, (unsigned long)gen);
+	    lost_gen = gen;
+	}
+	m->textpos = MEMO_NO_TEXT;
+	return;
+    }
+    text = smalloc(m->textlen+1);
+    if (pread(old_fd, text, m->textlen, m->textpos) != m->textlen)
+	*text = 0;
+    text[m->textlen] = 0;
+    memo_store_add(m, text);
+    free(text);
+    store_pending |= which;
+}
+
+/* Return the current store position of a memo's text for writing to a
+ * database, first trying to store any text kept in memory. */
+
+uint32 memo_store_pos(Memo *m)
+{
+    if (m->textpos == MEMO_NO_TEXT && m->text)
+	append_text(m, m->text);
+    return m->textpos;
+}
+
+/* Prepare to save a database: make sure everything written to the store
+ * so far is on disk, and return the generation positions refer to. */
+
+uint32 sync_memo_store(void)
+{
+    if (open_memo_store() < 0)
+	return 0;
+    if (store_dirty && fsync(store_fd) < 0)
+	log_perror("fsync(%s)", MemoDBName);
+    store_dirty = 0;
+    return store_gen;
+}
+
+/* Note that a database using the store has been saved.  Once both have
+ * been saved since the last compaction, the old generation can go. */
+
+void memo_store_saved(int which)
+{
+    char namebuf[PATH_MAX+1];
+
+    if (!store_pending)
+	return;
+    store_pending &= ~which;
+    if (store_pending)
+	return;
+    if (old_fd >= 0) {
+	close(old_fd);
+	old_fd = -1;
+    }
+    snprintf(namebuf, sizeof(namebuf), "%s.old", MemoDBName);
+    unlink(namebuf);
+}
+
+/*************************************************************************/
+
+/* Copying texts for compact_memo_store(). */
+
+static FILE *compact_file;
+static uint32 compact_size;
+static int compact_error;
+static char *compact_buf;
+
+static void compact_copy(Memo *m)
+{
+    const char *text = m->text;
+    int len = m->textlen;
+
+    if (compact_error || (m->textpos == MEMO_NO_TEXT && !m->text))
+	return;
+    if (m->textpos == MEMO_NO_TEXT) {
+	len = text_len(text);
+    } else if (!text) {
+	if (pread(store_fd, compact_buf, m->textlen, m->textpos)
+							!= m->textlen) {
+	    compact_error = 1;
+	    return;
+	}
+	compact_buf[m->textlen] = 0;
+	text = compact_buf;
+    }
+    if (fwrite(text, len, 1, compact_file) != 1 || fputc(0, compact_file) == EOF)
+	compact_error = 1;
+}
+
+static void compact_move(Memo *m)
+{
+    if (m->textpos == MEMO_NO_TEXT && !m->text)
+	return;
+    if (m->textpos == MEMO_NO_TEXT)
+	m->textlen = text_len(m->text);
+    m->textpos = compact_size;
+    compact_size += m->textlen+1;
+}
+
+/* Copy all live texts to a new generation of the store, if enough of the
+ * current one is dead.  Called just before nick.db and chan.db are saved,
+ * so they pick up the new positions straight away. */
+
+void compact_memo_store(void)
+{
+    char newname[PATH_MAX+1], oldname[PATH_MAX+1];
+    unsigned char header[MEMO_STORE_HEADER];
+    uint32 dead, newgen;
+    int fd;
+
+    if (store_fd < 0 || store_pending)
+	return;
+    dead = store_size - MEMO_STORE_HEADER - store_live;
+    if (dead < MEMO_STORE_SLACK || dead < store_live)
+	return;
+
+    snprintf(newname, sizeof(newname), "%s.new", MemoDBName);
+    snprintf(oldname, sizeof(oldname), "%s.old", MemoDBName);
+    if (!(compact_file = fopen(newname, "w"))) {
+	log_perror("Can't create %s", newname);
+	return;
+    }
+    newgen = store_gen+1;
+    memcpy(header, MEMO_STORE_MAGIC, 4);
+    header[4] = newgen>>24;
+    header[5] = newgen>>16;
+    header[6] = newgen>>8;
+    header[7] = newgen;
+    compact_error = fwrite(header, sizeof(header), 1, compact_file) != 1;
+    compact_buf = smalloc(65536);
+
+    /* Copy first; only once the new file is safely written do the memos
+     * get their new positions (in the same order) */
+    ns_foreach_memo(compact_copy);
+    cs_foreach_memo(compact_copy);
+    free(compact_buf);
+    if (fflush(compact_file) == EOF || fsync(fileno(compact_file)) < 0)
+	compact_error = 1;
+    if (fclose(compact_file) == EOF)
+	compact_error = 1;
+    if (compact_error) {
+	log_perror("Write error on %s", newname);
+	unlink(newname);
+	return;
+    }
+    if (rename(MemoDBName, oldname) < 0) {
+	log_perror("Can't rename %s", MemoDBName);
+	unlink(newname);
+	return;
+    }
+    if (rename(newname, MemoDBName) < 0 || (fd = open(MemoDBName, O_RDWR)) < 0) {
+	/* Put things back the way they were */
+	log_perror("Can't install %s", newname);
+	rename(oldname, MemoDBName);
+	unlink(newname);
+	return;
+    }
+
+    compact_size = MEMO_STORE_HEADER;
+    ns_foreach_memo(compact_move);
+    cs_foreach_memo(compact_move);
+    log("%s: compacted memo store (%lu bytes live, %lu dead)",
+		s_MemoServ, (unsigned long)store_live, (unsigned long)dead);
+    close(store_fd);
+    store_fd = fd;
+    store_gen = newgen;
+    store_size = compact_size;
+    store_live = compact_size - MEMO_STORE_HEADER;
+    store_dirty = 0;
+    store_pending = MEMO_STORE_NICKS | MEMO_STORE_CHANS;
+}
+
+/*************************************************************************/
+
 /* MemoServ initialization. */
 
 void ms_init(void)
@@ -177,8 +557,11 @@ void load_old_ms_dbase(void)
 		}
 		memos = old_memolist.memos;
 		for (j = 0; j < old_memolist.n_memos; j++) {
-		    if (read_string(&memos[j].text, f) < 0)
+		    char *text;
+		    if (read_string(&text, f) < 0)
 			fatal("Read error on memo.db");
+		    memo_store_add(&memos[j], text ? text : "");
+		    free(text);
 		}
 		ni = findnick(old_memolist.nick);
 		if (ni) {
@@ -345,7 +728,7 @@ static int delmemo(MemoInfo *mi, int num)
 	    break;
     }
     if (i < mi->memocount) {
-	free(mi->memos[i].text); /* Deallocate memo text memory */
+	memo_free_text(&mi->memos[i]); /* Forget the memo's text */
 	mi->memocount--;	 /* One less memo now */
 	if (i < mi->memocount)	 /* Move remaining memos down a slot */
 	    memmove(mi->memos + i, mi->memos + i+1,
@@ -398,7 +781,7 @@ static void do_send(User *u)
     Memo *m;
     char *name = strtok(NULL, " ");
     char *text = strtok(NULL, "");
-    time_t now = time(NULL);
+    time_t now = cur_time;
     int is_servadmin = is_services_admin(u);
 
     if (!text) {
@@ -448,8 +831,8 @@ static void do_send(User *u)
 	} else {
 	    m->number = 1;
 	}
-	m->time = time(NULL);
-	m->text = sstrdup(text);
+	m->time = cur_time;
+	memo_store_add(m, text);
 	m->flags = MF_UNREAD;
 	notice_lang(s_MemoServ, u, MEMO_SENT, name);
 	if (!ischan) {
@@ -667,7 +1050,7 @@ static int read_memo(User *u, int index, MemoInfo *mi, const char *chan)
     else
 	notice_lang(s_MemoServ, u, MEMO_HEADER, m->number,
 		m->sender, timebuf, s_MemoServ, m->number);
-    notice_lang(s_MemoServ, u, MEMO_TEXT, m->text);
+    notice_lang(s_MemoServ, u, MEMO_TEXT, memo_text(m));
     m->flags &= ~MF_UNREAD;
     return 1;
 }
@@ -874,7 +1257,7 @@ static void do_del(User *u)
 	} else {
 	    /* Delete all memos. */
 	    for (i = 0; i < mi->memocount; i++)
-		free(mi->memos[i].text);
+		memo_free_text(&mi->memos[i]);
 	    free(mi->memos);
 	    mi->memos = NULL;
 	    mi->memocount = 0;
@@ -9,6 +9,7 @@
 #include "services.h"
 #include "messages.h"
 #include "language.h"
+#include "latency.h"
 
 /* List of messages is at the bottom of the file. */
 
@@ -199,20 +200,13 @@ static void m_part(char *source, int ac, char **av)
 
 static void m_privmsg(char *source, int ac, char **av)
 {
-    time_t starttime, stoptime;	/* When processing started and finished */
+    lat_t starttime, elapsed;	/* When processing started, how long it took */
     char *s;
 
     if (ac != 2)
 	return;
 
-    /* Check if we should ignore.  Operators always get through. */
-    if (allow_ignore && !is_oper(source)) {
-	IgnoreData *ign = get_ignore(source);
-	if (ign && ign->time > time(NULL)) {
-	    log("Ignored message from %s: \"%s\"", source, inbuf);
-	    return;
-	}
-    }
+    /* Flood control has already been checked in process(). */
 
     /* If a server is specified (nick@server format), make sure it matches
      * us, and strip it off. */
@@ -223,7 +217,7 @@ static void m_privmsg(char *source, int ac, char **av)
 	    return;
     }
 
-    starttime = time(NULL);
+    starttime = lat_now();
 
     if (stricmp(av[0], s_OperServ) == 0) {
 	if (is_oper(source)) {
@@ -258,11 +252,15 @@ static void m_privmsg(char *source, int ac, char **av)
 	helpserv(s_IrcIIHelp, source, buf);
     }
 
-    /* Add to ignore list if the command took a significant amount of time. */
+    /* Stop listening to the user for a while if the command took a
+     * significant amount of time. */
     if (allow_ignore) {
-	stoptime = time(NULL);
-	if (stoptime > starttime && *source && !strchr(source, '.'))
-	    add_ignore(source, stoptime-starttime);
+	elapsed = lat_now() - starttime;
+	if (elapsed >= 1000000000) {
+	    User *u = finduser(source);
+	    if (u)
+		flood_penalty(u, elapsed / 1000000000);
+	}
     }
 }
 
@@ -302,7 +300,7 @@ static void m_stats(char *source, int ac, char **av)
 	return;
     switch (*av[0]) {
       case 'u': {
-	int uptime = time(NULL) - start_time;
+	int uptime = cur_time - start_time;
 	send_cmd(ServerName, "242 %s :Services up %d day%s, %02d:%02d:%02d",
 		source, uptime/86400, (uptime/86400 == 1) ? "" : "s",
 		(uptime/3600) % 24, (uptime/60) % 60, uptime % 60);
@@ -322,6 +320,26 @@ static void m_stats(char *source, int ac, char **av)
 	send_cmd(ServerName, "219 %s l :End of /STATS report.", source);
 	break;
 
+      case 't': {
+	LatStat *ls;
+	char avg[16], p50[16], p99[16], max[16];
+
+	send_cmd(ServerName, "249 %s :Service Command Calls Avg P50 P99 Max",
+		source);
+	for (ls = lat_list(); ls; ls = ls->next) {
+	    if (!ls->count)
+		continue;
+	    send_cmd(ServerName, "249 %s :%s %s %lu %s %s %s %s", source,
+		ls->service, ls->name, (unsigned long)ls->count,
+		lat_format(avg, sizeof(avg), ls->total / ls->count),
+		lat_format(p50, sizeof(p50), lat_percentile(ls, 500)),
+		lat_format(p99, sizeof(p99), lat_percentile(ls, 990)),
+		lat_format(max, sizeof(max), ls->max));
+	}
+	send_cmd(ServerName, "219 %s t :End of /STATS report.", source);
+	break;
+      } /* case 't' */
+
       case 'c':
       case 'h':
       case 'i':
@@ -11,6 +11,7 @@
 typedef struct {
     const char *name;
     void (*func)(char *source, int ac, char **av);
+    struct latstat_ *latency;	/* Timing statistics; see latency.h */
 } Message;
 
 extern Message messages[];
@@ -244,6 +244,30 @@ int strCasecmp(const char *a, const char *b)
 }                
 /*************************************************************************/
 
+/* hash_nocase:  Hash de una cadena sin distinguir mayusculas, usando las
+ *               tablas toLower, de forma que [zoltan] y {zoltan} (y por
+ *               tanto cualquier par que stricmp() da por igual) caen en el
+ *               mismo sitio.  Es FNV-1a con una mezcla final, para que los
+ *               bits bajos sirvan como indice de una tabla potencia de 2.
+ */
+
+uint32 hash_nocase(const char *s)
+{
+    uint32 h = 2166136261U;
+
+    while (*s) {
+	h ^= (unsigned char)toLower(*s);
+	h *= 16777619U;
+	s++;
+    }
+    h ^= h >> 16;
+    h *= 0x85EBCA6BU;
+    h ^= h >> 13;
+    return h;
+}
+
+/*************************************************************************/
+
 /*
  * strToken.c
  *
@@ -190,10 +190,10 @@ void load_news()
     if ((x) < 0) {						\
 	restore_db(f);						\
 	log_perror("Write error on %s", NewsDBName);		\
-	if (time(NULL) - lastwarn > WarningTimeout) {		\
+	if (cur_time - lastwarn > WarningTimeout) {		\
 	    canalopers(NULL, "Write error on %s: %s", NewsDBName,	\
 			strerror(errno));			\
-	    lastwarn = time(NULL);				\
+	    lastwarn = cur_time;				\
 	}							\
 	return;							\
     }								\
@@ -395,7 +395,7 @@ static int add_newsitem(User *u, const char *text, short type)
     news[nnews].type = type;
     news[nnews].num = num+1;
     news[nnews].text = sstrdup(text);
-    news[nnews].time = time(NULL);
+    news[nnews].time = cur_time;
     strscpy(news[nnews].who, u->nick, NICKMAX);
     nnews++;
     return num+1;
@@ -32,6 +32,34 @@
 
 static NickInfo *nicklists[256];	/* One for each initial character */
 
+/* Tabla hash para findnick(), con la misma equivalencia de mayusculas que
+ * strCasecmp(); crece al doble cuando se llena, como la de usuarios. */
+#define NICKHASH_MIN	1024
+static NickInfo **nickhash;
+static int nickhash_size, nickhash_count;
+static ExpireHeap ns_expire;		/* Nicks ordered by expiry check */
+static SearchIndex ns_search;		/* Trigrams of nicks, for LIST */
+
+/* Estado de un LIST en curso.  Se procesa por pasos (SEARCH_STEP nicks en
+ * cada vuelta del bucle principal) para no dejar colgado el enlace con
+ * bases de datos grandes. */
+typedef struct nicklist_ NickList;
+struct nicklist_ {
+    NickList *next, *prev;
+    Job *job;			/* NULL si aun no se ha pasado a segundo plano */
+    User *who;			/* Quien ha pedido el LIST */
+    char *pattern;
+    int is_servoper;		/* Se comprueba de nuevo en cada paso */
+    int16 matchflags;
+    int shown;
+    int prefixlen;		/* Prefijo literal del patron, 0 si no hay */
+    int bucket;			/* Postings de ns_search, -1 si no se usan */
+    int pos;			/* Siguiente posicion en los postings */
+    int i;			/* nicklists[] que se esta recorriendo */
+    NickInfo *ni;		/* Siguiente nick a mirar en nicklists[i] */
+};
+static NickList *nicklist_jobs;
+
 #define TO_COLLIDE   0			/* Collide the user with this nick */
 #define TO_RELEASE   1			/* Release a collided nick */
 
@@ -39,12 +67,23 @@ static NickInfo *nicklists[256];	/* One for each initial character */
 
 Mail *domainlist;
 
+/* Sube cada vez que cambia algun enlace entre nicks, o se borra un nick;
+ * ChanServ rehace entonces sus indices de accesos (ver get_access()). */
+uint32 link_generation = 0;
+
 static int is_on_access(User *u, NickInfo *ni);
 static void alpha_insert_nick(NickInfo *ni);
+static void hash_insert_nick(NickInfo *ni);
+static void hash_remove_nick(NickInfo *ni);
 static NickInfo *makenick(const char *nick);
 static int delnick(NickInfo *ni);
+static void schedule_nick_expire(NickInfo *ni);
+static void nicklist_forget(NickInfo *ni);
 static void remove_links(NickInfo *ni);
 static void delink(NickInfo *ni);
+static void set_link(NickInfo *ni, NickInfo *target);
+static void clear_link(NickInfo *ni);
+static void build_links(void);
 
 static void collide(NickInfo *ni, int from_timeout);
 static void release(NickInfo *ni, int from_timeout);
@@ -309,10 +348,6 @@ void get_nickserv_stats(long *nrec, long *memuse, long *nforbid,
                 mem += strlen(ni->emailreg)+1;		
             if (ni->msg_fullmemo)
                 mem += strlen(ni->msg_fullmemo) +1;
-	    if (ni->last_usermask)
-		mem += strlen(ni->last_usermask)+1;
-	    if (ni->last_realname)
-		mem += strlen(ni->last_realname)+1;
 	    if (ni->last_quit)
 		mem += strlen(ni->last_quit)+1;
             caccess+= ni->accesscount;
@@ -344,6 +379,24 @@ void get_nickserv_stats(long *nrec, long *memuse, long *nforbid,
     *nmemosnr = cmemosnr;
 }
 
+/*************************************************************************/
+
+/* Call the given function for every memo of every registered nick, in the
+ * same order each time (for compact_memo_store()). */
+
+void ns_foreach_memo(void (*fn)(Memo *m))
+{
+    NickInfo *ni;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+	for (ni = nicklists[i]; ni; ni = ni->next) {
+	    for (j = 0; j < ni->memos.memocount; j++)
+		fn(&ni->memos.memos[j]);
+	}
+    }
+}
+
 /*************************************************************************/
 /*************************************************************************/
 
@@ -388,6 +441,567 @@ void nickserv(const char *source, char *buf)
 
 }
 
+/*************************************************************************/
+
+/* Make sure a freshly loaded nick's password is stored the way this
+ * binary expects it: encrypt it if encryption is enabled and it isn't
+ * already, or bail out if it is encrypted and encryption is disabled. */
+
+static void check_nick_password(NickInfo *ni)
+{
+#ifdef USE_ENCRYPTION
+    if (!(ni->status & (NS_ENCRYPTEDPW | NS_VERBOTEN))) {
+	if (debug)
+	    log("debug: %s: encrypting password for `%s' on load",
+		    s_NickServ, ni->nick);
+	if (encrypt_in_place(ni->pass, PASSMAX) < 0)
+	    fatal("%s: Can't encrypt `%s' nickname password!",
+		    s_NickServ, ni->nick);
+	ni->status |= NS_ENCRYPTEDPW;
+    }
+#else
+    if (ni->status & NS_ENCRYPTEDPW) {
+	/* Bail: it makes no sense to continue with encrypted
+	 * passwords, since we won't be able to verify them */
+	fatal("%s: load database: password for %s encrypted "
+	      "but encryption disabled, aborting",
+	      s_NickServ, ni->nick);
+    }
+#endif
+}
+
+/*************************************************************************/
+
+/* nick.db versions 11 and up are stored by columns rather than by
+ * records, so that anything which only needs a few fields (listnicks, for
+ * instance) can look at them in place without building NickInfo
+ * structures.  After the version number come:
+ *	nick count N, access entry count NA, memo count NM, string heap
+ *	    size HS, and (version 12) the memo store generation (int32 each);
+ *	257 int32s: index of the first nick of each nicklists[] list, plus N;
+ *	NC_INT32 columns of N int32s, then NC_STRING columns of N int32
+ *	    string offsets (see below);
+ *	NA int32 access string offsets, then NM memo numbers, NM memo times
+ *	    and NM memo text offsets (int32 each); in version 12, memo text
+ *	    offsets are positions in the memo store rather than the heap;
+ *	NC_INT16 columns of N int16s, then NM int16 memo flags, then
+ *	    (version 12) NM int16 memo text lengths;
+ *	N nicks (NICKMAX bytes each), N passwords (PASSMAX bytes each), NM
+ *	    memo senders (NICKMAX bytes each);
+ *	the string heap: HS bytes of null-terminated strings.
+ * A string is stored as its offset in the heap, or NC_NULL for NULL.
+ * Nicks are written in nicklists[] order, which is stricmp() order, so the
+ * nick column doubles as a sorted index.  Access entries and memos are
+ * stored one nick after another, so a nick's first entry is the sum of
+ * the counts of the nicks before it.  Linked nicks have no access entries
+ * or memos.
+ */
+
+enum {
+    NC_REGISTERED, NC_LAST_SEEN, NC_CHANGED_PASS, NC_TIME_SUSPEND,
+    NC_EXPIRESUSPEND, NC_FLAGS,
+    NC_INT32
+};
+enum {
+    NC_URL, NC_EMAIL, NC_EMAILREG, NC_FULLMEMO, NC_USERMASK, NC_REALNAME,
+    NC_QUIT, NC_SUSPENDBY, NC_SUSPENDREASON, NC_FORBIDBY, NC_FORBIDREASON,
+    NC_LINK,
+    NC_STRING
+};
+enum {
+    NC_STATUS, NC_LINKCOUNT, NC_CHANCOUNT, NC_CHANMAX, NC_LANGUAGE,
+    NC_ACCESSCOUNT, NC_MEMOCOUNT, NC_MEMOMAX,
+    NC_INT16
+};
+#define NC_NULL		0xFFFFFFFF
+
+typedef struct {
+    int32 count, naccess, nmemos, heapsize;
+    uint32 memogen;		/* Memo store generation (version 12) */
+    const unsigned char *bucket;
+    const unsigned char *int32[NC_INT32], *string[NC_STRING];
+    const unsigned char *access, *memo_number, *memo_time, *memo_text;
+    const unsigned char *int16[NC_INT16], *memo_flags, *memo_textlen;
+    const unsigned char *nick, *pass, *memo_sender;
+    const char *heap;
+} NickColumns;
+
+#define NC_GET32(nc,col,i)	DB_INT32((nc)->int32[col] + 4*(i))
+#define NC_GET16(nc,col,i)	DB_INT16((nc)->int16[col] + 2*(i))
+#define NC_NICK(nc,i)		((const char *)(nc)->nick + NICKMAX*(i))
+
+/*************************************************************************/
+
+/* Return the string at the given heap offset, or NULL. */
+
+static const char *nc_heap(const NickColumns *nc, const unsigned char *p)
+{
+    uint32 off = DB_INT32(p);
+
+    if (off == NC_NULL || off >= nc->heapsize)
+	return NULL;
+    return nc->heap + off;
+}
+
+#define NC_STR(nc,col,i)	nc_heap((nc), (nc)->string[col] + 4*(i))
+
+/* sstrdup() a string from the heap, or return NULL. */
+
+static char *nc_strdup(const NickColumns *nc, const unsigned char *p)
+{
+    const char *s = nc_heap(nc, p);
+    return s ? sstrdup(s) : NULL;
+}
+
+/*************************************************************************/
+
+/* Find the columns in a version 11 or 12 file (positioned just after the
+ * version number).  Returns 0 on success, -1 if the file is too short or
+ * its counts don't make sense. */
+
+static int map_ns_columns(dbFILE *f, NickColumns *nc, int ver)
+{
+    const unsigned char *p;
+    int i;
+
+#define SPAN(var,len) \
+    if (!(var = read_db_span(f, (len)))) return -1
+
+    SPAN(p, ver >= 12 ? 20 : 16);
+    nc->count = DB_INT32(p);
+    nc->naccess = DB_INT32(p+4);
+    nc->nmemos = DB_INT32(p+8);
+    nc->heapsize = DB_INT32(p+12);
+    nc->memogen = ver >= 12 ? DB_INT32(p+16) : 0;
+    if (nc->count < 0 || nc->naccess < 0 || nc->nmemos < 0
+						|| nc->heapsize < 0)
+	return -1;
+    SPAN(nc->bucket, 4*257);
+    for (i = 0; i < 256; i++) {
+	if (DB_INT32(nc->bucket+4*i) > DB_INT32(nc->bucket+4*(i+1)))
+	    return -1;
+    }
+    if (DB_INT32(nc->bucket) != 0 || DB_INT32(nc->bucket+4*256) != nc->count)
+	return -1;
+    for (i = 0; i < NC_INT32; i++)
+	SPAN(nc->int32[i], 4*(size_t)nc->count);
+    for (i = 0; i < NC_STRING; i++)
+	SPAN(nc->string[i], 4*(size_t)nc->count);
+    SPAN(nc->access, 4*(size_t)nc->naccess);
+    SPAN(nc->memo_number, 4*(size_t)nc->nmemos);
+    SPAN(nc->memo_time, 4*(size_t)nc->nmemos);
+    SPAN(nc->memo_text, 4*(size_t)nc->nmemos);
+    for (i = 0; i < NC_INT16; i++)
+	SPAN(nc->int16[i], 2*(size_t)nc->count);
+    SPAN(nc->memo_flags, 2*(size_t)nc->nmemos);
+    nc->memo_textlen = NULL;
+    if (ver >= 12) {
+	SPAN(nc->memo_textlen, 2*(size_t)nc->nmemos);
+    }
+    SPAN(nc->nick, NICKMAX*(size_t)nc->count);
+    SPAN(nc->pass, PASSMAX*(size_t)nc->count);
+    SPAN(nc->memo_sender, NICKMAX*(size_t)nc->nmemos);
+    SPAN(p, nc->heapsize);
+    nc->heap = (const char *)p;
+    /* The heap has to end in a null, so every offset in it is a string */
+    if (nc->heapsize && nc->heap[nc->heapsize-1] != 0)
+	return -1;
+    for (i = 0; i < nc->count; i++) {
+	if (NC_NICK(nc,i)[NICKMAX-1] != 0)
+	    return -1;
+    }
+
+#undef SPAN
+    return 0;
+}
+
+/*************************************************************************/
+
+/* Number of access entries and memos record `i' of a version 11 or 12 file
+ * has, given the index of its first of each (a damaged file can't make us
+ * read past the end of the columns). */
+
+static void nc_counts(const NickColumns *nc, int i, int32 access, int32 memo,
+			int *accesscount, int *memocount)
+{
+    if (NC_STR(nc, NC_LINK, i)) {
+	*accesscount = *memocount = 0;
+	return;
+    }
+    *accesscount = NC_GET16(nc, NC_ACCESSCOUNT, i);
+    if (*accesscount > nc->naccess - access)
+	*accesscount = nc->naccess - access;
+    *memocount = NC_GET16(nc, NC_MEMOCOUNT, i);
+    if (*memocount > nc->nmemos - memo)
+	*memocount = nc->nmemos - memo;
+}
+
+/* Build a NickInfo from record `i' of a version 11 or 12 file, whose first
+ * access entry and memo are `access' and `memo'.  This only reads the
+ * columns and allocates memory, so load_ns_columns() runs it in worker
+ * threads; nc_finish_nick() does the rest.  The link target is left as its
+ * name (in the heap, not allocated), as for older versions; the caller
+ * resolves it. */
+
+static NickInfo *nc_decode_nick(const NickColumns *nc, int i,
+				int32 access, int32 memo)
+{
+    NickInfo *ni = scalloc(sizeof(NickInfo), 1);
+    int accesscount, memocount, j;
+
+    nc_counts(nc, i, access, memo, &accesscount, &memocount);
+    memcpy(ni->nick, NC_NICK(nc,i), NICKMAX);
+    memcpy(ni->pass, nc->pass + PASSMAX*i, PASSMAX);
+    ni->url = nc_strdup(nc, nc->string[NC_URL] + 4*i);
+    ni->email = nc_strdup(nc, nc->string[NC_EMAIL] + 4*i);
+    ni->emailreg = nc_strdup(nc, nc->string[NC_EMAILREG] + 4*i);
+    ni->msg_fullmemo = nc_strdup(nc, nc->string[NC_FULLMEMO] + 4*i);
+    ni->last_quit = nc_strdup(nc, nc->string[NC_QUIT] + 4*i);
+    ni->suspendby = nc_strdup(nc, nc->string[NC_SUSPENDBY] + 4*i);
+    ni->suspendreason = nc_strdup(nc, nc->string[NC_SUSPENDREASON] + 4*i);
+    ni->forbidby = nc_strdup(nc, nc->string[NC_FORBIDBY] + 4*i);
+    ni->forbidreason = nc_strdup(nc, nc->string[NC_FORBIDREASON] + 4*i);
+    ni->link = (NickInfo *)NC_STR(nc, NC_LINK, i);
+    ni->time_registered = NC_GET32(nc, NC_REGISTERED, i);
+    ni->last_seen = NC_GET32(nc, NC_LAST_SEEN, i);
+    ni->last_changed_pass = NC_GET32(nc, NC_CHANGED_PASS, i);
+    ni->time_suspend = NC_GET32(nc, NC_TIME_SUSPEND, i);
+    ni->time_expiresuspend = NC_GET32(nc, NC_EXPIRESUSPEND, i);
+    ni->status = NC_GET16(nc, NC_STATUS, i) & ~NS_TEMPORARY;
+    ni->linkcount = NC_GET16(nc, NC_LINKCOUNT, i);
+    ni->channelcount = NC_GET16(nc, NC_CHANCOUNT, i);
+    if (ni->link) {
+	ni->flags = 0;
+	ni->memos.memomax = MSMaxMemos;
+	ni->channelmax = CSMaxReg;
+	ni->language = DEF_LANGUAGE;
+    } else {
+	ni->flags = NC_GET32(nc, NC_FLAGS, i);
+	if (!NSAllowKillImmed)
+	    ni->flags &= ~NI_KILL_IMMED;
+	ni->memos.memomax = NC_GET16(nc, NC_MEMOMAX, i);
+	ni->channelmax = NC_GET16(nc, NC_CHANMAX, i);
+	ni->language = NC_GET16(nc, NC_LANGUAGE, i);
+    }
+    if (accesscount > 0) {
+	ni->accesscount = accesscount;
+	ni->access = smalloc(sizeof(char *) * accesscount);
+	for (j = 0; j < accesscount; j++)
+	    ni->access[j] = nc_strdup(nc, nc->access + 4*(access+j));
+    }
+    if (memocount > 0) {
+	Memo *m;
+	ni->memos.memocount = memocount;
+	ni->memos.memos = m = scalloc(sizeof(Memo), memocount);
+	for (j = 0; j < memocount; j++, m++, memo++) {
+	    m->number = DB_INT32(nc->memo_number + 4*memo);
+	    m->flags = DB_INT16(nc->memo_flags + 2*memo);
+	    m->time = DB_INT32(nc->memo_time + 4*memo);
+	    memcpy(m->sender, nc->memo_sender + NICKMAX*memo, NICKMAX);
+	    m->sender[NICKMAX-1] = 0;
+	    if (nc->memo_textlen) {
+		m->textpos = DB_INT32(nc->memo_text + 4*memo);
+		m->textlen = DB_INT16(nc->memo_textlen + 2*memo);
+	    }
+	}
+    }
+    ni->id_timestamp = 0;
+    return ni;
+}
+
+/* The part of loading record `i' that uses shared tables (interned
+ * strings, the memo store), and so has to be done in the main thread. */
+
+static void nc_finish_nick(const NickColumns *nc, int i, NickInfo *ni,
+			   int32 memo)
+{
+    Memo *m = ni->memos.memos;
+    const char *s;
+    int j;
+
+    s = NC_STR(nc, NC_USERMASK, i);
+    ni->last_usermask = sintern(s ? s : "@");
+    s = NC_STR(nc, NC_REALNAME, i);
+    ni->last_realname = sintern(s ? s : "");
+    for (j = 0; j < ni->memos.memocount; j++, m++, memo++) {
+	if (nc->memo_textlen) {
+	    memo_store_loaded(m, nc->memogen, MEMO_STORE_NICKS);
+	} else {
+	    const char *text = nc_heap(nc, nc->memo_text + 4*memo);
+	    memo_store_add(m, text ? text : "");
+	}
+    }
+    check_nick_password(ni);
+}
+
+/* Both of the above, for loading a single nick.  `access' and `memo' are
+ * advanced past the record's entries. */
+
+static NickInfo *nc_make_nick(const NickColumns *nc, int i,
+				int32 *access, int32 *memo)
+{
+    NickInfo *ni = nc_decode_nick(nc, i, *access, *memo);
+
+    nc_finish_nick(nc, i, ni, *memo);
+    *access += ni->accesscount;
+    *memo += ni->memos.memocount;
+    return ni;
+}
+
+/*************************************************************************/
+
+/* Load a version 11 or 12 nick database (positioned just after the
+ * version number) into nicklists[].  The nicklists[] buckets are
+ * independent, so they are decoded in parallel (see db_parallel()), each
+ * starting from the access entry and memo worked out for it beforehand;
+ * then this thread finishes the nicks off and adds them to the hash
+ * table, and resolves the links. */
+
+typedef struct {
+    dbFILE *f;
+    const NickColumns *nc;
+    int32 access[256], memo[256];	/* First of each for each bucket */
+} NickLoad;
+
+static void nc_load_bucket(void *arg, int i)
+{
+    NickLoad *nl = arg;
+    const NickColumns *nc = nl->nc;
+    NickInfo *ni, **last = &nicklists[i], *prev = NULL;
+    int32 access = nl->access[i], memo = nl->memo[i];
+    int n;
+
+    for (n = DB_INT32(nc->bucket+4*i); n < DB_INT32(nc->bucket+4*(i+1)); n++) {
+	ni = nc_decode_nick(nc, n, access, memo);
+	access += ni->accesscount;
+	memo += ni->memos.memocount;
+	*last = ni;
+	last = &ni->next;
+	ni->prev = prev;
+	prev = ni;
+    }
+    *last = NULL;
+    release_db_pages(nl->f);
+}
+
+static void load_ns_columns(dbFILE *f, int ver)
+{
+    NickColumns nc;
+    NickLoad nl;
+    NickInfo *ni;
+    int32 access = 0, memo = 0;
+    int i, n, accesscount, memocount;
+
+    if (map_ns_columns(f, &nc, ver) < 0) {
+	if (!forceload)
+	    fatal("Read error on %s", NickDBName);
+	return;
+    }
+    nl.f = f;
+    nl.nc = &nc;
+    for (i = n = 0; i < 256; i++) {
+	nl.access[i] = access;
+	nl.memo[i] = memo;
+	for (; n < DB_INT32(nc.bucket+4*(i+1)); n++) {
+	    nc_counts(&nc, n, access, memo, &accesscount, &memocount);
+	    access += accesscount;
+	    memo += memocount;
+	}
+    }
+    db_parallel(256, nc_load_bucket, &nl);
+    for (i = 0; i < 256; i++) {
+	n = DB_INT32(nc.bucket+4*i);
+	memo = nl.memo[i];
+	for (ni = nicklists[i]; ni; ni = ni->next, n++) {
+	    nc_finish_nick(&nc, n, ni, memo);
+	    memo += ni->memos.memocount;
+	    hash_insert_nick(ni);
+	}
+	release_db_pages(f);
+    }
+    /* Now resolve links; the names point into the file, so this has to be
+     * done before it is closed */
+    for (i = 0; i < 256; i++) {
+	for (ni = nicklists[i]; ni; ni = ni->next) {
+	    if (ni->link)
+		ni->link = findnick((char *)ni->link);
+	}
+    }
+}
+
+/*************************************************************************/
+
+/* Open nick.db and map its columns, if it is in a columnar format.
+ * Returns the open file (to be closed by the caller) or NULL. */
+
+static dbFILE *open_ns_columns(NickColumns *nc)
+{
+    dbFILE *f;
+    int ver;
+
+    if (!(f = open_db(s_NickServ, NickDBName, "r", NICK_VERSION)))
+	return NULL;
+    ver = get_file_version(f);
+    if (ver < 11 || map_ns_columns(f, nc, ver) < 0) {
+	close_db(f);
+	return NULL;
+    }
+    return f;
+}
+
+/* listnicks without a nick (count only, or the whole list), straight from
+ * the columns.  Returns 0 if nick.db isn't in a columnar format, in which
+ * case the caller should load it and use listnicks() as usual. */
+
+int listnicks_columns(int count_only)
+{
+    NickColumns nc;
+    dbFILE *f;
+    const char *mask;
+    int i, status;
+
+    if (!(f = open_ns_columns(&nc)))
+	return 0;
+    if (!count_only) {
+	for (i = 0; i < nc.count; i++) {
+	    status = NC_GET16(&nc, NC_STATUS, i);
+	    mask = NC_STR(&nc, NC_USERMASK, i);
+	    printf("    %s %-20s  %s\n",
+			status & NS_NO_EXPIRE ? "!" : " ",
+			NC_NICK(&nc,i), status & NS_VERBOTEN ?
+			    "Disallowed (FORBID)" : mask ? mask : "@");
+	}
+    }
+    printf("%d nicknames registered.\n", nc.count);
+    close_db(f);
+    return 1;
+}
+
+/* Load just the given nick (for listnicks), looking it up in the sorted
+ * nick column.  Returns 0 if nick.db isn't in a columnar format. */
+
+int load_ns_nick(const char *nick)
+{
+    NickColumns nc;
+    dbFILE *f;
+    NickInfo *ni;
+    int32 lo, hi, mid, access, memo, i;
+    int cmp;
+
+    if (findnick(nick))
+	return 1;
+    if (!(f = open_ns_columns(&nc)))
+	return 0;
+    lo = DB_INT32(nc.bucket + 4*tolower((unsigned char)*nick));
+    hi = DB_INT32(nc.bucket + 4*(tolower((unsigned char)*nick)+1));
+    mid = -1;
+    while (lo < hi) {
+	mid = lo + (hi-lo)/2;
+	cmp = stricmp(NC_NICK(&nc,mid), nick);
+	if (cmp == 0)
+	    break;
+	else if (cmp < 0)
+	    lo = mid+1;
+	else
+	    hi = mid;
+	mid = -1;
+    }
+    /* findnick() also treats [] and {} (and so on) as equal, and those
+     * don't sort together; fall back to looking at every nick */
+    for (i = 0; mid < 0 && i < nc.count; i++) {
+	if (strCasecmp(NC_NICK(&nc,i), nick) == 0)
+	    mid = i;
+    }
+    if (mid >= 0) {
+	/* Count up the access entries and memos before this one */
+	for (i = access = memo = 0; i < mid; i++) {
+	    if (!NC_STR(&nc, NC_LINK, i)) {
+		access += NC_GET16(&nc, NC_ACCESSCOUNT, i);
+		memo += NC_GET16(&nc, NC_MEMOCOUNT, i);
+	    }
+	}
+	ni = nc_make_nick(&nc, mid, &access, &memo);
+	ni->link = NULL;
+	ni->master = ni;
+	alpha_insert_nick(ni);
+	hash_insert_nick(ni);
+    }
+    close_db(f);
+    return 1;
+}
+
+/*************************************************************************/
+
+/* Return string field `col' (NC_URL...) of a nick, for save_ns_dbase(). */
+
+static const char *nc_string_field(NickInfo *ni, int col)
+{
+    switch (col) {
+      case NC_URL:		return ni->url;
+      case NC_EMAIL:		return ni->email;
+      case NC_EMAILREG:		return ni->emailreg;
+      case NC_FULLMEMO:		return ni->msg_fullmemo;
+      case NC_USERMASK:		return ni->last_usermask;
+      case NC_REALNAME:		return ni->last_realname;
+      case NC_QUIT:		return ni->last_quit;
+      case NC_SUSPENDBY:	return ni->suspendby;
+      case NC_SUSPENDREASON:	return ni->suspendreason;
+      case NC_FORBIDBY:		return ni->forbidby;
+      case NC_FORBIDREASON:	return ni->forbidreason;
+      case NC_LINK:		return ni->link ? ni->link->nick : NULL;
+    }
+    return NULL;
+}
+
+static uint32 nc_int32_field(NickInfo *ni, int col)
+{
+    switch (col) {
+      case NC_REGISTERED:	return ni->time_registered;
+      case NC_LAST_SEEN:	return ni->last_seen;
+      case NC_CHANGED_PASS:	return ni->last_changed_pass;
+      case NC_TIME_SUSPEND:	return ni->time_suspend;
+      case NC_EXPIRESUSPEND:	return ni->time_expiresuspend;
+      case NC_FLAGS:		return ni->link ? 0 : ni->flags;
+    }
+    return 0;
+}
+
+static uint16 nc_int16_field(NickInfo *ni, int col)
+{
+    switch (col) {
+      case NC_STATUS:		return ni->status;
+      case NC_LINKCOUNT:	return ni->linkcount;
+      case NC_CHANCOUNT:	return ni->channelcount;
+      case NC_CHANMAX:		return ni->channelmax;
+      case NC_LANGUAGE:		return ni->language;
+      case NC_ACCESSCOUNT:	return ni->link ? 0 : ni->accesscount;
+      case NC_MEMOCOUNT:	return ni->link ? 0 : ni->memos.memocount;
+      case NC_MEMOMAX:		return ni->memos.memomax;
+    }
+    return 0;
+}
+
+/* Write a string's heap offset and move the heap size past it. */
+
+static int nc_write_offset(const char *s, uint32 *heapsize, dbFILE *f)
+{
+    if (!s)
+	return write_int32(NC_NULL, f);
+    if (write_int32(*heapsize, f) < 0)
+	return -1;
+    *heapsize += strlen(s)+1;
+    return 0;
+}
+
+static int nc_write_heap(const char *s, dbFILE *f)
+{
+    if (!s)
+	return 0;
+    return write_db(f, s, strlen(s)+1) == strlen(s)+1 ? 0 : -1;
+}
+
+
+
 /*************************************************************************/
 
 /* Load/save data files. */
@@ -425,6 +1039,7 @@ static void load_old_ns_dbase(dbFILE *f, int ver)
 
     int i, j, c;
     NickInfo *ni, **last, *prev;
+    char *s;
     int failed = 0;
 
     for (i = 33; i < 256 && !failed; i++) {
@@ -442,6 +1057,7 @@ static void load_old_ns_dbase(dbFILE *f, int ver)
 	    ni->prev = prev;
 	    prev = ni;
 	    strscpy(ni->nick, old_nickinfo.nick, NICKMAX);
+	    hash_insert_nick(ni);
 	    strscpy(ni->pass, old_nickinfo.pass, PASSMAX);
 	    ni->time_registered = old_nickinfo.time_registered;
 	    ni->last_seen = old_nickinfo.last_seen;
@@ -487,12 +1103,14 @@ static void load_old_ns_dbase(dbFILE *f, int ver)
 		SAFE(read_string(&ni->url, f));
 	    if (old_nickinfo.email)
 		SAFE(read_string(&ni->email, f));
-	    SAFE(read_string(&ni->last_usermask, f));
-	    if (!ni->last_usermask)
-		ni->last_usermask = sstrdup("@");
-	    SAFE(read_string(&ni->last_realname, f));
-	    if (!ni->last_realname)
-		ni->last_realname = sstrdup("");
+	    s = NULL;
+	    SAFE(read_string(&s, f));
+	    ni->last_usermask = sintern(s ? s : "@");
+	    free(s);
+	    s = NULL;
+	    SAFE(read_string(&s, f));
+	    ni->last_realname = sintern(s ? s : "");
+	    free(s);
 	    if (ni->accesscount) {
 		char **access, *s;
 		if (ni->accesscount > NSAccessMax)
@@ -563,6 +1181,7 @@ void load_ns_dbase(void)
     dbFILE *f;
     int ver, i, j, c;
     NickInfo *ni, **last, *prev;
+    char *s;
     int failed = 0;
 
     load_domainmail_db();
@@ -571,6 +1190,11 @@ void load_ns_dbase(void)
 	return;
 
     switch (ver = get_file_version(f)) {
+      case 12:
+      case 11:
+	load_ns_columns(f, ver);
+	break;
+
       case 10:
       case 9:
       case 8:
@@ -590,6 +1214,7 @@ void load_ns_dbase(void)
 		ni->prev = prev;
 		prev = ni;
 		SAFE(read_buffer(ni->nick, f));
+		hash_insert_nick(ni);
 		SAFE(read_buffer(ni->pass, f));
 		SAFE(read_string(&ni->url, f));
 		SAFE(read_string(&ni->email, f));
@@ -603,12 +1228,14 @@ void load_ns_dbase(void)
                 } else {
                     ni->msg_fullmemo = NULL;
                 }
-		SAFE(read_string(&ni->last_usermask, f));
-		if (!ni->last_usermask)
-		    ni->last_usermask = sstrdup("@");
-		SAFE(read_string(&ni->last_realname, f));
-		if (!ni->last_realname)
-		    ni->last_realname = sstrdup("");
+		s = NULL;
+		SAFE(read_string(&s, f));
+		ni->last_usermask = sintern(s ? s : "@");
+		free(s);
+		s = NULL;
+		SAFE(read_string(&s, f));
+		ni->last_realname = sintern(s ? s : "");
+		free(s);
 		SAFE(read_string(&ni->last_quit, f));
 		SAFE(read_int32(&tmp32, f));
 		ni->time_registered = tmp32;
@@ -618,29 +1245,11 @@ void load_ns_dbase(void)
                     SAFE(read_int32(&tmp32, f));
                     ni->last_changed_pass = tmp32;
                 } else {
-                    ni->last_changed_pass = time(NULL);
+                    ni->last_changed_pass = cur_time;
                 }
 		SAFE(read_int16(&ni->status, f));
 		ni->status &= ~NS_TEMPORARY;
-#ifdef USE_ENCRYPTION
-		if (!(ni->status & (NS_ENCRYPTEDPW | NS_VERBOTEN))) {
-		    if (debug)
-			log("debug: %s: encrypting password for `%s' on load",
-				s_NickServ, ni->nick);
-		    if (encrypt_in_place(ni->pass, PASSMAX) < 0)
-			fatal("%s: Can't encrypt `%s' nickname password!",
-				s_NickServ, ni->nick);
-		    ni->status |= NS_ENCRYPTEDPW;
-		}
-#else
-		if (ni->status & NS_ENCRYPTEDPW) {
-		    /* Bail: it makes no sense to continue with encrypted
-		     * passwords, since we won't be able to verify them */
-		    fatal("%s: load database: password for %s encrypted "
-		          "but encryption disabled, aborting",
-		          s_NickServ, ni->nick);
-		}
-#endif
+		check_nick_password(ni);
                 /* Suspensin y forbid de nicks
                  * zoltan 8/11/2000
                  */
@@ -693,6 +1302,7 @@ void load_ns_dbase(void)
 		    SAFE(read_int16(&ni->memos.memomax, f));
 		    if (ni->memos.memocount) {
 			Memo *memos;
+			char *text;
 			memos = smalloc(sizeof(Memo) * ni->memos.memocount);
 			ni->memos.memos = memos;
 			for (j = 0; j < ni->memos.memocount; j++, memos++) {
@@ -701,7 +1311,9 @@ void load_ns_dbase(void)
 			    SAFE(read_int32(&tmp32, f));
 			    memos->time = tmp32;
 			    SAFE(read_buffer(memos->sender, f));
-			    SAFE(read_string(&memos->text, f));
+			    SAFE(read_string(&text, f));
+			    memo_store_add(memos, text ? text : "");
+			    free(text);
 			}
 		    }
 		    SAFE(read_int16(&ni->channelcount, f));
@@ -717,6 +1329,7 @@ void load_ns_dbase(void)
 		ni->id_timestamp = 0;
 	    } /* while (getc_db(f) != 0) */
 	    *last = NULL;
+	    release_db_pages(f);
 	} /* for (i) */
 
 	/* Now resolve links */
@@ -742,6 +1355,14 @@ void load_ns_dbase(void)
     } /* switch (version) */
 
     close_db(f);
+    build_links();
+
+    for (i = 0; i < 256; i++) {
+	for (ni = nicklists[i]; ni; ni = ni->next) {
+	    schedule_nick_expire(ni);
+	    search_add(&ns_search, ni, &ni->search_id, ni->nick);
+	}
+    }
 }
 
 #undef SAFE
@@ -752,10 +1373,10 @@ void load_ns_dbase(void)
     if ((x) < 0) {						\
 	restore_db(f);						\
 	log_perror("Write error on %s", NickDBName);		\
-	if (time(NULL) - lastwarn > WarningTimeout) {		\
+	if (cur_time - lastwarn > WarningTimeout) {		\
 	    canalopers(NULL, "Write error on %s: %s", NickDBName,	\
 			strerror(errno));			\
-	    lastwarn = time(NULL);				\
+	    lastwarn = cur_time;				\
 	}							\
 	return;							\
     }								\
@@ -764,69 +1385,205 @@ void load_ns_dbase(void)
 void save_ns_dbase(void)
 {
     dbFILE *f;
-    int i, j;
+    int i, j, col;
+    int32 count = 0, naccess = 0, nmemos = 0, bucket[257];
+    uint32 heapsize = 0, offset, memogen;
+    NickInfo *ni;
+    Memo *memos;
+    static time_t lastwarn = 0;
+    User *u;
+
+    /* Que lo grabado refleje a quien sigue conectado */
+    for (u = firstuser(); u; u = nextuser())
+	update_last_seen(u);
+
+    /* Count everything first; the header needs the totals */
+    for (i = 0; i < 256; i++) {
+	bucket[i] = count;
+	for (ni = nicklists[i]; ni; ni = ni->next) {
+	    count++;
+	    for (col = 0; col < NC_STRING; col++) {
+		const char *s = nc_string_field(ni, col);
+		if (s)
+		    heapsize += strlen(s)+1;
+	    }
+	    if (ni->link)
+		continue;
+	    naccess += ni->accesscount;
+	    for (j = 0; j < ni->accesscount; j++) {
+		if (ni->access[j])
+		    heapsize += strlen(ni->access[j])+1;
+	    }
+	    nmemos += ni->memos.memocount;
+	}
+    }
+    bucket[256] = count;
+    memogen = sync_memo_store();
+
+    if (!(f = open_db(s_NickServ, NickDBName, "w", NICK_VERSION)))
+	return;
+    SAFE(write_int32(count, f));
+    SAFE(write_int32(naccess, f));
+    SAFE(write_int32(nmemos, f));
+    SAFE(write_int32(heapsize, f));
+    SAFE(write_int32(memogen, f));
+    for (i = 0; i < 257; i++)
+	SAFE(write_int32(bucket[i], f));
+
+    for (col = 0; col < NC_INT32; col++) {
+	for (i = 0; i < 256; i++) {
+	    for (ni = nicklists[i]; ni; ni = ni->next)
+		SAFE(write_int32(nc_int32_field(ni, col), f));
+	}
+    }
+    offset = 0;
+    for (col = 0; col < NC_STRING; col++) {
+	for (i = 0; i < 256; i++) {
+	    for (ni = nicklists[i]; ni; ni = ni->next)
+		SAFE(nc_write_offset(nc_string_field(ni, col), &offset, f));
+	}
+    }
+    for (i = 0; i < 256; i++) {
+	for (ni = nicklists[i]; ni; ni = ni->next) {
+	    if (ni->link)
+		continue;
+	    for (j = 0; j < ni->accesscount; j++)
+		SAFE(nc_write_offset(ni->access[j], &offset, f));
+	}
+    }
+    for (col = 0; col < 3; col++) {
+	for (i = 0; i < 256; i++) {
+	    for (ni = nicklists[i]; ni; ni = ni->next) {
+		if (ni->link)
+		    continue;
+		memos = ni->memos.memos;
+		for (j = 0; j < ni->memos.memocount; j++, memos++) {
+		    if (col == 0)
+			SAFE(write_int32(memos->number, f));
+		    else if (col == 1)
+			SAFE(write_int32(memos->time, f));
+		    else
+			SAFE(write_int32(memo_store_pos(memos), f));
+		}
+	    }
+	}
+    }
+
+    for (col = 0; col < NC_INT16; col++) {
+	for (i = 0; i < 256; i++) {
+	    for (ni = nicklists[i]; ni; ni = ni->next)
+		SAFE(write_int16(nc_int16_field(ni, col), f));
+	}
+    }
+    for (i = 0; i < 256; i++) {
+	for (ni = nicklists[i]; ni; ni = ni->next) {
+	    if (ni->link)
+		continue;
+	    memos = ni->memos.memos;
+	    for (j = 0; j < ni->memos.memocount; j++, memos++)
+		SAFE(write_int16(memos->flags, f));
+	}
+    }
+    for (i = 0; i < 256; i++) {
+	for (ni = nicklists[i]; ni; ni = ni->next) {
+	    if (ni->link)
+		continue;
+	    memos = ni->memos.memos;
+	    for (j = 0; j < ni->memos.memocount; j++, memos++)
+		SAFE(write_int16(memos->textlen, f));
+	}
+    }
+
+    for (i = 0; i < 256; i++) {
+	for (ni = nicklists[i]; ni; ni = ni->next)
+	    SAFE(write_buffer(ni->nick, f) ? 0 : -1);
+    }
+    for (i = 0; i < 256; i++) {
+	for (ni = nicklists[i]; ni; ni = ni->next)
+	    SAFE(write_buffer(ni->pass, f) ? 0 : -1);
+    }
+    for (i = 0; i < 256; i++) {
+	for (ni = nicklists[i]; ni; ni = ni->next) {
+	    if (ni->link)
+		continue;
+	    memos = ni->memos.memos;
+	    for (j = 0; j < ni->memos.memocount; j++, memos++)
+		SAFE(write_buffer(memos->sender, f) ? 0 : -1);
+	}
+    }
+
+    /* And finally the strings, in the same order as their offsets */
+    for (col = 0; col < NC_STRING; col++) {
+	for (i = 0; i < 256; i++) {
+	    for (ni = nicklists[i]; ni; ni = ni->next)
+		SAFE(nc_write_heap(nc_string_field(ni, col), f));
+	}
+    }
+    for (i = 0; i < 256; i++) {
+	for (ni = nicklists[i]; ni; ni = ni->next) {
+	    if (ni->link)
+		continue;
+	    for (j = 0; j < ni->accesscount; j++)
+		SAFE(nc_write_heap(ni->access[j], f));
+	}
+    }
+    /* La generacion vieja del almacen de memos solo se puede tirar si el
+     * nick.db nuevo ha sustituido de verdad al viejo */
+    if (close_db(f) == 0)
+	memo_store_saved(MEMO_STORE_NICKS);
+}
+
+#undef SAFE
+
+/*************************************************************************/
+
+/* Register `count' made-up nicks, for the nickdb benchmark (bench.c).
+ * Each has a mail address, a usermask and two access entries, and every
+ * tenth one two memos.  They are made last to first, so that every one
+ * goes at the head of its nicklists[] bucket. */
+
+void bench_make_nicks(int count)
+{
     NickInfo *ni;
-    char **access;
-    Memo *memos;
-    static time_t lastwarn = 0;
+    Memo *m;
+    char buf[BUFSIZE];
+    int i, j;
 
-    if (!(f = open_db(s_NickServ, NickDBName, "w", NICK_VERSION)))
-	return;
-    for (i = 0; i < 256; i++) {
-	for (ni = nicklists[i]; ni; ni = ni->next) {
-	    SAFE(write_int8(1, f));
-	    SAFE(write_buffer(ni->nick, f));
-	    SAFE(write_buffer(ni->pass, f));
-	    SAFE(write_string(ni->url, f));
-	    SAFE(write_string(ni->email, f));
-	    SAFE(write_string(ni->emailreg, f));
-            SAFE(write_string(ni->msg_fullmemo, f));
-	    SAFE(write_string(ni->last_usermask, f));
-	    SAFE(write_string(ni->last_realname, f));
-	    SAFE(write_string(ni->last_quit, f));
-	    SAFE(write_int32(ni->time_registered, f));
-	    SAFE(write_int32(ni->last_seen, f));
-            SAFE(write_int32(ni->last_changed_pass, f));
-	    SAFE(write_int16(ni->status, f));
-            SAFE(write_string(ni->suspendby, f));
-            SAFE(write_string(ni->suspendreason, f));
-            SAFE(write_int32(ni->time_suspend, f));
-            SAFE(write_int32(ni->time_expiresuspend, f));
-            SAFE(write_string(ni->forbidby, f));
-            SAFE(write_string(ni->forbidreason, f));
-	    if (ni->link) {
-		SAFE(write_string(ni->link->nick, f));
-		SAFE(write_int16(ni->linkcount, f));
-		SAFE(write_int16(ni->channelcount, f));
-	    } else {
-		SAFE(write_string(NULL, f));
-		SAFE(write_int16(ni->linkcount, f));
-		SAFE(write_int32(ni->flags, f));
-		SAFE(write_int16(ni->accesscount, f));
-		for (j=0, access=ni->access; j<ni->accesscount; j++, access++)
-		    SAFE(write_string(*access, f));
-		SAFE(write_int16(ni->memos.memocount, f));
-		SAFE(write_int16(ni->memos.memomax, f));
-		memos = ni->memos.memos;
-		for (j = 0; j < ni->memos.memocount; j++, memos++) {
-		    SAFE(write_int32(memos->number, f));
-		    SAFE(write_int16(memos->flags, f));
-		    SAFE(write_int32(memos->time, f));
-		    SAFE(write_buffer(memos->sender, f));
-		    SAFE(write_string(memos->text, f));
-		}
-		SAFE(write_int16(ni->channelcount, f));
-		SAFE(write_int16(ni->channelmax, f));
-		SAFE(write_int16(ni->language, f));
+    for (i = count-1; i >= 0; i--) {
+	snprintf(buf, sizeof(buf), "%c%07dnick", 'a' + (i*7)%26, i);
+	if (findnick(buf))
+	    continue;
+	ni = makenick(buf);
+	strscpy(ni->pass, "secreto", PASSMAX);
+	snprintf(buf, sizeof(buf), "user%d@host%d.example.com", i, i%5000);
+	ni->last_usermask = sintern(buf);
+	ni->last_realname = sintern("Bench user");
+	snprintf(buf, sizeof(buf), "user%d@example.com", i);
+	ni->email = sstrdup(buf);
+	ni->time_registered = ni->last_seen = cur_time;
+	ni->memos.memomax = MSMaxMemos;
+	ni->channelmax = CSMaxReg;
+	ni->language = DEF_LANGUAGE;
+	ni->flags = NI_SECURE;
+	ni->accesscount = 2;
+	ni->access = smalloc(sizeof(char *) * 2);
+	for (j = 0; j < 2; j++) {
+	    snprintf(buf, sizeof(buf), "*user%d@*.host%d.example.com", i, j);
+	    ni->access[j] = sstrdup(buf);
+	}
+	if (i % 10 == 0) {
+	    ni->memos.memocount = 2;
+	    ni->memos.memos = m = scalloc(sizeof(Memo), 2);
+	    for (j = 0; j < 2; j++, m++) {
+		m->number = j+1;
+		m->time = cur_time;
+		strscpy(m->sender, "Bench", NICKMAX);
+		memo_store_add(m, "Hola, esto es un memo de prueba normal.");
 	    }
-	} /* for (ni) */
-	SAFE(write_int8(0, f));
-    } /* for (i) */
-    close_db(f);
+	}
+    }
 }
 
-#undef SAFE
-
 /*************************************************************************/
 
 /* Check whether a user is on the access list of the nick they're using, or
@@ -882,14 +1639,8 @@ int validate_user(User *u)
 
     if (!(u->ni->flags & NI_SECURE) && on_access) {
 	ni->status |= NS_RECOGNIZED;
-	ni->last_seen = time(NULL);
-	if (ni->last_usermask)
-	    free(ni->last_usermask);
-	ni->last_usermask = smalloc(strlen(u->username)+strlen(u->host)+2);
-	sprintf(ni->last_usermask, "%s@%s", u->username, u->host);
-	if (ni->last_realname)
-	    free(ni->last_realname);
-	ni->last_realname = sstrdup(u->realname);
+	ni->last_seen = cur_time;
+	set_last_usermask(ni, u);
 	return 1;
     }
 
@@ -924,6 +1675,24 @@ int validate_user(User *u)
 
 /*************************************************************************/
 
+/* Pone la hora de ultima conexion del nick que usa `u' (si lo tiene
+ * identificado) a la actual.  expire_nicks() ya no lo hace con todos los
+ * usuarios en cada pasada, asi que hay que llamarla cuando el usuario deja
+ * el nick sin pasar por QUIT o KILL (cambio de nick, split) y antes de
+ * grabar la base de datos.
+ */
+
+void update_last_seen(User *u)
+{
+    NickInfo *ni;
+
+    if ((ni = u->ni) && !(ni->status & NS_VERBOTEN) &&
+			(ni->status & (NS_IDENTIFIED | NS_RECOGNIZED)))
+	u->real_ni->last_seen = cur_time;
+}
+
+/*************************************************************************/
+
 /* Cancel validation flags for a nick (i.e. when the user with that nick
  * signs off or changes nicks).  Also cancels any impending collide. */
 
@@ -975,57 +1744,77 @@ int nick_suspendied(User *u)
     
 /*************************************************************************/
 
-/* Remove all nicks which have expired.  Also update last-seen time for all
- * nicks.
+/* Remove all nicks which have expired.  Only nicks whose expiry check is
+ * due are looked at, at most EXPIRE_BATCH per call; the last-seen time of
+ * a nick in use is updated when its check comes up.  Returns nonzero if
+ * there are still due nicks left for the next call.
  */
 
-void expire_nicks()
+int expire_nicks()
 {
     User *u;
-    NickInfo *ni, *next;
-    int i;
-    time_t now = time(NULL);
+    NickInfo *ni;
+    int n = 0;
+    time_t now = cur_time;
+
+    if (!NSExpire || opt_noexpire)
+	return 0;
+    while (n++ < EXPIRE_BATCH && (ni = expire_next(&ns_expire, now))) {
 
-    /* Assumption: this routine takes less than NSExpire seconds to run.
-     * If it doesn't, some users may end up with invalid user->ni pointers. */
-    for (u = firstuser(); u; u = nextuser()) {
-	if (u->real_ni) {
+	if ((u = finduser(ni->nick)) && u->real_ni == ni) {
 	    if (debug >= 2)
 		log("debug: NickServ: updating last seen time for %s", u->nick);
-	    u->real_ni->last_seen = time(NULL);
+	    ni->last_seen = now;
 	}
-    }
-    if (!NSExpire || opt_noexpire)
-	return;
-    for (i = 0; i < 256; i++) {
-	for (ni = nicklists[i]; ni; ni = next) {
-	    next = ni->next;
- 
+
       /* Expiracion suspension nicks suspendidos */     
-            if (ni->status & NS_SUSPENDED)
-                if (ni->time_expiresuspend != 0 && ni->time_expiresuspend <= now) {
-                    if (NSExpire && NSSuspendGrace &&
-                           (now - ni->last_seen >= NSExpire - NSSuspendGrace))
-                        ni->last_seen = now - NSExpire + NSSuspendGrace;	    
-                    log("Expiring nick-suspend for %s", ni->nick);
-                    canalopers(s_NickServ, "Expirando suspension del nick %s", ni->nick);
-                    free(ni->suspendby);
-                    free(ni->suspendreason);
-                    ni->time_suspend = 0;
-                    ni->time_expiresuspend = 0;
-                    ni->status &= ~NS_SUSPENDED;                        
-                }     
-                        
+	if (ni->status & NS_SUSPENDED)
+	    if (ni->time_expiresuspend != 0 && ni->time_expiresuspend <= now) {
+		if (NSExpire && NSSuspendGrace &&
+		       (now - ni->last_seen >= NSExpire - NSSuspendGrace))
+		    ni->last_seen = now - NSExpire + NSSuspendGrace;	    
+		log("Expiring nick-suspend for %s", ni->nick);
+		canalopers(s_NickServ, "Expirando suspension del nick %s", ni->nick);
+		free(ni->suspendby);
+		free(ni->suspendreason);
+		ni->time_suspend = 0;
+		ni->time_expiresuspend = 0;
+		ni->status &= ~NS_SUSPENDED;                        
+	    }     
+			
       /* Expiracion nicks */
-	    if (now - ni->last_seen >= NSExpire
-			&& !(ni->status & (NS_VERBOTEN | NS_NO_EXPIRE | NS_SUSPENDED))) {
-		log("Expiring nickname %s", ni->nick);
-		canalopers(s_NickServ, "Expirando el nick %s", ni->nick);
-		delnick(ni);
-	    }
-	    
+	if (now - ni->last_seen >= NSExpire
+		    && !(ni->status & (NS_VERBOTEN | NS_NO_EXPIRE | NS_SUSPENDED))) {
+	    log("Expiring nickname %s", ni->nick);
+	    canalopers(s_NickServ, "Expirando el nick %s", ni->nick);
+	    delnick(ni);
+	    continue;
 	}
+	schedule_nick_expire(ni);
     }
+    return expire_due(&ns_expire, now);
+}
+
+/*************************************************************************/
+
+/* Put a nick in the expiry heap at the time it next needs to be checked:
+ * when its suspension ends, or when it would expire if not seen before.
+ * Nicks which cannot expire are just checked again after NSExpire.  The
+ * time only has to be no later than the real one, so callers only need
+ * to reschedule when a change makes a nick expire sooner.
+ */
+
+static void schedule_nick_expire(NickInfo *ni)
+{
+    time_t when;
+
+    if ((ni->status & NS_SUSPENDED) && ni->time_expiresuspend)
+	when = ni->time_expiresuspend;
+    else if (ni->status & (NS_VERBOTEN | NS_NO_EXPIRE | NS_SUSPENDED))
+	when = cur_time + NSExpire;
+    else
+	when = ni->last_seen + NSExpire;
+    expire_add(&ns_expire, ni, &ni->expire_pos, when);
 }
 
 /*************************************************************************/
@@ -1067,12 +1856,13 @@ NickInfo *findnick(const char *nick)
         return NULL;
 
  /* Codigo Nuevo */
-    for (ni = nicklists[toLower(*nick)]; ni; ni = ni->next) {
-        if (strCasecmp(ni->nick, nick) == 0)
-            return ni;
-    }    
- 
-    for (ni = nicklists[toUpper(*nick)]; ni; ni = ni->next) {
+    /* Los nicks estan en nicklists[] por tolower() de la primera letra,
+     * asi que "[x" y "{x" caian en listas distintas; la tabla hash ya usa
+     * la equivalencia de strCasecmp() */
+    if (!nickhash)
+	return NULL;
+    for (ni = nickhash[hash_nocase(nick) & (nickhash_size-1)]; ni;
+							ni = ni->hnext) {
         if (strCasecmp(ni->nick, nick) == 0)
             return ni;
     }
@@ -1081,32 +1871,134 @@ NickInfo *findnick(const char *nick)
 
 /*************************************************************************/
 
-/* Return the "master" nick for the given nick; i.e., trace the linked list
- * through the `link' field until we find a nickname with a NULL `link'
- * field.  Assumes `ni' is not NULL.
- *
- * Note that we impose an arbitrary limit of 512 nested links.  This is to
- * prevent infinite loops in case someone manages to create a circular
- * link.  If we pass this limit, we arbitrarily cut off the link at the
- * initial nick.
+/* Return the "master" nick for the given nick; i.e., the nickname at the
+ * end of the chain of `link' fields, the one with a NULL `link' field.
+ * Each nick keeps this in its `master' field, which set_link() and
+ * clear_link() update for the nick and everything linked to it, so this
+ * doesn't have to walk the chain.
  */
 
 NickInfo *getlink(NickInfo *ni)
 {
-    NickInfo *orig = ni;
-    int i = 0;
-    
-    if(ni) 
-        while (ni->link && ++i < 512)
-	    ni = ni->link;
-    if (i >= 512) {
-	log("%s: Infinite loop(?) found at nick %s for nick %s, cutting link",
-		s_NickServ, ni->nick, orig->nick);
-	orig->link = NULL;
-	ni = orig;
-	/* FIXME: we should sanitize the data fields */
+    return ni ? ni->master : NULL;
+}
+
+/*************************************************************************/
+
+/* Set the master of a nick and of all the nicks linked to it (directly or
+ * not). */
+
+static void set_master(NickInfo *ni, NickInfo *master)
+{
+    NickInfo *ptr;
+
+    ni->master = master;
+    for (ptr = ni->links; ptr; ptr = ptr->link_next)
+	set_master(ptr, master);
+}
+
+/* Link a nick (which must not be linked already) to another one. */
+
+static void set_link(NickInfo *ni, NickInfo *target)
+{
+    ni->link = target;
+    ni->link_prev = NULL;
+    ni->link_next = target->links;
+    if (target->links)
+	target->links->link_prev = ni;
+    target->links = ni;
+    target->linkcount++;
+    set_master(ni, target->master);
+    link_generation++;
+}
+
+/* Remove a nick from its parent's list of links, making it a master.  The
+ * data fields are left alone; see delink(). */
+
+static void clear_link(NickInfo *ni)
+{
+    NickInfo *link = ni->link;
+
+    if (!link)
+	return;
+    if (ni->link_next)
+	ni->link_next->link_prev = ni->link_prev;
+    if (ni->link_prev)
+	ni->link_prev->link_next = ni->link_next;
+    else
+	link->links = ni->link_next;
+    ni->link_next = ni->link_prev = NULL;
+    ni->link = NULL;
+    link->linkcount--;
+    set_master(ni, ni);
+    link_generation++;
+}
+
+/* Build the lists of links and the master of every nick, once the
+ * database has been loaded and the link names resolved.  The saved link
+ * counts are recounted.  As a safeguard against circular links, chains of
+ * more than 512 nicks are cut off at the first nick.
+ */
+
+static void build_links(void)
+{
+    NickInfo *ni, *ptr, *link;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+	for (ni = nicklists[i]; ni; ni = ni->next) {
+	    ni->master = NULL;
+	    ni->links = ni->link_next = ni->link_prev = NULL;
+	    ni->linkcount = 0;
+	}
+    }
+    for (i = 0; i < 256; i++) {
+	for (ni = nicklists[i]; ni; ni = ni->next) {
+	    if ((link = ni->link) != NULL) {
+		ni->link_next = link->links;
+		if (link->links)
+		    link->links->link_prev = ni;
+		link->links = ni;
+		link->linkcount++;
+	    }
+	}
+    }
+    for (i = 0; i < 256; i++) {
+	for (ni = nicklists[i]; ni; ni = ni->next) {
+	    if (ni->master)
+		continue;
+	    j = 0;
+	    for (ptr = ni; ptr->link && ++j < 512; ptr = ptr->link)
+		;
+	    if (j >= 512) {
+		log("%s: Infinite loop(?) found at nick %s for nick %s, "
+		    "cutting link", s_NickServ, ptr->nick, ni->nick);
+		clear_link(ni);
+		/* FIXME: we should sanitize the data fields */
+	    } else {
+		ni->master = ptr;
+	    }
+	}
     }
-    return ni;
+}
+
+/*************************************************************************/
+
+/* Record the user's current user@host and realname as the nick's last
+ * seen ones. */
+
+void set_last_usermask(NickInfo *ni, User *u)
+{
+    char buf[BUFSIZE];
+    char *mask, *realname;
+
+    snprintf(buf, sizeof(buf), "%s@%s", u->username, u->host);
+    mask = sintern(buf);
+    realname = sintern(u->realname);
+    sunintern(ni->last_usermask);
+    sunintern(ni->last_realname);
+    ni->last_usermask = mask;
+    ni->last_realname = realname;
 }
 
 /*************************************************************************/
@@ -1162,6 +2054,65 @@ static void alpha_insert_nick(NickInfo *ni)
 
 /*************************************************************************/
 
+/* Rebuild the findnick() hash table with the given (power of 2) size. */
+
+static void resize_nickhash(int newsize)
+{
+    NickInfo **newhash, *ni, *next, **list;
+    int i;
+
+    if (debug)
+	log("debug: Redimensionando tabla de nicks de %d a %d",
+		nickhash_size, newsize);
+    newhash = scalloc(sizeof(NickInfo *), newsize);
+    for (i = 0; i < nickhash_size; i++) {
+	for (ni = nickhash[i]; ni; ni = next) {
+	    next = ni->hnext;
+	    list = &newhash[hash_nocase(ni->nick) & (newsize-1)];
+	    ni->hnext = *list;
+	    *list = ni;
+	}
+    }
+    if (nickhash)
+	free(nickhash);
+    nickhash = newhash;
+    nickhash_size = newsize;
+}
+
+/* Add a nick to / remove a nick from the findnick() hash table. */
+
+static void hash_insert_nick(NickInfo *ni)
+{
+    NickInfo **list;
+
+    if (!nickhash)
+	resize_nickhash(NICKHASH_MIN);
+    else if (nickhash_count >= nickhash_size)
+	resize_nickhash(nickhash_size * 2);
+    list = &nickhash[hash_nocase(ni->nick) & (nickhash_size-1)];
+    ni->hnext = *list;
+    *list = ni;
+    nickhash_count++;
+}
+
+static void hash_remove_nick(NickInfo *ni)
+{
+    NickInfo **list;
+
+    if (!nickhash)
+	return;
+    for (list = &nickhash[hash_nocase(ni->nick) & (nickhash_size-1)];
+			*list; list = &(*list)->hnext) {
+	if (*list == ni) {
+	    *list = ni->hnext;
+	    nickhash_count--;
+	    return;
+	}
+    }
+}
+
+/*************************************************************************/
+
 /* Add a nick to the database.  Returns a pointer to the new NickInfo
  * structure if the nick was successfully registered, NULL otherwise.
  * Assumes nick does not already exist.
@@ -1173,7 +2124,12 @@ static NickInfo *makenick(const char *nick)
 
     ni = scalloc(sizeof(NickInfo), 1);
     strscpy(ni->nick, nick, NICKMAX);
+    ni->master = ni;
     alpha_insert_nick(ni);
+    hash_insert_nick(ni);
+    search_add(&ns_search, ni, &ni->search_id, ni->nick);
+    /* Se mira en la siguiente pasada, ya con last_seen puesto */
+    expire_add(&ns_expire, ni, &ni->expire_pos, cur_time);
     return ni;
 }
 
@@ -1188,15 +2144,21 @@ static int delnick(NickInfo *ni)
 {
     int i;
 
+    expire_del(&ns_expire, &ni->expire_pos);
+    search_del(&ns_search, &ni->search_id);
+    nicklist_forget(ni);
+    hash_remove_nick(ni);
     cs_remove_nick(ni);
     os_remove_nick(ni);
 #ifdef CYBER
     cyber_remove_nick(ni);
 #endif
-    if (ni->linkcount)
+    /* cs_remove_nick() ya ha quitado sus entradas de los access list (con
+     * access_changed() en esos canales); link_generation solo cambia, en
+     * clear_link() y set_link(), si el nick tenia enlaces. */
+    if (ni->links)
 	remove_links(ni);
-    if (ni->link)
-	ni->link->linkcount--;
+    clear_link(ni);
     if (ni->next)
 	ni->next->prev = ni->prev;
     if (ni->prev)
@@ -1207,10 +2169,8 @@ static int delnick(NickInfo *ni)
     	free(ni->emailreg);
     if (ni->msg_fullmemo)
         free(ni->msg_fullmemo);
-    if (ni->last_usermask)
-	free(ni->last_usermask);
-    if (ni->last_realname)
-	free(ni->last_realname);
+    sunintern(ni->last_usermask);
+    sunintern(ni->last_realname);
     if (ni->suspendby)
         free(ni->suspendby);
     if (ni->suspendreason)
@@ -1227,10 +2187,8 @@ static int delnick(NickInfo *ni)
 	free(ni->access);
     }
     if (ni->memos.memos) {
-	for (i = 0; i < ni->memos.memocount; i++) {
-	    if (ni->memos.memos[i].text)
-		free(ni->memos.memos[i].text);
-	}
+	for (i = 0; i < ni->memos.memocount; i++)
+	    memo_free_text(&ni->memos.memos[i]);
 	free(ni->memos.memos);
     }
     free(ni);
@@ -1240,25 +2198,21 @@ static int delnick(NickInfo *ni)
 /*************************************************************************/
 
 /* Remove any links to the given nick (i.e. prior to deleting the nick).
- * Note this is currently linear in the number of nicks in the database--
- * that's the tradeoff for the nice clean method of keeping a single parent
- * link in the data structure.
+ * Nicks linked to it are moved up to its own parent, or unlinked if it
+ * has none.
  */
 
 static void remove_links(NickInfo *ni)
 {
-    int i;
-    NickInfo *ptr;
+    NickInfo *ptr, *next;
 
-    for (i = 0; i < 256; i++) {
-	for (ptr = nicklists[i]; ptr; ptr = ptr->next) {
-	    if (ptr->link == ni) {
-		if (ni->link) {
-		    ptr->link = ni->link;
-		    ni->link->linkcount++;
-		} else
-		    delink(ptr);
-	    }
+    for (ptr = ni->links; ptr; ptr = next) {
+	next = ptr->link_next;
+	if (ni->link) {
+	    clear_link(ptr);
+	    set_link(ptr, ni->link);
+	} else {
+	    delink(ptr);
 	}
     }
 }
@@ -1272,7 +2226,7 @@ static void delink(NickInfo *ni)
     NickInfo *link;
 
     link = ni->link;
-    ni->link = NULL;
+    clear_link(ni);
     do {
 	link->channelcount -= ni->channelcount;
 	if (link->link)
@@ -1294,7 +2248,6 @@ static void delink(NickInfo *ni)
 	for (i = 0; i < ni->accesscount; i++, access++)
 	    *access = sstrdup(link->access[i]);
     }
-    link->linkcount--;
 }
 
 /*************************************************************************/
@@ -1354,7 +2307,7 @@ static void collide(NickInfo *ni, int from_timeout)
 //        notice_lang(s_NickServ, u, FORCENICKCHANGE_NOW, guestnick);
         notice_lang(s_NickServ, u, FORCENICKCHANGE_NOW, "ircXXXXXX");
 
-//	send_cmd(NULL, "SVSNICK %s %s :%ld", ni->nick, guestnick, time(NULL));
+//	send_cmd(NULL, "SVSNICK %s %s :%ld", ni->nick, guestnick, cur_time);
         /* Comando SVSNICK de TERRA */
         send_cmd(ServerName, "SVSNICK %s", ni->nick);        
 	ni->status |= NS_GUESTED;
@@ -1362,7 +2315,7 @@ static void collide(NickInfo *ni, int from_timeout)
 	notice_lang(s_NickServ, u, DISCONNECT_NOW);
     	kill_user(s_NickServ, ni->nick, "Nick kill enforced");
     	send_cmd(NULL, "NICK %s %ld 1 %s %s %s :Protegiendo a %s",
-		ni->nick, time(NULL), NSEnforcerUser, NSEnforcerHost,
+		ni->nick, cur_time, NSEnforcerUser, NSEnforcerHost,
 		ServerName, ni->nick);
 	ni->status |= NS_KILL_HELD;
 	add_ns_timeout(ni, TO_RELEASE, NSReleaseTimeout);
@@ -1673,7 +2626,7 @@ static void do_register(User *u)
     if (!pass || (stricmp(pass, u->nick) == 0 && strtok(NULL, " "))) {
 	syntax_error(s_NickServ, u, "REGISTER", NICK_REGISTER_SYNTAX);
 #endif
-    } else if ((time(NULL) < u->lastnickreg + NSRegDelay) && !is_oper(u->nick)) {
+    } else if ((cur_time < u->lastnickreg + NSRegDelay) && !is_oper(u->nick)) {
 	notice_lang(s_NickServ, u, NICK_REG_PLEASE_WAIT, NSRegDelay);
 
     } else if (u->real_ni) {	/* i.e. there's already such a nick regged */
@@ -1713,7 +2666,7 @@ static void do_register(User *u)
 /* Registro de nicks por mail
  * - zoltan
  */
-        srand(time(NULL));
+        srand(cur_time);
         sprintf(pass,"Terra%04u",1+(int)(rand()%9999));
 #else
     } else if (stricmp(u->nick, pass) == 0
@@ -1773,10 +2726,8 @@ static void do_register(User *u)
             ni->msg_fullmemo = NULL;
 	    ni->channelcount = 0;
 	    ni->channelmax = CSMaxReg;
-	    ni->last_usermask = smalloc(strlen(u->username)+strlen(u->host)+2);
-	    sprintf(ni->last_usermask, "%s@%s", u->username, u->host);
-	    ni->last_realname = sstrdup(u->realname);
-	    ni->time_registered = ni->last_seen = time(NULL);
+	    set_last_usermask(ni, u);
+	    ni->time_registered = ni->last_seen = cur_time;
 /* A peticion de GSi, que se registraba con masks muy genericas
  * de tipo Ircap6.999@*.uc.nombres.ttd.es
  * Se borra del codigo
@@ -1825,7 +2776,7 @@ static void do_register(User *u)
 #if defined (USE_ENCRYPTION) && !defined (REG_NICK_MAIL)
 	    notice_lang(s_NickServ, u, NICK_PASSWORD_IS, ni->pass);
 #endif
-	    u->lastnickreg = time(NULL);
+	    u->lastnickreg = cur_time;
 
 #ifndef REG_NICK_MAIL
 	    send_cmd(ServerName, "SVSMODE %s +r", u->nick);
@@ -1871,7 +2822,7 @@ static void do_identify(User *u)
         time_t last_login;
         char buf[BUFSIZE];
         struct tm *tm;
-        time_t now = time(NULL);
+        time_t now = cur_time;
         char **av_umode;        
                 
         last_mask = sstrdup(ni->last_usermask);
@@ -1880,14 +2831,8 @@ static void do_identify(User *u)
             notice_lang(s_NickServ, u, NICK_IS_IDENTIFIED, ni->nick);
 	ni->id_timestamp = u->signon;
 	if (!(ni->status & NS_RECOGNIZED)) {
-	    ni->last_seen = time(NULL);
-	    if (ni->last_usermask)
-		free(ni->last_usermask);
-	    ni->last_usermask = smalloc(strlen(u->username)+strlen(u->host)+2);
-	    sprintf(ni->last_usermask, "%s@%s", u->username, u->host);
-	    if (ni->last_realname)
-		free(ni->last_realname);
-	    ni->last_realname = sstrdup(u->realname);
+	    ni->last_seen = cur_time;
+	    set_last_usermask(ni, u);
 	}
         if (!(ni->status & NS_IDENTIFIED)) {
 //            log("%s: %s!%s@%s identified for nick %s", s_NickServ,
@@ -2134,7 +3079,7 @@ static void do_set_password(User *u, NickInfo *ni, char *param)
 	notice_lang(s_NickServ, u, PASSWORD_TRUNCATED, PASSMAX-1);
     strscpy(ni->pass, param, PASSMAX);
     ni->flags &= ~NI_CHANGE_PASS;
-    ni->last_changed_pass = time(NULL);
+    ni->last_changed_pass = cur_time;
     notice_lang(s_NickServ, u, NICK_SET_PASSWORD_CHANGED_TO, ni->pass);
 #endif
     if (u->real_ni != ni) {
@@ -2329,6 +3274,7 @@ static void do_set_noexpire(User *u, NickInfo *ni, char *param)
 	notice_lang(s_NickServ, u, NICK_SET_NOEXPIRE_ON, ni->nick);
     } else if (stricmp(param, "OFF") == 0) {
 	ni->status &= ~NS_NO_EXPIRE;
+	schedule_nick_expire(ni);
 	notice_lang(s_NickServ, u, NICK_SET_NOEXPIRE_OFF, ni->nick);
     } else {
 	syntax_error(s_NickServ, u, "SET NOEXPIRE", NICK_SET_NOEXPIRE_SYNTAX);
@@ -2488,8 +3434,7 @@ static void do_link(User *u)
 	if (ni->link)
 	    delink(ni);
 
-	ni->link = target;
-	target->linkcount++;
+	set_link(ni, target);
 	do {
 	    target->channelcount += ni->channelcount;
 	    if (target->link)
@@ -2604,12 +3549,33 @@ static void do_unlink(User *u)
 
 /*************************************************************************/
 
+/* Send the nicks linked to `ni' (and, if `all' is set, the ones linked to
+ * those in turn) for LISTLINKS on `top'.  Return how many were sent. */
+
+static int send_links(User *u, NickInfo *ni, NickInfo *top, int all)
+{
+    NickInfo *ptr;
+    int count = 0;
+
+    for (ptr = ni->links; ptr; ptr = ptr->link_next) {
+	if (ni == top)
+	    notice_lang(s_NickServ, u, NICK_X_IS_LINKED, ptr->nick);
+	else
+	    notice_lang(s_NickServ, u, NICK_X_IS_LINKED_VIA_X,
+				ptr->nick, ni->nick);
+	count++;
+	if (all)
+	    count += send_links(u, ptr, top, all);
+    }
+    return count;
+}
+
 static void do_listlinks(User *u)
 {
     char *nick = strtok(NULL, " ");
     char *param = strtok(NULL, " ");
-    NickInfo *ni, *ni2;
-    int count = 0, i;
+    NickInfo *ni;
+    int count;
 
     if (!nick || (param && stricmp(param, "ALL") != 0)) {
 	syntax_error(s_NickServ, u, "LISTLINKS", NICK_LISTLINKS_SYNTAX);
@@ -2624,20 +3590,7 @@ static void do_listlinks(User *u)
 	notice_lang(s_NickServ, u, NICK_LISTLINKS_HEADER, ni->nick);
 	if (param)
 	    ni = getlink(ni);
-	for (i = 0; i < 256; i++) {
-	    for (ni2 = nicklists[i]; ni2; ni2 = ni2->next) {
-		if (ni2 == ni)
-		    continue;
-		if (param ? getlink(ni2) == ni : ni2->link == ni) {
-                    if (ni2->link == ni)
-                        notice_lang(s_NickServ, u, NICK_X_IS_LINKED, ni2->nick);
-                    else
-                        notice_lang(s_NickServ, u, NICK_X_IS_LINKED_VIA_X,
-                                          ni2->nick, ni2->link->nick);                        
-		    count++;
-		}
-	    }
-	}
+	count = send_links(u, ni, ni, param != NULL);
 	notice_lang(s_NickServ, u, NICK_LISTLINKS_FOOTER, count);
     }
 }
@@ -2673,7 +3626,6 @@ static void do_info(User *u)
 	struct tm *tm;
 	char buf[BUFSIZE], *end;
 	const char *commastr = getstring(u->ni, COMMA_SPACE);
-	int i;
 	NickInfo *ni2;
 	int need_comma = 0;
 	int nick_online = 0;
@@ -2702,7 +3654,7 @@ static void do_info(User *u)
             notice_lang(s_NickServ, u, NICK_INFO_SUSPENDED, ni->suspendreason);
             if (is_services_oper(u)) {
                 char timebuf[32], expirebuf[256];
-                time_t now = time(NULL);
+                time_t now = cur_time;
                 tm = localtime(&ni->time_suspend);            
                 strftime_lang(timebuf, sizeof(timebuf), u, STRFTIME_DATE_TIME_FORMAT, tm);
                 if (ni->time_expiresuspend == 0) {
@@ -2808,14 +3760,10 @@ static void do_info(User *u)
 #endif            
             check_cs_access(u, ni);
            /* Si hay links, mostrar la info */
-            if (ni->linkcount) {
-                for (i = 0; i < 256; i++)
-                    for (ni2 = nicklists[i]; ni2; ni2 = ni2->next)
-                        if (ni2->link == ni) {
-                            notice_lang(s_NickServ, u, NICK_INFO_LINKS, ni2->nick, 
-                                      ni2->email ? ni2->email : "Sin email");
-                            check_cs_access(u, ni2);
-                        }                    
+            for (ni2 = ni->links; ni2; ni2 = ni2->link_next) {
+                notice_lang(s_NickServ, u, NICK_INFO_LINKS, ni2->nick, 
+                            ni2->email ? ni2->email : "Sin email");
+                check_cs_access(u, ni2);
             }                    
         }           
     }
@@ -2823,13 +3771,185 @@ static void do_info(User *u)
 
 /*************************************************************************/
 
+/* Mira si un nick entra en el LIST y, si es asi, lo manda.  Devuelve 1 si
+ * se ha mostrado. */
+
+static int nicklist_match(User *u, NickList *nl, NickInfo *ni)
+{
+    char buf[BUFSIZE];
+    int is_servoper = nl->is_servoper;
+
+    if (!is_servoper && ((ni->flags & NI_PRIVATE)
+				    || (ni->status & NS_VERBOTEN)))
+	return 0;
+    if ((nl->matchflags != 0) && !(ni->status & nl->matchflags))
+	return 0;
+
+    /* We no longer compare the pattern against the output buffer.
+     * Instead we build a nice nick!user@host buffer to compare.
+     * The output is then generated separately. -TheShadow */
+    snprintf(buf, sizeof(buf), "%s!%s", ni->nick,
+			ni->last_usermask ? ni->last_usermask : "*@*");
+    if (stricmp(nl->pattern, ni->nick) != 0 &&
+				!match_wild_nocase(nl->pattern, buf))
+	return 0;
+
+    {
+	char noexpire_char = ' ';
+	char suspend_char = ' ';
+	if (is_servoper) {
+	    if (ni->status & NS_NO_EXPIRE)
+		noexpire_char = '!';
+	    if (ni->status & NS_SUSPENDED)
+		suspend_char = '*';
+	}
+//	if (!is_servoper && (ni->flags & NI_HIDE_MASK)) {
+	if (!is_servoper) {
+	    snprintf(buf, sizeof(buf), "%-20s  [Oculto]",
+				ni->nick);
+	} else if (ni->status & NS_VERBOTEN) {
+	    snprintf(buf, sizeof(buf), "%-20s  [Prohibido]",
+				ni->nick);
+	} else if (ni->status & NS_SUSPENDED) {
+	    snprintf(buf, sizeof(buf), "%-20s  [Suspendido]",
+				ni->nick);
+	} else {
+	    snprintf(buf, sizeof(buf), "%-20s  %s",
+				ni->nick, ni->last_usermask);
+	}
+	privmsg(s_NickServ, u->nick, "   %c%c%s",
+			suspend_char, noexpire_char, buf);
+    }
+    nl->shown++;
+    return 1;
+}
+
+/*************************************************************************/
+
+/* Libera un LIST terminado o cancelado. */
+
+static void nicklist_free(NickList *nl)
+{
+    if (nl->next)
+	nl->next->prev = nl->prev;
+    if (nl->prev)
+	nl->prev->next = nl->next;
+    else
+	nicklist_jobs = nl->next;
+    if (nl->bucket >= 0)
+	search_release(&ns_search);
+    free(nl->pattern);
+    free(nl);
+}
+
+/*************************************************************************/
+
+/* Avanza un LIST hasta SEARCH_STEP nicks.  Devuelve 1 si queda trabajo;
+ * si no, manda el final de la lista y libera el LIST.
+ *
+ * Con prefijo literal solo se recorre el tramo de nicklists[] que empieza
+ * por el (las listas estan en orden alfabetico); si el patron aisla el
+ * nick (nick!user@host) se miran solo los candidatos de ns_search; si no,
+ * toda la base de datos.  En todos los casos se para al llegar a
+ * NSListMax.
+ */
+
+static int nicklist_run(NickList *nl)
+{
+    User *u = nl->who;
+    NickInfo *ni;
+    int n, done = 0;
+
+    /* Si ha dejado de ser oper no ve el resto de la lista de oper */
+    if (nl->is_servoper && !is_services_oper(u)) {
+	nicklist_free(nl);
+	return 0;
+    }
+    for (n = 0; n < SEARCH_STEP && nl->shown < NSListMax; n++) {
+	if (nl->bucket >= 0) {
+	    Postings *p = &ns_search.post[nl->bucket];
+	    if (nl->pos >= p->count) {
+		done = 1;
+		break;
+	    }
+	    if (!(ni = search_get(&ns_search, p->ids[nl->pos++])))
+		continue;
+	} else {
+	    while (!nl->ni && !nl->prefixlen && ++nl->i < 256)
+		nl->ni = nicklists[nl->i];
+	    if (!(ni = nl->ni)) {
+		done = 1;
+		break;
+	    }
+	    nl->ni = ni->next;
+	    if (nl->prefixlen) {
+		int cmp = strnicmp(ni->nick, nl->pattern, nl->prefixlen);
+		if (cmp < 0)
+		    continue;
+		if (cmp > 0) {
+		    done = 1;
+		    break;
+		}
+	    }
+	}
+	nicklist_match(u, nl, ni);
+    }
+    if (!done && nl->shown < NSListMax)
+	return 1;
+    notice_lang(s_NickServ, u, NICK_LIST_RESULTS, nl->shown);
+    nicklist_free(nl);
+    return 0;
+}
+
+static int nicklist_job(Job *j)
+{
+    return nicklist_run(j->data);
+}
+
+/*************************************************************************/
+
+/* Un nick va a desaparecer; que ningun LIST en curso se quede apuntando a
+ * el. */
+
+static void nicklist_forget(NickInfo *ni)
+{
+    NickList *nl;
+
+    for (nl = nicklist_jobs; nl; nl = nl->next) {
+	if (nl->ni == ni)
+	    nl->ni = ni->next;
+    }
+}
+
+/*************************************************************************/
+
+/* Cancela el LIST en curso de un usuario, si tiene alguno.  Se llama
+ * tambien cuando el usuario sale o cambia de nick, para que el resto de la
+ * lista no le llegue a otro que coja ese nick. */
+
+void cancel_nick_list(User *u)
+{
+    NickList *nl;
+
+    for (nl = nicklist_jobs; nl; nl = nl->next) {
+	if (nl->who == u) {
+	    if (nl->job)
+		del_job(nl->job);
+	    nicklist_free(nl);
+	    return;
+	}
+    }
+}
+
+/*************************************************************************/
+
 static void do_list(User *u)
 {
     char *pattern = strtok(NULL, " ");
     char *keyword;
+    NickList *nl;
     NickInfo *ni;
-    int nnicks, i;
-    char buf[BUFSIZE];
+    char *s;
     int is_servoper = is_services_oper(u);
     int16 matchflags = 0; /* NS_ flags a nick must match one of to qualify */
 
@@ -2841,66 +3961,59 @@ static void do_list(User *u)
     if (!pattern) {
 	syntax_error(s_NickServ, u, "LIST",
 		is_servoper ? NICK_LIST_SERVADMIN_SYNTAX : NICK_LIST_SYNTAX);
-    } else {
-	nnicks = 0;
-
-	while (is_servoper && (keyword = strtok(NULL, " "))) {
-	    if (stricmp(keyword, "FORBID") == 0)
-		matchflags |= NS_VERBOTEN;
-            if (stricmp(keyword, "SUSPEND") == 0)
-                matchflags |= NS_SUSPENDED;		
-	    if (stricmp(keyword, "NOEXPIRE") == 0)
-		matchflags |= NS_NO_EXPIRE;
-	}
+	return;
+    }
 
-	notice_lang(s_NickServ, u, NICK_LIST_HEADER, pattern);
-	for (i = 0; i < 256; i++) {
-	    for (ni = nicklists[i]; ni; ni = ni->next) {
-		if (!is_servoper && ((ni->flags & NI_PRIVATE)
-						|| (ni->status & NS_VERBOTEN)))
-		    continue;
-		if ((matchflags != 0) && !(ni->status & matchflags))
-		    continue;
+    while (is_servoper && (keyword = strtok(NULL, " "))) {
+	if (stricmp(keyword, "FORBID") == 0)
+	    matchflags |= NS_VERBOTEN;
+	if (stricmp(keyword, "SUSPEND") == 0)
+	    matchflags |= NS_SUSPENDED;
+	if (stricmp(keyword, "NOEXPIRE") == 0)
+	    matchflags |= NS_NO_EXPIRE;
+    }
 
-		/* We no longer compare the pattern against the output buffer.
-		 * Instead we build a nice nick!user@host buffer to compare.
-		 * The output is then generated separately. -TheShadow */
-		snprintf(buf, sizeof(buf), "%s!%s", ni->nick,
-				ni->last_usermask ? ni->last_usermask : "*@*");
-		if (stricmp(pattern, ni->nick) == 0 ||
-					match_wild_nocase(pattern, buf)) {
-		    if (++nnicks <= NSListMax) {
-			char noexpire_char = ' ';
-                        char suspend_char = ' ';
-                        if (is_servoper) {
-                           if (ni->status & NS_NO_EXPIRE)
-                               noexpire_char = '!';
-                            if (ni->status & NS_SUSPENDED)
-                                suspend_char = '*';
-                        }
-//                     if (!is_servoper && (ni->flags & NI_HIDE_MASK)) {
-                        if (!is_servoper) {
-                            snprintf(buf, sizeof(buf), "%-20s  [Oculto]",
-						ni->nick);
-			} else if (ni->status & NS_VERBOTEN) {
-			    snprintf(buf, sizeof(buf), "%-20s  [Prohibido]",
-						ni->nick);
-                        } else if (ni->status & NS_SUSPENDED) {
-                            snprintf(buf, sizeof(buf), "%-20s  [Suspendido]",
-                                                ni->nick);						
-			} else {
-			    snprintf(buf, sizeof(buf), "%-20s  %s",
-						ni->nick, ni->last_usermask);
-			}
-			privmsg(s_NickServ, u->nick, "   %c%c%s",
-                                       suspend_char, noexpire_char, buf);
-		    }
-		}
-	    }
-	}
-	notice_lang(s_NickServ, u, NICK_LIST_RESULTS,
-			nnicks>NSListMax ? NSListMax : nnicks, nnicks);
+    /* Un LIST nuevo cancela el anterior del mismo usuario */
+    cancel_nick_list(u);
+
+    nl = scalloc(sizeof(NickList), 1);
+    nl->who = u;
+    nl->pattern = sstrdup(pattern);
+    nl->is_servoper = is_servoper;
+    nl->matchflags = matchflags;
+    nl->bucket = -1;
+    nl->prefixlen = strcspn(pattern, "*?");
+    nl->next = nicklist_jobs;
+    if (nicklist_jobs)
+	nicklist_jobs->prev = nl;
+    nicklist_jobs = nl;
+
+    notice_lang(s_NickServ, u, NICK_LIST_HEADER, pattern);
+
+    if (nl->prefixlen && (s = memchr(pattern, '!', nl->prefixlen))) {
+	/* El nick esta entero en el patron: solo puede ser ese */
+	*s = 0;
+	ni = findnick(pattern);
+	*s = '!';
+	if (ni)
+	    nicklist_match(u, nl, ni);
+	notice_lang(s_NickServ, u, NICK_LIST_RESULTS, nl->shown);
+	nicklist_free(nl);
+	return;
+    } else if (nl->prefixlen) {
+	nl->i = tolower(*pattern);
+	nl->ni = nicklists[nl->i];
+    } else if ((s = strchr(pattern, '!'))
+		&& (nl->bucket = search_bucket(&ns_search, pattern,
+						s - pattern)) >= 0) {
+	search_hold(&ns_search);
+    } else {
+	nl->i = 0;
+	nl->ni = nicklists[0];
     }
+
+    if (nicklist_run(nl))
+	nl->job = add_job(nicklist_job, nl);
 }
 
 /*************************************************************************/
@@ -3071,29 +4184,30 @@ static void do_status(User *u)
 
 static void do_opers(User *u)
 {
-    int i;
     int online = 0;
     User *u2;
     
-    for (i = 0; i < 1024; i++) {
-        for (u2 = userlist[i]; u2; u2 = u2->next) {
-            if (u2->ni && (u2->ni->status & NS_IDENTIFIED) && !(u2->mode & AWAY)) {     
-                if (is_services_admin(u2)) {
-                    privmsg(s_NickServ, u->nick, "%-10s es un 12Administrador de la red", u2->nick);
-                    online++;
-                    break;
-                }
-                if (is_services_oper(u2)) {
-                    privmsg(s_NickServ, u->nick, "%-10s es un 12Operador de la red", u2->nick);
-                    online++;
-                    break;
-                }                
-                if (u2->mode & UMODE_O) {
-                    privmsg(s_NickServ, u->nick, "%-10s es un 12IRCop de la red", u2->nick);
-                    online++;
-                }   
-            }                    
-        }
+    /* Cada usuario sale una sola vez, con su rango mas alto.  Cuando se
+     * recorrian las listas del hash, el break de un admin u oper cortaba
+     * tambien el resto de su lista, y los opers que estuvieran detras no
+     * salian. */
+    for (u2 = firstuser(); u2; u2 = nextuser()) {
+        if (u2->ni && (u2->ni->status & NS_IDENTIFIED) && !(u2->mode & AWAY)) {     
+            if (is_services_admin(u2)) {
+                privmsg(s_NickServ, u->nick, "%-10s es un 12Administrador de la red", u2->nick);
+                online++;
+                continue;
+            }
+            if (is_services_oper(u2)) {
+                privmsg(s_NickServ, u->nick, "%-10s es un 12Operador de la red", u2->nick);
+                online++;
+                continue;
+            }                
+            if (u2->mode & UMODE_O) {
+                privmsg(s_NickServ, u->nick, "%-10s es un 12IRCop de la red", u2->nick);
+                online++;
+            }   
+        }                    
     }        
     privmsg(s_NickServ, u->nick, "12%d IRCops, OPERS y ADMINS on-line", online);                
 
@@ -3265,20 +4379,21 @@ static void do_suspend(User *u)
                 notice_lang(s_NickServ, u, BAD_EXPIRY_TIME);
                 return;
             } else if (expires > 0) {
-                expires += time(NULL);
+                expires += cur_time;
             }    
         } else {
-            expires = time(NULL) + NSSuspendExpire;
+            expires = cur_time + NSSuspendExpire;
         }            
         u2 = finduser(nick);
         log("%s: %s!%s@%s SUSPENDi el nick %s, Motivo: %s",
                   s_NickServ, u->nick, u->username, u->host, nick, reason);
         ni->suspendby = sstrdup(u->nick);
         ni->suspendreason = sstrdup(reason);
-        ni->time_suspend = time(NULL);        
+        ni->time_suspend = cur_time;        
         ni->time_expiresuspend = expires;
         ni->status |= NS_SUSPENDED;
         ni->status &= ~NS_IDENTIFIED;
+        schedule_nick_expire(ni);
         notice_lang(s_NickServ, u, NICK_SUSPEND_SUCCEEDED, nick);
         canalopers(s_NickServ, "%s ha SUSPENDido el nick %s, motivo: %s",
                                               u->nick, nick, reason);        
@@ -3329,6 +4444,7 @@ static void do_unsuspend(User *u)
          ni->time_suspend = 0;
          ni->time_expiresuspend = 0;         
          ni->status &= ~NS_SUSPENDED;
+         schedule_nick_expire(ni);
          notice_lang(s_NickServ, u, NICK_UNSUSPEND_SUCCEEDED, nick);
          canalopers(s_NickServ, "%s ha reactivado el nick %s", u->nick, nick);
 
@@ -3512,10 +4628,8 @@ static void do_reguser(User *u)
             ni->msg_fullmemo = NULL;
 	    ni->channelcount = 0;
 	    ni->channelmax = CSMaxReg;
-	    ni->last_usermask = smalloc(strlen(u->username)+strlen(u->host)+2);
-	    sprintf(ni->last_usermask, "%s@%s", u->username, u->host);
-	    ni->last_realname = sstrdup(u->realname);
-	    ni->time_registered = ni->last_seen = time(NULL);
+	    set_last_usermask(ni, u);
+	    ni->time_registered = ni->last_seen = cur_time;
 /* A peticion de GSi, que se registraba con masks muy genericas
  * de tipo Ircap6.999@*.uc.nombres.ttd.es
  * Se borra del codigo
@@ -3537,7 +4651,7 @@ static void do_reguser(User *u)
 #if defined (USE_ENCRYPTION) && !defined (REG_NICK_MAIL)
 	    notice_lang(s_NickServ, u, NICK_PASSWORD_IS, ni->pass);
 #endif
-	    u->lastnickreg = time(NULL);
+	    u->lastnickreg = cur_time;
 
 	} else {
 	    log("%s: makenick(%s) failed", s_NickServ, u->nick);
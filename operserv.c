@@ -10,6 +10,7 @@
 
 #include "services.h"
 #include "pseudo.h"
+#include "latency.h"
 
 /*************************************************************************/
 
@@ -308,10 +309,10 @@ void load_os_dbase(void)
     if ((x) < 0) {						\
 	restore_db(f);						\
 	log_perror("Write error on %s", OperDBName);		\
-	if (time(NULL) - lastwarn > WarningTimeout) {		\
+	if (cur_time - lastwarn > WarningTimeout) {		\
 	    canalopers(NULL, "Write error on %s: %s", OperDBName,	\
 			strerror(errno));			\
-	    lastwarn = time(NULL);				\
+	    lastwarn = cur_time;				\
 	}							\
 	return;							\
     }								\
@@ -355,9 +356,18 @@ void save_os_dbase(void)
 
 /*************************************************************************/
 
-/* Does the given user have Services root privileges? */
+/* Privilege checks.  Working out whether someone is a Services root,
+ * admin or oper means walking the admin and oper lists, so the answer is
+ * kept in User.privs and only worked out again when something it depends
+ * on changes: the user's nick (do_nick() clears it), their effective
+ * NickInfo, whether they're identified or an IRC operator, or the lists
+ * and links themselves (privs_generation, link_generation). */
 
-int is_services_root(User *u)
+/* Bumped whenever the admin or oper lists change. */
+static uint32 privs_generation = 0;
+
+
+static int check_root(User *u)
 {
     if (!(u->mode & UMODE_O) || stricmp(u->nick, ServicesRoot) != 0)
 	return 0;
@@ -366,25 +376,15 @@ int is_services_root(User *u)
     return 0;
 }
 
-/*************************************************************************/
-
-/* Does the given user have Services admin privileges? */
 
-int is_services_admin(User *u)
+static int check_admin(User *u)
 {
     int i;
-/*
-    if (!(u->mode & UMODE_O))
-	return 0;
-*/
-    if (is_services_root(u))
-	return 1;
+
     if (skeleton)
 	return 1;
-
     if (u->ni && ((u->ni->flags & NI_ADMIN_SERV) && nick_identified(u)))
         return 1;
-   
     for (i = 0; i < MAX_SERVADMINS; i++) {
 	if (services_admins[i] && u->ni == getlink(services_admins[i])) {
 	    if (nick_identified(u))
@@ -395,24 +395,15 @@ int is_services_admin(User *u)
     return 0;
 }
 
-/*************************************************************************/
-
-/* Does the given user have Services oper privileges? */
 
-int is_services_oper(User *u)
+static int check_oper(User *u)
 {
     int i;
 
-//    if (!(u->mode & UMODE_O))
-//	return 0;
-    if (is_services_admin(u))
-	return 1;
     if (skeleton)
 	return 1;
-
     if (u->ni && ((u->ni->flags & NI_OPER_SERV) && nick_identified(u)))
         return 1;
-
     for (i = 0; i < MAX_SERVOPERS; i++) {
 	if (services_opers[i] && u->ni == getlink(services_opers[i])) {
 	    if (nick_identified(u))
@@ -423,6 +414,57 @@ int is_services_oper(User *u)
     return 0;
 }
 
+
+/* Return the user's PRIV_* bits, working them out again if needed.  Both
+ * generation counters only ever go up, so their sum only stays the same
+ * if neither has changed. */
+
+static int get_privs(User *u)
+{
+    int state = (u->mode & UMODE_O ? PRIV_IRCOP : 0)
+		| (nick_identified(u) ? PRIV_IDENTIFIED : 0);
+    uint32 gen = privs_generation + link_generation;
+
+    if ((u->privs & PRIV_KNOWN)
+	    && (u->privs & (PRIV_IRCOP | PRIV_IDENTIFIED)) == state
+	    && u->privs_ni == u->ni && u->privs_gen == gen)
+	return u->privs;
+
+    u->privs = PRIV_KNOWN | state;
+    if (check_root(u))
+	u->privs |= PRIV_ROOT | PRIV_ADMIN | PRIV_OPER;
+    else if (check_admin(u))
+	u->privs |= PRIV_ADMIN | PRIV_OPER;
+    else if (check_oper(u))
+	u->privs |= PRIV_OPER;
+    u->privs_ni = u->ni;
+    u->privs_gen = gen;
+    return u->privs;
+}
+
+/*************************************************************************/
+
+/* Does the given user have Services root privileges? */
+
+int is_services_root(User *u)
+{
+    return get_privs(u) & PRIV_ROOT;
+}
+
+/* Does the given user have Services admin privileges? */
+
+int is_services_admin(User *u)
+{
+    return get_privs(u) & PRIV_ADMIN;
+}
+
+/* Does the given user have Services oper privileges? */
+
+int is_services_oper(User *u)
+{
+    return get_privs(u) & PRIV_OPER;
+}
+
 /*************************************************************************/
 
 /* Is the given nick a Services admin/root nick? */
@@ -483,12 +525,16 @@ void os_remove_nick(const NickInfo *ni)
     int i;
 
     for (i = 0; i < MAX_SERVADMINS; i++) {
-	if (services_admins[i] == ni)
+	if (services_admins[i] == ni) {
 	    services_admins[i] = NULL;
+	    privs_generation++;
+	}
     }
     for (i = 0; i < MAX_SERVOPERS; i++) {
-	if (services_opers[i] == ni)
+	if (services_opers[i] == ni) {
 	    services_opers[i] = NULL;
+	    privs_generation++;
+	}
     }
 }
 
@@ -587,9 +633,90 @@ static void do_globaln(User *u)
 
 /* STATS command. */
 
+/* Numero de columnas del histograma de STATS HASH; la ultima agrupa las
+ * cadenas de esa longitud o mayores. */
+#define HASH_HISTLEN	9
+
+/* Manda la ocupacion de una tabla hash: tamano, factor de carga y cuantas
+ * entradas tienen cadenas de 0, 1, 2... elementos. */
+
+static void send_hash_stats(User *u, int msg, int size, int count, int *hist)
+{
+    char buf[BUFSIZE], *s = buf;
+    int i;
+
+    notice_lang(s_OperServ, u, msg, size, count, size ? count/size : 0,
+		size ? (count*100/size)%100 : 0);
+    *s = 0;
+    for (i = 0; i < HASH_HISTLEN; i++)
+	s += snprintf(s, sizeof(buf)-(s-buf), " %d%s:%d", i,
+		i == HASH_HISTLEN-1 ? "+" : "", hist[i]);
+    notice_lang(s_OperServ, u, OPER_STATS_HASH_CHAINS, buf);
+}
+
+/*************************************************************************/
+
+/* STATS LATENCY: list the messages and commands with the most total time.
+ */
+
+static int compare_latency(const void *a, const void *b)
+{
+    const LatStat *la = *(const LatStat **)a, *lb = *(const LatStat **)b;
+
+    return la->total < lb->total ? 1 : la->total > lb->total ? -1 : 0;
+}
+
+static void send_latency_stats(User *u, const char *param)
+{
+    LatStat *ls, **sorted;
+    char avg[16], p50[16], p99[16], max[16], total[16];
+    int n = 0, i, top = 10;
+
+    if (param && stricmp(param, "DUMP") == 0) {
+	if (lat_dump(LATENCY_FILENAME) < 0)
+	    notice_lang(s_OperServ, u, OPER_STATS_LATENCY_DUMP_FAILED,
+			LATENCY_FILENAME, strerror(errno));
+	else
+	    notice_lang(s_OperServ, u, OPER_STATS_LATENCY_DUMPED,
+			LATENCY_FILENAME);
+	return;
+    } else if (param && stricmp(param, "RESET") == 0) {
+	lat_reset();
+	log("%s: %s reset latency statistics", s_OperServ, u->nick);
+	notice_lang(s_OperServ, u, OPER_STATS_LATENCY_RESET);
+	return;
+    } else if (param && isdigit((int)*param)) {
+	top = atoi(param);
+    }
+
+    for (ls = lat_list(); ls; ls = ls->next)
+	n++;
+    sorted = smalloc(sizeof(*sorted) * (n ? n : 1));
+    for (i = 0, ls = lat_list(); ls; ls = ls->next)
+	sorted[i++] = ls;
+    qsort(sorted, n, sizeof(*sorted), compare_latency);
+
+    notice_lang(s_OperServ, u, OPER_STATS_LATENCY_HEADER,
+		top < n ? top : n, n);
+    for (i = 0; i < n && i < top && sorted[i]->count; i++) {
+	ls = sorted[i];
+	notice_lang(s_OperServ, u, OPER_STATS_LATENCY_FORMAT,
+		ls->service, ls->name,
+		(unsigned long)ls->count,
+		lat_format(avg, sizeof(avg), ls->total / ls->count),
+		lat_format(p50, sizeof(p50), lat_percentile(ls, 500)),
+		lat_format(p99, sizeof(p99), lat_percentile(ls, 990)),
+		lat_format(max, sizeof(max), ls->max),
+		lat_format(total, sizeof(total), ls->total));
+    }
+    free(sorted);
+}
+
+/*************************************************************************/
+
 static void do_stats(User *u)
 {
-    time_t uptime = time(NULL) - start_time;
+    time_t uptime = cur_time - start_time;
     char *extra = strtok(NULL, "");
     int days = uptime/86400, hours = (uptime/3600)%24,
         mins = (uptime/60)%60, secs = uptime%60;
@@ -618,6 +745,28 @@ static void do_stats(User *u)
 	    else
 		notice_lang(s_OperServ, u, OPER_STATS_AKILL_EXPIRE_NONE);
 	    return;
+	} else if (stricmp(extra, "HASH") == 0) {
+	    int size, count, hist[HASH_HISTLEN];
+
+	    if (!is_services_admin(u)) {
+		notice_lang(s_OperServ, u, PERMISSION_DENIED);
+		return;
+	    }
+	    get_user_hash_stats(&size, &count, hist, HASH_HISTLEN);
+	    send_hash_stats(u, OPER_STATS_HASH_USERS, size, count, hist);
+	    get_channel_hash_stats(&size, &count, hist, HASH_HISTLEN);
+	    send_hash_stats(u, OPER_STATS_HASH_CHANNELS, size, count, hist);
+	    return;
+	} else if (strnicmp(extra, "LATENCY", 7) == 0
+				&& (!extra[7] || extra[7] == ' ')) {
+	    char *param = strtok(extra+7, " ");
+
+	    if (!is_services_admin(u)) {
+		notice_lang(s_OperServ, u, PERMISSION_DENIED);
+		return;
+	    }
+	    send_latency_stats(u, param);
+	    return;
 	} else {
 	    notice_lang(s_OperServ, u, OPER_STATS_UNKNOWN_OPTION,
 			strupper(extra));
@@ -716,6 +865,31 @@ static void do_stats(User *u)
 	get_user_stats(&count, &mem);
 	notice_lang(s_OperServ, u, OPER_STATS_USER_MEM,
 			count, (mem+512) / 1024);
+	get_intern_stats(&count, &count2, &mem, &mem2);
+	notice_lang(s_OperServ, u, OPER_STATS_INTERN_MEM,
+		count, count2, count ? count2/count : 0,
+		count ? (count2*100/count)%100 : 0,
+		(mem+512) / 1024, (mem2+512) / 1024);
+	{
+	    long nlines, ndropped, dropped[LOG_NSUBSYS];
+	    char buf[BUFSIZE], *end = buf;
+	    int i;
+
+	    get_log_stats(&nlines, &ndropped, dropped);
+	    *buf = 0;
+	    for (i = 0; i < LOG_NSUBSYS; i++) {
+		if (dropped[i])
+		    end += snprintf(end, sizeof(buf)-(end-buf), " %s:12%ld",
+				log_subsys_name(i), dropped[i]);
+	    }
+	    notice_lang(s_OperServ, u, OPER_STATS_LOG, nlines, ndropped, buf);
+	}
+	get_flood_stats(&count, &count2, &mem2);
+	notice_lang(s_OperServ, u, OPER_STATS_FLOOD,
+		count, count2+mem2, count2, mem2);
+	get_latency_stats(&count, &mem);
+	notice_lang(s_OperServ, u, OPER_STATS_LATENCY_MEM,
+		count, (mem+512) / 1024);
 	get_channel_stats(&count, &mem);
 	notice_lang(s_OperServ, u, OPER_STATS_CHANNEL_MEM,
 			count, (mem+512) / 1024);
@@ -915,14 +1089,11 @@ static void do_os_mode(User *u)
 static void do_clearmodes(User *u)
 {
     char *s;
-    int i;
     char *argv[3];
     char *chan = strtok(NULL, " ");
     Channel *c;
+    BulkOp *op;
     int all = 0;
-    int count;		/* For saving ban info */
-    char **bans;	/* For saving ban info */
-    struct c_userlist *cu, *next;
 
     if (!chan) {
 	syntax_error(s_OperServ, u, "CLEARMODES", OPER_CLEARMODES_SYNTAX);
@@ -943,36 +1114,6 @@ static void do_clearmodes(User *u)
 	}
         canalopers(s_OperServ, "%s usa CLEARMODES%s en %s",
 			u->nick, all ? " ALL" : "", chan);
-	if (all) {
-	    /* Clear mode +o */
-	    for (cu = c->chanops; cu; cu = next) {
-		next = cu->next;
-		argv[0] = sstrdup(chan);
-		argv[1] = sstrdup("-o");
-		argv[2] = sstrdup(cu->user->nick);
-		send_cmd(s_OperServ, "MODE %s %s :%s",
-			argv[0], argv[1], argv[2]);
-		do_cmode(s_ChanServ, 3, argv);
-		free(argv[2]);
-		free(argv[1]);
-		free(argv[0]);
-	    }
-
-	    /* Clear mode +v */
-	    for (cu = c->voices; cu; cu = next) {
-		next = cu->next;
-		argv[0] = sstrdup(chan);
-		argv[1] = sstrdup("-v");
-		argv[2] = sstrdup(cu->user->nick);
-		send_cmd(s_OperServ, "MODE %s %s :%s",
-			argv[0], argv[1], argv[2]);
-		do_cmode(s_ChanServ, 3, argv);
-		free(argv[2]);
-		free(argv[1]);
-		free(argv[0]);
-	    }
-	}
-
 	/* Clear modes */
 	if (c->key) {
             send_cmd(s_OperServ, "MODE %s -ilkmnpst :%s", chan, c->key);
@@ -992,30 +1133,10 @@ static void do_clearmodes(User *u)
 	c->key = NULL;
 	c->limit = 0;
 
-	/* Clear bans */
-        if (c->bancount) {
-            count = c->bancount;
-	    bans = smalloc(sizeof(char *) * count);
-	    for (i = 0; i < count; i++)
-	        bans[i] = sstrdup(c->bans[i]);
-	    for (i = 0; i < count; i++) {
-	        argv[0] = sstrdup(chan);
-	        argv[1] = sstrdup("-b");
-	        argv[2] = bans[i];
-	        send_cmd(s_OperServ, "MODE %s %s :%s",
-			argv[0], argv[1], argv[2]);
-	        do_cmode(s_OperServ, 3, argv);
-	        free(argv[2]);
-	        free(argv[1]);
-	        free(argv[0]);
-	    }
-	    free(bans);
-        }
-        if (all)
-            notice_lang(s_OperServ, u, OPER_CLEARMODES_ALL_DONE, chan);
-        else
-            notice_lang(s_OperServ, u, OPER_CLEARMODES_DONE, chan);
-
+	/* Clear bans, and ops and voices too for ALL */
+	op = bulk_new(s_OperServ, u, chan);
+	op->done_msg = all ? OPER_CLEARMODES_ALL_DONE : OPER_CLEARMODES_DONE;
+	bulk_start(op, BULK_UNBAN | (all ? BULK_DEOP | BULK_DEVOICE : 0));
     }
 }
 
@@ -1074,27 +1195,15 @@ static void do_apodera(User *u)
     } else if (!(c = findchan(chan))) {
         notice_lang(s_OperServ, u, CHAN_X_NOT_IN_USE, chan);
     } else {    
-        char *av[3];
-        struct c_userlist *cu, *next;
+        BulkOp *op;
+
         send_cmd(s_ChanServ, "JOIN %s", chan);
         send_cmd(ServerName, "MODE %s +o %s", chan, s_ChanServ);
         send_cmd(s_ChanServ, "MODE %s :+tnsim", chan);        
-        for (cu = c->users; cu; cu = next) {
-            next = cu->next;        
-            if (!is_services_oper(finduser(cu->user->nick))) {            
-                av[0] = sstrdup(chan);        
-                av[1] = sstrdup("-o");
-                av[2] = sstrdup(cu->user->nick);
-                send_cmd(s_ChanServ, "MODE %s %s %s",
-                          av[0], av[1], av[2]);
-                do_cmode(s_ChanServ, 3, av);
-                free(av[2]);
-                free(av[1]);
-                free(av[0]);
-            }            
-            /* Poner timeout salida de chan... */
-         }
-         notice_lang(s_OperServ, u, OPER_APODERA_SUCCEEDED, chan);
+        op = bulk_new(s_OperServ, u, chan);
+        op->sender = s_ChanServ;
+        op->done_msg = OPER_APODERA_SUCCEEDED;
+        bulk_start(op, BULK_DEOP | BULK_SPARE_OPERS);
          canalopers(s_OperServ, "%s se APODERA de %s", u->nick, chan);
     }
 }                                                
@@ -1114,34 +1223,18 @@ static void do_limpia(User *u)
     } else if (!(c = findchan(chan))) {
         notice_lang(s_OperServ, u, CHAN_X_NOT_IN_USE, chan);
     } else {    
-        char *av[3];
-        struct c_userlist *cu, *next;       
-        char buf[256];
-        if (!reason)                        
-            snprintf(buf, sizeof(buf), "No puedes permanecer en este canal");                
-        else
-            snprintf(buf, sizeof(buf), "%s", reason);            
-        
+        BulkOp *op;
+
         send_cmd(s_ChanServ, "JOIN %s", chan);
         send_cmd(ServerName, "MODE %s +o %s", chan, s_ChanServ);
         send_cmd(s_ChanServ, "MODE %s :+tnsim", chan);
         
-        for (cu = c->users; cu; cu = next) {
-            next = cu->next;        
-            if (!is_services_oper(finduser(cu->user->nick))) {                    
-                av[0] = sstrdup(chan);        
-                av[1] = sstrdup(cu->user->nick);
-                av[2] = sstrdup(buf);
-                send_cmd(s_ChanServ, "KICK %s %s :%s",
-                                 av[0], av[1], av[2]);            
-                do_kick(s_ChanServ, 3, av);
-                free(av[2]);
-                free(av[1]);
-                free(av[0]);
-            }
-            /* Poner timeout salida de chan... */
-        }        
-        notice_lang(s_OperServ, u, OPER_LIMPIA_SUCCEEDED, chan);
+        op = bulk_new(s_OperServ, u, chan);
+        op->sender = s_ChanServ;
+        op->reason = sstrdup(reason ? reason
+				    : "No puedes permanecer en este canal");
+        op->done_msg = OPER_LIMPIA_SUCCEEDED;
+        bulk_start(op, BULK_KICK | BULK_SPARE_OPERS);
         canalopers(s_OperServ, "%s ha LIMPIADO %s", u->nick, chan);        
     }
 }   
@@ -1239,7 +1332,7 @@ static void do_unblock(User *u)
 
 static void do_settime(User *u)
 {
-    time_t now = time(NULL);
+    time_t now = cur_time;
     
     send_cmd(NULL, "SETTIME %lu", now);
     send_cmd(ServerName, "WALLOPS :Sincronizando la RED...");
@@ -1285,6 +1378,7 @@ static void do_admin(User *u)
 	    } else if (i < MAX_SERVADMINS) {
 		services_admins[i] = ni;
 		ni->flags |= NI_ADMIN_SERV;
+		privs_generation++;
 		notice_lang(s_OperServ, u, OPER_ADMIN_ADDED, ni->nick);
                 canaladmins(s_OperServ, "%s aade a %s como ADMIN", u->nick, ni->nick);
 	    } else {
@@ -1314,6 +1408,7 @@ static void do_admin(User *u)
 	    if (i < MAX_SERVADMINS) {
 		services_admins[i] = NULL;
 		ni->flags &= ~NI_ADMIN_SERV;
+		privs_generation++;
 		notice_lang(s_OperServ, u, OPER_ADMIN_REMOVED, ni->nick);
                 canaladmins(s_OperServ, "%s quita a %s de ADMIN", u->nick, ni->nick);
 		if (readonly)
@@ -1375,6 +1470,7 @@ static void do_oper(User *u)
 	    } else if (i < MAX_SERVOPERS) {
 		services_opers[i] = ni;
 		ni->flags |= NI_OPER_SERV;
+		privs_generation++;
 		notice_lang(s_OperServ, u, OPER_OPER_ADDED, ni->nick);
                 canaladmins(s_OperServ, "%s aade a %s como OPER", u->nick, ni->nick);
 	    } else {
@@ -1404,6 +1500,7 @@ static void do_oper(User *u)
 	    if (i < MAX_SERVOPERS) {
 		services_opers[i] = NULL;
 		ni->flags &= ~NI_OPER_SERV;
+		privs_generation++;
 		notice_lang(s_OperServ, u, OPER_OPER_REMOVED, ni->nick);
                 canaladmins(s_OperServ, "%s borra a %s de OPER", u->nick, ni->nick);
 		if (readonly)
@@ -1480,7 +1577,31 @@ static void do_set(User *u)
 	    log("Debug mode activated (level %d)", debug);
 	    notice_lang(s_OperServ, u, OPER_SET_DEBUG_LEVEL, debug);
 	} else {
-	    notice_lang(s_OperServ, u, OPER_SET_DEBUG_ERROR);
+	    /* SET DEBUG <subsistema> <nivel|OFF|DEFAULT> */
+	    char *level = strtok(NULL, " ");
+	    int n = -2;
+
+	    if (level) {
+		if (stricmp(level, "off") == 0)
+		    n = 0;
+		else if (stricmp(level, "default") == 0)
+		    n = -1;
+		else if (isdigit((int)*level))
+		    n = atoi(level);
+	    }
+	    if (n < -1) {
+		syntax_error(s_OperServ, u, "SET", OPER_SET_DEBUG_SUBSYS_SYNTAX);
+	    } else if (!set_log_level(setting, n)) {
+		notice_lang(s_OperServ, u, OPER_SET_DEBUG_SUBSYS_UNKNOWN, setting);
+	    } else {
+		log("Debug level for %s set to %d", setting, n);
+		if (n < 0)
+		    notice_lang(s_OperServ, u, OPER_SET_DEBUG_SUBSYS_DEFAULT,
+				setting);
+		else
+		    notice_lang(s_OperServ, u, OPER_SET_DEBUG_SUBSYS_LEVEL,
+				setting, n);
+	    }
 	}
 
     } else {
@@ -1510,7 +1631,7 @@ static void do_jupe(User *u)
 	}
 
 	send_cmd(NULL, "SERVER %s 1 %lu %lu P10 :%s",
-		jserver, time(NULL), time(NULL), reason);
+		jserver, cur_time, cur_time, reason);
     }
 }
 
@@ -1581,25 +1702,31 @@ static void do_restart(User *u)
 
 /*************************************************************************/
 
-/* XXX - this function is broken!! */
+/* List the users whose commands are being dropped by flood control. */
 
 static void do_listignore(User *u)
 {
     int sent_header = 0;
-    IgnoreData *id;
-    int i;
-
-    privmsg(s_OperServ, u->nick, "Command disabled - it's broken.");
-    return;
-    
-    for (i = 0; i < 256; i++) {
-	for (id = ignore[i]; id; id = id->next) {
-	    if (!sent_header) {
-		notice_lang(s_OperServ, u, OPER_IGNORE_LIST);
-		sent_header = 1;
-	    }
-	    privmsg(s_OperServ, u->nick, "%ld %s", id->time, id->who);
+    User *u2;
+    int why;
+
+    for (u2 = firstuser(); u2; u2 = nextuser()) {
+	if (u2->flood.until > cur_time)
+	    why = OPER_IGNORE_SLOW;
+	else if (u2->flood.dropped
+			&& cur_time - u2->flood.last < FloodUserPeriod)
+	    why = OPER_IGNORE_USER;
+	else if (u2->floodhost && u2->floodhost->bucket.dropped
+			&& cur_time - u2->floodhost->bucket.last < FloodHostPeriod)
+	    why = OPER_IGNORE_HOST;
+	else
+	    continue;
+	if (!sent_header) {
+	    notice_lang(s_OperServ, u, OPER_IGNORE_LIST);
+	    sent_header = 1;
 	}
+	notice_lang(s_OperServ, u, OPER_IGNORE_LIST_FORMAT, u2->nick,
+		u2->username, u2->host, getstring(u->ni, why));
     }
     if (!sent_header)
 	notice_lang(s_OperServ, u, OPER_IGNORE_LIST_EMPTY);
@@ -1623,6 +1750,33 @@ static void do_matchwild(User *u)
 
 /*************************************************************************/
 
+/* Once KILLCLONES has killed everyone on the host, tell the other opers.
+ * The AKILL was added when the kills started. */
+
+static void killclones_done(BulkOp *op)
+{
+    char *clonemask, *akillmask;
+
+    clonemask = smalloc(strlen(op->target) + 5);
+    sprintf(clonemask, "*!*@%s", op->target);
+
+    akillmask = smalloc(strlen(op->target) + 3);
+    sprintf(akillmask, "*@%s", op->target);
+    strlower(akillmask);
+
+    canalopers(s_OperServ, "%s usa KILLCLONES para %s killeando "
+                   "%d clones. Un Gline Temporal ha sido aadido "
+                   "para %s.", op->who, clonemask, op->done, akillmask);
+
+    log("%s: KILLCLONES: %d clone(s) matching %s killed.",
+			s_OperServ, op->done, clonemask);
+
+    free(akillmask);
+    free(clonemask);
+}
+
+/*************************************************************************/
+
 /* Kill all users matching a certain host. The host is obtained from the
  * supplied nick. The raw hostmsk is not supplied with the command in an effort
  * to prevent abuse and mistakes from being made - which might cause *.com to
@@ -1637,11 +1791,9 @@ static void do_matchwild(User *u)
 static void do_killclones(User *u)
 {
     char *clonenick = strtok(NULL, " ");
-    int count=0;
-    User *cloneuser, *user, *tempuser;
-    char *clonemask, *akillmask;
-    char killreason[NICKMAX+32];
-    char akillreason[] = "Gline Temporal de KILLCLONES.";
+    User *cloneuser;
+    char *akillmask;
+    BulkOp *op;
 
     if (!clonenick) {
 	notice_lang(s_OperServ, u, OPER_KILLCLONES_SYNTAX);
@@ -1650,38 +1802,20 @@ static void do_killclones(User *u)
 	notice_lang(s_OperServ, u, OPER_KILLCLONES_UNKNOWN_NICK, clonenick);
 
     } else {
-	clonemask = smalloc(strlen(cloneuser->host) + 5);
-	sprintf(clonemask, "*!*@%s", cloneuser->host);
-
+	/* Everyone on the host is on its FloodHost list, so there's no
+	 * need to look through every user online */
+	op = bulk_new(s_OperServ, u, cloneuser->host);
+	op->reason = sstrdup("Cloning");
+	op->finish = killclones_done;
+	/* Add the AKILL before any kills go out, so that clients can't
+	 * reconnect under new nicks while the rest are being killed. */
 	akillmask = smalloc(strlen(cloneuser->host) + 3);
-	sprintf(akillmask, "*@%s", strlower(cloneuser->host));
-	
-	user = firstuser();
-	while (user) {
-	    if (match_usermask(clonemask, user) != 0) {
-		tempuser = nextuser();
-		count++;
-		snprintf(killreason, sizeof(killreason), 
-					"Cloning [%d]", count);
-		kill_user(NULL, user->nick, killreason);
-		user = tempuser;
-	    } else {
-		user = nextuser();
-	    }
-	}
-
-	add_akill(akillmask, akillreason, u->nick, 
-			time(NULL) + KillClonesAkillExpire);
-
-        canalopers(s_OperServ, "%s usa KILLCLONES para %s killeando "
-                       "%d clones. Un Gline Temporal ha sido aadido "
-                       "para %s.", u->nick, clonemask, count, akillmask);
-
-	log("%s: KILLCLONES: %d clone(s) matching %s killed.",
-			s_OperServ, count, clonemask);
-
+	sprintf(akillmask, "*@%s", cloneuser->host);
+	strlower(akillmask);
+	add_akill(akillmask, "Gline Temporal de KILLCLONES.", u->nick,
+			cur_time + KillClonesAkillExpire);
 	free(akillmask);
-	free(clonemask);
+	bulk_start(op, BULK_KILL);
     }
 }
 
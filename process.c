@@ -10,74 +10,472 @@
 
 #include "services.h"
 #include "messages.h"
+#include "latency.h"
 
 /*************************************************************************/
 /*************************************************************************/
 
-/* Use ignore code? */
+/* Use flood control?  (OperServ SET IGNORE) */
 int allow_ignore = 1;
 
-/* People to ignore (hashed by first character of nick). */
-IgnoreData *ignore[256];
+/* Commands dropped by flood control, by which bucket was empty. */
+static long dropped_user, dropped_host;
+
+/* Hosts with users online, hashed by their interned host string (so
+ * comparing pointers is enough). */
+static FloodHost **floodhosts;
+static int floodhosts_size, floodhosts_count;
+
+#define FHHASH(host) \
+	((((unsigned long)(host) >> 3) ^ ((unsigned long)(host) >> 13)) \
+	 & (floodhosts_size-1))
+
+/* IPv4 networks with users online, hashed by address and prefix length. */
+static IpNet **ipnets;
+static int ipnets_size, ipnets_count;
+
+#define NETHASH(net,bits) \
+	((((uint32)(net) ^ (uint32)(bits)) * 0x9E3779B1U >> 12) \
+	 & (ipnets_size-1))
+
+static void add_host_net(FloodHost *fh);
+static void del_host_net(FloodHost *fh);
 
 /*************************************************************************/
 
-/* add_ignore: Add someone to the ignorance list for the next `delta'
- *             seconds.
- */
+/* Double the size of the host table. */
+
+static void grow_floodhosts(void)
+{
+    FloodHost **old = floodhosts, *fh, *next;
+    int oldsize = floodhosts_size, i;
+
+    floodhosts_size = oldsize ? oldsize*2 : 1024;
+    floodhosts = scalloc(floodhosts_size, sizeof(*floodhosts));
+    for (i = 0; i < oldsize; i++) {
+	for (fh = old[i]; fh; fh = next) {
+	    next = fh->next;
+	    fh->next = floodhosts[FHHASH(fh->host)];
+	    floodhosts[FHHASH(fh->host)] = fh;
+	}
+    }
+    free(old);
+}
+
+
+/* Return the record for the given host (which must be interned with
+ * sintern_nocase()), or NULL if nobody is online from it. */
 
-void add_ignore(const char *nick, time_t delta)
+FloodHost *find_floodhost(const char *host)
 {
-    IgnoreData *ign;
-    char who[NICKMAX];
-    time_t now = time(NULL);
-    IgnoreData **whichlist = &ignore[tolower(nick[0])];
+    FloodHost *fh;
 
-    strscpy(who, nick, NICKMAX);
-    for (ign = *whichlist; ign; ign = ign->next) {
-	if (stricmp(ign->who, who) == 0)
+    if (!floodhosts_size)
+	return NULL;
+    for (fh = floodhosts[FHHASH(host)]; fh; fh = fh->next) {
+	if (fh->host == host)
 	    break;
     }
-    if (ign) {
-	if (ign->time > now)
-	    ign->time += delta;
-	else
-	    ign->time = now + delta;
-    } else {
-	ign = smalloc(sizeof(*ign));
-	strscpy(ign->who, who, sizeof(ign->who));
-	ign->time = now + delta;
-	ign->next = *whichlist;
-	*whichlist = ign;
+    return fh;
+}
+
+
+/* Add the user to the record for their host (u->host, which must be
+ * interned with sintern_nocase()), creating it if needed.  Call
+ * put_floodhost() when the user goes away. */
+
+void get_floodhost(User *u)
+{
+    const char *host = u->host;
+    FloodHost *fh;
+
+    if (floodhosts_count >= floodhosts_size)
+	grow_floodhosts();
+    for (fh = floodhosts[FHHASH(host)]; fh; fh = fh->next) {
+	if (fh->host == host)
+	    break;
+    }
+    if (!fh) {
+	fh = scalloc(1, sizeof(*fh));
+	fh->host = host;
+	fh->next = floodhosts[FHHASH(host)];
+	floodhosts[FHHASH(host)] = fh;
+	floodhosts_count++;
+	add_host_net(fh);
     }
+    fh->nusers++;
+    if (fh->net) {
+	fh->net->nusers++;
+	fh->net->parent->nusers++;
+    }
+    u->hnext = fh->users;
+    u->hprev = NULL;
+    if (fh->users)
+	fh->users->hprev = u;
+    fh->users = u;
+    u->floodhost = fh;
+}
+
+
+void put_floodhost(User *u)
+{
+    FloodHost *fh = u->floodhost, **prev;
+
+    if (!fh)
+	return;
+    if (u->hnext)
+	u->hnext->hprev = u->hprev;
+    if (u->hprev)
+	u->hprev->hnext = u->hnext;
+    else
+	fh->users = u->hnext;
+    u->floodhost = NULL;
+    if (fh->net) {
+	fh->net->nusers--;
+	fh->net->parent->nusers--;
+    }
+    if (--fh->nusers > 0)
+	return;
+    del_host_net(fh);
+    for (prev = &floodhosts[FHHASH(fh->host)]; *prev != fh;
+						prev = &(*prev)->next)
+	;
+    *prev = fh->next;
+    floodhosts_count--;
+    free(fh);
 }
 
 /*************************************************************************/
 
-/* get_ignore: Retrieve an ignorance record for a nick.  If the nick isn't
- *             being ignored, return NULL and flush the record from the
- *             in-core list if it exists (i.e. ignore timed out).
- */
+/* Parse an IPv4 address in dotted-quad form, optionally followed by
+ * "/bits".  Store the network address (host byte order, with the bits
+ * past the prefix cleared) and the prefix length (32 if none was given),
+ * and return 1; return 0 if `s' isn't one. */
 
-IgnoreData *get_ignore(const char *nick)
+int parse_cidr(const char *s, uint32 *net, int *bits)
 {
-    IgnoreData *ign, *prev;
-    time_t now = time(NULL);
-    IgnoreData **whichlist = &ignore[tolower(nick[0])];
+    uint32 ip = 0;
+    int i, n, b = 32;
 
-    for (ign = *whichlist, prev = NULL; ign; prev = ign, ign = ign->next) {
-	if (stricmp(ign->who, nick) == 0)
+    for (i = 0; i < 4; i++) {
+	if (i > 0 && *s++ != '.')
+	    return 0;
+	if (!isdigit((unsigned char)*s))
+	    return 0;
+	for (n = 0; isdigit((unsigned char)*s); s++) {
+	    n = n*10 + (*s - '0');
+	    if (n > 255)
+		return 0;
+	}
+	ip = ip<<8 | n;
+    }
+    if (*s == '/') {
+	s++;
+	if (!isdigit((unsigned char)*s))
+	    return 0;
+	for (b = 0; isdigit((unsigned char)*s); s++) {
+	    b = b*10 + (*s - '0');
+	    if (b > 32)
+		return 0;
+	}
+    }
+    if (*s)
+	return 0;
+    *net = b ? ip & (~(uint32)0 << (32-b)) : 0;
+    *bits = b;
+    return 1;
+}
+
+
+/* Double the size of the network table. */
+
+static void grow_ipnets(void)
+{
+    IpNet **old = ipnets, *n, *next;
+    int oldsize = ipnets_size, i;
+
+    ipnets_size = oldsize ? oldsize*2 : 1024;
+    ipnets = scalloc(ipnets_size, sizeof(*ipnets));
+    for (i = 0; i < oldsize; i++) {
+	for (n = old[i]; n; n = next) {
+	    next = n->next;
+	    n->next = ipnets[NETHASH(n->net, n->bits)];
+	    ipnets[NETHASH(n->net, n->bits)] = n;
+	}
+    }
+    free(old);
+}
+
+
+static IpNet *find_ipnet(uint32 net, int bits)
+{
+    IpNet *n;
+
+    if (!ipnets_size)
+	return NULL;
+    for (n = ipnets[NETHASH(net, bits)]; n; n = n->next) {
+	if (n->net == net && n->bits == bits)
 	    break;
     }
-    if (ign && ign->time <= now) {
-	if (prev)
-	    prev->next = ign->next;
-	else
-	    *whichlist = ign->next;
-	free(ign);
-	ign = NULL;
+    return n;
+}
+
+
+static IpNet *get_ipnet(uint32 net, int bits)
+{
+    IpNet *n = find_ipnet(net, bits);
+
+    if (n)
+	return n;
+    if (ipnets_count >= ipnets_size)
+	grow_ipnets();
+    n = scalloc(1, sizeof(*n));
+    n->net = net;
+    n->bits = bits;
+    n->next = ipnets[NETHASH(net, bits)];
+    ipnets[NETHASH(net, bits)] = n;
+    ipnets_count++;
+    return n;
+}
+
+
+static void free_ipnet(IpNet *n)
+{
+    IpNet **prev;
+
+    for (prev = &ipnets[NETHASH(n->net, n->bits)]; *prev != n;
+						prev = &(*prev)->next)
+	;
+    *prev = n->next;
+    ipnets_count--;
+    free(n);
+}
+
+
+/* If a new host record is for an IPv4 address, add it to its /24 (and
+ * that to its /16). */
+
+static void add_host_net(FloodHost *fh)
+{
+    IpNet *n24, *n16;
+    int bits;
+
+    if (!parse_cidr(fh->host, &fh->ip, &bits) || bits != 32)
+	return;
+    n24 = find_ipnet(fh->ip & 0xFFFFFF00, 24);
+    if (!n24) {
+	n24 = get_ipnet(fh->ip & 0xFFFFFF00, 24);
+	n16 = get_ipnet(fh->ip & 0xFFFF0000, 16);
+	n24->parent = n16;
+	n24->subnext = n16->sub;
+	if (n16->sub)
+	    n16->sub->subprev = n24;
+	n16->sub = n24;
     }
-    return ign;
+    fh->net = n24;
+    fh->netnext = n24->hosts;
+    if (n24->hosts)
+	n24->hosts->netprev = fh;
+    n24->hosts = fh;
+}
+
+
+/* A host record is going away; take it out of its /24, and drop the /24
+ * and /16 if nothing is left in them. */
+
+static void del_host_net(FloodHost *fh)
+{
+    IpNet *n24 = fh->net, *n16;
+
+    if (!n24)
+	return;
+    if (fh->netnext)
+	fh->netnext->netprev = fh->netprev;
+    if (fh->netprev)
+	fh->netprev->netnext = fh->netnext;
+    else
+	n24->hosts = fh->netnext;
+    if (n24->hosts)
+	return;
+    n16 = n24->parent;
+    if (n24->subnext)
+	n24->subnext->subprev = n24->subprev;
+    if (n24->subprev)
+	n24->subprev->subnext = n24->subnext;
+    else
+	n16->sub = n24->subnext;
+    free_ipnet(n24);
+    if (!n16->sub)
+	free_ipnet(n16);
+}
+
+
+/* Call `fn' for each user online from an address in `net'/`mask' within
+ * the given /24, and return how many there were. */
+
+static int net_hosts_users(IpNet *n24, uint32 net, uint32 mask,
+			   void (*fn)(User *u, void *arg), void *arg)
+{
+    FloodHost *fh;
+    User *u;
+    int count = 0;
+
+    for (fh = n24->hosts; fh; fh = fh->netnext) {
+	if ((fh->ip & mask) != net)
+	    continue;
+	for (u = fh->users; u; u = u->hnext) {
+	    fn(u, arg);
+	    count++;
+	}
+    }
+    return count;
+}
+
+
+/* Call `fn' for each user online from an IPv4 address in the network
+ * `net'/`bits' (`bits' at least 8), and return how many there were.  Only
+ * the /16s and /24s in the network are looked at, so this takes time in
+ * proportion to the answer.  `fn' must not remove users. */
+
+int foreach_net_user(uint32 net, int bits,
+		     void (*fn)(User *u, void *arg), void *arg)
+{
+    uint32 mask = bits ? ~(uint32)0 << (32-bits) : 0;
+    IpNet *n16, *n24;
+    int count = 0, i, nnets;
+
+    if (bits < 8)
+	return 0;
+    net &= mask;
+    if (bits >= 24) {
+	if ((n24 = find_ipnet(net & 0xFFFFFF00, 24)) != NULL)
+	    count = net_hosts_users(n24, net, mask, fn, arg);
+	return count;
+    }
+    nnets = bits >= 16 ? 1 : 1 << (16-bits);
+    for (i = 0; i < nnets; i++) {
+	if (!(n16 = find_ipnet((net & 0xFFFF0000) + ((uint32)i << 16), 16)))
+	    continue;
+	for (n24 = n16->sub; n24; n24 = n24->subnext) {
+	    if ((n24->net & mask) == net)
+		count += net_hosts_users(n24, net, mask, fn, arg);
+	}
+    }
+    return count;
+}
+
+
+/* Fill `top' with the (up to) `max' /`bits' networks (16 or 24) with the
+ * most users online, most first, and return how many there are. */
+
+int top_ipnets(int bits, IpNet **top, int max)
+{
+    IpNet *n;
+    int count = 0, i, j;
+
+    for (i = 0; i < ipnets_size; i++) {
+	for (n = ipnets[i]; n; n = n->next) {
+	    if (n->bits != bits)
+		continue;
+	    for (j = count; j > 0 && top[j-1]->nusers < n->nusers; j--) {
+		if (j < max)
+		    top[j] = top[j-1];
+	    }
+	    if (j < max) {
+		top[j] = n;
+		if (count < max)
+		    count++;
+	    }
+	}
+    }
+    return count;
+}
+
+/*************************************************************************/
+
+/* Top up a bucket holding up to `count' commands which refills at `count'
+ * per `period' seconds, then take a command from it.  Return 1 if there
+ * was one to take, else 0.  A new (zeroed) bucket starts out full. */
+
+static int take_token(FloodBucket *b, int count, int period)
+{
+    int32 cap = count * FLOOD_UNIT;
+    time_t elapsed = cur_time - b->last;
+
+    if (cur_time < b->until)
+	return 0;
+    if (!b->last || elapsed >= period) {
+	b->tokens = cap;
+    } else if (elapsed > 0) {
+	b->tokens += (int32)((long)elapsed * cap / period);
+	if (b->tokens > cap)
+	    b->tokens = cap;
+    }
+    b->last = cur_time;
+    if (b->tokens < FLOOD_UNIT)
+	return 0;
+    b->tokens -= FLOOD_UNIT;
+    b->dropped = 0;
+    return 1;
+}
+
+
+/* Note a command dropped because of the given bucket, logging only the
+ * first one each time the bucket runs dry. */
+
+static void drop_command(FloodBucket *b, User *u, const char *which)
+{
+    if (!b->dropped++)
+	log("Flood: dropping commands from %s!%s@%s (%s limit)",
+		u->nick, u->username, u->host, which);
+}
+
+
+/* Decide whether a message from `nick' to Services should be processed,
+ * charging it to the user's and the host's buckets.  Returns 0 if it
+ * should be dropped.  Opers, servers and unknown nicks always get
+ * through. */
+
+int flood_check(const char *nick)
+{
+    User *u;
+
+    if (!allow_ignore || !(u = finduser(nick)) || (u->mode & UMODE_O))
+	return 1;
+    if (FloodUserCount
+	    && !take_token(&u->flood, FloodUserCount, FloodUserPeriod)) {
+	dropped_user++;
+	drop_command(&u->flood, u, "user");
+	return 0;
+    }
+    if (FloodHostCount && u->floodhost
+	    && !take_token(&u->floodhost->bucket, FloodHostCount,
+			   FloodHostPeriod)) {
+	dropped_host++;
+	drop_command(&u->floodhost->bucket, u, "host");
+	return 0;
+    }
+    return 1;
+}
+
+
+/* Drop everything from the user for the next `secs' seconds (used when a
+ * command took a long time to process). */
+
+void flood_penalty(User *u, int secs)
+{
+    if (u->flood.until < cur_time + secs)
+	u->flood.until = cur_time + secs;
+}
+
+
+/* Return flood control statistics: hosts tracked and commands dropped. */
+
+void get_flood_stats(long *nhosts, long *nuser, long *nhost)
+{
+    *nhosts = floodhosts_count;
+    *nuser = dropped_user;
+    *nhost = dropped_host;
 }
 
 /*************************************************************************/
@@ -139,9 +537,9 @@ void process()
     Message *m;
 
 
-    /* If debugging, log the buffer. */
-    if (debug)
-	log("debug: Received: %s", inbuf);
+    /* If debugging, log the buffer; if capturing, record it. */
+    log_debug(LOG_IN, 1, "debug: Received: %s", inbuf);
+    capture_line(inbuf);
 
     /* First make a copy of the buffer so we have the original in case we
      * crash - in that case, we want to know what we crashed on. */
@@ -170,13 +568,23 @@ void process()
     } else
 	s = buf + strlen(buf);
     strscpy(cmd, buf, sizeof(cmd));
+
+    /* Drop commands from users who are flooding us before spending any
+     * more time on them.  Channel messages aren't commands. */
+    if (*source && *s != '#' && stricmp(cmd, "PRIVMSG") == 0
+						&& !flood_check(source))
+	return;
+
     ac = split_buf(s, &av, 1);
 
     /* Do something with the message. */
     m = find_message(cmd);
     if (m) {
-	if (m->func)
+	if (m->func) {
+	    lat_t start = lat_now();
 	    m->func(source, ac, av);
+	    lat_record(&m->latency, "server", m->name, lat_now() - start);
+	}
     } else {
 	log("unknown message from server (%s)", inbuf);
     }
@@ -9,5 +9,8 @@
 #include "commands.h"
 #include "language.h"
 #include "timeout.h"
+#include "expire.h"
+#include "search.h"
+#include "bulk.h"
 #include "encrypt.h"
 #include "datafiles.h"
@@ -0,0 +1,245 @@
+/* Traffic capture and replay.  In capture mode (-capture file) every line
+ * received from the server is written to a file, prefixed with the time it
+ * arrived.  Running the binary as "replay" feeds such a file back through
+ * process() as fast as possible, with everything Services sends going to
+ * a sink file, and reports how long it took.
+ *
+ * Services is copyright (c) 1996-1999 Andrew Church.
+ *     E-mail: <achurch@dragonfire.net>
+ * Services is copyright (c) 1999-2000 Andrew Kempe.
+ *     E-mail: <theshadow@shadowfire.org>
+ * This program is free but copyrighted software; see the file COPYING for
+ * details.
+ */
+
+#include "services.h"
+#include "latency.h"
+#include "timeout.h"
+#include <sys/resource.h>
+
+static FILE *capture;
+static char capture_buf[65536];
+
+/*************************************************************************/
+/************************** Capturing traffic ***************************/
+/*************************************************************************/
+
+/* Start writing received lines to the given file (appending to it).
+ * Return 0 on success, -1 on error. */
+
+int open_capture(const char *filename)
+{
+    if (capture)
+	return 0;
+    capture = fopen(filename, "a");
+    if (!capture)
+	return -1;
+    setvbuf(capture, capture_buf, _IOFBF, sizeof(capture_buf));
+    atexit(close_capture);
+    return 0;
+}
+
+
+void close_capture(void)
+{
+    if (!capture)
+	return;
+    fclose(capture);
+    capture = NULL;
+}
+
+
+/* Record one line from the server: "seconds.microseconds line". */
+
+void capture_line(const char *line)
+{
+    struct timeval tv;
+
+    if (!capture)
+	return;
+#if HAVE_GETTIMEOFDAY
+    gettimeofday(&tv, NULL);
+#else
+    tv.tv_sec = time(NULL);
+    tv.tv_usec = 0;
+#endif
+    fprintf(capture, "%ld.%06ld %s\n", (long)tv.tv_sec, (long)tv.tv_usec,
+		line);
+}
+
+/*************************************************************************/
+/*************************** Replaying traffic ***************************/
+/*************************************************************************/
+
+static int compare_total(const void *a, const void *b)
+{
+    const LatStat *la = *(const LatStat **)a, *lb = *(const LatStat **)b;
+
+    return la->total < lb->total ? 1 : la->total > lb->total ? -1 : 0;
+}
+
+/* Print the handlers which took the most time in all. */
+
+static void report_handlers(int top)
+{
+    LatStat *ls, **sorted;
+    char avg[16], p99[16], max[16], total[16];
+    int n = 0, i;
+
+    for (ls = lat_list(); ls; ls = ls->next)
+	n++;
+    sorted = smalloc(sizeof(*sorted) * (n ? n : 1));
+    for (i = 0, ls = lat_list(); ls; ls = ls->next)
+	sorted[i++] = ls;
+    qsort(sorted, n, sizeof(*sorted), compare_total);
+
+    printf("%-8s %-12s %10s %10s %10s %10s %10s\n", "Service", "Command",
+		"Calls", "Avg", "P99", "Max", "Total");
+    for (i = 0; i < n && i < top && sorted[i]->count; i++) {
+	ls = sorted[i];
+	printf("%-8s %-12s %10lu %10s %10s %10s %10s\n", ls->service,
+		ls->name, (unsigned long)ls->count,
+		lat_format(avg, sizeof(avg), ls->total / ls->count),
+		lat_format(p99, sizeof(p99), lat_percentile(ls, 990)),
+		lat_format(max, sizeof(max), ls->max),
+		lat_format(total, sizeof(total), ls->total));
+    }
+    free(sorted);
+}
+
+
+/* If a line starts with a time stamp as written by capture_line() (digits,
+ * a dot, six digits and one space), store the time in *t and return the
+ * rest of the line; otherwise return NULL, so that a server line which
+ * merely starts with a digit is taken as it is. */
+
+static char *skip_stamp(char *line, double *t)
+{
+    char *s = line;
+    int i;
+
+    if (!isdigit(*s))
+	return NULL;
+    while (isdigit(*s))
+	s++;
+    if (*s++ != '.')
+	return NULL;
+    for (i = 0; i < 6; i++, s++) {
+	if (!isdigit(*s))
+	    return NULL;
+    }
+    if (*s != ' ')
+	return NULL;
+    *t = strtod(line, NULL);
+    return s+1;
+}
+
+
+/* Entry point when run as "replay".  Any options other than -sink and
+ * -top are passed on to init() as usual. */
+
+int do_replay(int ac, char **av)
+{
+    char *filename = NULL, *sink = "/dev/null";
+    char line[BUFSIZE+32], *s;
+    int top = 20, i, j, usage = 0;
+    long count = 0;
+    double first = -1, last = 0, secs, t;
+    time_t last_check = 0;
+    lat_t start, elapsed;
+    struct rusage ru;
+    FILE *f;
+
+    /* The capture file comes last; everything else except our own
+     * options is left for init(). */
+    if (ac < 2 || av[ac-1][0] == '-')
+	usage = 1;
+    else
+	filename = av[--ac];
+    for (i = j = 1; i < ac; i++) {
+	if (strcmp(av[i], "-sink") == 0 && i+1 < ac)
+	    sink = av[++i];
+	else if (strcmp(av[i], "-top") == 0 && i+1 < ac)
+	    top = atoi(av[++i]);
+	else
+	    av[j++] = av[i];
+    }
+    if (usage) {
+	fprintf(stderr, "\
+\n\
+Usage: replay [services options] [-sink file] [-top n] capture-file\n\
+   -sink: file to write everything Services sends to (default /dev/null)\n\
+    -top: number of handlers to list (default 20)\n\
+\n\
+Feeds a file recorded with \"services -capture file\" through Services as\n\
+fast as possible, then reports the messages per second, the time taken by\n\
+the most expensive server messages and commands, and the peak memory use.\n\
+Databases are loaded as usual but never saved.  Relative file names are\n\
+taken from the Services data directory.\n\
+\n");
+	return 1;
+    }
+    ac = j;
+    av[ac] = NULL;
+
+    /* Never save, and talk to the sink instead of a server.  Read-only mode
+     * also keeps the log quiet unless -nofork copies it to stderr. */
+    readonly = 1;
+    replay_sink = sink;
+    if ((i = init(ac, av)) != 0)
+	return i;
+    if (!(f = fopen(filename, "r"))) {
+	perror(filename);
+	return 1;
+    }
+
+    start = lat_now();
+    while (fgets(line, sizeof(line), f)) {
+	s = line + strlen(line);
+	while (s > line && (s[-1] == '\n' || s[-1] == '\r'))
+	    *--s = 0;
+	/* Lines from a capture start with their time; plain server traffic
+	 * (e.g. from a client log) will do too. */
+	if ((s = skip_stamp(line, &t)) != NULL) {
+	    if (first < 0)
+		first = t;
+	    last = t;
+	    /* Run the clock as it was when the line arrived, so that timers
+	     * go off at the same points in the traffic as they did then. */
+	    set_virtual_time((time_t)t);
+	} else {
+	    s = line;
+	    update_time();
+	}
+	if (cur_time - last_check >= TimeoutCheck) {
+	    if (last_check)
+		check_timeouts();
+	    last_check = cur_time;
+	}
+	strscpy(inbuf, s, sizeof(inbuf));
+	process();
+	run_jobs();
+	count++;
+    }
+    while (run_jobs())
+	;
+    elapsed = lat_now() - start;
+    set_virtual_time(0);
+    fclose(f);
+    sflush(servsock);
+
+    secs = elapsed / 1e9;
+    printf("Replayed %ld messages in %.3f s: %.0f messages/s\n", count, secs,
+		secs > 0 ? count / secs : 0.0);
+    if (first >= 0)
+	printf("Capture covered %.3f s (%.1fx real time)\n", last-first,
+		secs > 0 ? (last-first) / secs : 0.0);
+    getrusage(RUSAGE_SELF, &ru);
+    printf("Peak RSS: %ld kB\n", (long)ru.ru_maxrss);
+    printf("\n");
+    report_handlers(top);
+    disconn(servsock);
+    return 0;
+}
+
+/*************************************************************************/
@@ -0,0 +1,158 @@
+/* Search index: trigram postings over the text NickServ and ChanServ LIST
+ * match their patterns against, so a pattern with a literal part only has
+ * to be checked against the records which contain it.
+ *
+ * Services is copyright (c) 1996-1999 Andrew Church.
+ *     E-mail: <achurch@dragonfire.net>
+ * Services is copyright (c) 1999-2000 Andrew Kempe.
+ *     E-mail: <theshadow@shadowfire.org>
+ * This program is free but copyrighted software; see the file COPYING for
+ * details.
+ */
+
+#include "services.h"
+#include "search.h"
+
+/*************************************************************************/
+
+/* Hash a trigram (case-insensitively, the way match_wild_nocase() compares
+ * characters) into a postings bucket. */
+
+static int trigram_hash(const char *s)
+{
+    uint32 h = (unsigned char)tolower(s[0]);
+
+    h = h<<8 | (unsigned char)tolower(s[1]);
+    h = h<<8 | (unsigned char)tolower(s[2]);
+    h *= 0x9E3779B1U;
+    return (int)(h >> 16) & (SEARCH_HASHSIZE-1);
+}
+
+/*************************************************************************/
+
+/* Drop deleted records from the index, renumbering the rest.  Slots keep
+ * their relative order, so postings lists stay sorted. */
+
+static void renumber(SearchIndex *si)
+{
+    int *newslot = smalloc(sizeof(int) * (si->count ? si->count : 1));
+    int i, j, n;
+
+    for (i = n = 0; i < si->count; i++) {
+	if (si->recs[i].data) {
+	    newslot[i] = n;
+	    si->recs[n] = si->recs[i];
+	    *si->recs[n].id = n+1;
+	    n++;
+	} else {
+	    newslot[i] = -1;
+	}
+    }
+    si->count = n;
+    for (i = 0; i < SEARCH_HASHSIZE; i++) {
+	Postings *p = &si->post[i];
+	for (j = n = 0; j < p->count; j++) {
+	    if (newslot[p->ids[j]] >= 0)
+		p->ids[n++] = newslot[p->ids[j]];
+	}
+	p->count = n;
+    }
+    free(newslot);
+}
+
+/*************************************************************************/
+
+void search_add(SearchIndex *si, void *data, int *id, const char *text)
+{
+    int slot, len, i;
+
+    if (*id)
+	search_del(si, id);
+    if (si->count >= si->size) {
+	si->size = si->size ? si->size*2 : 1024;
+	si->recs = srealloc(si->recs, sizeof(SearchEntry) * si->size);
+    }
+    slot = si->count++;
+    si->recs[slot].data = data;
+    si->recs[slot].id = id;
+    *id = slot+1;
+    si->live++;
+
+    len = strlen(text);
+    for (i = 0; i+2 < len; i++) {
+	Postings *p = &si->post[trigram_hash(text+i)];
+	/* The same trigram may turn up twice in one text */
+	if (p->count && p->ids[p->count-1] == slot)
+	    continue;
+	if (p->count >= p->size) {
+	    p->size = p->size ? p->size*2 : 16;
+	    p->ids = srealloc(p->ids, sizeof(int) * p->size);
+	}
+	p->ids[p->count++] = slot;
+    }
+}
+
+/*************************************************************************/
+
+void search_del(SearchIndex *si, int *id)
+{
+    int dead;
+
+    if (!*id)
+	return;
+    si->recs[*id-1].data = NULL;
+    *id = 0;
+    si->live--;
+    dead = si->count - si->live;
+    if (!si->holds && dead >= 1024 && dead > si->live)
+	renumber(si);
+}
+
+/*************************************************************************/
+
+void *search_get(SearchIndex *si, int slot)
+{
+    if (slot < 0 || slot >= si->count)
+	return NULL;
+    return si->recs[slot].data;
+}
+
+/*************************************************************************/
+
+int search_bucket(SearchIndex *si, const char *pattern, int len)
+{
+    int best = -1, run = 0, i, b;
+
+    for (i = 0; i < len; i++) {
+	if (pattern[i] == '*' || pattern[i] == '?') {
+	    run = 0;
+	    continue;
+	}
+	if (++run < 3)
+	    continue;
+	b = trigram_hash(pattern+i-2);
+	if (best < 0 || si->post[b].count < si->post[best].count)
+	    best = b;
+    }
+    return best;
+}
+
+/*************************************************************************/
+
+void search_hold(SearchIndex *si)
+{
+    si->holds++;
+}
+
+void search_release(SearchIndex *si)
+{
+    int dead;
+
+    if (--si->holds > 0)
+	return;
+    dead = si->count - si->live;
+    if (dead >= 1024 && dead > si->live)
+	renumber(si);
+}
+
+/*************************************************************************/
@@ -0,0 +1,72 @@
+/* Search index include stuff.
+ *
+ * Services is copyright (c) 1996-1999 Andrew Church.
+ *     E-mail: <achurch@dragonfire.net>
+ * Services is copyright (c) 1999-2000 Andrew Kempe.
+ *     E-mail: <theshadow@shadowfire.org>
+ * This program is free but copyrighted software; see the file COPYING for
+ * details.
+ */
+
+#ifndef SEARCH_H
+#define SEARCH_H
+
+
+/* Number of trigram buckets; trigrams are hashed into these, so a postings
+ * list may hold a few records which don't really contain the trigram.
+ * Callers always check candidates against the full pattern anyway. */
+#define SEARCH_HASHSIZE	8192
+
+/* Maximum number of records a LIST looks at per trip through the main
+ * loop. */
+#define SEARCH_STEP	2000
+
+/* Trigram index over the text LIST matches patterns against.  Each record
+ * gets a serial slot when it is added, and keeps its slot number plus one
+ * as its id (0 means not in the index).  Deleting a record just clears its
+ * slot; postings lists are cleaned up lazily, by renumbering the whole
+ * index once most of it is dead.  Postings lists hold slots in ascending
+ * order, and stay put while a search holds the index (see search_hold()).
+ */
+typedef struct {
+    void *data;			/* The record (NickInfo, ChannelInfo...) */
+    int *id;			/* Record's field holding its id */
+} SearchEntry;
+
+typedef struct {
+    int *ids;
+    int count, size;
+} Postings;
+
+typedef struct searchindex_ SearchIndex;
+struct searchindex_ {
+    SearchEntry *recs;		/* data == NULL if deleted */
+    int count, size;		/* Slots handed out / allocated */
+    int live;			/* Records not deleted */
+    int holds;			/* Searches in progress */
+    Postings post[SEARCH_HASHSIZE];
+};
+
+
+/* Add a record to the index under the given text, or re-add it (with a new
+ * id) if it is already there.  `id' is the record's field holding its id;
+ * 0 means the record is not in the index. */
+extern void search_add(SearchIndex *si, void *data, int *id, const char *text);
+
+/* Remove a record from the index (if it's there). */
+extern void search_del(SearchIndex *si, int *id);
+
+/* Return the record in the given slot, or NULL if it has been deleted. */
+extern void *search_get(SearchIndex *si, int slot);
+
+/* Return the bucket of the shortest postings list among the trigrams in
+ * the literal parts of a wildcard pattern, or -1 if the pattern has no run
+ * of three literal characters (so the index can't help). */
+extern int search_bucket(SearchIndex *si, const char *pattern, int len);
+
+/* Keep ids and postings positions stable while a search is in progress. */
+extern void search_hold(SearchIndex *si);
+extern void search_release(SearchIndex *si);
+
+
+#endif	/* SEARCH_H */
@@ -31,12 +31,10 @@ void vsend_cmd(const char *source, const char *fmt, va_list args)
     vsnprintf(buf, sizeof(buf), fmt, args);
     if (source) {
 	sockprintf(servsock, ":%s %s\r\n", source, buf);
-	if (debug)
-	    log("debug: Sent: :%s %s", source, buf);
+	log_debug(LOG_OUT, 1, "debug: Sent: :%s %s", source, buf);
     } else {
 	sockprintf(servsock, "%s\r\n", buf);
-	if (debug)
-	    log("debug: Sent: %s", buf);
+	log_debug(LOG_OUT, 1, "debug: Sent: %s", buf);
     }
 }
 
@@ -194,6 +192,6 @@ void send_nick(const char *nick, const char *user, const char *host,
                const char *server, const char *name)
 {
 
-    send_cmd(ServerName, "NICK %s 1 %ld %s %s %s :%s", nick, time(NULL),
+    send_cmd(ServerName, "NICK %s 1 %ld %s %s %s :%s", nick, cur_time,
            user, host, server, name);
 }
@@ -17,6 +17,11 @@ int usuarios;
 static Server *serverlist; 
 static Server *lastserver = NULL;
 
+/* Tabla de servidores indexada por numerico; los numericos de servidor
+ * ocupan como mucho 2 caracteres base64. */
+#define MAX_NUMSERVERS	(NUMNICKBASE * NUMNICKBASE)
+static Server *servernumerics[MAX_NUMSERVERS];
+
 
 /*************************************************************************/
 /**************************** Funciones Internas *************************/
@@ -35,7 +40,13 @@ void del_server(Server *server)
     usuarios = usuarios + server->users;
     
     del_users_server(server);
-    
+
+    if (server->numeric && servernumerics[server->num] == server)
+        servernumerics[server->num] = NULL;
+    if (server->clientes)
+        free(server->clientes);
+    if (server->numeric)
+        free(server->numeric);
     free(server->name);
     if (server->prev)
         server->prev->next = server->next;
@@ -109,24 +120,106 @@ Server *find_servername(const char *servername)
                             
 /*************************************************************************/
 
+/* Caracteres que ocupa el numerico del servidor dentro de un numerico
+ * P10: 1 en la forma corta (Y, YXX) y 2 en la larga (YY, YYXXX). */
+
+static int numeric_server_len(const char *numeric)
+{
+    int len = strlen(numeric);
+
+    return (len == 1 || len == 3) ? 1 : 2;
+}
+
+/*************************************************************************/
+
+/* Decodifica el numerico y la mascara de clientes de un servidor (av[5]
+ * del SERVER) y lo da de alta en la tabla de numericos. */
+
+static void set_servernumeric(Server *server, const char *numeric)
+{
+    char buf[3];
+    int n = numeric_server_len(numeric);
+
+    strscpy(buf, numeric, n+1);
+    server->numeric = sstrdup(numeric);
+    server->num = base64toint(buf);
+    server->num_mask = numeric[n] ? base64toint(numeric+n) : 0;
+    if (servernumerics[server->num])
+        log("Server: Numerico %s de %s ya usado por %s", buf, server->name,
+                servernumerics[server->num]->name);
+    servernumerics[server->num] = server;
+    if (server->num_mask)
+        server->clientes = scalloc(sizeof(User *), server->num_mask + 1);
+}
+
+/*************************************************************************/
+
+/* Busca un servidor por su numerico (o por la parte de servidor de un
+ * numerico de cliente) indexando directamente la tabla. */
+
 Server *find_servernumeric(const char *numeric)
 {
-    Server *server;
-    
-    if (!numeric)
+    char buf[3];
+
+    if (!numeric || !*numeric)
         return NULL;
-                       
-    if (lastserver && strncmp(numeric, lastserver->numeric,1) == 0)
-        return lastserver;
 
-    for (server = serverlist; server; server = server->next) {
-        if (strcmp(numeric, server->numeric) == 0) {
-            lastserver = server;
-            return server;
-        }
+    strscpy(buf, numeric, numeric_server_len(numeric)+1);
+    return servernumerics[base64toint(buf)];
+}
+
+/*************************************************************************/
+
+/* Busca un usuario por su numerico P10 (YXX o YYXXX).  Ni se calcula hash
+ * ni se compara el nick. */
+
+User *find_usernumeric(const char *numeric)
+{
+    Server *server = find_servernumeric(numeric);
+
+    if (!server || !server->clientes)
+        return NULL;
+    return server->clientes[base64toint(numeric +
+                numeric_server_len(numeric)) & server->num_mask];
+}
+
+/*************************************************************************/
+
+/* Asocia un numerico P10 a un usuario. */
+
+void add_usernumeric(User *user, const char *numeric)
+{
+    Server *server = find_servernumeric(numeric);
+
+    if (!server || !server->clientes) {
+        log("Server: Numerico %s de %s en servidor desconocido", numeric,
+                user->nick);
+        return;
     }
-                  
-    return NULL;
+    strscpy(user->numeric, numeric, sizeof(user->numeric));
+    server->clientes[base64toint(numeric + numeric_server_len(numeric))
+                & server->num_mask] = user;
+}
+
+/*************************************************************************/
+
+/* Quita el usuario de la tabla de numericos, si estaba. */
+
+void del_usernumeric(User *user)
+{
+    Server *server;
+    unsigned int i;
+
+    if (!*user->numeric)
+        return;
+    server = find_servernumeric(user->numeric);
+    if (server && server->clientes) {
+        i = base64toint(user->numeric + numeric_server_len(user->numeric))
+                & server->num_mask;
+        if (server->clientes[i] == user)
+            server->clientes[i] = NULL;
+    }
+    *user->numeric = 0;
 }
 
 /*************************************************************************/
@@ -174,7 +267,7 @@ void do_server(const char *source, int ac, char **av)
     Server *server, *tmpserver;
     
     server = add_server(av[0]);
-    server->numeric = sstrdup(av[5]);
+    set_servernumeric(server, av[5]);
     server->hijo = NULL;
     server->rehijo = NULL;
     server->hub = find_servername(source);
@@ -200,7 +293,7 @@ void do_server(const char *source, int ac, char **av)
         tmpserver = tmpserver->rehijo;
         tmpserver->rehijo = server;
     }
-    if ((time(NULL) - start_time) >= 60)
+    if ((cur_time - start_time) >= 60)
         canalopers(s_OperServ, "SERVER 12%s Numeric 12%s entra en la RED.", av[0], sstrdup(av[5]));
     return;
 }    
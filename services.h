@@ -137,8 +137,8 @@ extern int toupper(char), tolower(char);
 /* Defino versiones de las DB de forma independiente... :) */
 
 #define AKILL_VERSION   7
-#define CHAN_VERSION    9
-#define NICK_VERSION    10
+#define CHAN_VERSION    10
+#define NICK_VERSION    12
 #define OPER_VERSION    8
 #define NEWS_VERSION    7
 #ifdef CYBER
@@ -161,7 +161,11 @@ struct server_ {
     char *name;
     time_t ts_join;
     int  users;
+    struct user_ *lista_usuarios;      /* Usuarios conectados al servidor */
     char *numeric;
+    unsigned int num;                   /* Numerico del servidor decodificado */
+    unsigned int num_mask;              /* Mascara de numericos de clientes */
+    struct user_ **clientes;            /* Usuarios indexados por numerico */
 };
 
 
@@ -176,11 +180,21 @@ struct memo_ {
     int16 flags;
     time_t time;	/* When it was sent */
     char sender[NICKMAX];
-    char *text;
+    char *text;		/* NULL until read from the memo store */
+    uint32 textpos;	/* Where the text is in the memo store */
+    uint16 textlen;	/* Not counting the trailing null */
 };
 
 #define MF_UNREAD	0x0001	/* Memo has not yet been read */
 
+/* Memo.textpos for a memo whose text isn't in the memo store (text holds
+ * it instead, or it was lost) */
+#define MEMO_NO_TEXT	0xFFFFFFFF
+
+/* Databases which hold memo store positions, for memo_store_saved() */
+#define MEMO_STORE_NICKS	1
+#define MEMO_STORE_CHANS	2
+
 typedef struct {
     int16 memocount, memomax;
     Memo *memos;
@@ -205,6 +219,7 @@ typedef struct nickinfo_ NickInfo;
 
 struct nickinfo_ {
     NickInfo *next, *prev;
+    NickInfo *hnext;	/* Next nick in the same findnick() hash chain */
     char nick[NICKMAX];
     char pass[PASSMAX];
     char *url;
@@ -229,6 +244,9 @@ struct nickinfo_ {
 
     NickInfo *link;	/* If non-NULL, nick to which this one is linked */
     int16 linkcount;	/* Number of links to this nick */
+    NickInfo *master;	/* End of the link chain (see getlink()) */
+    NickInfo *links;	/* Nicks linked to this one, by link_next */
+    NickInfo *link_next, *link_prev;
 
     /* All information from this point down is governed by links.  Note,
      * however, that channelcount is always saved, even for linked nicks
@@ -247,6 +265,9 @@ struct nickinfo_ {
     uint16 language;	/* Language selected by nickname owner (LANG_*) */
 
     time_t id_timestamp;/* TS8 timestamp of user who last ID'd for nick */
+
+    int expire_pos;	/* Position in NickServ's expiry heap (expire.c) */
+    int search_id;	/* Id in NickServ's LIST index (search.c) */
 };
 
 
@@ -319,6 +340,8 @@ struct nickinfo_ {
  * determine the list.  (Hashing based on the first character of the name
  * wouldn't get very far. ;) ) */
 
+typedef struct accessindex_ AccessIndex;
+
 /* Access levels for users. */
 typedef struct {
     int16 in_use;	/* 1 if this entry is in use, else 0 */
@@ -379,6 +402,7 @@ struct chaninfo_ {
 
     int16 accesscount;
     ChanAccess *access;			/* List of authorized users */
+    AccessIndex *accindex;		/* Ver get_access() en chanserv.c */
     int16 akickcount;
     AutoKick *akick;			/* List of users to kickban */
 
@@ -393,6 +417,9 @@ struct chaninfo_ {
 
     struct channel_ *c;			/* Pointer to channel record (if   *
 					 *    channel is currently in use) */
+
+    int expire_pos;			/* Position in ChanServ's expiry heap */
+    int search_id;			/* Id in ChanServ's LIST index */
 };
 
 /* Retain topic even after last person leaves channel */
@@ -462,6 +489,49 @@ struct chaninfo_ {
 
 typedef struct user_ User;
 typedef struct channel_ Channel;
+typedef struct banindex_ BanIndex;
+typedef struct floodhost_ FloodHost;
+typedef struct ipnet_ IpNet;
+
+/* Flood control token bucket (see process.c).  A zeroed bucket is full. */
+#define FLOOD_UNIT	1000	/* Tokens per command */
+
+typedef struct {
+    int32 tokens;		/* Tokens left */
+    time_t last;		/* When it was last topped up */
+    time_t until;		/* Drop everything until this time */
+    int32 dropped;		/* Commands dropped since it ran dry */
+} FloodBucket;
+
+/* Per-host data, shared by all users on the host: flood control, and the
+ * list of who is on it. */
+struct floodhost_ {
+    FloodHost *next;
+    const char *host;		/* Interned, same pointer as User.host */
+    int nusers;			/* Users online from this host */
+    User *users;		/* Those users, linked through hnext/hprev */
+    FloodBucket bucket;
+    uint32 ip;			/* If the host is an IPv4 address: the address */
+    IpNet *net;			/* ... the /24 it is in */
+    FloodHost *netnext, *netprev; /* ... and the other addresses there */
+};
+
+/* IPv4 networks with users online, for the hosts which are addresses:
+ * one record for each /16 and each /24 with anyone on it.  A /16 lists
+ * the /24s in it, and a /24 the addresses (FloodHosts) in it. */
+struct ipnet_ {
+    IpNet *next;		/* Hash chain */
+    uint32 net;			/* Network address, host byte order */
+    int bits;			/* 16 or 24 */
+    int nusers;			/* Users online from the network */
+    IpNet *parent;		/* The /16 a /24 is in (NULL for a /16) */
+    IpNet *sub;			/* The /24s in a /16 */
+    IpNet *subnext, *subprev;	/* The other /24s in the same /16 */
+    FloodHost *hosts;		/* The addresses in a /24 */
+};
+
+/* Longitud del host virtual de Terra (As.qWeRtYu.Terra), con el nulo */
+#define VIRTUALHOSTMAX	17
 
 struct user_ {
     User *next, *prev;
@@ -469,8 +539,12 @@ struct user_ {
     NickInfo *ni;			/* Effective NickInfo (not a link) */
     NickInfo *real_ni;			/* Real NickInfo (ni.nick==user.nick) */
     Server *server;                     /* Server user is on */
+    User *snext, *sprev;                /* Lista de usuarios del servidor */
+    User *hnext, *hprev;		/* Lista de usuarios del host */
+    char numeric[6];                    /* Numerico P10 (YYXXX), o vacio */
     char *username;
     char *host;				/* User's hostname */
+    char virtualhost[VIRTUALHOSTMAX];	/* Host cifrado, o vacio si no hay */
     char *realname;
 
     time_t timestamp;                   /* TS3 - time of signon/last nick change
@@ -492,8 +566,21 @@ struct user_ {
     time_t invalid_pw_time;		/* Time of last invalid password */
     time_t lastmemosend;		/* Last time MS SEND command used */
     time_t lastnickreg;			/* Last time NS REGISTER cmd used */
+    FloodBucket flood;			/* Commands this user may send */
+    FloodHost *floodhost;		/* Same for the user's host */
+    int16 privs;			/* PRIV_*, see get_privs() in operserv.c */
+    NickInfo *privs_ni;			/* u->ni when privs were worked out */
+    uint32 privs_gen;			/* Generation when privs were worked out */
 };
 
+/* Services privilege bits cached in User.privs. */
+#define PRIV_ROOT	0x0001		/* Services root */
+#define PRIV_ADMIN	0x0002		/* Services admin */
+#define PRIV_OPER	0x0004		/* Services oper */
+#define PRIV_IRCOP	0x0010		/* Was +o when last worked out */
+#define PRIV_IDENTIFIED	0x0020		/* Was identified when last worked out */
+#define PRIV_KNOWN	0x0080		/* The bits above are valid */
+
 #define UMODE_O 0x00000001              /* IRCOP */
 #define UMODE_I 0x00000002              /* Invisible */
 #define UMODE_S 0x00000004              /* Noticias servidor */
@@ -524,7 +611,8 @@ struct channel_ {
     char *key;				/* NULL if none */
 
     int32 bancount, bansize;
-    char **bans;
+    char **bans;			/* No siempre en el orden en que se pusieron */
+    BanIndex *banindex;			/* Ver channels.c */
 
     struct c_userlist {
 	struct c_userlist *next, *prev;
@@ -536,6 +624,7 @@ struct channel_ {
     int16 server_modecount;		/* Number of server MODEs this second */
     int16 chanserv_modecount;		/* Number of check_mode()'s this sec */
     int16 bouncy_modes;			/* Did we fail to set modes here? */
+    Server *squit;			/* Marca temporal durante un SQUIT */
 };
 
 #define CMODE_I 0x00000001
@@ -568,6 +657,8 @@ struct clones_ {
 typedef struct ilineinfo_ IlineInfo;
 struct ilineinfo_ {
     IlineInfo *next, *prev;
+    IlineInfo *hnext, *h2next;  /* Indice por host y por host2 */
+    IlineInfo *tnext;           /* Otras ilines de la misma red (ip/bits) */
     char *host;                 /* Host de la iline */
     char *host2;                /* Host 2, para la ip numerica si hay Inversa */
     NickInfo *admin;            /* Nick del administrador */
@@ -587,6 +678,8 @@ struct ilineinfo_ {
     int16 record_clones;
     time_t time_record;
     int16 estado;    
+
+    int expire_pos;             /* Posicion en el heap de expiracion */
 };
 #endif
 /*************************************************************************/
@@ -614,13 +707,17 @@ struct ilineinfo_ {
 
 /*************************************************************************/
 
-/* Ignorance list data. */
+/* Subsistemas del log, cada uno con su propio nivel de depuracion (ver
+ * LOG_LEVEL() y OperServ SET DEBUG). */
+
+#define LOG_GENERAL	0
+#define LOG_IN		1	/* Lineas recibidas del servidor */
+#define LOG_OUT		2	/* Lineas enviadas al servidor */
+#define LOG_USERS	3	/* Usuarios y canales */
+#define LOG_NSUBSYS	4
 
-typedef struct ignore_data {
-    struct ignore_data *next;
-    char who[NICKMAX];
-    time_t time;	/* When do we stop ignoring them? */
-} IgnoreData;
+/* Nivel de depuracion de un subsistema: el suyo, o `debug' si no tiene. */
+#define LOG_LEVEL(sub)	(log_levels[sub] >= 0 ? log_levels[sub] : debug)
 
 /*************************************************************************/
 
@@ -378,6 +378,23 @@ char *sgets(char *buf, int len, int s)
 
 /*************************************************************************/
 
+/* Return nonzero if there is data which can be read from the socket
+ * without blocking. */
+
+int sready(int s)
+{
+    struct timeval tv = {0,0};
+    fd_set fds;
+
+    if (lastchar != EOF || read_buffer_len() > 0)
+	return 1;
+    FD_ZERO(&fds);
+    FD_SET(s, &fds);
+    return select(s+1, &fds, NULL, NULL, &tv) > 0;
+}
+
+/*************************************************************************/
+
 /* sgets2:  Read a line of text from a socket, and strip newline and
  *          carriage return characters from the end of the line.
  */
@@ -520,6 +537,19 @@ int conn(const char *host, int port, const char *lhost, int lport)
 
 /*************************************************************************/
 
+/* Write out everything buffered for the given socket, waiting if
+ * necessary. */
+
+void sflush(int s)
+{
+    if (s != write_fd)
+	return;
+    while (flush_write_buffer(1) > 0)
+	;
+}
+
+/*************************************************************************/
+
 void disconn(int s)
 {
     shutdown(s, 2);
@@ -125,57 +125,105 @@ const char *make_special_ircop_host(const char *host)
 } 
                                               
 
-/* Codigo sacado del ircu de Terra. Thz a FreeMind <animedes@terra.es> */
-               
-const char *make_virtualhost(const char *host)
+/* Clave TEA.  Se saca de CLAVE_CIFRADO una sola vez, la primera vez que
+ * hace falta, en lugar de en cada vuelta de make_virtualhost_r().
+ */
+
+static unsigned int clave_tea[2];
+static int clave_tea_lista = 0;
+
+static void calcula_clave_tea(void)
 {
-  unsigned int v[2], k[2], x[2];
-//  int cont = (NICKLEN + 8) / 8, 
-  int ts = 0;
-  char clave[12 + 1];  
-  char virtualhost[64];
-    
-  strcpy(virtualhost, host);
-  
+  char clave[12 + 1];
+
   strncpy(clave, CLAVE_CIFRADO, 12);
-  clave[12] = '\0';  
+  clave[12] = '\0';
+  clave_tea[1] = base64toint(clave + 6);
+  clave[6] = '\0';
+  clave_tea[0] = base64toint(clave);
+  clave_tea_lista = 1;
+}
+
+/* Devuelve 0 si alguno de los `count' digitos base64 de `v' seria '[' o
+ * ']' (62 y 63), es decir, si el host virtual no seria valido.
+ */
+
+static int digitos_validos(unsigned int v, int count)
+{
+  while (count-- > 0) {
+      if ((v & NUMNICKMASK) >= 62)
+          return 0;
+      v >>= NUMNICKLOG;
+  }
+  return 1;
+}
+
+/* Codigo sacado del ircu de Terra. Thz a FreeMind <animedes@terra.es> */
+
+/* Calcula el host virtual en `buf' (VIRTUALHOSTMAX bytes).  Devuelve 0 (y
+ * deja `buf' vacio) si no hay ninguno valido, cosa que no deberia ocurrir
+ * nunca.
+ */
+
+int make_virtualhost_r(const char *host, char *buf)
+{
+  unsigned int v[2], x[2];
+  int ts;
 
-  while (1) {
-      char tmp;
-      
+  if (!clave_tea_lista)
+      calcula_clave_tea();
+
+  v[1] = ntohl((unsigned long)host);
+  for (ts = 0; ts < 65536; ts++) {
       /* resultado */
-      x[0] = x[1] = 0;  
-      
-      /* valor */
-      tmp = clave[6];
-      clave[6] = '\0';
-      k[0] = base64toint(clave);
-      clave[6] = tmp;
-      k[1] = base64toint(clave + 6);      
-      
-      v[0] = (k[0] & 0xffff0000) + ts;
-      v[1] = ntohl((unsigned long)host);
-        
-      cifrado_tea(v, k, x);      
-     
-      /* formato direccion virtual: As.qWeRtYu.Terra */
-      inttobase64(virtualhost, x[0], 2);
-      virtualhost[2] = '.';
-      inttobase64(virtualhost + 3, x[1], 7);
-      strcpy(virtualhost + 10, ".Terra");     
-      
+      x[0] = x[1] = 0;
+      v[0] = (clave_tea[0] & 0xffff0000) + ts;
+
+      cifrado_tea(v, clave_tea, x);
+
       /* el nombre de Host es correcto? */
-      if (strchr(virtualhost, '[') == NULL &&
-          strchr(virtualhost, ']') == NULL)
-          break;                    /* nice host name */
-      else {      
-          if (++ts == 65536) {         /* No deberia ocurrir nunca */
-              strcpy(virtualhost, host);
-              break;
-          }
+      if (digitos_validos(x[0], 2) && digitos_validos(x[1], 7)) {
+          /* formato direccion virtual: As.qWeRtYu.Terra */
+          inttobase64(buf, x[0], 2);
+          buf[2] = '.';
+          inttobase64(buf + 3, x[1], 7);
+          strcpy(buf + 10, ".Terra");
+          return 1;
       }
   }
-  host = sstrdup(virtualhost);      
-  return host;
-  
-}  
+  *buf = '\0';
+  return 0;
+}
+
+const char *make_virtualhost(const char *host)
+{
+  char virtualhost[VIRTUALHOSTMAX];
+
+  if (!make_virtualhost_r(host, virtualhost))
+      return sstrdup(host);
+  return sstrdup(virtualhost);
+}
+
+/* Host que ven los demas para un usuario: el especial de admin/oper/ircop,
+ * o su host virtual, calculado al conectar.  `buf' debe tener sitio para
+ * NICKMAX+16 bytes; se devuelve `buf', user->virtualhost o user->host.
+ */
+
+const char *user_virtualhost(User *user, char *buf)
+{
+  const char *sufijo;
+
+  if (user->mode & UMODE_A)
+      sufijo = ".admin.terra.es";
+  else if (user->mode & UMODE_H)
+      sufijo = ".oper.terra.es";
+  else if (user->mode & UMODE_O)
+      sufijo = ".ircop.terra.es";
+  else
+      return *user->virtualhost ? user->virtualhost : user->host;
+
+  strcpy(buf, user->nick);
+  strLower(buf);
+  strcat(buf, sufijo);
+  return buf;
+}
@@ -12,6 +12,7 @@
 #include "timeout.h"
 
 static Timeout *timeouts = NULL;
+static Job *jobs = NULL;
 
 /*************************************************************************/
 
@@ -23,7 +24,7 @@ void send_timeout_list(User *u)
 {
     Timeout *to, *last;
 
-    notice(s_OperServ, u->nick, "Now: %ld", time(NULL));
+    notice(s_OperServ, u->nick, "Now: %ld", cur_time);
     for (to = timeouts, last = NULL; to; last = to, to = to->next) {
 	privmsg(s_OperServ, u->nick, "%p: %ld: %p (%p)",
 			to, to->timeout, to->code, to->data);
@@ -43,7 +44,7 @@ void send_timeout_list(User *u)
 void check_timeouts(void)
 {
     Timeout *to, *to2;
-    time_t t = time(NULL);
+    time_t t = cur_time;
 
     if (debug >= 2)
 	log("debug: Checking timeouts at %ld", t);
@@ -88,7 +89,7 @@ void check_timeouts(void)
 Timeout *add_timeout(int delay, void (*code)(Timeout *), int repeat)
 {
     Timeout *t = smalloc(sizeof(Timeout));
-    t->settime = time(NULL);
+    t->settime = cur_time;
     t->timeout = t->settime + delay;
     t->code = code;
     t->repeat = repeat;
@@ -124,3 +125,64 @@ void del_timeout(Timeout *t)
 }
 
 /*************************************************************************/
+
+/* Run one step of each background job, dropping those which have
+ * finished.  Returns nonzero if any jobs are left.  Jobs added from within
+ * a job are not run until the next call.
+ */
+
+int run_jobs(void)
+{
+    Job *j, *next;
+
+    for (j = jobs; j; j = next) {
+	next = j->next;
+	if (debug >= 4)
+	    log("debug: Running job %p (code=%p)", j, j->code);
+	if (!j->code(j))
+	    del_job(j);
+    }
+    return jobs != NULL;
+}
+
+/*************************************************************************/
+
+/* Add a background job. */
+
+Job *add_job(int (*code)(Job *), void *data)
+{
+    Job *j = smalloc(sizeof(Job));
+    j->code = code;
+    j->data = data;
+    j->next = jobs;
+    j->prev = NULL;
+    if (jobs)
+	jobs->prev = j;
+    jobs = j;
+    return j;
+}
+
+/*************************************************************************/
+
+/* Remove a background job from the list (if it's there). */
+
+void del_job(Job *j)
+{
+    Job *ptr;
+
+    for (ptr = jobs; ptr; ptr = ptr->next) {
+	if (ptr == j)
+	    break;
+    }
+    if (!ptr)
+	return;
+    if (j->prev)
+	j->prev->next = j->next;
+    else
+	jobs = j->next;
+    if (j->next)
+	j->next->prev = j->prev;
+    free(j);
+}
+
+/*************************************************************************/
@@ -37,6 +37,28 @@ extern Timeout *add_timeout(int delay, void (*code)(Timeout *), int repeat);
 /* Remove a timeout from the list (if it's there). */
 extern void del_timeout(Timeout *t);
 
+
+/* Definitions for background jobs: long operations split into steps, one
+ * step run each trip through the main loop until the job is done. */
+typedef struct job_ Job;
+struct job_ {
+    Job *next, *prev;
+    int (*code)(Job *);		/* Returns nonzero while work is left */
+    void *data;			/* Can be anything */
+};
+
+
+/* Run one step of each background job, dropping those which have
+ * finished.  Returns nonzero if any jobs are left. */
+extern int run_jobs(void);
+
+/* Add a background job.  The job's code is responsible for freeing `data'
+ * before it returns zero. */
+extern Job *add_job(int (*code)(Job *), void *data);
+
+/* Remove a background job from the list (if it's there). */
+extern void del_job(Job *j);
+
 #ifdef DEBUG_COMMANDS
 /* Send the list of timeouts to the given user. */
 extern void send_timeout_list(User *u);
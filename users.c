@@ -11,8 +11,12 @@
 #include "services.h"
 #include "language.h"
 
-#define HASH(nick)	(((nick)[0]&31)<<5 | ((nick)[1]&31))
-User *userlist[1024];
+/* La tabla de usuarios crece (siempre potencia de 2) en cuanto hay mas
+ * usuarios que entradas, asi las cadenas se mantienen cortas. */
+#define USERHASH_MIN	1024
+#define HASH(nick)	(hash_nocase(nick) & (userhash_size-1))
+static User **userlist;
+static int userhash_size;
 
 int  servercnt = 0, usercnt = 0, chancnt = 0, opcnt = 0,
   maxusercnt = 0, maxchancnt = 0;
@@ -22,6 +26,35 @@ time_t maxchantime;
 /*************************************************************************/
 /*************************************************************************/
 
+/* Rehash all users into a table of the given size. */
+
+static void resize_userhash(int newsize)
+{
+    User **newlist, *user, *next, **list;
+    int i;
+
+    log_debug(LOG_USERS, 1, "debug: Redimensionando tabla de usuarios de %d a %d",
+		userhash_size, newsize);
+    newlist = scalloc(sizeof(User *), newsize);
+    for (i = 0; i < userhash_size; i++) {
+	for (user = userlist[i]; user; user = next) {
+	    next = user->next;
+	    list = &newlist[hash_nocase(user->nick) & (newsize-1)];
+	    user->prev = NULL;
+	    user->next = *list;
+	    if (*list)
+		(*list)->prev = user;
+	    *list = user;
+	}
+    }
+    if (userlist)
+	free(userlist);
+    userlist = newlist;
+    userhash_size = newsize;
+}
+
+/*************************************************************************/
+
 /* Allocate a new User structure, fill in basic values, link it to the
  * overall list, and return it.  Always successful.
  */
@@ -34,6 +67,10 @@ static User *new_user(const char *nick)
     if (!nick)
 	nick = "";
     strscpy(user->nick, nick, NICKMAX);
+    if (!userlist)
+	resize_userhash(USERHASH_MIN);
+    else if (usercnt >= userhash_size)
+	resize_userhash(userhash_size * 2);
     list = &userlist[HASH(user->nick)];
     user->next = *list;
     if (*list)
@@ -47,7 +84,7 @@ static User *new_user(const char *nick)
     usercnt++;
     if (usercnt > maxusercnt) {
 	maxusercnt = usercnt;
-	maxusertime = time(NULL);
+	maxusertime = cur_time;
 	if (LogMaxUsers)
 	    log("user: New maximum user count: %d", maxusercnt);
     }
@@ -62,6 +99,9 @@ static void change_user_nick(User *user, const char *nick)
 {
     User **list;
 
+    /* Los LIST en curso iban al nick viejo */
+    cancel_nick_list(user);
+    cancel_chan_list(user);
     if (user->prev)
 	user->prev->next = user->next;
     else
@@ -70,6 +110,7 @@ static void change_user_nick(User *user, const char *nick)
 	user->next->prev = user->prev;
     user->nick[1] = 0;	/* paranoia for zero-length nicks */
     strscpy(user->nick, nick, NICKMAX);
+    user->privs = 0;	/* ServicesRoot is matched by nick */
     list = &userlist[HASH(user->nick)];
     user->next = *list;
     user->prev = NULL;
@@ -93,21 +134,29 @@ static void delete_user(User *user)
     struct u_chaninfolist *ci, *ci2;
     Server *server = user->server;
 
-    if (debug >= 2)
-	log("debug: delete_user() called");
-    if (server)
+    log_debug(LOG_USERS, 2, "debug: delete_user() called");
+    del_usernumeric(user);
+    if (server) {
         server->users--;
+        if (user->snext)
+            user->snext->sprev = user->sprev;
+        if (user->sprev)
+            user->sprev->snext = user->snext;
+        else
+            server->lista_usuarios = user->snext;
+    }
     usercnt--;
     if (user->mode & UMODE_O)
 	opcnt--;
     cancel_user(user);
-    if (debug >= 2)
-	log("debug: delete_user(): free user data");
-    free(user->username);
-    free(user->host);
-    free(user->realname);
-    if (debug >= 2)
-	log("debug: delete_user(): remove from channels");
+    cancel_nick_list(user);
+    cancel_chan_list(user);
+    log_debug(LOG_USERS, 2, "debug: delete_user(): free user data");
+    put_floodhost(user);
+    sunintern(user->username);
+    sunintern(user->host);
+    sunintern(user->realname);
+    log_debug(LOG_USERS, 2, "debug: delete_user(): remove from channels");
     c = user->chans;
     while (c) {
 	c2 = c->next;
@@ -115,90 +164,109 @@ static void delete_user(User *user)
 	free(c);
 	c = c2;
     }
-    if (debug >= 2)
-	log("debug: delete_user(): free founder data");
+    log_debug(LOG_USERS, 2, "debug: delete_user(): free founder data");
     ci = user->founder_chans;
     while (ci) {
 	ci2 = ci->next;
 	free(ci);
 	ci = ci2;
     }
-    if (debug >= 2)
-	log("debug: delete_user(): delete from list");
+    log_debug(LOG_USERS, 2, "debug: delete_user(): delete from list");
     if (user->prev)
 	user->prev->next = user->next;
     else
 	userlist[HASH(user->nick)] = user->next;
     if (user->next)
 	user->next->prev = user->prev;
-    if (debug >= 2)
-	log("debug: delete_user(): free user structure");
+    log_debug(LOG_USERS, 2, "debug: delete_user(): free user structure");
     free(user);
-    if (debug >= 2)
-	log("debug: delete_user() done");
+    log_debug(LOG_USERS, 2, "debug: delete_user() done");
 }
 
 
 /*************************************************************************/
 
+/* Borra todos los usuarios de un servidor que hace SQUIT.  Solo recorre la
+ * lista de usuarios del propio servidor, y cada canal afectado se limpia
+ * una sola vez con chan_delusers_server() en lugar de un chan_deluser()
+ * por usuario.
+ */
+
 void del_users_server(Server *server)
 {
-    int i;
     User *user, *u2;
+    Channel **canales = NULL;
+    int ncanales = 0, maxcanales = 0, i;
     struct u_chanlist *c, *c2;
     struct u_chaninfolist *ci, *ci2;
-    
-    for (i = 0;i < 1024;i++) {
-        user=userlist[i];
-        while (user) {
-            if (user->server != server) {
-                user = user->next;
+
+    /* Primero recogemos los canales afectados, marcando cada uno para no
+     * repetirlo. */
+    for (user = server->lista_usuarios; user; user = user->snext) {
+        for (c = user->chans; c; c = c->next) {
+            if (c->chan->squit == server)
                 continue;
+            c->chan->squit = server;
+            if (ncanales >= maxcanales) {
+                maxcanales += 64;
+                canales = srealloc(canales, sizeof(Channel *) * maxcanales);
             }
-            usercnt--;    
-            if (user->mode & UMODE_O)
-                opcnt--;
+            canales[ncanales++] = c->chan;
+        }
+    }
+    for (i = 0; i < ncanales; i++)
+        chan_delusers_server(canales[i], server);
+    if (canales)
+        free(canales);
+
+    user = server->lista_usuarios;
+    while (user) {
+        usercnt--;
+        if (user->mode & UMODE_O)
+            opcnt--;
 
 #ifdef CYBER
-            if (ControlClones)
-                del_clones(user->host);                            
-#endif                           
-            cancel_user(user);
-            free(user->username);
-            free(user->host);
-            free(user->realname);            
-
-            c = user->chans;
-            
-            while (c) {
-                c2 = c->next;
-                chan_deluser(user, c->chan);
-                free(c);
-                c = c2;
-            }            
-            ci = user->founder_chans;
-            
-            while (ci) {
-                ci2 = ci->next;
-                free(ci);
-                ci = ci2;
-            }            
-            
-            u2 = user->next;
-            
-            if (user->prev)
-                user->prev->next = user->next;
-            else
-                userlist[i] = user->next;
-            if (user->next)
-                user->next->prev = user->prev;            
-
-            free (user);
-            user = u2; /* Usuario siguiente */
-        } // while...
-    }  // fin del for de users.
-}       
-         
+        if (ControlClones)
+            del_clones(user->host);
+#endif
+        update_last_seen(user);
+        cancel_user(user);
+        cancel_nick_list(user);
+        cancel_chan_list(user);
+        put_floodhost(user);
+        sunintern(user->username);
+        sunintern(user->host);
+        sunintern(user->realname);
+
+        /* Los canales ya estan limpios, solo liberamos la lista */
+        c = user->chans;
+        while (c) {
+            c2 = c->next;
+            free(c);
+            c = c2;
+        }
+        ci = user->founder_chans;
+        while (ci) {
+            ci2 = ci->next;
+            free(ci);
+            ci = ci2;
+        }
+
+        if (user->prev)
+            user->prev->next = user->next;
+        else
+            userlist[HASH(user->nick)] = user->next;
+        if (user->next)
+            user->next->prev = user->prev;
+
+        u2 = user->snext;
+        free(user);
+        user = u2; /* Usuario siguiente */
+    }
+    server->lista_usuarios = NULL;
+    server->users = 0;
+}
+
 /*************************************************************************/
 /*************************************************************************/
 
@@ -212,28 +280,49 @@ void get_user_stats(long *nusers, long *memuse)
     struct u_chanlist *uc;
     struct u_chaninfolist *uci;
 
-    for (i = 0; i < 1024; i++) {
+    for (i = 0; i < userhash_size; i++) {
 	for (user = userlist[i]; user; user = user->next) {
 	    count++;
+	    /* username, host and realname are shared; see
+	     * get_intern_stats() */
 	    mem += sizeof(*user);
-	    if (user->username)
-		mem += strlen(user->username)+1;
-	    if (user->host)
-		mem += strlen(user->host)+1;
-	    if (user->realname)
-		mem += strlen(user->realname)+1;
 	    for (uc = user->chans; uc; uc = uc->next)
 		mem += sizeof(*uc);
 	    for (uci = user->founder_chans; uci; uci = uci->next)
 		mem += sizeof(*uci);
 	}
     }
+    mem += sizeof(User *) * userhash_size;
     *nusers = count;
     *memuse = mem;
 }
 
 /*************************************************************************/
 
+/* Return the size of the user hash table, the number of users in it, and
+ * a histogram of chain lengths: hist[n] is the number of buckets holding
+ * n users, with the last entry counting all longer chains too.
+ */
+
+void get_user_hash_stats(int *size, int *count, int *hist, int histlen)
+{
+    int i, len;
+    User *user;
+
+    memset(hist, 0, sizeof(int) * histlen);
+    *count = 0;
+    for (i = 0; i < userhash_size; i++) {
+	len = 0;
+	for (user = userlist[i]; user; user = user->next)
+	    len++;
+	*count += len;
+	hist[len < histlen ? len : histlen-1]++;
+    }
+    *size = userhash_size;
+}
+
+/*************************************************************************/
+
 #ifdef DEBUG_COMMANDS
 
 /* Send the current list of users to the named user. */
@@ -319,13 +408,13 @@ User *finduser(const char *nick)
 {
     User *user;
 
-    if (debug >= 3)
-	log("debug: finduser(%p)", nick);
+    log_debug(LOG_USERS, 3, "debug: finduser(%p)", nick);
+    if (!userlist)
+	return NULL;
     user = userlist[HASH(nick)];
     while (user && stricmp(user->nick, nick) != 0)
 	user = user->next;
-    if (debug >= 3)
-	log("debug: finduser(%s) -> %p", nick, user);
+    log_debug(LOG_USERS, 3, "debug: finduser(%s) -> %p", nick, user);
     return user;
 }
 
@@ -339,10 +428,9 @@ static int next_index;
 User *firstuser(void)
 {
     next_index = 0;
-    while (next_index < 1024 && current == NULL)
+    while (next_index < userhash_size && current == NULL)
 	current = userlist[next_index++];
-    if (debug >= 3)
-	log("debug: firstuser() returning %s",
+    log_debug(LOG_USERS, 3, "debug: firstuser() returning %s",
 			current ? current->nick : "NULL (end of list)");
     return current;
 }
@@ -351,12 +439,11 @@ User *nextuser(void)
 {
     if (current)
 	current = current->next;
-    if (!current && next_index < 1024) {
-	while (next_index < 1024 && current == NULL)
+    if (!current && next_index < userhash_size) {
+	while (next_index < userhash_size && current == NULL)
 	    current = userlist[next_index++];
     }
-    if (debug >= 3)
-	log("debug: nextuser() returning %s",
+    log_debug(LOG_USERS, 3, "debug: nextuser() returning %s",
 			current ? current->nick : "NULL (end of list)");
     return current;
 }
@@ -387,8 +474,7 @@ void do_nick(const char *source, int ac, char **av)
     if (!*source) {
 	/* This is a new user; create a User structure for it. */
 
-	if (debug)
-	    log("debug: new user: %s", av[0]);
+	log_debug(LOG_USERS, 1, "debug: new user: %s", av[0]);
 
 	/* We used to ignore the ~ which a lot of ircd's use to indicate no
 	 * identd response.  That caused channel bans to break, so now we
@@ -412,17 +498,28 @@ void do_nick(const char *source, int ac, char **av)
 	/* Allocate User structure and fill it in. */
 	user = new_user(av[0]);
 	user->signon = atol(av[2]);
-	user->username = sstrdup(av[3]);
-	user->host = sstrdup(av[4]);
+	user->username = sintern(av[3]);
+	user->host = sintern_nocase(av[4]);
+	get_floodhost(user);
+	make_virtualhost_r(user->host, user->virtualhost);
         user->server = find_servername(av[5]);
         user->server->users++;
-	user->realname = sstrdup(av[6]);
+        user->snext = user->server->lista_usuarios;
+        if (user->snext)
+            user->snext->sprev = user;
+        user->server->lista_usuarios = user;
+#ifdef IRC_UNDERNET_P10
+        /* En P10 el numerico YYXXX va justo antes del realname */
+        if (ac >= 8)
+            add_usernumeric(user, av[ac-2]);
+#endif
+	user->realname = sintern(av[6]);
         user->timestamp = user->signon;
-	user->my_signon = time(NULL);
+	user->my_signon = cur_time;
 
 
     /* Para evitar lag de Reentrada de los bots */
-        if ((time(NULL) - start_time) > (2*60)) 
+        if ((cur_time - start_time) > (2*60)) 
             display_news(user, NEWS_LOGON);
 
     } else {
@@ -434,16 +531,17 @@ void do_nick(const char *source, int ac, char **av)
 							merge_args(ac, av));
 	    return;
 	}
-	if (debug)
-	    log("debug: %s changes nick to %s", source, av[0]);
+	log_debug(LOG_USERS, 1, "debug: %s changes nick to %s", source, av[0]);
 
 	/* Changing nickname case isn't a real change.  Only update
 	 * my_signon if the nicks aren't the same, case-insensitively. */
 	if (stricmp(av[0], user->nick) != 0)
-	    user->my_signon = time(NULL);
+	    user->my_signon = cur_time;
 
         user->timestamp = atol(av[1]);
 
+	/* El nick que deja cuenta como visto ahora */
+	update_last_seen(user);
 	new_ni = findnick(av[0]);
 	if (new_ni)
 	    new_ni = getlink(new_ni);
@@ -489,8 +587,7 @@ void do_join(const char *source, int ac, char **av)
 	t = s + strcspn(s, ",");
 	if (*t)
 	    *t++ = 0;
-	if (debug)
-	    log("debug: %s joins %s", source, s);
+	log_debug(LOG_USERS, 1, "debug: %s joins %s", source, s);
 
 /* Soporte para JOIN #,0 */
 
@@ -514,7 +611,7 @@ void do_join(const char *source, int ac, char **av)
 /* Aadir soporte aviso de MemoServ si hay memos en el canal que entras */
         if ((ci = cs_findchan(s)) && !(ci->flags & CI_VERBOTEN)) {
          /* Para evitar lag de Reentrada de los bots */      
-            if ((ci = cs_findchan(s)) && (time(NULL) - start_time) > (2*60)) {
+            if ((ci = cs_findchan(s)) && (cur_time - start_time) > (2*60)) {
                  if (ci->flags & CI_SUSPENDED) {
                      notice(s_ChanServ, user->nick, "El canal %s est SUSPENDIDO temporalmente. "
                             "Motivo: %s", ci->name, ci->suspendreason);
@@ -560,8 +657,7 @@ void do_part(const char *source, int ac, char **av)
 	t = s + strcspn(s, ",");
 	if (*t)
 	    *t++ = 0;
-	if (debug)
-	    log("debug: %s leaves %s", source, s);
+	log_debug(LOG_USERS, 1, "debug: %s leaves %s", source, s);
 	for (c = user->chans; c && stricmp(s, c->chan->name) != 0; c = c->next)
 	    ;
 	if (c) {
@@ -607,8 +703,7 @@ void do_kick(const char *source, int ac, char **av)
 						merge_args(ac-2, av+2));
 	    continue;
 	}
-	if (debug)
-	    log("debug: kicking %s from %s", s, av[0]);
+	log_debug(LOG_USERS, 1, "debug: kicking %s from %s", s, av[0]);
 	for (c = user->chans; c && stricmp(av[0], c->chan->name) != 0;
 								c = c->next)
 	    ;
@@ -652,8 +747,7 @@ void do_umode(const char *source, int ac, char **av)
 //							merge_args(ac, av));
 	return;
     }
-    if (debug)
-	log("debug: Changing mode for %s to %s", source, av[1]);
+    log_debug(LOG_USERS, 1, "debug: Changing mode for %s to %s", source, av[1]);
     s = av[1];
     while (*s) {
 	switch (*s++) {
@@ -687,16 +781,8 @@ void do_umode(const char *source, int ac, char **av)
                             new_ni->status |= NS_IDENTIFIED;
                             new_ni->id_timestamp = user->signon;                        
                             if (!(new_ni->status & NS_RECOGNIZED)) {
-                                new_ni->last_seen = time(NULL);
-                                if (new_ni->last_usermask);
-                                    free(new_ni->last_usermask);                        
-                                new_ni->last_usermask = 
-                                      smalloc(strlen(user->username)+strlen(user->host)+2);
-                                sprintf(new_ni->last_usermask, "%s@%s", 
-                                        user->username, user->host);
-                                if (new_ni->last_realname)
-                                    free(new_ni->last_realname);
-                                new_ni->last_realname = sstrdup(user->realname);                                      
+                                new_ni->last_seen = cur_time;
+                                set_last_usermask(new_ni, user);
                             }    
                             // log("%s: %s!%s@%s AUTO-identified for nick %s", s_NickServ,
                             //             user->nick, user->username, user->host, user->nick);
@@ -774,12 +860,11 @@ void do_quit(const char *source, int ac, char **av)
 #endif
 	return;
     }
-    if (debug)
-	log("debug: %s quits", source);
+    log_debug(LOG_USERS, 1, "debug: %s quits", source);
     if ((ni = user->ni) && (!(ni->status & NS_VERBOTEN)) &&
 			(ni->status & (NS_IDENTIFIED | NS_RECOGNIZED))) {
 	ni = user->real_ni;
-	ni->last_seen = time(NULL);
+	ni->last_seen = cur_time;
 	if (ni->last_quit)
 	    free(ni->last_quit);
 	ni->last_quit = *av[0] ? sstrdup(av[0]) : NULL;
@@ -808,12 +893,11 @@ void do_kill(const char *source, int ac, char **av)
     user = finduser(av[0]);
     if (!user)
 	return;
-    if (debug)
-	log("debug: %s killed", av[0]);
+    log_debug(LOG_USERS, 1, "debug: %s killed", av[0]);
     if ((ni = user->ni) && (!(ni->status & NS_VERBOTEN)) &&
 			(ni->status & (NS_IDENTIFIED | NS_RECOGNIZED))) {
 	ni = user->real_ni;
-	ni->last_seen = time(NULL);
+	ni->last_seen = cur_time;
 	if (ni->last_quit)
 	    free(ni->last_quit);
 	ni->last_quit = *av[1] ? sstrdup(av[1]) : NULL;
@@ -982,60 +1066,6 @@ int match_usermask(const char *mask, User *user)
 
 /*************************************************************************/
 
-/* Calcula el virtualhost de un usuario, para el
- * unban de ChanServ
- */
-
-int match_virtualmask(const char *mask, User *user)
-{
-    
-    char *mask2 = sstrdup(mask);
-    char *nick, *username, *host, *nick2, *host2;
-    int result;
-
-    if (strchr(mask2, '!')) {
-        nick = strlower(strtok(mask2, "!"));
-        username = strtok(NULL, "@");
-    } else {
-        nick = NULL;
-        username = strtok(mask2, "@");
-    }
-    
-    host = strtok(NULL, "");
-    if (!username || !host) {
-        free(mask2);
-        return 0;
-    }    
-    
-    strlower(host);
-/* Aqui calcular la ip virtual */
-    if (user->mode & UMODE_A)
-        host2 = (char *)make_special_admin_host(user->nick);
-    else if (user->mode & UMODE_H)    
-        host2 = (char *)make_special_oper_host(user->nick);        
-    else if (user->mode & UMODE_O)        
-        host2 = (char *)make_special_ircop_host(user->nick);
-    else 
-        host2 = (char *)make_virtualhost(user->host);    
-   
-//    privmsg(s_ChanServ, user->nick, "DEBUG: IP CIFRADA CALCULADA: %s", host2);    
-    if (nick) {
-        nick2 = strlower(sstrdup(user->nick));
-        result = match_wild(nick, nick2) &&
-                 match_wild(username, user->username) &&
-                 match_wild(host, host2);
-        free(nick2);
-    } else {    
-        result = match_wild(username, user->username) &&
-                 match_wild(host, host2);
-    }
-    free(mask2);
-    free(host2);
-    return result;    
-}
-    
-/*************************************************************************/
-
 /* Split a usermask up into its constitutent parts.  Returned strings are
  * malloc()'d, and should be free()'d when done with.  Returns "*" for
  * missing parts.